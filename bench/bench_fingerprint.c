@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "fingerprint.h"
+#include "utils.h"
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_CERTS 20000
+// Certificates fingerprinted per batch, about what one server's chain holds
+#define BATCH_SIZE 4
+#define HEX_ROUNDS 2000000
+
+/**
+ * Read the wall clock used for throughput.
+ *
+ * @return Monotonic time in nanoseconds
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Build distinct self-signed certificates sharing one key.
+ *
+ * @param certs Receives the certificates
+ * @param count Number of certificates
+ * @return 0 on success, -1 on failure
+ */
+static int create_certificates(X509 **certs, int count) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    if (!key) return -1;
+
+    for (int i = 0; i < count; i++) {
+        X509 *cert = X509_new();
+        if (!cert) return -1;
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), i + 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                                   (const unsigned char *)"bench.local", -1, -1, 0);
+        X509_set_issuer_name(cert, X509_get_subject_name(cert));
+        if (!X509_sign(cert, key, EVP_sha256())) return -1;
+        certs[i] = cert;
+    }
+    EVP_PKEY_free(key);
+    return 0;
+}
+
+/**
+ * Encode a certificate as PEM text.
+ *
+ * @param cert The certificate
+ * @param length Receives the length of the text
+ * @return The text, to be freed by the caller, or NULL on failure
+ */
+static unsigned char *encode_pem(X509 *cert, size_t *length) {
+    BIO *bio = BIO_new(BIO_s_mem());
+    unsigned char *copy = NULL;
+    char *data;
+
+    if (bio && PEM_write_bio_X509(bio, cert)) {
+        long size = BIO_get_mem_data(bio, &data);
+        if (size > 0 && (copy = malloc((size_t)size))) {
+            memcpy(copy, data, (size_t)size);
+            *length = (size_t)size;
+        }
+    }
+    BIO_free(bio);
+    return copy;
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : DEFAULT_CERTS;
+    unsigned char expected[SHA256_DIGEST_LENGTH];
+    unsigned char digests[BATCH_SIZE][SHA256_DIGEST_LENGTH];
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    char reference[SHA256_DIGEST_LENGTH * 2 + 1];
+    unsigned int length;
+    int mismatches = 0;
+    volatile unsigned char sink = 0;
+
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [certificates]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    X509 **certs = calloc((size_t)count, sizeof(*certs));
+    unsigned char **pems = calloc((size_t)count, sizeof(*pems));
+    size_t *pem_lengths = calloc((size_t)count, sizeof(*pem_lengths));
+    if (!certs || !pems || !pem_lengths || create_certificates(certs, count) != 0) {
+        fprintf(stderr, "Failed to set up the benchmark\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!(pems[i] = encode_pem(certs[i], &pem_lengths[i]))) {
+            fprintf(stderr, "Failed to set up the benchmark\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Certificate fingerprints: a fresh digest context per call against one reused per thread
+    double start = now_ns();
+    for (int i = 0; i < count; i++) {
+        X509_digest(certs[i], EVP_sha256(), expected, &length);
+        sink ^= expected[0];
+    }
+    double digest_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < count; i += BATCH_SIZE) {
+        size_t batch = (size_t)(count - i < BATCH_SIZE ? count - i : BATCH_SIZE);
+        fingerprint_batch(&certs[i], batch, digests, NULL);
+        sink ^= digests[0][0];
+    }
+    double batch_ns = now_ns() - start;
+
+    // PEM file names: the one-shot hash and hex against the reused context and table lookup
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        sha256sum(pems[i], pem_lengths[i], reference, sizeof(reference));
+        sink ^= (unsigned char)reference[0];
+    }
+    double sha256sum_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        fingerprint_bytes(pems[i], pem_lengths[i], digests[0]);
+        hex_encode(digests[0], SHA256_DIGEST_LENGTH, hex);
+        sink ^= (unsigned char)hex[0];
+    }
+    double bytes_ns = now_ns() - start;
+
+    // Hex encoding alone, against a formatted print per byte
+    start = now_ns();
+    for (int r = 0; r < HEX_ROUNDS; r++) {
+        expected[r & 31] = (unsigned char)r;
+        for (int j = 0; j < SHA256_DIGEST_LENGTH; j++) {
+            snprintf(&reference[j * 2], 3, "%02x", expected[j]);
+        }
+        sink ^= (unsigned char)reference[r & 63];
+    }
+    double snprintf_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int r = 0; r < HEX_ROUNDS; r++) {
+        expected[r & 31] = (unsigned char)r;
+        hex_encode(expected, SHA256_DIGEST_LENGTH, hex);
+        sink ^= (unsigned char)hex[r & 63];
+    }
+    double hex_ns = now_ns() - start;
+
+    // Both paths must agree with OpenSSL before their timings mean anything
+    for (int i = 0; i < count; i++) {
+        X509_digest(certs[i], EVP_sha256(), expected, &length);
+        if (!fingerprint_cert(certs[i], digests[0]) || memcmp(expected, digests[0], SHA256_DIGEST_LENGTH) != 0) {
+            mismatches++;
+        }
+        sha256sum(pems[i], pem_lengths[i], reference, sizeof(reference));
+        fingerprint_bytes(pems[i], pem_lengths[i], digests[0]);
+        hex_encode(digests[0], SHA256_DIGEST_LENGTH, hex);
+        if (strcmp(reference, hex) != 0) {
+            mismatches++;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        X509_free(certs[i]);
+        free(pems[i]);
+    }
+    free(certs);
+    free(pems);
+    free(pem_lengths);
+
+    if (mismatches) {
+        printf("Benchmark run failed: %d fingerprints differ\n", mismatches);
+        return EXIT_FAILURE;
+    }
+
+    printf("bench_fingerprint certificates=%d\n", count);
+    printf("  %-28s %8.2f us/cert\n", "X509_digest", digest_ns / count / 1e3);
+    printf("  %-28s %8.2f us/cert\n", "fingerprint_batch", batch_ns / count / 1e3);
+    printf("  %-28s %8.2f us/cert\n", "sha256sum of PEM", sha256sum_ns / count / 1e3);
+    printf("  %-28s %8.2f us/cert\n", "fingerprint_bytes + hex", bytes_ns / count / 1e3);
+    printf("  %-28s %8.1f ns/digest\n", "snprintf hex", snprintf_ns / HEX_ROUNDS);
+    printf("  %-28s %8.1f ns/digest\n", "hex_encode", hex_ns / HEX_ROUNDS);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,846 @@
+#define _GNU_SOURCE
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LISTENERS 16
+#define DEFAULT_TARGETS 5000
+#define DEFAULT_CHAIN 1
+#define DEFAULT_SERVER_THREADS 2
+#define DEFAULT_BINARY "./download_cert"
+#define DEFAULT_REPORT "bench/fleet_report.json"
+#define MAX_CHAIN 8
+#define MAX_EVENTS 256
+#define MAX_STATUSES 16
+// Server threads check for shutdown at least this often
+#define POLL_INTERVAL_MS 100
+
+// What a simulated server does with one connection
+typedef enum {
+    BEHAVIOUR_SERVE,
+    BEHAVIOUR_DROP,
+    BEHAVIOUR_RESET,
+    BEHAVIOUR_TARPIT,
+    BEHAVIOUR_FAIL
+} behaviour_t;
+
+typedef struct {
+    int listeners;
+    int targets;
+    int chain;
+    bool rsa;
+    int latency_ms;
+    int drop_pct;
+    int reset_pct;
+    int tarpit_pct;
+    int fail_pct;
+    int server_threads;
+    unsigned int seed;
+    const char *binary;
+    const char *report;
+    char **scanner_args;
+    int scanner_arg_count;
+} fleet_options_t;
+
+typedef struct server_thread server_thread_t;
+
+// Listeners and connections both sit in epoll; this first member tells them apart
+typedef struct {
+    bool listening;
+} poll_entry_t;
+
+// One listening socket with its own leaf certificate
+typedef struct {
+    poll_entry_t entry;
+    int fd;
+    uint16_t port;
+    SSL_CTX *ctx;
+    server_thread_t *thread;
+} listener_t;
+
+// One accepted connection; a delayed one waits in its thread's FIFO until ready_ms
+typedef struct server_conn {
+    poll_entry_t entry;
+    int fd;
+    SSL *ssl;
+    listener_t *listener;
+    long long ready_ms;
+    struct server_conn *next;
+} server_conn_t;
+
+struct server_thread {
+    pthread_t thread;
+    int epoll_fd;
+    const fleet_options_t *options;
+    unsigned int seed;
+    server_conn_t *delayed_head;
+    server_conn_t *delayed_tail;
+    int *tarpit;
+    size_t tarpit_count;
+    size_t tarpit_capacity;
+};
+
+static atomic_bool stopping;
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return Monotonic time in milliseconds
+ */
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Build a certificate signed by an issuer, or self-signed if there is none.
+ *
+ * @param key The key of the certificate and of its issuer
+ * @param issuer The issuer, or NULL
+ * @param name The common name
+ * @param serial The serial number
+ * @param ca Whether the certificate may sign others
+ * @return The certificate, or NULL on failure
+ */
+static X509 *create_certificate(EVP_PKEY *key, X509 *issuer, const char *name, long serial, bool ca) {
+    X509 *cert = X509_new();
+    if (!cert) return NULL;
+
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char *)name, -1, -1, 0);
+    X509_set_issuer_name(cert, issuer ? X509_get_subject_name(issuer) : X509_get_subject_name(cert));
+
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, issuer ? issuer : cert, cert, NULL, NULL, 0);
+    X509_EXTENSION *ext = X509V3_EXT_conf_nid(NULL, &v3, NID_basic_constraints, ca ? "critical,CA:TRUE" : "CA:FALSE");
+    if (!ext || !X509_add_ext(cert, ext, -1) || !X509_sign(cert, key, EVP_sha256())) {
+        X509_EXTENSION_free(ext);
+        X509_free(cert);
+        return NULL;
+    }
+    X509_EXTENSION_free(ext);
+    return cert;
+}
+
+/**
+ * Build a server context per listener. Every listener serves its own leaf certificate,
+ * issued through the same chain of intermediates below one root.
+ *
+ * @param options The fleet settings
+ * @param listeners The listeners to give contexts
+ * @return 0 on success, -1 on failure
+ */
+static int create_contexts(const fleet_options_t *options, listener_t *listeners) {
+    EVP_PKEY *key = options->rsa ? EVP_RSA_gen(2048) : EVP_EC_gen("P-256");
+    X509 *chain[MAX_CHAIN + 1];
+    int ret = -1;
+
+    if (!key) return -1;
+    chain[0] = create_certificate(key, NULL, "bench root", 1, true);
+    for (int i = 1; i <= options->chain; i++) {
+        chain[i] = chain[i - 1] ? create_certificate(key, chain[i - 1], "bench intermediate", i + 1, true) : NULL;
+    }
+    if (!chain[options->chain]) goto cleanup;
+
+    for (int l = 0; l < options->listeners; l++) {
+        char name[64];
+        snprintf(name, sizeof(name), "host%d.bench.local", l);
+        X509 *leaf = create_certificate(key, chain[options->chain], name, 1000 + l, false);
+        SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+        if (!leaf || !ctx || SSL_CTX_use_certificate(ctx, leaf) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1) {
+            X509_free(leaf);
+            SSL_CTX_free(ctx);
+            goto cleanup;
+        }
+        X509_free(leaf);
+        // The intermediates are sent, the root is not, as real servers do
+        for (int i = options->chain; i >= 1; i--) {
+            if (X509_up_ref(chain[i]) && SSL_CTX_add_extra_chain_cert(ctx, chain[i]) != 1) {
+                X509_free(chain[i]);
+                SSL_CTX_free(ctx);
+                goto cleanup;
+            }
+        }
+        listeners[l].ctx = ctx;
+    }
+    ret = 0;
+
+cleanup:
+    for (int i = 0; i <= options->chain; i++) {
+        X509_free(chain[i]);
+    }
+    EVP_PKEY_free(key);
+    return ret;
+}
+
+/**
+ * Pick what to do with a new connection from the configured failure rates.
+ *
+ * @param thread The server thread
+ * @return The behaviour
+ */
+static behaviour_t pick_behaviour(server_thread_t *thread) {
+    const fleet_options_t *options = thread->options;
+    int roll = rand_r(&thread->seed) % 100;
+
+    if ((roll -= options->drop_pct) < 0) return BEHAVIOUR_DROP;
+    if ((roll -= options->reset_pct) < 0) return BEHAVIOUR_RESET;
+    if ((roll -= options->tarpit_pct) < 0) return BEHAVIOUR_TARPIT;
+    if ((roll -= options->fail_pct) < 0) return BEHAVIOUR_FAIL;
+    return BEHAVIOUR_SERVE;
+}
+
+static void close_conn(server_conn_t *conn) {
+    if (conn->ssl) SSL_free(conn->ssl);
+    close(conn->fd);
+    free(conn);
+}
+
+/**
+ * Advance a connection's TLS handshake, registering it with epoll while it waits.
+ *
+ * @param thread The server thread
+ * @param conn The connection
+ */
+static void serve_conn(server_thread_t *thread, server_conn_t *conn) {
+    if (!conn->ssl) {
+        conn->ssl = SSL_new(conn->listener->ctx);
+        if (!conn->ssl || SSL_set_fd(conn->ssl, conn->fd) != 1) {
+            close_conn(conn);
+            return;
+        }
+        SSL_set_accept_state(conn->ssl);
+    }
+
+    ERR_clear_error();
+    int rc = SSL_do_handshake(conn->ssl);
+    int error = rc == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, rc);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        struct epoll_event ev = {
+            .events = (error == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT,
+            .data.ptr = conn
+        };
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) != 0 &&
+            epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) != 0) {
+            close_conn(conn);
+        }
+        return;
+    }
+    ERR_clear_error();
+    close_conn(conn);
+}
+
+/**
+ * Accept every pending connection on a listener and apply its behaviour.
+ *
+ * @param thread The server thread
+ * @param listener The listener
+ */
+static void accept_all(server_thread_t *thread, listener_t *listener) {
+    int fd;
+
+    while ((fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        switch (pick_behaviour(thread)) {
+            case BEHAVIOUR_DROP:
+                close(fd);
+                continue;
+            case BEHAVIOUR_RESET: {
+                struct linger linger = { 1, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+                close(fd);
+                continue;
+            }
+            case BEHAVIOUR_TARPIT:
+                if (thread->tarpit_count == thread->tarpit_capacity) {
+                    size_t capacity = thread->tarpit_capacity ? thread->tarpit_capacity * 2 : 64;
+                    int *tarpit = realloc(thread->tarpit, capacity * sizeof(*tarpit));
+                    if (!tarpit) {
+                        close(fd);
+                        continue;
+                    }
+                    thread->tarpit = tarpit;
+                    thread->tarpit_capacity = capacity;
+                }
+                thread->tarpit[thread->tarpit_count++] = fd;
+                continue;
+            case BEHAVIOUR_FAIL: {
+                static const char reply[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+                ssize_t written = write(fd, reply, sizeof(reply) - 1);
+                (void)written;
+                close(fd);
+                continue;
+            }
+            case BEHAVIOUR_SERVE:
+                break;
+        }
+
+        server_conn_t *conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->listener = listener;
+        if (thread->options->latency_ms > 0) {
+            // Every delay is the same, so a FIFO keeps the connections in ready order
+            conn->ready_ms = now_ms() + thread->options->latency_ms;
+            if (thread->delayed_tail) thread->delayed_tail->next = conn;
+            else thread->delayed_head = conn;
+            thread->delayed_tail = conn;
+        } else {
+            serve_conn(thread, conn);
+        }
+    }
+}
+
+/**
+ * Server thread: drive the listeners and connections assigned to it until the run stops.
+ *
+ * @param arg The server thread
+ * @return NULL
+ */
+static void *server_thread(void *arg) {
+    server_thread_t *thread = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!atomic_load(&stopping)) {
+        long long now = now_ms();
+        while (thread->delayed_head && thread->delayed_head->ready_ms <= now) {
+            server_conn_t *conn = thread->delayed_head;
+            thread->delayed_head = conn->next;
+            if (!thread->delayed_head) thread->delayed_tail = NULL;
+            conn->next = NULL;
+            serve_conn(thread, conn);
+        }
+
+        int timeout = POLL_INTERVAL_MS;
+        if (thread->delayed_head && thread->delayed_head->ready_ms - now < timeout) {
+            timeout = (int)(thread->delayed_head->ready_ms - now);
+        }
+        int n = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            poll_entry_t *entry = events[i].data.ptr;
+            if (entry->listening) {
+                accept_all(thread, (listener_t *)entry);
+            } else {
+                serve_conn(thread, (server_conn_t *)entry);
+            }
+        }
+    }
+
+    while (thread->delayed_head) {
+        server_conn_t *conn = thread->delayed_head;
+        thread->delayed_head = conn->next;
+        close_conn(conn);
+    }
+    for (size_t i = 0; i < thread->tarpit_count; i++) {
+        close(thread->tarpit[i]);
+    }
+    free(thread->tarpit);
+    return NULL;
+}
+
+/**
+ * Open the listeners on loopback ports chosen by the kernel and spread them over the server threads.
+ *
+ * @param listeners The listeners, with their contexts set
+ * @param count Number of listeners
+ * @param threads The server threads, with their epoll instances open
+ * @param thread_count Number of server threads
+ * @return 0 on success, -1 on failure
+ */
+static int open_listeners(listener_t *listeners, int count, server_thread_t *threads, int thread_count) {
+    for (int l = 0; l < count; l++) {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = 0 };
+        socklen_t length = sizeof(addr);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        listener_t *listener = &listeners[l];
+        listener->entry.listening = true;
+        listener->thread = &threads[l % thread_count];
+        listener->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener->fd < 0 || bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listener->fd, SOMAXCONN) != 0 ||
+            getsockname(listener->fd, (struct sockaddr *)&addr, &length) != 0) {
+            return -1;
+        }
+        listener->port = ntohs(addr.sin_port);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = listener };
+        if (epoll_ctl(listener->thread->epoll_fd, EPOLL_CTL_ADD, listener->fd, &ev) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the target list: every listener in turn, until there are enough targets.
+ *
+ * @param path The file to write
+ * @param listeners The listeners
+ * @param options The fleet settings
+ * @return 0 on success, -1 on failure
+ */
+static int write_targets(const char *path, const listener_t *listeners, const fleet_options_t *options) {
+    FILE *file = fopen(path, "w");
+    if (!file) return -1;
+    for (int i = 0; i < options->targets; i++) {
+        fprintf(file, "127.0.0.1:%u\n", (unsigned int)listeners[i % options->listeners].port);
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Read an integer field of a JSON result line.
+ *
+ * @param line The line
+ * @param field The quoted field name followed by a colon, e.g. "\"total_us\":"
+ * @return The value, or -1 if the field is missing
+ */
+static long long json_integer(const char *line, const char *field) {
+    const char *value = strstr(line, field);
+    return value ? strtoll(value + strlen(field), NULL, 10) : -1;
+}
+
+// The results of one scanner run
+typedef struct {
+    double wall_seconds;
+    double cpu_seconds;
+    long max_rss_kb;
+    int exit_status;
+    long long *latencies;
+    size_t latency_count;
+    char status_names[MAX_STATUSES][16];
+    size_t status_counts[MAX_STATUSES];
+    int statuses;
+    size_t results;
+    double allocations_per_host;
+    double heap_allocations_per_host;
+} fleet_run_t;
+
+/**
+ * Count a result line by its status and keep its total latency if it succeeded.
+ *
+ * @param run The run
+ * @param line The JSON result line
+ */
+static void record_result(fleet_run_t *run, const char *line) {
+    const char *status = strstr(line, "\"status\":\"");
+    if (!status) return;
+    status += strlen("\"status\":\"");
+    size_t length = strcspn(status, "\"");
+    if (length >= sizeof(run->status_names[0])) return;
+
+    run->results++;
+    int s = 0;
+    while (s < run->statuses && (strlen(run->status_names[s]) != length || strncmp(run->status_names[s], status, length) != 0)) {
+        s++;
+    }
+    if (s == run->statuses && run->statuses < MAX_STATUSES) {
+        memcpy(run->status_names[s], status, length);
+        run->status_names[s][length] = '\0';
+        run->statuses++;
+    }
+    if (s < run->statuses) run->status_counts[s]++;
+
+    long long total_us = json_integer(line, "\"total_us\":");
+    if (length == 2 && strncmp(status, "ok", 2) == 0 && total_us >= 0) {
+        run->latencies[run->latency_count++] = total_us;
+    }
+}
+
+/**
+ * Pick the allocation counts out of the scanner's run summary.
+ *
+ * @param run The run
+ * @param summary The scanner's stderr, holding the summary
+ */
+static void read_allocations(fleet_run_t *run, FILE *summary) {
+    char line[512];
+
+    rewind(summary);
+    while (fgets(line, sizeof(line), summary)) {
+        if (sscanf(line, "Allocations: %lf per connection by OpenSSL, %lf of them from malloc",
+                   &run->allocations_per_host, &run->heap_allocations_per_host) == 2) {
+            return;
+        }
+    }
+}
+
+/**
+ * Run the scanner against the fleet and collect its JSON results, CPU time, peak RSS and allocation counts.
+ *
+ * @param options The fleet settings
+ * @param targets_path The target list
+ * @param output_dir The scanner's certificate directory
+ * @param stats_path The scanner's -stats-file, which also has it report its allocation counts
+ * @param run Receives the results
+ * @return 0 on success, -1 if the scanner could not be run
+ */
+static int run_scanner(const fleet_options_t *options, const char *targets_path, const char *output_dir,
+                       const char *stats_path, fleet_run_t *run) {
+    char **argv = calloc((size_t)options->scanner_arg_count + 10, sizeof(*argv));
+    int pipe_fds[2];
+    int argc = 0;
+    // The run summary goes to stderr next to the JSON results
+    FILE *summary = tmpfile();
+
+    if (!argv || !summary || pipe(pipe_fds) != 0) {
+        free(argv);
+        if (summary) fclose(summary);
+        return -1;
+    }
+    argv[argc++] = (char *)options->binary;
+    argv[argc++] = "-if";
+    argv[argc++] = (char *)targets_path;
+    argv[argc++] = "-od";
+    argv[argc++] = (char *)output_dir;
+    argv[argc++] = "-output";
+    argv[argc++] = "jsonl";
+    argv[argc++] = "-stats-file";
+    argv[argc++] = (char *)stats_path;
+    for (int i = 0; i < options->scanner_arg_count; i++) {
+        argv[argc++] = options->scanner_args[i];
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        dup2(fileno(summary), STDERR_FILENO);
+        execv(options->binary, argv);
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+    free(argv);
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        fclose(summary);
+        return -1;
+    }
+
+    FILE *results = fdopen(pipe_fds[0], "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    while (results && getline(&line, &capacity, results) > 0) {
+        if (line[0] == '{' && run->results < (size_t)options->targets) {
+            record_result(run, line);
+        }
+    }
+    free(line);
+    if (results) fclose(results);
+    else close(pipe_fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        fclose(summary);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    read_allocations(run, summary);
+    fclose(summary);
+
+    run->wall_seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    run->cpu_seconds = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+                       (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    run->max_rss_kb = usage.ru_maxrss;
+    run->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return 0;
+}
+
+/**
+ * Pick a latency percentile from the sorted latencies.
+ *
+ * @param run The run, with its latencies sorted
+ * @param quantile The quantile, between 0 and 1
+ * @return The latency in milliseconds, or 0 without latencies
+ */
+static double percentile_ms(const fleet_run_t *run, double quantile) {
+    if (run->latency_count == 0) return 0.0;
+    size_t index = (size_t)(quantile * (double)(run->latency_count - 1) + 0.5);
+    return (double)run->latencies[index] / 1000.0;
+}
+
+/**
+ * Write the run as a JSON report, so runs before and after a change can be compared.
+ *
+ * @param out The stream to write to
+ * @param options The fleet settings
+ * @param run The run, with its latencies sorted
+ */
+static void write_report(FILE *out, const fleet_options_t *options, const fleet_run_t *run) {
+    fprintf(out, "{\n  \"benchmark\": \"fleet\",\n");
+    fprintf(out, "  \"fleet\": {\"listeners\": %d, \"targets\": %d, \"chain\": %d, \"key\": \"%s\", "
+                 "\"latency_ms\": %d, \"drop_pct\": %d, \"reset_pct\": %d, \"tarpit_pct\": %d, \"fail_pct\": %d, "
+                 "\"server_threads\": %d, \"seed\": %u},\n",
+            options->listeners, options->targets, options->chain, options->rsa ? "rsa2048" : "p256",
+            options->latency_ms, options->drop_pct, options->reset_pct, options->tarpit_pct, options->fail_pct,
+            options->server_threads, options->seed);
+
+    fprintf(out, "  \"scanner_args\": [");
+    for (int i = 0; i < options->scanner_arg_count; i++) {
+        fprintf(out, "%s\"%s\"", i ? ", " : "", options->scanner_args[i]);
+    }
+    fprintf(out, "],\n");
+
+    fprintf(out, "  \"exit_status\": %d,\n  \"results\": %zu,\n  \"statuses\": {", run->exit_status, run->results);
+    for (int s = 0; s < run->statuses; s++) {
+        fprintf(out, "%s\"%s\": %zu", s ? ", " : "", run->status_names[s], run->status_counts[s]);
+    }
+    fprintf(out, "},\n");
+
+    fprintf(out, "  \"wall_seconds\": %.3f,\n  \"hosts_per_second\": %.1f,\n",
+            run->wall_seconds, run->wall_seconds > 0 ? (double)run->results / run->wall_seconds : 0.0);
+    fprintf(out, "  \"cpu_seconds\": %.3f,\n  \"cpu_us_per_host\": %.1f,\n  \"max_rss_kb\": %ld,\n",
+            run->cpu_seconds, run->results ? run->cpu_seconds * 1e6 / (double)run->results : 0.0, run->max_rss_kb);
+    fprintf(out, "  \"openssl_allocations_per_host\": %.1f,\n  \"malloc_calls_per_host\": %.1f,\n",
+            run->allocations_per_host, run->heap_allocations_per_host);
+    fprintf(out, "  \"ok_latency_ms\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}\n}\n",
+            percentile_ms(run, 0.5), percentile_ms(run, 0.9), percentile_ms(run, 0.99), percentile_ms(run, 1.0));
+}
+
+/**
+ * Remove a scratch directory and the files in it.
+ *
+ * @param dir The directory
+ */
+static void remove_directory(const char *dir) {
+    char path[1024];
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+
+    while (d && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    if (d) closedir(d);
+    rmdir(dir);
+}
+
+/**
+ * Parse a whole-number option within bounds.
+ *
+ * @param text The value
+ * @param min The smallest value allowed
+ * @param max The largest value allowed
+ * @param value Receives the value
+ * @return true if the value is valid
+ */
+static bool parse_int(const char *text, long min, long max, int *value) {
+    char *end;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || parsed < min || parsed > max) {
+        return false;
+    }
+    *value = (int)parsed;
+    return true;
+}
+
+static void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [-listeners <n>] [-targets <n>] [-chain <0-%d>] [-key ec|rsa] [-latency <ms>]\n"
+                    "          [-drop <pct>] [-reset <pct>] [-tarpit <pct>] [-fail <pct>] [-server-threads <n>]\n"
+                    "          [-seed <n>] [-binary <path>] [-report <file>] [-- <download_cert options>]\n",
+            program_name, MAX_CHAIN);
+}
+
+int main(int argc, char *argv[]) {
+    fleet_options_t options = {
+        .listeners = DEFAULT_LISTENERS,
+        .targets = DEFAULT_TARGETS,
+        .chain = DEFAULT_CHAIN,
+        .server_threads = DEFAULT_SERVER_THREADS,
+        .seed = 1,
+        .binary = DEFAULT_BINARY,
+        .report = DEFAULT_REPORT
+    };
+    static char *default_scanner_args[] = { "-engine", "epoll", "-inflight", "256", "-timeout", "2s" };
+    bool valid = true;
+
+    for (int i = 1; i < argc && valid; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--") == 0) {
+            options.scanner_args = argv + i + 1;
+            options.scanner_arg_count = argc - i - 1;
+            break;
+        } else if (!value) {
+            valid = false;
+        } else if (strcmp(argv[i], "-listeners") == 0) {
+            valid = parse_int(value, 1, 4096, &options.listeners);
+        } else if (strcmp(argv[i], "-targets") == 0) {
+            valid = parse_int(value, 1, 10000000, &options.targets);
+        } else if (strcmp(argv[i], "-chain") == 0) {
+            valid = parse_int(value, 0, MAX_CHAIN, &options.chain);
+        } else if (strcmp(argv[i], "-key") == 0) {
+            options.rsa = strcmp(value, "rsa") == 0;
+            valid = options.rsa || strcmp(value, "ec") == 0;
+        } else if (strcmp(argv[i], "-latency") == 0) {
+            valid = parse_int(value, 0, 60000, &options.latency_ms);
+        } else if (strcmp(argv[i], "-drop") == 0) {
+            valid = parse_int(value, 0, 100, &options.drop_pct);
+        } else if (strcmp(argv[i], "-reset") == 0) {
+            valid = parse_int(value, 0, 100, &options.reset_pct);
+        } else if (strcmp(argv[i], "-tarpit") == 0) {
+            valid = parse_int(value, 0, 100, &options.tarpit_pct);
+        } else if (strcmp(argv[i], "-fail") == 0) {
+            valid = parse_int(value, 0, 100, &options.fail_pct);
+        } else if (strcmp(argv[i], "-server-threads") == 0) {
+            valid = parse_int(value, 1, 64, &options.server_threads);
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            int seed;
+            valid = parse_int(value, 0, 2147483647L, &seed);
+            options.seed = (unsigned int)seed;
+        } else if (strcmp(argv[i], "-binary") == 0) {
+            options.binary = value;
+        } else if (strcmp(argv[i], "-report") == 0) {
+            options.report = value;
+        } else {
+            valid = false;
+        }
+        i++;
+    }
+    if (!valid || options.drop_pct + options.reset_pct + options.tarpit_pct + options.fail_pct > 100) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (options.scanner_arg_count == 0) {
+        options.scanner_args = default_scanner_args;
+        options.scanner_arg_count = (int)(sizeof(default_scanner_args) / sizeof(default_scanner_args[0]));
+    }
+    // Simulated servers write to clients that may already have hung up
+    signal(SIGPIPE, SIG_IGN);
+    if (access(options.binary, X_OK) != 0) {
+        fprintf(stderr, "%s not found; build it with make all\n", options.binary);
+        return EXIT_FAILURE;
+    }
+
+    char work_dir[] = "/tmp/bench_fleet_XXXXXX";
+    char targets_path[64], output_dir[64], stats_path[64];
+    listener_t *listeners = calloc((size_t)options.listeners, sizeof(*listeners));
+    server_thread_t *threads = calloc((size_t)options.server_threads, sizeof(*threads));
+    fleet_run_t run;
+    memset(&run, 0, sizeof(run));
+    run.latencies = calloc((size_t)options.targets, sizeof(*run.latencies));
+    if (!listeners || !threads || !run.latencies || !mkdtemp(work_dir)) {
+        fprintf(stderr, "Failed to set up the benchmark\n");
+        return EXIT_FAILURE;
+    }
+    snprintf(targets_path, sizeof(targets_path), "%s/targets.txt", work_dir);
+    snprintf(output_dir, sizeof(output_dir), "%s/certs", work_dir);
+    snprintf(stats_path, sizeof(stats_path), "%s/stats.prom", work_dir);
+
+    int ret = EXIT_FAILURE;
+    int started = 0;
+    for (int t = 0; t < options.server_threads; t++) {
+        threads[t].options = &options;
+        threads[t].seed = options.seed + (unsigned int)t;
+        threads[t].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (threads[t].epoll_fd < 0) goto cleanup;
+    }
+    for (int l = 0; l < options.listeners; l++) {
+        listeners[l].fd = -1;
+    }
+    if (create_contexts(&options, listeners) != 0 ||
+        open_listeners(listeners, options.listeners, threads, options.server_threads) != 0 ||
+        write_targets(targets_path, listeners, &options) != 0) {
+        fprintf(stderr, "Failed to start the server fleet\n");
+        goto cleanup;
+    }
+    for (; started < options.server_threads; started++) {
+        if (pthread_create(&threads[started].thread, NULL, server_thread, &threads[started]) != 0) {
+            fprintf(stderr, "Failed to start a server thread\n");
+            goto cleanup;
+        }
+    }
+
+    if (run_scanner(&options, targets_path, output_dir, stats_path, &run) != 0) {
+        fprintf(stderr, "Failed to run %s\n", options.binary);
+        goto cleanup;
+    }
+    qsort(run.latencies, run.latency_count, sizeof(*run.latencies), compare_latency);
+
+    FILE *report = fopen(options.report, "w");
+    if (report) {
+        write_report(report, &options, &run);
+        fclose(report);
+    } else {
+        perror("Failed to write the report");
+    }
+
+    printf("bench_fleet listeners=%d targets=%d chain=%d latency=%dms drop=%d%% reset=%d%% tarpit=%d%% fail=%d%%\n",
+           options.listeners, options.targets, options.chain, options.latency_ms,
+           options.drop_pct, options.reset_pct, options.tarpit_pct, options.fail_pct);
+    printf("  %-28s %8.1f hosts/s %8.1f us CPU/host %8ld KB max RSS\n", "download_cert",
+           run.wall_seconds > 0 ? (double)run.results / run.wall_seconds : 0.0,
+           run.results ? run.cpu_seconds * 1e6 / (double)run.results : 0.0, run.max_rss_kb);
+    printf("  %-28s %8.2f p50 %8.2f p99 %8.2f max (ms, %zu ok of %zu)\n", "latency",
+           percentile_ms(&run, 0.5), percentile_ms(&run, 0.99), percentile_ms(&run, 1.0),
+           run.latency_count, run.results);
+    printf("  %-28s %8.1f per host %8.1f from malloc\n", "OpenSSL allocations",
+           run.allocations_per_host, run.heap_allocations_per_host);
+    printf("  report written to %s\n", options.report);
+    if (run.exit_status == 0 && run.results == (size_t)options.targets) {
+        ret = EXIT_SUCCESS;
+    } else {
+        printf("Benchmark run failed: exit status %d, %zu of %d results\n", run.exit_status, run.results, options.targets);
+    }
+
+cleanup:
+    atomic_store(&stopping, true);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    for (int l = 0; l < options.listeners; l++) {
+        if (listeners[l].fd >= 0) close(listeners[l].fd);
+        SSL_CTX_free(listeners[l].ctx);
+    }
+    for (int t = 0; t < options.server_threads; t++) {
+        if (threads[t].epoll_fd > 0) close(threads[t].epoll_fd);
+    }
+    unlink(targets_path);
+    unlink(stats_path);
+    remove_directory(output_dir);
+    rmdir(work_dir);
+    free(run.latencies);
+    free(listeners);
+    free(threads);
+    return ret;
+}
@@ -0,0 +1,160 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "read_file.h"
+#include "target_queue.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LINES 1000000
+#define DEFAULT_THREADS 8
+#define QUEUE_CAPACITY 4096
+
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *shared_file = NULL;
+static target_queue_t queue;
+
+/**
+ * Read the wall clock used for throughput.
+ *
+ * @return Monotonic time in nanoseconds
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Consumer using the previous dispatch path: fgets under a shared mutex, then strtok_r.
+ *
+ * @param arg Receives the number of items consumed (size_t *)
+ * @return NULL
+ */
+static void *mutex_consumer(void *arg) {
+    size_t *count = (size_t *)arg;
+    char line[MAX_LINE_LENGTH];
+    target_t target;
+
+    for (;;) {
+        pthread_mutex_lock(&file_mutex);
+        char *read = fgets(line, sizeof(line), shared_file);
+        pthread_mutex_unlock(&file_mutex);
+        if (!read) {
+            break;
+        }
+
+        char *saveptr = NULL;
+        char *host = strtok_r(line, ":\n", &saveptr);
+        char *port = strtok_r(NULL, "\n", &saveptr);
+        snprintf(target.hostname, sizeof(target.hostname), "%s", host ? host : "");
+        snprintf(target.port, sizeof(target.port), "%s", port ? port : DEFAULT_PORT);
+        (*count)++;
+    }
+    return NULL;
+}
+
+/**
+ * Consumer popping pre-parsed targets from the lock-free queue.
+ *
+ * @param arg Receives the number of items consumed (size_t *)
+ * @return NULL
+ */
+static void *queue_consumer(void *arg) {
+    size_t *count = (size_t *)arg;
+    target_t target;
+
+    while (target_queue_pop(&queue, &target, -1) > 0) {
+        (*count)++;
+    }
+    return NULL;
+}
+
+/**
+ * Run one dispatch strategy over the whole input file.
+ *
+ * @param path The input file
+ * @param threads Number of consumer threads
+ * @param use_queue true for the input reader and queue, false for the mutex path
+ * @param items Receives the number of items consumed
+ * @return Elapsed wall-clock nanoseconds, or a negative value on failure
+ */
+static double run(const char *path, int threads, bool use_queue, size_t *items) {
+    pthread_t tids[threads];
+    size_t counts[threads];
+    input_reader_t *reader = NULL;
+    input_source_t *source = NULL;
+
+    shared_file = fopen(path, "r");
+    if (!shared_file) return -1;
+    if (use_queue && !(source = open_input_source(path))) return -1;
+    if (use_queue && target_queue_init(&queue, QUEUE_CAPACITY) != 0) return -1;
+
+    double start = now_ns();
+    if (use_queue) {
+        reader = input_reader_start(source, 1, &queue, NULL, NULL, NULL);
+        if (!reader) return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        counts[i] = 0;
+        pthread_create(&tids[i], NULL, use_queue ? queue_consumer : mutex_consumer, &counts[i]);
+    }
+
+    *items = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        *items += counts[i];
+    }
+    if (reader) input_reader_join(reader);
+    double elapsed = now_ns() - start;
+
+    if (use_queue) {
+        target_queue_destroy(&queue);
+        close_input_source(source);
+    }
+    fclose(shared_file);
+    return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    long lines = argc > 1 ? atol(argv[1]) : DEFAULT_LINES;
+    int threads = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+    char path[] = "/tmp/bench_queue_XXXXXX";
+
+    if (lines <= 0 || threads <= 0) {
+        fprintf(stderr, "Usage: %s [lines] [threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int fd = mkstemp(path);
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file) {
+        perror("Failed to create input file");
+        return EXIT_FAILURE;
+    }
+    for (long i = 0; i < lines; i++) {
+        fprintf(file, "host%ld.example.com:%ld\n", i, 443 + i % 3);
+    }
+    fclose(file);
+
+    size_t mutex_items = 0;
+    size_t queue_items = 0;
+    double mutex_ns = run(path, threads, false, &mutex_items);
+    double queue_ns = run(path, threads, true, &queue_items);
+    unlink(path);
+
+    if (mutex_ns < 0 || queue_ns < 0 || mutex_items != (size_t)lines || queue_items != (size_t)lines) {
+        fprintf(stderr, "Benchmark run failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("bench_queue lines=%ld consumers=%d\n", lines, threads);
+    printf("  %-28s %8.1f ns/item %10.0f items/s\n", "fgets under mutex + strtok",
+           mutex_ns / lines, lines / (mutex_ns / 1e9));
+    printf("  %-28s %8.1f ns/item %10.0f items/s\n", "mmap reader + MPMC queue",
+           queue_ns / lines, lines / (queue_ns / 1e9));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ssl_profile.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 20000
+#define HANDSHAKE_DIVISOR 20
+
+/**
+ * Read the CPU time used by this process.
+ *
+ * @return CPU time in nanoseconds
+ */
+static double cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Build a throwaway self-signed server context for the in-memory handshakes.
+ *
+ * @return The server context, or NULL on failure
+ */
+static SSL_CTX *create_server_context(void) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!key || !cert || !ctx) goto error;
+
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                               (const unsigned char *)"bench.local", -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(cert));
+    if (!X509_sign(cert, key, EVP_sha256())) goto error;
+
+    if (SSL_CTX_use_certificate(ctx, cert) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1) goto error;
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ctx;
+
+error:
+    if (ctx) SSL_CTX_free(ctx);
+    if (cert) X509_free(cert);
+    if (key) EVP_PKEY_free(key);
+    return NULL;
+}
+
+/**
+ * Run one client handshake against an in-memory server.
+ *
+ * @param client The client SSL object
+ * @param server_ctx The server context
+ * @return 0 on success, -1 on failure
+ */
+static int handshake_in_memory(SSL *client, SSL_CTX *server_ctx) {
+    SSL *server = SSL_new(server_ctx);
+    BIO *client_bio = NULL;
+    BIO *server_bio = NULL;
+    int ret = -1;
+
+    if (!server || !BIO_new_bio_pair(&client_bio, 0, &server_bio, 0)) goto cleanup;
+    SSL_set_bio(client, client_bio, client_bio);
+    SSL_set_bio(server, server_bio, server_bio);
+    SSL_set_connect_state(client);
+    SSL_set_accept_state(server);
+
+    for (int round = 0; round < 32; round++) {
+        int c = SSL_do_handshake(client);
+        int s = SSL_do_handshake(server);
+        if (c == 1 && s == 1) {
+            ret = 0;
+            break;
+        }
+    }
+
+cleanup:
+    if (server) SSL_free(server);
+    ERR_clear_error();
+    return ret;
+}
+
+/**
+ * Time the per-host client setup, optionally including a handshake.
+ *
+ * @param profile The SSL profile
+ * @param shared The shared context, or NULL to build a context per host
+ * @param server_ctx Server context for handshakes, or NULL for setup only
+ * @param iterations Number of simulated hosts
+ * @return CPU nanoseconds per host, or a negative value on failure
+ */
+static double run(const char *profile, SSL_CTX *shared, SSL_CTX *server_ctx, int iterations) {
+    char error_message[256];
+    double start = cpu_ns();
+
+    for (int i = 0; i < iterations; i++) {
+        SSL_CTX *ctx = shared ? shared : create_ssl_context(profile, error_message, sizeof(error_message));
+        if (!ctx) return -1;
+
+        SSL *ssl = SSL_new(ctx);
+        if (!ssl) return -1;
+        SSL_set_tlsext_host_name(ssl, "bench.local");
+
+        if (server_ctx && handshake_in_memory(ssl, server_ctx) != 0) {
+            return -1;
+        }
+
+        SSL_free(ssl);
+        if (!shared) SSL_CTX_free(ctx);
+    }
+
+    return (cpu_ns() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    const char *profile = argc > 2 ? argv[2] : NULL;
+    char error_message[256];
+
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [iterations] [ssl-profile]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    SSL_CTX *shared = create_ssl_context(profile, error_message, sizeof(error_message));
+    SSL_CTX *server_ctx = create_server_context();
+    if (!shared || !server_ctx) {
+        fprintf(stderr, "Failed to set up contexts\n");
+        return EXIT_FAILURE;
+    }
+
+    int handshakes = iterations / HANDSHAKE_DIVISOR > 0 ? iterations / HANDSHAKE_DIVISOR : 1;
+    double setup_per_host = run(profile, NULL, NULL, iterations);
+    double setup_shared = run(profile, shared, NULL, iterations);
+    double full_per_host = run(profile, NULL, server_ctx, handshakes);
+    double full_shared = run(profile, shared, server_ctx, handshakes);
+
+    if (setup_per_host < 0 || setup_shared < 0 || full_per_host < 0 || full_shared < 0) {
+        fprintf(stderr, "Benchmark run failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("bench_ssl_ctx profile=%s\n", profile ? profile : "default");
+    printf("  %-28s %10.0f ns/host (%d hosts)\n", "setup, SSL_CTX per host", setup_per_host, iterations);
+    printf("  %-28s %10.0f ns/host (%d hosts)\n", "setup, shared SSL_CTX", setup_shared, iterations);
+    printf("  %-28s %10.0f ns/host (%d hosts)\n", "handshake, SSL_CTX per host", full_per_host, handshakes);
+    printf("  %-28s %10.0f ns/host (%d hosts)\n", "handshake, shared SSL_CTX", full_shared, handshakes);
+    printf("  setup speedup %.1fx, handshake CPU saved %.1f%%\n",
+           setup_per_host / setup_shared, 100.0 * (full_per_host - full_shared) / full_per_host);
+
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(shared);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "save_certificate.h"
+#include "cert_store.h"
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CERTS 20000
+
+/**
+ * Read the wall clock used for throughput.
+ *
+ * @return Monotonic time in nanoseconds
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Build distinct self-signed certificates sharing one key.
+ *
+ * @param certs Receives the certificates
+ * @param count Number of certificates
+ * @return 0 on success, -1 on failure
+ */
+static int create_certificates(X509 **certs, int count) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    if (!key) return -1;
+
+    for (int i = 0; i < count; i++) {
+        X509 *cert = X509_new();
+        if (!cert) return -1;
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), i + 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                                   (const unsigned char *)"bench.local", -1, -1, 0);
+        X509_set_issuer_name(cert, X509_get_subject_name(cert));
+        if (!X509_sign(cert, key, EVP_sha256())) return -1;
+        certs[i] = cert;
+    }
+    EVP_PKEY_free(key);
+    return 0;
+}
+
+/**
+ * Count and remove the files in a scratch directory, then the directory itself.
+ *
+ * @param dir The directory
+ * @return Number of files removed
+ */
+static int remove_directory(const char *dir) {
+    char path[1024];
+    int files = 0;
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+
+    while (d && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+        files++;
+    }
+    if (d) closedir(d);
+    rmdir(dir);
+    return files;
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : DEFAULT_CERTS;
+    char files_dir[] = "/tmp/bench_store_files_XXXXXX";
+    char pack_dir[] = "/tmp/bench_store_pack_XXXXXX";
+    char error_message[256];
+    arena_t arena;
+
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [certificates]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    X509 **certs = calloc((size_t)count, sizeof(*certs));
+    if (!certs || create_certificates(certs, count) != 0 || !mkdtemp(files_dir) || !mkdtemp(pack_dir)) {
+        fprintf(stderr, "Failed to set up the benchmark\n");
+        return EXIT_FAILURE;
+    }
+
+    // Both paths report every certificate on stderr; keep that out of the timing
+    if (!freopen("/dev/null", "w", stderr)) return EXIT_FAILURE;
+
+    arena_init(&arena, 16 * 1024);
+    double start = now_ns();
+    for (int i = 0; i < count; i++) {
+        save_certificate(certs[i], NULL, CERT_FORMAT_PEM, files_dir, false, false, &arena, 1);
+        arena_reset(&arena);
+    }
+    double files_ns = now_ns() - start;
+
+    start = now_ns();
+    cert_store_t *store = cert_store_open(pack_dir, error_message, sizeof(error_message));
+    for (int i = 0; store && i < count; i++) {
+        store_certificate(certs[i], NULL, CERT_FORMAT_PEM, store, &arena, 1);
+        arena_reset(&arena);
+    }
+    int store_status = store ? cert_store_close(store) : -1;
+    double pack_ns = now_ns() - start;
+
+    int file_count = remove_directory(files_dir);
+    int pack_count = remove_directory(pack_dir);
+    for (int i = 0; i < count; i++) {
+        X509_free(certs[i]);
+    }
+    free(certs);
+    arena_destroy(&arena);
+
+    if (store_status != 0 || file_count != count) {
+        printf("Benchmark run failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("bench_store certificates=%d\n", count);
+    printf("  %-28s %8.1f us/cert %8d files\n", "one file per certificate", files_ns / count / 1e3, file_count);
+    printf("  %-28s %8.1f us/cert %8d files (fsynced)\n", "pack store", pack_ns / count / 1e3, pack_count);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,21 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_block arena_block_t;
+
+// A bump allocator a worker resets after every host. Its memory is kept across resets,
+// so once it has grown to the largest host's needs it stops calling malloc.
+typedef struct {
+    arena_block_t *blocks;
+    size_t block_size;
+    size_t used;
+} arena_t;
+
+void arena_init(arena_t *arena, size_t block_size);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+void arena_destroy(arena_t *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,23 @@
+#ifndef CERT_DEDUP_H
+#define CERT_DEDUP_H
+
+#include <openssl/sha.h>
+#include <stddef.h>
+
+// Counters for the run summary
+typedef struct {
+    size_t seeded;
+    size_t checked;
+    size_t hits;
+} cert_dedup_stats_t;
+
+typedef struct cert_dedup cert_dedup_t;
+
+cert_dedup_t *cert_dedup_create(void);
+void cert_dedup_free(cert_dedup_t *dedup);
+int cert_dedup_seed(cert_dedup_t *dedup, const char *dir, int threads);
+int cert_dedup_add(cert_dedup_t *dedup, const unsigned char fingerprint[SHA256_DIGEST_LENGTH]);
+void cert_dedup_remove(cert_dedup_t *dedup, const unsigned char fingerprint[SHA256_DIGEST_LENGTH]);
+void cert_dedup_get_stats(cert_dedup_t *dedup, cert_dedup_stats_t *stats);
+
+#endif // CERT_DEDUP_H
@@ -0,0 +1,30 @@
+#ifndef CERT_INDEX_H
+#define CERT_INDEX_H
+
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stddef.h>
+
+// Counters for the run summary
+typedef struct {
+    size_t analysed;
+    size_t failed;
+    size_t indexed;
+} cert_index_stats_t;
+
+// What cert_index_query selects; every set filter must match
+typedef struct {
+    int expires_within_days;    // -1 for any expiry
+    int weak_key_bits;          // 0 for any key; else RSA and DSA keys shorter than this
+    const char *name;           // NULL for any; else a substring of the subject or a SAN
+} cert_index_query_t;
+
+typedef struct cert_index cert_index_t;
+
+cert_index_t *cert_index_open(const char *path, int threads, char *error_message, size_t max_length);
+int cert_index_submit(cert_index_t *index, X509 *cert, const unsigned char fingerprint[SHA256_DIGEST_LENGTH]);
+int cert_index_close(cert_index_t *index, cert_index_stats_t *stats);
+int cert_index_query(const char *path, const cert_index_query_t *query, FILE *out);
+
+#endif // CERT_INDEX_H
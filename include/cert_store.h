@@ -0,0 +1,23 @@
+#ifndef CERT_STORE_H
+#define CERT_STORE_H
+
+#include <stddef.h>
+
+// Pack store layout inside the output directory
+#define CERT_STORE_INDEX_NAME "certs.idx"
+#define CERT_STORE_SEGMENT_FORMAT "certs-%06u.pack"
+
+typedef struct cert_store cert_store_t;
+
+// Called for each certificate by cert_store_foreach; return non-zero to stop
+typedef int (*cert_store_visit_t)(const char *key, const unsigned char *data, size_t length, void *arg);
+
+cert_store_t *cert_store_open(const char *dir, char *error_message, size_t max_length);
+int cert_store_put(cert_store_t *store, const unsigned char *data, size_t length, const unsigned char *digest,
+                   char *key_hex, size_t key_size);
+int cert_store_sync(cert_store_t *store);
+int cert_store_close(cert_store_t *store);
+int cert_store_foreach(const char *dir, cert_store_visit_t visit, void *arg);
+int cert_store_extract(const char *dir, const char *key_prefix, const char *output_dir);
+
+#endif // CERT_STORE_H
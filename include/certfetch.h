@@ -0,0 +1,84 @@
+#ifndef CERTFETCH_H
+#define CERTFETCH_H
+
+// libcertfetch: fetch the certificate chains of many TLS servers from one thread.
+// A scanner never touches the filesystem or stdio and starts no threads; each scanner
+// is driven by the thread calling certfetch_run, so run one scanner per thread to scale.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/x509.h>
+
+// The shared library is built with hidden visibility; only these functions are exported
+#define CERTFETCH_API __attribute__((visibility("default")))
+
+typedef struct certfetch certfetch_t;
+
+// How fetching one target ended
+typedef enum {
+    CERTFETCH_OK = 0,
+    CERTFETCH_ERR_DNS,
+    CERTFETCH_ERR_REFUSED,
+    CERTFETCH_ERR_CONNECT,
+    CERTFETCH_ERR_TIMEOUT,
+    CERTFETCH_ERR_HANDSHAKE,
+    CERTFETCH_ERR_STARTTLS,
+    CERTFETCH_ERR_NO_CERTIFICATE,
+    CERTFETCH_ERR_INTERNAL
+} certfetch_status_t;
+
+// Memory for the scanner and its connection slots; OpenSSL keeps its own allocator
+typedef struct {
+    void *(*alloc)(size_t size, void *context);
+    void (*free)(void *ptr, void *context);
+    void *context;
+} certfetch_allocator_t;
+
+// Scanner settings; start from certfetch_options_init
+typedef struct {
+    const char *ssl_profile;
+    int timeout_ms;
+    int connect_timeout_ms;
+    int handshake_timeout_ms;
+    int inflight;
+    bool fast_cert;
+    const certfetch_allocator_t *allocator;
+} certfetch_options_t;
+
+// One server to fetch from. Without an address the host is resolved on the calling thread;
+// without a port the protocol's usual port is used. The protocol is a STARTTLS protocol
+// name (smtp, imap, pop3, ldap, postgres or tls), or NULL to pick one by port.
+typedef struct {
+    const char *host;
+    const char *address;
+    uint16_t port;
+    const char *protocol;
+    void *user_data;
+} certfetch_target_t;
+
+// The outcome of one target. The certificates are only valid during the callback;
+// take a reference (X509_up_ref, X509_chain_up_ref) to keep them.
+typedef struct {
+    const certfetch_target_t *target;
+    certfetch_status_t status;
+    const char *error;
+    const char *address;
+    X509 *leaf;
+    STACK_OF(X509) *chain;
+    bool resumed;
+    long long connect_us;
+    long long handshake_us;
+    long long total_us;
+} certfetch_result_t;
+
+typedef void (*certfetch_callback_t)(const certfetch_result_t *result, void *context);
+
+CERTFETCH_API void certfetch_options_init(certfetch_options_t *options);
+CERTFETCH_API certfetch_t *certfetch_create(const certfetch_options_t *options, char *error_message, size_t max_length);
+CERTFETCH_API int certfetch_run(certfetch_t *scanner, const certfetch_target_t *targets, size_t count,
+                                certfetch_callback_t callback, void *context);
+CERTFETCH_API const char *certfetch_status_name(certfetch_status_t status);
+CERTFETCH_API void certfetch_free(certfetch_t *scanner);
+
+#endif // CERTFETCH_H
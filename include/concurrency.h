@@ -0,0 +1,30 @@
+#ifndef CONCURRENCY_H
+#define CONCURRENCY_H
+
+#include <stdbool.h>
+#include "progress.h"
+
+// How many connections a scan may keep open at once, and what may change that while it runs
+typedef struct {
+    int initial;
+    int minimum;
+    int maximum;
+    bool autoscale;
+    const char *control_path;
+} concurrency_options_t;
+
+typedef struct concurrency concurrency_t;
+
+concurrency_t *concurrency_create(const concurrency_options_t *options, progress_t *progress);
+void concurrency_free(concurrency_t *concurrency);
+int concurrency_limit(concurrency_t *concurrency);
+int concurrency_maximum(concurrency_t *concurrency);
+void concurrency_set_maximum(concurrency_t *concurrency, int maximum);
+int concurrency_share(concurrency_t *concurrency, int index, int count);
+bool concurrency_wait_turn(concurrency_t *concurrency, int id);
+int concurrency_wait_above(concurrency_t *concurrency, int count);
+void concurrency_finish(concurrency_t *concurrency);
+int concurrency_controller_start(concurrency_t *concurrency);
+void concurrency_controller_stop(concurrency_t *concurrency);
+
+#endif // CONCURRENCY_H
@@ -0,0 +1,33 @@
+#ifndef CONN_LOOP_H
+#define CONN_LOOP_H
+
+#include "tls_conn.h"
+
+// Called with each connection once it finished, before its slot is freed
+typedef void (*conn_loop_finish_t)(void *context, int slot, tls_conn_t *conn);
+
+// Drives a fixed set of connection slots from one epoll set on the calling thread.
+// The caller owns the slot arrays; the loop only keeps the epoll set.
+typedef struct {
+    int epoll_fd;
+    int capacity;
+    tls_conn_t *conns;
+    int *registered_fd;
+    int *free_slots;
+    int free_count;
+    long long next_sweep_ms;
+    conn_loop_finish_t finish;
+    void *context;
+} conn_loop_t;
+
+int conn_loop_init(conn_loop_t *loop, int capacity, tls_conn_t *conns, int *registered_fd, int *free_slots,
+                   conn_loop_finish_t finish, void *context);
+void conn_loop_reset(conn_loop_t *loop);
+int conn_loop_acquire(conn_loop_t *loop);
+void conn_loop_start(conn_loop_t *loop, int slot, const tls_conn_options_t *options, const target_t *target);
+int conn_loop_active(const conn_loop_t *loop);
+int conn_loop_poll(conn_loop_t *loop, int max_wait_ms);
+void conn_loop_abort(conn_loop_t *loop);
+void conn_loop_destroy(conn_loop_t *loop);
+
+#endif // CONN_LOOP_H
@@ -0,0 +1,9 @@
+#ifndef EPOLL_ENGINE_H
+#define EPOLL_ENGINE_H
+
+#include "scan_config.h"
+#include "scheduler.h"
+
+int run_epoll_engine(const scan_config_t *config, scheduler_t *scheduler);
+
+#endif // EPOLL_ENGINE_H
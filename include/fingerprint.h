@@ -0,0 +1,14 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+bool fingerprint_bytes(const unsigned char *data, size_t length, unsigned char digest[SHA256_DIGEST_LENGTH]);
+bool fingerprint_cert(X509 *cert, unsigned char digest[SHA256_DIGEST_LENGTH]);
+size_t fingerprint_batch(X509 *const *certs, size_t count, unsigned char (*digests)[SHA256_DIGEST_LENGTH],
+                         bool *valid);
+
+#endif // FINGERPRINT_H
@@ -3,8 +3,28 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include "tls_conn.h"
+#include "scan_config.h"
+#include "metrics.h"
+#include "result_stream.h"
+#include "arena.h"
 
-int download_certificate(const char *hostname, const char *port, const char *output_dir,
-                         char *result_message, size_t max_length, int timeout, bool overwrite, int worker_id);
+#define MAX_RESULT_LENGTH 2048
+// Initial size of a worker's arena, enough for the PEM encoding of a typical chain
+#define WORKER_ARENA_SIZE (32 * 1024)
+
+// What a worker reports its results through; the metrics and results are per worker and may be NULL.
+// The arena holds scratch memory for one host and is reset before the next.
+typedef struct {
+    int id;
+    metrics_shard_t *metrics;
+    result_buffer_t *results;
+    arena_t *arena;
+} worker_context_t;
+
+int download_certificate(const target_t *target, const scan_config_t *config, const worker_context_t *worker,
+                         char *result_message, size_t max_length);
+int complete_certificate_download(tls_conn_t *conn, const scan_config_t *config, const worker_context_t *worker,
+                                  char *result_message, size_t max_length);
 
 #endif // GET_CERTIFICATE_H
@@ -0,0 +1,25 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "target.h"
+
+typedef struct journal journal_t;
+typedef struct journal_set journal_set_t;
+
+// Makes the outputs of every target recorded so far durable; returns 0 on success, -1 on failure
+typedef int (*journal_sync_t)(void *context);
+
+journal_t *journal_open(const char *path, char *error_message, size_t max_length);
+void journal_set_sync(journal_t *journal, journal_sync_t sync, void *context);
+void journal_record(journal_t *journal, const target_t *target, const char *outcome);
+int journal_close(journal_t *journal);
+
+journal_set_t *journal_load(const char *path, char *error_message, size_t max_length);
+bool journal_contains(const journal_set_t *set, const target_t *target);
+size_t journal_set_count(const journal_set_t *set);
+void journal_set_free(journal_set_t *set);
+
+#endif // JOURNAL_H
@@ -0,0 +1,29 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <openssl/sha.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "target.h"
+
+typedef enum {
+    MANIFEST_JSONL,
+    MANIFEST_CSV
+} manifest_format_t;
+
+// First line of every CSV manifest; manifests written before the ip column have the header without it
+#define MANIFEST_CSV_HEADER "host,port,time,outcome,leaf,chain,ip\n"
+#define MANIFEST_CSV_HEADER_NO_IP "host,port,time,outcome,leaf,chain\n"
+
+typedef struct manifest manifest_t;
+
+manifest_t *manifest_open(const char *path, manifest_format_t format);
+void manifest_write(manifest_t *manifest, const target_t *target, const target_addr_t *addr, const char *outcome,
+                    const unsigned char (*fingerprints)[SHA256_DIGEST_LENGTH], int count);
+int manifest_sync(manifest_t *manifest);
+int manifest_close(manifest_t *manifest);
+int manifest_detect_format(const char *line, size_t length, manifest_format_t *format);
+bool manifest_entry_key(const char *line, size_t length, manifest_format_t format,
+                        unsigned char key[SHA256_DIGEST_LENGTH]);
+
+#endif // MANIFEST_H
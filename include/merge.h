@@ -0,0 +1,24 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Counters for the merge summary
+typedef struct {
+    size_t certificates;
+    size_t added;
+    size_t unreadable;
+    size_t entries;
+    size_t entries_added;
+} merge_stats_t;
+
+typedef struct merge merge_t;
+
+merge_t *merge_open(const char *output_dir, bool pack_store, const char *manifest_path, int threads,
+                    char *error_message, size_t max_length);
+int merge_add_directory(merge_t *merge, const char *dir);
+int merge_add_manifest(merge_t *merge, const char *path);
+int merge_close(merge_t *merge, merge_stats_t *stats);
+
+#endif // MERGE_H
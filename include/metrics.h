@@ -0,0 +1,45 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+// Phases of a scan whose latency is measured
+typedef enum {
+    METRIC_PHASE_DNS,
+    METRIC_PHASE_CONNECT,
+    METRIC_PHASE_HANDSHAKE,
+    METRIC_PHASE_SAVE,
+    METRIC_PHASE_TOTAL,
+    METRIC_PHASES
+} metric_phase_t;
+
+// How a target ended; the error classes operators size timeouts and workers by
+typedef enum {
+    METRIC_OUTCOME_OK,
+    METRIC_OUTCOME_DNS,
+    METRIC_OUTCOME_REFUSED,
+    METRIC_OUTCOME_CONNECT,
+    METRIC_OUTCOME_TIMEOUT,
+    METRIC_OUTCOME_HANDSHAKE,
+    METRIC_OUTCOME_SAVE,
+    METRIC_OUTCOME_OTHER,
+    METRIC_OUTCOME_STARTTLS,
+    METRIC_OUTCOMES
+} metric_outcome_t;
+
+typedef struct metrics metrics_t;
+typedef struct metrics_shard metrics_shard_t;
+typedef struct metrics_reporter metrics_reporter_t;
+
+metrics_t *metrics_create(void);
+void metrics_free(metrics_t *metrics);
+const char *metric_outcome_name(metric_outcome_t outcome);
+metrics_shard_t *metrics_shard(metrics_t *metrics);
+void metrics_record(metrics_shard_t *shard, metric_phase_t phase, long long us);
+void metrics_outcome(metrics_shard_t *shard, metric_outcome_t outcome, long long total_us);
+void metrics_report(metrics_t *metrics, FILE *out);
+int metrics_write_prometheus(metrics_t *metrics, const char *path);
+metrics_reporter_t *metrics_reporter_start(metrics_t *metrics, int interval_seconds, const char *path);
+void metrics_reporter_stop(metrics_reporter_t *reporter);
+
+#endif // METRICS_H
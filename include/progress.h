@@ -0,0 +1,32 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdbool.h>
+#include "metrics.h"
+#include "target_queue.h"
+
+// Running totals of a scan, read as a whole by the reporter and the concurrency controller
+typedef struct {
+    unsigned long long started;
+    unsigned long long attempts;
+    unsigned long long timeouts;
+    unsigned long long done;
+    unsigned long long connects;
+    unsigned long long connect_us;
+    int limit;
+} progress_sample_t;
+
+typedef struct progress progress_t;
+typedef struct progress_reporter progress_reporter_t;
+
+progress_t *progress_create(int limit);
+void progress_free(progress_t *progress);
+void progress_start(progress_t *progress);
+void progress_record(progress_t *progress, metric_outcome_t outcome, bool final, long long connect_us);
+void progress_set_limit(progress_t *progress, int limit);
+void progress_sample(progress_t *progress, progress_sample_t *sample);
+
+progress_reporter_t *progress_reporter_start(progress_t *progress, int interval_seconds, target_queue_t *input);
+void progress_reporter_stop(progress_reporter_t *reporter);
+
+#endif // PROGRESS_H
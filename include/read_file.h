@@ -2,8 +2,36 @@
 #define READ_FILE_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "target.h"
+#include "target_queue.h"
+#include "journal.h"
+#include "target_generator.h"
+#include "starttls.h"
+#include "shard.h"
 
-FILE *open_input_file(const char *filename);
+#define DEFAULT_PORT "443"
+#define MAX_LINE_LENGTH 256
+
+// A view of one input line; not NUL-terminated and never copied
+typedef struct {
+    const char *data;
+    size_t length;
+} line_slice_t;
+
+typedef struct input_source input_source_t;
+typedef struct input_reader input_reader_t;
+
+input_source_t *open_input_source(const char *filename);
+void close_input_source(input_source_t *source);
+bool parse_target_line(line_slice_t line, target_t *target, bool *has_port);
+input_reader_t *input_reader_start(input_source_t *source, int readers, target_queue_t *output,
+                                   const journal_set_t *finished, target_generator_t *generator,
+                                   const shard_t *shard);
+size_t input_reader_skipped(input_reader_t *reader);
+size_t input_reader_other_shards(input_reader_t *reader);
+void input_reader_join(input_reader_t *reader);
 
 #endif
 
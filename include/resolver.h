@@ -0,0 +1,23 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdbool.h>
+#include "target.h"
+#include "target_queue.h"
+
+// Settings for the DNS resolution stage
+typedef struct {
+    int threads;
+    const char *server;
+    int ttl_seconds;
+    int cache_entries;
+    bool all_addresses;
+} resolver_options_t;
+
+typedef struct resolver resolver_t;
+
+resolver_t *resolver_start(const resolver_options_t *options, target_queue_t *input, target_queue_t *output);
+void resolver_join(resolver_t *resolver);
+const char *resolve_status_name(resolve_status_t status);
+
+#endif // RESOLVER_H
@@ -0,0 +1,45 @@
+#ifndef RESULT_STREAM_H
+#define RESULT_STREAM_H
+
+#include <stdbool.h>
+#include <openssl/sha.h>
+#include "target.h"
+#include "metrics.h"
+
+typedef enum {
+    RESULT_OUTPUT_TEXT,
+    RESULT_OUTPUT_JSONL,
+    RESULT_OUTPUT_BINARY
+} result_format_t;
+
+// The outcome of one target; phase timings are -1 for phases that were not reached
+typedef struct {
+    const target_t *target;
+    const target_addr_t *addr;
+    metric_outcome_t status;
+    int worker_id;
+    long long dns_us;
+    long long connect_us;
+    long long handshake_us;
+    long long save_us;
+    long long total_us;
+    bool has_fingerprint;
+    bool new_certificate;
+    bool resumed;
+    bool changed;
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+    const char *message;
+} scan_result_t;
+
+typedef struct result_stream result_stream_t;
+typedef struct result_buffer result_buffer_t;
+
+result_stream_t *result_stream_open(int fd, result_format_t format, bool quiet);
+result_buffer_t *result_stream_buffer(result_stream_t *stream);
+void result_buffer_write(result_buffer_t *buffer, const scan_result_t *result);
+void result_buffer_text(result_buffer_t *buffer, const char *line);
+void result_buffer_flush(result_buffer_t *buffer);
+int result_stream_sync(result_stream_t *stream);
+int result_stream_close(result_stream_t *stream);
+
+#endif // RESULT_STREAM_H
@@ -0,0 +1,11 @@
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+typedef struct rtt_estimator rtt_estimator_t;
+
+rtt_estimator_t *rtt_estimator_create(void);
+void rtt_estimator_free(rtt_estimator_t *estimator);
+void rtt_estimator_add(rtt_estimator_t *estimator, long long us);
+long long rtt_estimator_p99(rtt_estimator_t *estimator);
+
+#endif // RTT_ESTIMATOR_H
@@ -3,7 +3,17 @@
 
 #include <openssl/x509.h>
 #include <stdbool.h>
+#include "cert_store.h"
+#include "arena.h"
 
-int save_certificate(X509 *cert, const char *output_dir, bool overwrite, int worker_id);
+typedef enum {
+    CERT_FORMAT_PEM,
+    CERT_FORMAT_DER
+} cert_format_t;
+
+int save_certificate(X509 *cert, const unsigned char *fingerprint, cert_format_t format, const char *output_dir,
+                     bool overwrite, bool durable, arena_t *arena, int worker_id);
+int store_certificate(X509 *cert, const unsigned char *fingerprint, cert_format_t format, cert_store_t *store,
+                      arena_t *arena, int worker_id);
 
 #endif // SAVE_CERTIFICATE_H
@@ -0,0 +1,53 @@
+#ifndef SCAN_CONFIG_H
+#define SCAN_CONFIG_H
+
+#include <stdbool.h>
+#include "tls_conn.h"
+#include "resolver.h"
+#include "cert_store.h"
+#include "cert_dedup.h"
+#include "cert_index.h"
+#include "save_certificate.h"
+#include "manifest.h"
+#include "scheduler.h"
+#include "journal.h"
+#include "session_cache.h"
+#include "metrics.h"
+#include "result_stream.h"
+#include "progress.h"
+#include "concurrency.h"
+
+typedef enum {
+    SCAN_ENGINE_THREADS,
+    SCAN_ENGINE_EPOLL
+} scan_engine_t;
+
+// Settings shared by every worker, filled in from the command line
+typedef struct {
+    const char *output_dir;
+    double delay;
+    bool overwrite;
+    cert_store_t *store;
+    cert_dedup_t *dedup;
+    cert_index_t *index;
+    cert_format_t format;
+    bool chain;
+    bool changed_only;
+    manifest_t *manifest;
+    journal_t *journal;
+    session_cache_t *sessions;
+    metrics_t *metrics;
+    scheduler_t *scheduler;
+    result_stream_t *results;
+    progress_t *progress;
+    concurrency_t *concurrency;
+    int workers;
+    scan_engine_t engine;
+    int inflight;
+    int readers;
+    tls_conn_options_t tls;
+    resolver_options_t dns;
+    scheduler_options_t rate;
+} scan_config_t;
+
+#endif // SCAN_CONFIG_H
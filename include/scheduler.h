@@ -0,0 +1,28 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include "target.h"
+#include "target_queue.h"
+
+// Connection rate limits, where a rate of 0 disables that limit, and the retry policy
+typedef struct {
+    double global_rate;
+    double ip_rate;
+    double prefix_rate;
+    int prefix_len;
+    int prefix6_len;
+    int retries;
+    int retry_backoff_ms;
+} scheduler_options_t;
+
+typedef struct scheduler scheduler_t;
+
+scheduler_t *scheduler_create(const scheduler_options_t *options, target_queue_t *input);
+void scheduler_free(scheduler_t *scheduler);
+int scheduler_next(scheduler_t *scheduler, target_t *target, int timeout_ms);
+bool scheduler_finish(scheduler_t *scheduler, const target_t *target, bool failed);
+unsigned long long scheduler_deferrals(scheduler_t *scheduler);
+unsigned long long scheduler_retries(scheduler_t *scheduler);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,28 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <openssl/ssl.h>
+#include <openssl/sha.h>
+#include "target.h"
+
+// Counters for the run summary
+typedef struct {
+    size_t loaded;
+    size_t offered;
+    size_t resumed;
+    size_t changed;
+} session_cache_stats_t;
+
+typedef struct session_cache session_cache_t;
+
+session_cache_t *session_cache_load(const char *path, int max_age_seconds, char *error_message, size_t max_length);
+SSL_SESSION *session_cache_get(session_cache_t *cache, const target_t *target);
+int session_cache_update(session_cache_t *cache, const target_t *target, SSL_SESSION *session, bool resumed,
+                         const unsigned char fingerprint[SHA256_DIGEST_LENGTH]);
+int session_cache_save(session_cache_t *cache, const char *path, char *error_message, size_t max_length);
+void session_cache_get_stats(session_cache_t *cache, session_cache_stats_t *stats);
+void session_cache_free(session_cache_t *cache);
+
+#endif // SESSION_CACHE_H
@@ -0,0 +1,26 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "target.h"
+
+#define SHARD_MAX_COUNT 4096
+#define SHARD_MAX_WEIGHT 1000000
+
+// The part of the target hash space one node scans; every node derives the same split
+typedef struct {
+    uint32_t index;
+    uint32_t count;
+    uint32_t weight;
+    uint64_t total_weight;
+    uint64_t low;
+    uint64_t high;
+} shard_t;
+
+int shard_parse(const char *spec, const char *weights, shard_t *shard, char *error_message, size_t max_length);
+uint64_t shard_point(const char *hostname, const char *port);
+bool shard_contains(const shard_t *shard, const target_t *target);
+
+#endif // SHARD_H
@@ -0,0 +1,10 @@
+#ifndef SSL_PROFILE_H
+#define SSL_PROFILE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <openssl/ssl.h>
+
+SSL_CTX *create_ssl_context(const char *profile, char *error_message, size_t max_length);
+
+#endif // SSL_PROFILE_H
@@ -0,0 +1,32 @@
+#ifndef STARTTLS_H
+#define STARTTLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "target.h"
+
+// Readiness a negotiation is waiting for before it can make progress
+#define STARTTLS_WANT_READ  1
+#define STARTTLS_WANT_WRITE 2
+
+// Longest server reply line kept while negotiating; SMTP limits its lines to 512 bytes
+#define STARTTLS_BUFFER 512
+
+// The plaintext exchange that asks a server to switch to TLS, driven over a non-blocking socket
+typedef struct {
+    starttls_protocol_t protocol;
+    int step;
+    size_t sent;
+    size_t length;
+    const char *error;
+    char buffer[STARTTLS_BUFFER];
+} starttls_t;
+
+int starttls_protocol_parse(const char *name, size_t length);
+const char *starttls_protocol_name(starttls_protocol_t protocol);
+uint16_t starttls_default_port(starttls_protocol_t protocol);
+starttls_protocol_t starttls_protocol_for_port(uint16_t port);
+void starttls_init(starttls_t *negotiation, starttls_protocol_t protocol);
+int starttls_continue(starttls_t *negotiation, int fd);
+
+#endif // STARTTLS_H
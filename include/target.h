@@ -0,0 +1,48 @@
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <stdint.h>
+
+#define TARGET_MAX_HOSTNAME 256
+#define TARGET_MAX_PORT 16
+#define TARGET_MAX_ADDRS 8
+
+typedef enum {
+    RESOLVE_OK = 0,
+    RESOLVE_NXDOMAIN,
+    RESOLVE_NODATA,
+    RESOLVE_TEMPFAIL,
+    RESOLVE_INVALID
+} resolve_status_t;
+
+// Plaintext protocol spoken before the TLS handshake; STARTTLS_AUTO picks one by port
+typedef enum {
+    STARTTLS_AUTO = 0,
+    STARTTLS_NONE,
+    STARTTLS_SMTP,
+    STARTTLS_IMAP,
+    STARTTLS_POP3,
+    STARTTLS_LDAP,
+    STARTTLS_POSTGRES
+} starttls_protocol_t;
+
+// A resolved IPv4 or IPv6 address, without a port
+typedef struct {
+    int family;
+    unsigned char addr[16];
+} target_addr_t;
+
+// One host to scan, as it travels from the resolver stage to the connect stage
+typedef struct {
+    char hostname[TARGET_MAX_HOSTNAME];
+    char port[TARGET_MAX_PORT];
+    uint16_t port_number;
+    uint8_t starttls;
+    resolve_status_t dns_status;
+    uint32_t dns_us;
+    uint8_t attempts;
+    int addr_count;
+    target_addr_t addrs[TARGET_MAX_ADDRS];
+} target_t;
+
+#endif // TARGET_H
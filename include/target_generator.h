@@ -0,0 +1,30 @@
+#ifndef TARGET_GENERATOR_H
+#define TARGET_GENERATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "target.h"
+
+// Ports every input entry without its own port expands to
+typedef struct {
+    uint16_t *ports;
+    size_t count;
+} port_list_t;
+
+typedef struct target_generator target_generator_t;
+
+// Called for every generated target; returns false to stop the generator
+typedef bool (*target_emit_fn)(void *context, target_t *target);
+
+int port_list_parse(const char *text, port_list_t *list);
+void port_list_free(port_list_t *list);
+
+target_generator_t *target_generator_create(const port_list_t *ports, uint64_t seed);
+void target_generator_free(target_generator_t *generator);
+const port_list_t *target_generator_ports(const target_generator_t *generator);
+int target_generator_add(target_generator_t *generator, const char *text, size_t length);
+uint64_t target_generator_count(target_generator_t *generator);
+bool target_generator_run(target_generator_t *generator, target_t *scratch, target_emit_fn emit, void *context);
+
+#endif // TARGET_GENERATOR_H
@@ -0,0 +1,37 @@
+#ifndef TARGET_QUEUE_H
+#define TARGET_QUEUE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "target.h"
+
+#define TARGET_QUEUE_CACHE_LINE 64
+
+// A ring slot; its sequence number says whether it is ready to be written or read
+typedef struct {
+    atomic_size_t sequence;
+    target_t target;
+} target_queue_cell_t;
+
+// Bounded lock-free multi-producer multi-consumer queue of targets between two pipeline stages
+typedef struct {
+    target_queue_cell_t *cells;
+    size_t mask;
+    char pad0[TARGET_QUEUE_CACHE_LINE];
+    atomic_size_t enqueue_pos;
+    char pad1[TARGET_QUEUE_CACHE_LINE];
+    atomic_size_t dequeue_pos;
+    char pad2[TARGET_QUEUE_CACHE_LINE];
+    atomic_bool closed;
+} target_queue_t;
+
+int target_queue_init(target_queue_t *queue, size_t capacity);
+void target_queue_destroy(target_queue_t *queue);
+bool target_queue_push(target_queue_t *queue, const target_t *target);
+int target_queue_pop(target_queue_t *queue, target_t *target, int timeout_ms);
+void target_queue_close(target_queue_t *queue);
+size_t target_queue_pushed(target_queue_t *queue);
+bool target_queue_closed(target_queue_t *queue);
+
+#endif // TARGET_QUEUE_H
@@ -0,0 +1,17 @@
+#ifndef THREAD_CACHE_H
+#define THREAD_CACHE_H
+
+#include <stdbool.h>
+
+// Counters for the run summary and the fleet benchmark
+typedef struct {
+    unsigned long long allocations;
+    unsigned long long heap_allocations;
+    unsigned long long connections;
+} thread_cache_stats_t;
+
+bool thread_cache_install(void);
+void thread_cache_count_connection(void);
+void thread_cache_get_stats(thread_cache_stats_t *stats);
+
+#endif // THREAD_CACHE_H
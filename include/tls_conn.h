@@ -0,0 +1,115 @@
+#ifndef TLS_CONN_H
+#define TLS_CONN_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <openssl/ssl.h>
+#include "target.h"
+#include "rtt_estimator.h"
+#include "starttls.h"
+
+// Readiness a connection is waiting for before it can make progress
+#define TLS_CONN_WANT_READ  1
+#define TLS_CONN_WANT_WRITE 2
+
+typedef enum {
+    TLS_CONN_CONNECTING,
+    TLS_CONN_NEGOTIATING,
+    TLS_CONN_HANDSHAKING,
+    TLS_CONN_AWAITING_TICKET,
+    TLS_CONN_DONE,
+    TLS_CONN_FAILED
+} tls_conn_state_t;
+
+typedef enum {
+    TLS_CONN_OK = 0,
+    TLS_CONN_ERR_DNS,
+    TLS_CONN_ERR_CONNECT,
+    TLS_CONN_ERR_TIMEOUT,
+    TLS_CONN_ERR_HANDSHAKE,
+    TLS_CONN_ERR_STARTTLS,
+    TLS_CONN_ERR_INTERNAL
+} tls_conn_error_t;
+
+// Most local addresses a scan can connect from
+#define TLS_CONN_MAX_SOURCES 64
+
+// Local addresses connections are bound to, taken in turn so that each one's ephemeral ports share the load
+typedef struct {
+    int count;
+    target_addr_t addrs[TLS_CONN_MAX_SOURCES];
+    atomic_uint next;
+} tls_conn_sources_t;
+
+// Finds the session saved for a target, to offer it to the server, or returns NULL (see session_cache_get)
+typedef SSL_SESSION *(*tls_conn_session_lookup_t)(void *context, const target_t *target);
+
+// Settings shared by every connection of a scan. A phase timeout of 0 leaves the phase
+// limited by timeout_ms alone; with adaptive_multiplier and the estimators set, first attempts
+// use adaptive timeouts. The connect estimator also sets the delay before racing another address.
+typedef struct {
+    SSL_CTX *ctx;
+    int timeout_ms;
+    int connect_timeout_ms;
+    int handshake_timeout_ms;
+    double adaptive_multiplier;
+    rtt_estimator_t *connect_rtt;
+    rtt_estimator_t *handshake_rtt;
+    bool fast_cert;
+    tls_conn_session_lookup_t find_session;
+    void *session_context;
+    tls_conn_sources_t *sources;
+    // File descriptors left for racing addresses, shared by every connection; NULL for no limit
+    atomic_int *race_fds;
+} tls_conn_options_t;
+
+// A single non-blocking connect + optional STARTTLS exchange + TLS handshake state machine.
+// Once a target's second address is due, its addresses are raced: fd is then an epoll set
+// holding each attempt's socket, until one connects and becomes fd.
+typedef struct {
+    int fd;
+    const tls_conn_options_t *options;
+    SSL *ssl;
+    X509 *captured_cert;
+    STACK_OF(X509) *captured_chain;
+    SSL_SESSION *session;
+    starttls_t *starttls;
+    bool resumed;
+    int next_addr;
+    int addr_index;
+    int race_fd;
+    int racing;
+    int race_fds_taken;
+    int attempt_fds[TARGET_MAX_ADDRS];
+    long long attempt_started_us[TARGET_MAX_ADDRS];
+    bool attempt_due;
+    tls_conn_state_t state;
+    tls_conn_error_t error;
+    int want;
+    long long deadline_ms;
+    long long connect_deadline_ms;
+    long long connect_window_ms;
+    long long expires_ms;
+    long long started_us;
+    long long connected_us;
+    long long negotiated_us;
+    long long handshaken_us;
+    int connect_errno;
+    target_t target;
+} tls_conn_t;
+
+bool tls_conn_capture_sessions(SSL_CTX *ctx);
+int tls_conn_parse_sources(const char *list, tls_conn_sources_t *sources, char *error_message, size_t max_length);
+unsigned long long tls_conn_fallback_count(void);
+int tls_conn_start(tls_conn_t *conn, const tls_conn_options_t *options, const target_t *target);
+int tls_conn_continue(tls_conn_t *conn);
+bool tls_conn_finished(const tls_conn_t *conn);
+void tls_conn_expire(tls_conn_t *conn);
+int tls_conn_timeout(tls_conn_t *conn);
+X509 *tls_conn_get_peer_certificate(const tls_conn_t *conn);
+STACK_OF(X509) *tls_conn_get_peer_chain(const tls_conn_t *conn);
+const target_addr_t *tls_conn_get_address(const tls_conn_t *conn);
+void tls_conn_cleanup(tls_conn_t *conn);
+
+#endif // TLS_CONN_H
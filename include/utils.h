@@ -3,8 +3,14 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
+void hex_encode(const unsigned char *data, size_t len, char *output);
 bool sha256sum(const unsigned char *data, size_t len, char *output, size_t output_size);
 bool get_ssl_error(char *error_message, size_t max_length);
+long long monotonic_ms(void);
+long long monotonic_us(void);
+uint64_t target_key(const char *hostname, const char *port);
+int sync_directory(const char *path);
 
 #endif // UTILS_H
@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "arena.h"
+#include <stdlib.h>
+
+// Allocations are aligned for any type
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    arena_block_t *next;
+    size_t size;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+/**
+ * Set up an empty arena. No memory is taken until the first allocation.
+ *
+ * @param arena The arena
+ * @param block_size Size of the first block; later blocks grow to fit
+ */
+void arena_init(arena_t *arena, size_t block_size) {
+    arena->blocks = NULL;
+    arena->block_size = block_size;
+    arena->used = 0;
+}
+
+/**
+ * Take memory from the arena. It stays valid until the next reset.
+ *
+ * @param arena The arena
+ * @param size Bytes needed
+ * @return The memory, aligned to 16 bytes, or NULL on failure
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_block_t *block = arena->blocks;
+    if (!block || block->size - arena->used < size) {
+        // The new block goes in front; the rest of the old one is left unused until the reset
+        size_t block_size = block ? block->size * 2 : arena->block_size;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        block = malloc(sizeof(*block) + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->size = block_size;
+        arena->blocks = block;
+        arena->used = 0;
+    }
+
+    void *ptr = block->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+/**
+ * Release everything taken from the arena. An arena that needed more than one block
+ * is merged into a single block as large as all of them, so the next host fits at once.
+ *
+ * @param arena The arena
+ */
+void arena_reset(arena_t *arena) {
+    arena_block_t *block = arena->blocks;
+    arena->used = 0;
+    if (!block || !block->next) {
+        return;
+    }
+
+    size_t total = 0;
+    for (arena_block_t *b = block; b; b = b->next) {
+        total += b->size;
+    }
+    arena_destroy(arena);
+    arena->block_size = total;
+}
+
+/**
+ * Free the arena's memory.
+ *
+ * @param arena The arena
+ */
+void arena_destroy(arena_t *arena) {
+    arena_block_t *block = arena->blocks;
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->used = 0;
+}
@@ -0,0 +1,383 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cert_dedup.h"
+#include "cert_store.h"
+#include "fingerprint.h"
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEDUP_SHARDS 64
+#define INITIAL_SHARD_CAPACITY 256
+#define MAX_PATH_LENGTH 1024
+
+// One slice of the set with its own lock; open addressing with linear probing
+typedef struct {
+    pthread_mutex_t mutex;
+    unsigned char (*fingerprints)[SHA256_DIGEST_LENGTH];
+    bool *used;
+    size_t capacity;
+    size_t count;
+} dedup_shard_t;
+
+struct cert_dedup {
+    dedup_shard_t shards[DEDUP_SHARDS];
+    atomic_size_t seeded;
+    atomic_size_t checked;
+    atomic_size_t hits;
+};
+
+// Files in the output directory shared out between the seeding threads
+typedef struct {
+    cert_dedup_t *dedup;
+    const char *dir;
+    char **names;
+    size_t count;
+    atomic_size_t next;
+} seed_job_t;
+
+/**
+ * Read the hash of a fingerprint. The fingerprint is already a SHA-256, so its
+ * first bytes are uniformly distributed.
+ *
+ * @param fingerprint The fingerprint
+ * @return The hash
+ */
+static uint64_t fingerprint_hash(const unsigned char *fingerprint) {
+    uint64_t hash;
+    memcpy(&hash, fingerprint, sizeof(hash));
+    return hash;
+}
+
+/**
+ * Find the slot for a fingerprint in a shard. The shard must be locked.
+ *
+ * @param shard The shard
+ * @param fingerprint The fingerprint
+ * @return The slot holding the fingerprint, or the empty slot where it belongs
+ */
+static size_t shard_slot(const dedup_shard_t *shard, const unsigned char *fingerprint) {
+    size_t slot = (size_t)(fingerprint_hash(fingerprint) / DEDUP_SHARDS) & (shard->capacity - 1);
+    while (shard->used[slot] && memcmp(shard->fingerprints[slot], fingerprint, SHA256_DIGEST_LENGTH) != 0) {
+        slot = (slot + 1) & (shard->capacity - 1);
+    }
+    return slot;
+}
+
+/**
+ * Double the capacity of a shard. The shard must be locked.
+ *
+ * @param shard The shard
+ * @return 0 on success, -1 on allocation failure
+ */
+static int shard_grow(dedup_shard_t *shard) {
+    dedup_shard_t grown = { .capacity = shard->capacity ? shard->capacity * 2 : INITIAL_SHARD_CAPACITY };
+    grown.fingerprints = malloc(grown.capacity * sizeof(*grown.fingerprints));
+    grown.used = calloc(grown.capacity, sizeof(*grown.used));
+    if (!grown.fingerprints || !grown.used) {
+        free(grown.fingerprints);
+        free(grown.used);
+        return -1;
+    }
+
+    for (size_t i = 0; i < shard->capacity; i++) {
+        if (shard->used[i]) {
+            size_t slot = shard_slot(&grown, shard->fingerprints[i]);
+            memcpy(grown.fingerprints[slot], shard->fingerprints[i], SHA256_DIGEST_LENGTH);
+            grown.used[slot] = true;
+        }
+    }
+    free(shard->fingerprints);
+    free(shard->used);
+    shard->fingerprints = grown.fingerprints;
+    shard->used = grown.used;
+    shard->capacity = grown.capacity;
+    return 0;
+}
+
+/**
+ * Insert a fingerprint unless it is already present.
+ *
+ * @param dedup The set
+ * @param fingerprint The fingerprint
+ * @return 1 if inserted, 0 if already present, -1 on allocation failure
+ */
+static int insert(cert_dedup_t *dedup, const unsigned char *fingerprint) {
+    dedup_shard_t *shard = &dedup->shards[fingerprint_hash(fingerprint) % DEDUP_SHARDS];
+    int ret = 0;
+
+    pthread_mutex_lock(&shard->mutex);
+    if ((shard->count + 1) * 2 > shard->capacity && shard_grow(shard) != 0) {
+        ret = -1;
+    } else {
+        size_t slot = shard_slot(shard, fingerprint);
+        if (!shard->used[slot]) {
+            memcpy(shard->fingerprints[slot], fingerprint, SHA256_DIGEST_LENGTH);
+            shard->used[slot] = true;
+            shard->count++;
+            ret = 1;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return ret;
+}
+
+/**
+ * Create an empty fingerprint set.
+ *
+ * @return The set, or NULL on allocation failure
+ */
+cert_dedup_t *cert_dedup_create(void) {
+    cert_dedup_t *dedup = calloc(1, sizeof(*dedup));
+    if (!dedup) {
+        return NULL;
+    }
+    for (int i = 0; i < DEDUP_SHARDS; i++) {
+        pthread_mutex_init(&dedup->shards[i].mutex, NULL);
+    }
+    atomic_init(&dedup->seeded, 0);
+    atomic_init(&dedup->checked, 0);
+    atomic_init(&dedup->hits, 0);
+    return dedup;
+}
+
+/**
+ * Free a fingerprint set.
+ *
+ * @param dedup The set
+ */
+void cert_dedup_free(cert_dedup_t *dedup) {
+    for (int i = 0; i < DEDUP_SHARDS; i++) {
+        pthread_mutex_destroy(&dedup->shards[i].mutex);
+        free(dedup->shards[i].fingerprints);
+        free(dedup->shards[i].used);
+    }
+    free(dedup);
+}
+
+/**
+ * Record a downloaded certificate's fingerprint.
+ *
+ * @param dedup The set
+ * @param fingerprint The fingerprint
+ * @return 1 if the certificate is new, 0 if it was already seen, -1 on allocation failure
+ */
+int cert_dedup_add(cert_dedup_t *dedup, const unsigned char fingerprint[SHA256_DIGEST_LENGTH]) {
+    int ret = insert(dedup, fingerprint);
+    atomic_fetch_add_explicit(&dedup->checked, 1, memory_order_relaxed);
+    if (ret == 0) {
+        atomic_fetch_add_explicit(&dedup->hits, 1, memory_order_relaxed);
+    }
+    return ret;
+}
+
+/**
+ * Forget a fingerprint, so a certificate that failed to save is tried again.
+ * Later entries of the probe run are shifted back so lookups stay correct.
+ *
+ * @param dedup The set
+ * @param fingerprint The fingerprint
+ */
+void cert_dedup_remove(cert_dedup_t *dedup, const unsigned char fingerprint[SHA256_DIGEST_LENGTH]) {
+    dedup_shard_t *shard = &dedup->shards[fingerprint_hash(fingerprint) % DEDUP_SHARDS];
+
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->capacity > 0) {
+        size_t mask = shard->capacity - 1;
+        size_t hole = shard_slot(shard, fingerprint);
+
+        if (shard->used[hole]) {
+            shard->used[hole] = false;
+            shard->count--;
+            for (size_t slot = (hole + 1) & mask; shard->used[slot]; slot = (slot + 1) & mask) {
+                size_t home = (size_t)(fingerprint_hash(shard->fingerprints[slot]) / DEDUP_SHARDS) & mask;
+                // Move the entry into the hole unless its home lies cyclically in (hole, slot]
+                if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+                    memcpy(shard->fingerprints[hole], shard->fingerprints[slot], SHA256_DIGEST_LENGTH);
+                    shard->used[hole] = true;
+                    shard->used[slot] = false;
+                    hole = slot;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * Read the counters for the run summary.
+ *
+ * @param dedup The set
+ * @param stats Receives the counters
+ */
+void cert_dedup_get_stats(cert_dedup_t *dedup, cert_dedup_stats_t *stats) {
+    stats->seeded = atomic_load(&dedup->seeded);
+    stats->checked = atomic_load(&dedup->checked);
+    stats->hits = atomic_load(&dedup->hits);
+}
+
+/**
+ * Check whether a file in the output directory is a saved certificate.
+ *
+ * @param name The file name
+ * @return true if the file should be read
+ */
+static bool is_certificate_file(const char *name) {
+    size_t length = strlen(name);
+    return length > 4 && (strcmp(name + length - 4, ".pem") == 0 || strcmp(name + length - 4, ".der") == 0);
+}
+
+/**
+ * Add a certificate found while seeding.
+ *
+ * @param dedup The set
+ * @param cert The certificate
+ */
+static void seed_certificate(cert_dedup_t *dedup, X509 *cert) {
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+    if (fingerprint_cert(cert, fingerprint) && insert(dedup, fingerprint) == 1) {
+        atomic_fetch_add_explicit(&dedup->seeded, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Add a certificate from the pack store. A DER entry's key already is its fingerprint.
+ *
+ * @param key The entry's key
+ * @param data The encoded certificate
+ * @param length Number of bytes
+ * @param arg The set
+ * @return 0, to keep going
+ */
+static int seed_stored_certificate(const char *key, const unsigned char *data, size_t length, void *arg) {
+    cert_dedup_t *dedup = (cert_dedup_t *)arg;
+    (void)key;
+
+    if (data[0] == 0x30) {
+        unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+        if (fingerprint_bytes(data, length, fingerprint) && insert(dedup, fingerprint) == 1) {
+            atomic_fetch_add_explicit(&dedup->seeded, 1, memory_order_relaxed);
+        }
+        return 0;
+    }
+
+    BIO *mem = BIO_new_mem_buf(data, (int)length);
+    X509 *cert = mem ? PEM_read_bio_X509(mem, NULL, NULL, NULL) : NULL;
+    if (cert) {
+        seed_certificate(dedup, cert);
+        X509_free(cert);
+    }
+    BIO_free(mem);
+    ERR_clear_error();
+    return 0;
+}
+
+/**
+ * Seeding thread function.
+ * Takes files from the shared list and adds every certificate in them.
+ *
+ * @param arg The seed job
+ * @return NULL
+ */
+static void *seed_thread(void *arg) {
+    seed_job_t *job = (seed_job_t *)arg;
+    char path[MAX_PATH_LENGTH];
+    size_t i;
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+        if (snprintf(path, sizeof(path), "%s/%s", job->dir, job->names[i]) >= (int)sizeof(path)) {
+            continue;
+        }
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            continue;
+        }
+
+        size_t length = strlen(job->names[i]);
+        X509 *cert = strcmp(job->names[i] + length - 4, ".der") == 0 ? d2i_X509_fp(file, NULL)
+                                                                     : PEM_read_X509(file, NULL, NULL, NULL);
+        if (cert) {
+            seed_certificate(job->dedup, cert);
+            X509_free(cert);
+        }
+        fclose(file);
+        ERR_clear_error();
+    }
+    return NULL;
+}
+
+/**
+ * Add every certificate already saved in the output directory to the set:
+ * .pem and .der files, and the pack store if there is one.
+ *
+ * @param dedup The set
+ * @param dir The output directory
+ * @param threads Number of threads parsing files
+ * @return The number of certificates added, or -1 if the directory could not be read
+ */
+int cert_dedup_seed(cert_dedup_t *dedup, const char *dir, int threads) {
+    seed_job_t job = { .dedup = dedup, .dir = dir };
+    pthread_t *tids = NULL;
+    size_t capacity = 0;
+    struct dirent *entry;
+    int ret = -1;
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+
+    char index_path[MAX_PATH_LENGTH];
+    snprintf(index_path, sizeof(index_path), "%s/%s", dir, CERT_STORE_INDEX_NAME);
+    if (access(index_path, F_OK) == 0 && cert_store_foreach(dir, seed_stored_certificate, dedup) < 0) {
+        goto cleanup;
+    }
+
+    while ((entry = readdir(d)) != NULL) {
+        if (!is_certificate_file(entry->d_name)) {
+            continue;
+        }
+        if (job.count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            char **grown = realloc(job.names, capacity * sizeof(*grown));
+            if (!grown) goto cleanup;
+            job.names = grown;
+        }
+        if (!(job.names[job.count] = strdup(entry->d_name))) goto cleanup;
+        job.count++;
+    }
+
+    atomic_init(&job.next, 0);
+    tids = calloc(threads > 0 ? (size_t)threads : 1, sizeof(*tids));
+    if (!tids) goto cleanup;
+    int started = 0;
+    for (; started < threads && (size_t)started < job.count; started++) {
+        if (pthread_create(&tids[started], NULL, seed_thread, &job) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        seed_thread(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    ret = (int)atomic_load(&dedup->seeded);
+
+cleanup:
+    closedir(d);
+    free(tids);
+    for (size_t i = 0; i < job.count; i++) {
+        free(job.names[i]);
+    }
+    free(job.names);
+    return ret;
+}
@@ -0,0 +1,813 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "cert_index.h"
+#include "utils.h"
+#include <openssl/asn1.h>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/x509v3.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "CRTANA01"
+#define INDEX_MAGIC_LENGTH 8
+#define MAX_PATH_LENGTH 1024
+// Certificates waiting for the analysis threads; the fetch path only waits once this many are queued
+#define QUEUE_CAPACITY 8192
+#define MAX_NAME_LENGTH 1024
+#define MAX_SANS_LENGTH 8192
+#define SECONDS_PER_DAY 86400LL
+
+// One certificate in the index file. The strings are offsets into the string table
+// that follows the records; the SANs are a comma separated list.
+typedef struct {
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+    int64_t not_before;
+    int64_t not_after;
+    uint32_t subject;
+    uint32_t issuer;
+    uint32_t sans;
+    uint32_t key_bits;
+    int32_t key_nid;
+    int32_t signature_nid;
+} index_record_t;
+
+_Static_assert(sizeof(index_record_t) == 72, "index records are stored as 72 bytes");
+
+// The file starts with this header, then the records sorted by notAfter, then the strings
+typedef struct {
+    char magic[INDEX_MAGIC_LENGTH];
+    uint64_t count;
+    uint64_t strings_length;
+} index_header_t;
+
+_Static_assert(sizeof(index_header_t) == 24, "the index header is stored as 24 bytes");
+
+// Records and their strings, in memory
+typedef struct {
+    index_record_t *records;
+    size_t count;
+    size_t capacity;
+    char *strings;
+    size_t length;
+    size_t string_capacity;
+} index_table_t;
+
+// A certificate handed over by the fetch path, holding its own reference
+typedef struct {
+    X509 *cert;
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+} pending_cert_t;
+
+struct cert_index {
+    char path[MAX_PATH_LENGTH];
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t space;
+    pending_cert_t queue[QUEUE_CAPACITY];
+    size_t head;
+    size_t queued;
+    bool closing;
+    index_table_t table;
+    size_t failed;
+    bool out_of_memory;
+};
+
+/**
+ * Append a string, with its null terminator, to a table's string table.
+ *
+ * @param table The table
+ * @param text The string
+ * @param offset Receives the string's offset
+ * @return 0 on success, -1 on allocation failure or if the table is full
+ */
+static int table_add_string(index_table_t *table, const char *text, uint32_t *offset) {
+    size_t length = strlen(text) + 1;
+
+    if (table->length + length > UINT32_MAX) {
+        return -1;
+    }
+    if (table->length + length > table->string_capacity) {
+        size_t capacity = table->string_capacity ? table->string_capacity * 2 : 64 * 1024;
+        while (capacity < table->length + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(table->strings, capacity);
+        if (!grown) {
+            return -1;
+        }
+        table->strings = grown;
+        table->string_capacity = capacity;
+    }
+
+    memcpy(table->strings + table->length, text, length);
+    *offset = (uint32_t)table->length;
+    table->length += length;
+    return 0;
+}
+
+/**
+ * Append a record to a table, copying its strings from another string table.
+ *
+ * @param table The table
+ * @param record The record
+ * @param strings The string table the record's offsets point into
+ * @return 0 on success, -1 on allocation failure
+ */
+static int table_add(index_table_t *table, const index_record_t *record, const char *strings) {
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 1024;
+        index_record_t *grown = realloc(table->records, capacity * sizeof(*grown));
+        if (!grown) {
+            return -1;
+        }
+        table->records = grown;
+        table->capacity = capacity;
+    }
+
+    index_record_t copy = *record;
+    if (table_add_string(table, strings + record->subject, &copy.subject) != 0 ||
+        table_add_string(table, strings + record->issuer, &copy.issuer) != 0 ||
+        table_add_string(table, strings + record->sans, &copy.sans) != 0) {
+        return -1;
+    }
+    table->records[table->count++] = copy;
+    return 0;
+}
+
+static void table_free(index_table_t *table) {
+    free(table->records);
+    free(table->strings);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Read an index file into memory, checking that every string offset is inside the string table.
+ *
+ * @param path The index file
+ * @param table Receives the records and strings; empty if the file is missing or empty
+ * @return 0 on success, -1 with errno set on failure (EINVAL if the file is not an index)
+ */
+static int table_load(const char *path, index_table_t *table) {
+    index_header_t header;
+    struct stat st;
+
+    memset(table, 0, sizeof(*table));
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (fstat(fileno(file), &st) != 0) {
+        fclose(file);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        fclose(file);
+        return 0;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, INDEX_MAGIC, INDEX_MAGIC_LENGTH) != 0 ||
+        header.count > ((uint64_t)st.st_size - sizeof(header)) / sizeof(index_record_t) ||
+        header.strings_length > UINT32_MAX ||
+        (uint64_t)st.st_size != sizeof(header) + header.count * sizeof(index_record_t) + header.strings_length) {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
+    }
+
+    table->count = table->capacity = (size_t)header.count;
+    table->length = table->string_capacity = (size_t)header.strings_length;
+    table->records = malloc(table->count * sizeof(*table->records) + 1);
+    table->strings = malloc(table->length + 1);
+    if (!table->records || !table->strings ||
+        fread(table->records, sizeof(*table->records), table->count, file) != table->count ||
+        fread(table->strings, 1, table->length, file) != table->length) {
+        int saved_errno = table->records && table->strings ? EIO : ENOMEM;
+        fclose(file);
+        table_free(table);
+        errno = saved_errno;
+        return -1;
+    }
+    fclose(file);
+
+    if (table->length > 0 && table->strings[table->length - 1] != '\0') {
+        table_free(table);
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < table->count; i++) {
+        const index_record_t *record = &table->records[i];
+        if (record->subject >= table->length || record->issuer >= table->length || record->sans >= table->length) {
+            table_free(table);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Order records by notAfter, then by fingerprint, so copies of a certificate are adjacent.
+ */
+static int compare_records(const void *a, const void *b) {
+    const index_record_t *left = a;
+    const index_record_t *right = b;
+
+    if (left->not_after != right->not_after) {
+        return left->not_after < right->not_after ? -1 : 1;
+    }
+    return memcmp(left->fingerprint, right->fingerprint, SHA256_DIGEST_LENGTH);
+}
+
+/**
+ * Write a table to a file, through a temporary file renamed into place.
+ *
+ * @param path The index file
+ * @param table The table, sorted and without duplicates
+ * @return 0 on success, -1 on failure
+ */
+static int table_write(const char *path, const index_table_t *table) {
+    char temp_path[MAX_PATH_LENGTH];
+    index_header_t header = { .count = table->count, .strings_length = table->length };
+
+    memcpy(header.magic, INDEX_MAGIC, INDEX_MAGIC_LENGTH);
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *file = fopen(temp_path, "wb");
+    if (!file) {
+        return -1;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(table->records, sizeof(*table->records), table->count, file) == table->count &&
+                   fwrite(table->strings, 1, table->length, file) == table->length &&
+                   fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !written || rename(temp_path, path) != 0) {
+        int saved_errno = errno;
+        unlink(temp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Convert a certificate time to seconds since the epoch.
+ *
+ * @param time The time
+ * @param seconds Receives the seconds
+ * @return true on success
+ */
+static bool time_seconds(const ASN1_TIME *time, int64_t *seconds) {
+    struct tm tm;
+
+    if (!time || !ASN1_TIME_to_tm(time, &tm)) {
+        return false;
+    }
+    *seconds = (int64_t)timegm(&tm);
+    return true;
+}
+
+/**
+ * Format a certificate name as an RFC 2253 string, keeping UTF-8 as is.
+ *
+ * @param name The name
+ * @param mem A memory BIO to format into, reset here
+ * @param output Receives the string, truncated to fit
+ * @param size Size of the output buffer
+ */
+static void format_name(const X509_NAME *name, BIO *mem, char *output, size_t size) {
+    output[0] = '\0';
+    BIO_reset(mem);
+    if (!name || X509_NAME_print_ex(mem, name, 0, XN_FLAG_RFC2253 & ~ASN1_STRFLGS_ESC_MSB) < 0) {
+        return;
+    }
+    int length = BIO_read(mem, output, (int)size - 1);
+    output[length > 0 ? length : 0] = '\0';
+}
+
+/**
+ * Check that a DNS name can go into the comma separated SAN list as it is.
+ *
+ * @param name The name
+ * @param length Its length
+ * @return true if it holds only printable characters other than a comma
+ */
+static bool listable_name(const unsigned char *name, int length) {
+    for (int i = 0; i < length; i++) {
+        if (!isprint(name[i]) || name[i] == ',') {
+            return false;
+        }
+    }
+    return length > 0;
+}
+
+/**
+ * List a certificate's DNS and IP address SANs, comma separated.
+ *
+ * @param cert The certificate
+ * @param output Receives the list, with the names that did not fit left out
+ * @param size Size of the output buffer
+ */
+static void format_sans(X509 *cert, char *output, size_t size) {
+    GENERAL_NAMES *names = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL);
+    size_t length = 0;
+
+    output[0] = '\0';
+    for (int i = 0; names && i < sk_GENERAL_NAME_num(names); i++) {
+        const GENERAL_NAME *name = sk_GENERAL_NAME_value(names, i);
+        char address[INET6_ADDRSTRLEN];
+        const char *text = NULL;
+        size_t text_length = 0;
+
+        if (name->type == GEN_DNS) {
+            const unsigned char *data = ASN1_STRING_get0_data(name->d.dNSName);
+            int data_length = ASN1_STRING_length(name->d.dNSName);
+            if (listable_name(data, data_length)) {
+                text = (const char *)data;
+                text_length = (size_t)data_length;
+            }
+        } else if (name->type == GEN_IPADD) {
+            int data_length = ASN1_STRING_length(name->d.iPAddress);
+            int family = data_length == 4 ? AF_INET : data_length == 16 ? AF_INET6 : AF_UNSPEC;
+            if (family != AF_UNSPEC &&
+                inet_ntop(family, ASN1_STRING_get0_data(name->d.iPAddress), address, sizeof(address))) {
+                text = address;
+                text_length = strlen(address);
+            }
+        }
+
+        if (text && length + text_length + 2 <= size) {
+            if (length > 0) output[length++] = ',';
+            memcpy(output + length, text, text_length);
+            length += text_length;
+            output[length] = '\0';
+        }
+    }
+    GENERAL_NAMES_free(names);
+}
+
+/**
+ * Analyse one certificate and add it to the index.
+ *
+ * @param index The index
+ * @param pending The certificate and its fingerprint
+ * @param mem The thread's memory BIO for formatting names
+ */
+static void analyse_certificate(cert_index_t *index, const pending_cert_t *pending, BIO *mem) {
+    char subject[MAX_NAME_LENGTH];
+    char issuer[MAX_NAME_LENGTH];
+    char sans[MAX_SANS_LENGTH];
+    char *strings = NULL;
+    index_record_t record = { 0 };
+    X509 *cert = pending->cert;
+
+    memcpy(record.fingerprint, pending->fingerprint, SHA256_DIGEST_LENGTH);
+    bool parsed = time_seconds(X509_get0_notBefore(cert), &record.not_before) &&
+                  time_seconds(X509_get0_notAfter(cert), &record.not_after);
+    if (parsed) {
+        EVP_PKEY *key = X509_get0_pubkey(cert);
+        record.key_nid = key ? EVP_PKEY_base_id(key) : NID_undef;
+        record.key_bits = key ? (uint32_t)EVP_PKEY_bits(key) : 0;
+        record.signature_nid = X509_get_signature_nid(cert);
+        format_name(X509_get_subject_name(cert), mem, subject, sizeof(subject));
+        format_name(X509_get_issuer_name(cert), mem, issuer, sizeof(issuer));
+        format_sans(cert, sans, sizeof(sans));
+
+        // The strings are laid out next to each other for table_add to copy
+        size_t subject_length = strlen(subject) + 1;
+        size_t issuer_length = strlen(issuer) + 1;
+        strings = malloc(subject_length + issuer_length + strlen(sans) + 1);
+        if (strings) {
+            strcpy(strings, subject);
+            strcpy(strings + subject_length, issuer);
+            strcpy(strings + subject_length + issuer_length, sans);
+            record.subject = 0;
+            record.issuer = (uint32_t)subject_length;
+            record.sans = (uint32_t)(subject_length + issuer_length);
+        }
+    }
+
+    pthread_mutex_lock(&index->mutex);
+    if (!parsed) {
+        index->failed++;
+    } else if (!strings || table_add(&index->table, &record, strings) != 0) {
+        index->out_of_memory = true;
+    }
+    pthread_mutex_unlock(&index->mutex);
+    free(strings);
+}
+
+/**
+ * Analysis thread function.
+ * Takes certificates from the queue and parses them, away from the threads driving connections.
+ *
+ * @param arg The index
+ * @return NULL
+ */
+static void *analysis_thread(void *arg) {
+    cert_index_t *index = (cert_index_t *)arg;
+    BIO *mem = BIO_new(BIO_s_mem());
+
+    pthread_mutex_lock(&index->mutex);
+    for (;;) {
+        while (index->queued == 0 && !index->closing) {
+            pthread_cond_wait(&index->work, &index->mutex);
+        }
+        if (index->queued == 0) {
+            break;
+        }
+
+        pending_cert_t pending = index->queue[index->head];
+        index->head = (index->head + 1) % QUEUE_CAPACITY;
+        index->queued--;
+        pthread_cond_signal(&index->space);
+        pthread_mutex_unlock(&index->mutex);
+
+        if (mem) {
+            analyse_certificate(index, &pending, mem);
+        }
+        X509_free(pending.cert);
+
+        pthread_mutex_lock(&index->mutex);
+        if (!mem) index->failed++;
+    }
+    pthread_mutex_unlock(&index->mutex);
+
+    BIO_free(mem);
+    return NULL;
+}
+
+/**
+ * Start the analysis threads for an index file. An existing file is checked now
+ * and merged with this run's certificates when the index is closed.
+ *
+ * @param path The index file
+ * @param threads The number of analysis threads
+ * @param error_message Buffer for a description of the failure
+ * @param max_length Size of the error message buffer
+ * @return The index, or NULL on failure
+ */
+cert_index_t *cert_index_open(const char *path, int threads, char *error_message, size_t max_length) {
+    char magic[INDEX_MAGIC_LENGTH];
+
+    cert_index_t *index = calloc(1, sizeof(*index));
+    if (!index || !(index->threads = calloc((size_t)threads, sizeof(*index->threads)))) {
+        snprintf(error_message, max_length, "Failed to allocate the certificate index");
+        free(index);
+        return NULL;
+    }
+    pthread_mutex_init(&index->mutex, NULL);
+    pthread_cond_init(&index->work, NULL);
+    pthread_cond_init(&index->space, NULL);
+
+    if (snprintf(index->path, sizeof(index->path), "%s", path) >= (int)sizeof(index->path)) {
+        snprintf(error_message, max_length, "Certificate index path too long");
+        cert_index_close(index, NULL);
+        return NULL;
+    }
+
+    // Fail now rather than after the scan if the file cannot be written or is something else
+    FILE *file = fopen(path, "ab+");
+    if (!file) {
+        snprintf(error_message, max_length, "Failed to open %s: %s", path, strerror(errno));
+        cert_index_close(index, NULL);
+        return NULL;
+    }
+    rewind(file);
+    size_t read = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+    if (read > 0 && (read != sizeof(magic) || memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LENGTH) != 0)) {
+        snprintf(error_message, max_length, "%s is not a certificate index", path);
+        cert_index_close(index, NULL);
+        return NULL;
+    }
+
+    for (; index->thread_count < threads; index->thread_count++) {
+        if (pthread_create(&index->threads[index->thread_count], NULL, analysis_thread, index) != 0) {
+            snprintf(error_message, max_length, "Failed to start the certificate analysis threads");
+            cert_index_close(index, NULL);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+/**
+ * Queue a newly fetched certificate for analysis. The index takes its own reference,
+ * so the caller may free the certificate at once. Waits only if the analysis threads
+ * have fallen QUEUE_CAPACITY certificates behind.
+ *
+ * @param index The index
+ * @param cert The certificate
+ * @param fingerprint Its SHA256 fingerprint
+ * @return 0 on success, -1 on failure
+ */
+int cert_index_submit(cert_index_t *index, X509 *cert, const unsigned char fingerprint[SHA256_DIGEST_LENGTH]) {
+    if (!X509_up_ref(cert)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&index->mutex);
+    while (index->queued == QUEUE_CAPACITY) {
+        pthread_cond_wait(&index->space, &index->mutex);
+    }
+    pending_cert_t *pending = &index->queue[(index->head + index->queued) % QUEUE_CAPACITY];
+    pending->cert = cert;
+    memcpy(pending->fingerprint, fingerprint, SHA256_DIGEST_LENGTH);
+    index->queued++;
+    pthread_cond_signal(&index->work);
+    pthread_mutex_unlock(&index->mutex);
+    return 0;
+}
+
+/**
+ * Analyse everything still queued, stop the analysis threads and write the index file:
+ * the certificates already in it and this run's, sorted by notAfter, each fingerprint once.
+ *
+ * @param index The index
+ * @param stats Receives the counters, or NULL
+ * @return 0 on success, -1 if the file could not be written
+ */
+int cert_index_close(cert_index_t *index, cert_index_stats_t *stats) {
+    index_table_t existing;
+    index_table_t merged = { 0 };
+    int ret = -1;
+
+    pthread_mutex_lock(&index->mutex);
+    index->closing = true;
+    pthread_cond_broadcast(&index->work);
+    pthread_mutex_unlock(&index->mutex);
+
+    for (int i = 0; i < index->thread_count; i++) {
+        if (pthread_join(index->threads[i], NULL) != 0) {
+            perror("Failed to join certificate analysis thread");
+        }
+    }
+    // Only a failed open leaves certificates queued without threads to take them
+    for (size_t i = 0; i < index->queued; i++) {
+        X509_free(index->queue[(index->head + i) % QUEUE_CAPACITY].cert);
+    }
+
+    if (index->thread_count == 0 || !index->path[0]) {
+        goto cleanup;
+    }
+    if (index->out_of_memory) {
+        fprintf(stderr, "Ran out of memory analysing certificates for %s\n", index->path);
+        goto cleanup;
+    }
+    if (table_load(index->path, &existing) != 0) {
+        fprintf(stderr, "Failed to read %s: %s\n", index->path,
+                errno == EINVAL ? "not a certificate index" : strerror(errno));
+        goto cleanup;
+    }
+
+    // This run's records join the existing ones; after sorting, copies of a certificate are adjacent
+    bool copied = true;
+    for (size_t i = 0; copied && i < index->table.count; i++) {
+        copied = table_add(&existing, &index->table.records[i], index->table.strings) == 0;
+    }
+    if (copied && existing.count > 0) {
+        qsort(existing.records, existing.count, sizeof(*existing.records), compare_records);
+    }
+    for (size_t i = 0; copied && i < existing.count; i++) {
+        const index_record_t *record = &existing.records[i];
+        if (merged.count > 0 &&
+            memcmp(merged.records[merged.count - 1].fingerprint, record->fingerprint, SHA256_DIGEST_LENGTH) == 0) {
+            continue;
+        }
+        copied = table_add(&merged, record, existing.strings) == 0;
+    }
+    table_free(&existing);
+    if (!copied) {
+        fprintf(stderr, "Failed to allocate memory for %s\n", index->path);
+        goto cleanup;
+    }
+
+    if (table_write(index->path, &merged) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", index->path, strerror(errno));
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    if (stats) {
+        stats->analysed = index->table.count;
+        stats->failed = index->failed;
+        stats->indexed = merged.count;
+    }
+    table_free(&merged);
+    pthread_cond_destroy(&index->work);
+    pthread_cond_destroy(&index->space);
+    pthread_mutex_destroy(&index->mutex);
+    table_free(&index->table);
+    free(index->threads);
+    free(index);
+    return ret;
+}
+
+/**
+ * Find the first record that expires at or after a time.
+ *
+ * @param table The table, sorted by notAfter
+ * @param seconds The time
+ * @return The record's position, or the record count if there is none
+ */
+static size_t first_expiring_at(const index_table_t *table, int64_t seconds) {
+    size_t low = 0;
+    size_t high = table->count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (table->records[middle].not_after < seconds) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Check whether a string contains another, ignoring ASCII case.
+ *
+ * @param text The string to search
+ * @param pattern The string to look for
+ * @return true if found
+ */
+static bool contains_ignoring_case(const char *text, const char *pattern) {
+    size_t pattern_length = strlen(pattern);
+
+    for (; *text; text++) {
+        size_t i = 0;
+        while (i < pattern_length && text[i] &&
+               tolower((unsigned char)text[i]) == tolower((unsigned char)pattern[i])) {
+            i++;
+        }
+        if (i == pattern_length) {
+            return true;
+        }
+    }
+    return pattern_length == 0;
+}
+
+/**
+ * Name a key type.
+ *
+ * @param nid The key's type
+ * @return The name
+ */
+static const char *key_name(int nid) {
+    switch (nid) {
+        case EVP_PKEY_RSA:     return "RSA";
+        case EVP_PKEY_RSA_PSS: return "RSA-PSS";
+        case EVP_PKEY_DSA:     return "DSA";
+        case EVP_PKEY_EC:      return "EC";
+        case EVP_PKEY_ED25519: return "Ed25519";
+        case EVP_PKEY_ED448:   return "Ed448";
+        default: {
+            const char *name = nid != NID_undef ? OBJ_nid2sn(nid) : NULL;
+            return name ? name : "unknown";
+        }
+    }
+}
+
+/**
+ * Check a record against a query.
+ *
+ * @param record The record
+ * @param strings The table's strings
+ * @param query The query
+ * @return true if every filter matches
+ */
+static bool record_matches(const index_record_t *record, const char *strings, const cert_index_query_t *query) {
+    if (query->weak_key_bits > 0) {
+        bool sized_by_modulus = record->key_nid == EVP_PKEY_RSA || record->key_nid == EVP_PKEY_RSA_PSS ||
+                                record->key_nid == EVP_PKEY_DSA;
+        if (!sized_by_modulus || record->key_bits >= (uint32_t)query->weak_key_bits) {
+            return false;
+        }
+    }
+    if (query->name && !contains_ignoring_case(strings + record->subject, query->name) &&
+        !contains_ignoring_case(strings + record->sans, query->name)) {
+        return false;
+    }
+    return true;
+}
+
+static void write_json_string(FILE *out, const char *text, size_t length) {
+    fputc('"', out);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_json_time(FILE *out, int64_t seconds) {
+    char text[32];
+    struct tm tm;
+    time_t time = (time_t)seconds;
+
+    if (!gmtime_r(&time, &tm) || strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &tm) == 0) {
+        snprintf(text, sizeof(text), "%lld", (long long)seconds);
+    }
+    fprintf(out, "\"%s\"", text);
+}
+
+/**
+ * Write one record as a JSON line.
+ *
+ * @param out Where to write it
+ * @param record The record
+ * @param strings The table's strings
+ */
+static void write_record(FILE *out, const index_record_t *record, const char *strings) {
+    char fingerprint[SHA256_DIGEST_LENGTH * 2 + 1];
+    const char *sans = strings + record->sans;
+    const char *signature = record->signature_nid != NID_undef ? OBJ_nid2ln(record->signature_nid) : NULL;
+
+    hex_encode(record->fingerprint, SHA256_DIGEST_LENGTH, fingerprint);
+    fprintf(out, "{\"sha256\":\"%s\",\"subject\":", fingerprint);
+    write_json_string(out, strings + record->subject, strlen(strings + record->subject));
+    fputs(",\"issuer\":", out);
+    write_json_string(out, strings + record->issuer, strlen(strings + record->issuer));
+    fputs(",\"sans\":[", out);
+    while (*sans) {
+        size_t length = strcspn(sans, ",");
+        write_json_string(out, sans, length);
+        sans += length;
+        if (*sans == ',') {
+            fputc(',', out);
+            sans++;
+        }
+    }
+    fputs("],\"not_before\":", out);
+    write_json_time(out, record->not_before);
+    fputs(",\"not_after\":", out);
+    write_json_time(out, record->not_after);
+    fprintf(out, ",\"key\":\"%s\",\"key_bits\":%u,\"signature\":", key_name(record->key_nid), record->key_bits);
+    write_json_string(out, signature ? signature : "unknown", strlen(signature ? signature : "unknown"));
+    fputs("}\n", out);
+}
+
+/**
+ * Write the certificates in an index file that match a query, one JSON line each, soonest expiry first.
+ * An expiry filter is a binary search over the sorted records; the other filters scan what it leaves.
+ *
+ * @param path The index file
+ * @param query The filters
+ * @param out Where to write the matches
+ * @return The number of matches, or -1 on failure
+ */
+int cert_index_query(const char *path, const cert_index_query_t *query, FILE *out) {
+    index_table_t table;
+    struct stat st;
+    int matches = 0;
+
+    if (stat(path, &st) != 0 || table_load(path, &table) != 0) {
+        fprintf(stderr, "Failed to read %s: %s\n", path, errno == EINVAL ? "not a certificate index" : strerror(errno));
+        return -1;
+    }
+
+    size_t first = 0;
+    size_t end = table.count;
+    if (query->expires_within_days >= 0) {
+        int64_t now = (int64_t)time(NULL);
+        first = first_expiring_at(&table, now);
+        end = first_expiring_at(&table, now + query->expires_within_days * SECONDS_PER_DAY + 1);
+    }
+
+    for (size_t i = first; i < end; i++) {
+        if (record_matches(&table.records[i], table.strings, query)) {
+            write_record(out, &table.records[i], table.strings);
+            matches++;
+        }
+    }
+
+    table_free(&table);
+    return matches;
+}
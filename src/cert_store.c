@@ -0,0 +1,752 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cert_store.h"
+#include "utils.h"
+#include "fingerprint.h"
+#include <openssl/sha.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define INDEX_MAGIC "CRTIDX01"
+#define INDEX_MAGIC_LENGTH 8
+#define MAX_PATH_LENGTH 1024
+// A batch is written and fsynced once it holds this many certificates or bytes,
+// or once its oldest certificate has waited FLUSH_INTERVAL_MS
+#define BATCH_RECORDS 1024
+#define BATCH_BYTES (4UL * 1024 * 1024)
+#define FLUSH_INTERVAL_MS 500
+// Workers wait for the writer once this much is queued
+#define MAX_PENDING_BYTES (64UL * 1024 * 1024)
+// A new segment file is started once the current one passes this size
+#define SEGMENT_MAX_BYTES (1ULL << 30)
+#define INITIAL_KEY_CAPACITY 4096
+
+// One index entry: where the certificate with this SHA-256 lives
+typedef struct {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint64_t offset;
+    uint32_t segment;
+    uint32_t length;
+} store_record_t;
+
+_Static_assert(sizeof(store_record_t) == 48, "index records are stored as 48 bytes");
+
+// Certificates waiting to be written; record offsets are relative to data
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+    store_record_t *records;
+    size_t count;
+    size_t record_capacity;
+    long long since_ms;
+} store_batch_t;
+
+// Open-addressed set of the digests already in the store
+typedef struct {
+    unsigned char (*digests)[SHA256_DIGEST_LENGTH];
+    bool *used;
+    size_t capacity;
+    size_t count;
+} key_set_t;
+
+struct cert_store {
+    char dir[MAX_PATH_LENGTH];
+    int index_fd;
+    int segment_fd;
+    uint32_t segment;
+    uint64_t segment_size;
+    pthread_t writer;
+    bool writer_started;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t space;
+    pthread_cond_t synced_cond;
+    unsigned long long queued;
+    unsigned long long synced;
+    bool sync_requested;
+    store_batch_t pending;
+    store_batch_t writing;
+    key_set_t keys;
+    bool closing;
+    bool failed;
+};
+
+/**
+ * Find the slot for a digest in the key set.
+ *
+ * @param set The key set
+ * @param digest The digest
+ * @return The slot holding the digest, or the empty slot where it belongs
+ */
+static size_t key_slot(const key_set_t *set, const unsigned char *digest) {
+    uint64_t hash;
+    memcpy(&hash, digest, sizeof(hash));
+    size_t slot = (size_t)hash & (set->capacity - 1);
+    while (set->used[slot] && memcmp(set->digests[slot], digest, SHA256_DIGEST_LENGTH) != 0) {
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    return slot;
+}
+
+/**
+ * Add a digest to the key set, growing it to keep the load under one half.
+ *
+ * @param set The key set
+ * @param digest The digest
+ * @return 1 if added, 0 if already present, -1 on allocation failure
+ */
+static int key_set_add(key_set_t *set, const unsigned char *digest) {
+    if ((set->count + 1) * 2 > set->capacity) {
+        key_set_t grown = { .capacity = set->capacity ? set->capacity * 2 : INITIAL_KEY_CAPACITY };
+        grown.digests = malloc(grown.capacity * sizeof(*grown.digests));
+        grown.used = calloc(grown.capacity, sizeof(*grown.used));
+        if (!grown.digests || !grown.used) {
+            free(grown.digests);
+            free(grown.used);
+            return -1;
+        }
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->used[i]) {
+                size_t slot = key_slot(&grown, set->digests[i]);
+                memcpy(grown.digests[slot], set->digests[i], SHA256_DIGEST_LENGTH);
+                grown.used[slot] = true;
+            }
+        }
+        grown.count = set->count;
+        free(set->digests);
+        free(set->used);
+        *set = grown;
+    }
+
+    size_t slot = key_slot(set, digest);
+    if (set->used[slot]) {
+        return 0;
+    }
+    memcpy(set->digests[slot], digest, SHA256_DIGEST_LENGTH);
+    set->used[slot] = true;
+    set->count++;
+    return 1;
+}
+
+/**
+ * Append a certificate to a batch.
+ *
+ * @param batch The batch
+ * @param data The certificate bytes
+ * @param length Number of bytes
+ * @param digest SHA-256 of the bytes
+ * @return 0 on success, -1 on allocation failure
+ */
+static int batch_append(store_batch_t *batch, const unsigned char *data, size_t length, const unsigned char *digest) {
+    if (batch->length + length > batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity : BATCH_BYTES;
+        while (capacity < batch->length + length) {
+            capacity *= 2;
+        }
+        unsigned char *grown = realloc(batch->data, capacity);
+        if (!grown) {
+            return -1;
+        }
+        batch->data = grown;
+        batch->capacity = capacity;
+    }
+    if (batch->count == batch->record_capacity) {
+        size_t capacity = batch->record_capacity ? batch->record_capacity * 2 : BATCH_RECORDS;
+        store_record_t *grown = realloc(batch->records, capacity * sizeof(*grown));
+        if (!grown) {
+            return -1;
+        }
+        batch->records = grown;
+        batch->record_capacity = capacity;
+    }
+
+    store_record_t *record = &batch->records[batch->count++];
+    memcpy(record->digest, digest, SHA256_DIGEST_LENGTH);
+    record->offset = batch->length;
+    record->segment = 0;
+    record->length = (uint32_t)length;
+    memcpy(batch->data + batch->length, data, length);
+    batch->length += length;
+    return 0;
+}
+
+/**
+ * Check whether a batch should be written without waiting any longer.
+ *
+ * @param batch The batch
+ * @return true if the batch is full
+ */
+static bool batch_full(const store_batch_t *batch) {
+    return batch->count >= BATCH_RECORDS || batch->length >= BATCH_BYTES;
+}
+
+/**
+ * Write a whole buffer, retrying short writes.
+ *
+ * @param fd The file descriptor
+ * @param data The buffer
+ * @param length Number of bytes
+ * @return 0 on success, -1 on failure
+ */
+static int write_all(int fd, const void *data, size_t length) {
+    const unsigned char *p = data;
+    while (length > 0) {
+        ssize_t written = write(fd, p, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Build the path of a segment file.
+ *
+ * @param dir The store directory
+ * @param segment The segment number
+ * @param path Receives the path
+ * @param size Size of the path buffer
+ * @return 0 on success, -1 if the path does not fit
+ */
+static int segment_path(const char *dir, uint32_t segment, char *path, size_t size) {
+    char name[64];
+    snprintf(name, sizeof(name), CERT_STORE_SEGMENT_FORMAT, segment);
+    int written = snprintf(path, size, "%s/%s", dir, name);
+    return written < 0 || (size_t)written >= size ? -1 : 0;
+}
+
+/**
+ * Open a segment file for appending and record its current size.
+ *
+ * @param store The store
+ * @param segment The segment number
+ * @return 0 on success, -1 on failure
+ */
+static int open_segment(cert_store_t *store, uint32_t segment) {
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+
+    if (segment_path(store->dir, segment, path, sizeof(path)) != 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (store->segment_fd >= 0) {
+        close(store->segment_fd);
+    }
+    store->segment_fd = fd;
+    store->segment = segment;
+    store->segment_size = (uint64_t)st.st_size;
+    return 0;
+}
+
+/**
+ * Write one batch: the certificates go to the current segment and are synced
+ * before their index entries, so the index never points at data that was lost.
+ *
+ * @param store The store
+ * @param batch The batch
+ * @return 0 on success, -1 on failure
+ */
+static int write_batch(cert_store_t *store, store_batch_t *batch) {
+    if (store->segment_size > 0 && store->segment_size + batch->length > SEGMENT_MAX_BYTES) {
+        if (fdatasync(store->segment_fd) != 0 || open_segment(store, store->segment + 1) != 0) {
+            return -1;
+        }
+    }
+
+    if (write_all(store->segment_fd, batch->data, batch->length) != 0 || fdatasync(store->segment_fd) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < batch->count; i++) {
+        batch->records[i].segment = store->segment;
+        batch->records[i].offset += store->segment_size;
+    }
+    store->segment_size += batch->length;
+
+    if (write_all(store->index_fd, batch->records, batch->count * sizeof(*batch->records)) != 0 ||
+        fdatasync(store->index_fd) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writer thread function.
+ * Takes whole batches from the workers and writes each with a handful of
+ * syscalls, waiting up to FLUSH_INTERVAL_MS for a batch to fill.
+ *
+ * @param arg The store
+ * @return NULL
+ */
+static void *writer_thread(void *arg) {
+    cert_store_t *store = (cert_store_t *)arg;
+
+    pthread_mutex_lock(&store->mutex);
+    for (;;) {
+        while (!store->closing && !store->sync_requested && !batch_full(&store->pending)) {
+            if (store->pending.count == 0) {
+                pthread_cond_wait(&store->wake, &store->mutex);
+                continue;
+            }
+            long long deadline_ms = store->pending.since_ms + FLUSH_INTERVAL_MS;
+            struct timespec deadline = {
+                .tv_sec = (time_t)(deadline_ms / 1000),
+                .tv_nsec = (long)(deadline_ms % 1000) * 1000000L
+            };
+            if (pthread_cond_timedwait(&store->wake, &store->mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (store->pending.count == 0) {
+            if (store->closing) break;
+            continue;
+        }
+
+        store->sync_requested = false;
+        store_batch_t batch = store->pending;
+        store->pending = store->writing;
+        store->pending.length = 0;
+        store->pending.count = 0;
+        pthread_cond_broadcast(&store->space);
+        pthread_mutex_unlock(&store->mutex);
+
+        int ret = write_batch(store, &batch);
+        if (ret != 0) {
+            fprintf(stderr, "Failed to write to the certificate pack in %s: %s\n", store->dir, strerror(errno));
+        }
+
+        pthread_mutex_lock(&store->mutex);
+        store->writing = batch;
+        if (ret != 0) {
+            store->failed = true;
+            pthread_cond_broadcast(&store->space);
+            pthread_cond_broadcast(&store->synced_cond);
+            break;
+        }
+        store->synced += batch.count;
+        pthread_cond_broadcast(&store->synced_cond);
+    }
+    pthread_mutex_unlock(&store->mutex);
+    return NULL;
+}
+
+/**
+ * Read the whole index of a store.
+ *
+ * @param fd The open index file
+ * @param count Receives the number of complete records
+ * @return The records (NULL with *count 0 if there are none), or NULL with errno set on failure
+ */
+static store_record_t *read_index(int fd, size_t *count) {
+    char magic[INDEX_MAGIC_LENGTH];
+    struct stat st;
+
+    *count = 0;
+    errno = 0;
+    if (fstat(fd, &st) != 0) {
+        return NULL;
+    }
+    if (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+        memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LENGTH) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // A torn trailing record from an interrupted run is ignored
+    size_t records = ((size_t)st.st_size - INDEX_MAGIC_LENGTH) / sizeof(store_record_t);
+    if (records == 0) {
+        return NULL;
+    }
+    store_record_t *index = malloc(records * sizeof(*index));
+    if (!index) {
+        return NULL;
+    }
+    size_t bytes = records * sizeof(*index);
+    if (pread(fd, index, bytes, INDEX_MAGIC_LENGTH) != (ssize_t)bytes) {
+        free(index);
+        errno = EIO;
+        return NULL;
+    }
+    *count = records;
+    return index;
+}
+
+/**
+ * Open (or create) the pack store in a directory and start its writer thread.
+ * Digests already in the index are loaded so certificates are stored once.
+ *
+ * @param dir The output directory
+ * @param error_message Buffer for a description of the failure
+ * @param max_length Size of the error message buffer
+ * @return The store, or NULL on failure
+ */
+cert_store_t *cert_store_open(const char *dir, char *error_message, size_t max_length) {
+    char path[MAX_PATH_LENGTH];
+    store_record_t *index = NULL;
+    size_t count = 0;
+    uint32_t last_segment = 0;
+
+    cert_store_t *store = calloc(1, sizeof(*store));
+    if (!store) {
+        snprintf(error_message, max_length, "Failed to allocate the certificate store");
+        return NULL;
+    }
+    store->index_fd = -1;
+    store->segment_fd = -1;
+    pthread_mutex_init(&store->mutex, NULL);
+    pthread_cond_init(&store->space, NULL);
+    pthread_cond_init(&store->synced_cond, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&store->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (snprintf(store->dir, sizeof(store->dir), "%s", dir) >= (int)sizeof(store->dir) ||
+        snprintf(path, sizeof(path), "%s/%s", dir, CERT_STORE_INDEX_NAME) >= (int)sizeof(path)) {
+        snprintf(error_message, max_length, "Certificate store path too long");
+        goto error;
+    }
+
+    store->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    if (store->index_fd < 0 || fstat(store->index_fd, &st) != 0) {
+        snprintf(error_message, max_length, "Failed to open %s: %s", path, strerror(errno));
+        goto error;
+    }
+
+    if (st.st_size == 0) {
+        if (write_all(store->index_fd, INDEX_MAGIC, INDEX_MAGIC_LENGTH) != 0) {
+            snprintf(error_message, max_length, "Failed to write %s: %s", path, strerror(errno));
+            goto error;
+        }
+    } else {
+        index = read_index(store->index_fd, &count);
+        if (!index && errno != 0) {
+            snprintf(error_message, max_length, "Failed to read %s: %s", path,
+                     errno == EINVAL ? "not a certificate pack index" : strerror(errno));
+            goto error;
+        }
+        off_t complete = (off_t)(INDEX_MAGIC_LENGTH + count * sizeof(*index));
+        if (st.st_size != complete && ftruncate(store->index_fd, complete) != 0) {
+            snprintf(error_message, max_length, "Failed to repair %s: %s", path, strerror(errno));
+            goto error;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (key_set_add(&store->keys, index[i].digest) < 0) {
+            snprintf(error_message, max_length, "Failed to allocate the certificate store index");
+            goto error;
+        }
+        if (index[i].segment > last_segment) {
+            last_segment = index[i].segment;
+        }
+    }
+    free(index);
+    index = NULL;
+
+    if (open_segment(store, last_segment) != 0) {
+        snprintf(error_message, max_length, "Failed to open a certificate pack segment in %s: %s", dir, strerror(errno));
+        goto error;
+    }
+
+    if (pthread_create(&store->writer, NULL, writer_thread, store) != 0) {
+        snprintf(error_message, max_length, "Failed to start the certificate store writer");
+        goto error;
+    }
+    store->writer_started = true;
+    return store;
+
+error:
+    free(index);
+    cert_store_close(store);
+    return NULL;
+}
+
+/**
+ * Queue a certificate for the writer thread unless an identical one is already stored.
+ * Waits only if the writer has fallen MAX_PENDING_BYTES behind.
+ *
+ * @param store The store
+ * @param data The encoded certificate
+ * @param length Number of bytes
+ * @param digest SHA-256 of the bytes if the caller has it, such as a DER certificate's fingerprint; NULL to compute it
+ * @param key_hex Receives the SHA-256 key as hex (at least 65 bytes), or NULL
+ * @param key_size Size of the key buffer
+ * @return 1 if queued, 0 if already stored, -1 on failure
+ */
+int cert_store_put(cert_store_t *store, const unsigned char *data, size_t length, const unsigned char *digest,
+                   char *key_hex, size_t key_size) {
+    unsigned char computed[SHA256_DIGEST_LENGTH];
+    int ret = -1;
+
+    if (length > UINT32_MAX) {
+        return -1;
+    }
+    if (!digest) {
+        if (!fingerprint_bytes(data, length, computed)) {
+            return -1;
+        }
+        digest = computed;
+    }
+    if (key_hex && key_size > SHA256_DIGEST_LENGTH * 2) {
+        hex_encode(digest, SHA256_DIGEST_LENGTH, key_hex);
+    }
+
+    pthread_mutex_lock(&store->mutex);
+    while (!store->failed && store->pending.length >= MAX_PENDING_BYTES) {
+        pthread_cond_wait(&store->space, &store->mutex);
+    }
+    if (store->failed) {
+        goto cleanup;
+    }
+
+    ret = key_set_add(&store->keys, digest);
+    if (ret != 1) {
+        goto cleanup;
+    }
+    if (batch_append(&store->pending, data, length, digest) != 0) {
+        ret = -1;
+        goto cleanup;
+    }
+    store->queued++;
+    if (store->pending.count == 1) {
+        store->pending.since_ms = monotonic_ms();
+        pthread_cond_signal(&store->wake);
+    } else if (batch_full(&store->pending)) {
+        pthread_cond_signal(&store->wake);
+    }
+
+cleanup:
+    pthread_mutex_unlock(&store->mutex);
+    return ret;
+}
+
+/**
+ * Wait until every certificate queued so far is written and synced, having the writer
+ * thread write its batch at once instead of waiting for it to fill.
+ *
+ * @param store The store
+ * @return 0 on success, -1 if the store failed
+ */
+int cert_store_sync(cert_store_t *store) {
+    pthread_mutex_lock(&store->mutex);
+    unsigned long long target = store->queued;
+    if (store->synced < target) {
+        store->sync_requested = true;
+        pthread_cond_signal(&store->wake);
+    }
+    while (!store->failed && store->synced < target) {
+        pthread_cond_wait(&store->synced_cond, &store->mutex);
+    }
+    int ret = store->failed ? -1 : 0;
+    pthread_mutex_unlock(&store->mutex);
+    return ret;
+}
+
+/**
+ * Write out everything still queued, stop the writer thread and free the store.
+ *
+ * @param store The store
+ * @return 0 on success, -1 if any certificate could not be written
+ */
+int cert_store_close(cert_store_t *store) {
+    pthread_mutex_lock(&store->mutex);
+    store->closing = true;
+    pthread_cond_signal(&store->wake);
+    pthread_mutex_unlock(&store->mutex);
+
+    if (store->writer_started && pthread_join(store->writer, NULL) != 0) {
+        perror("Failed to join certificate store writer");
+    }
+
+    int ret = store->failed ? -1 : 0;
+    if (store->segment_fd >= 0) close(store->segment_fd);
+    if (store->index_fd >= 0) close(store->index_fd);
+    pthread_cond_destroy(&store->wake);
+    pthread_cond_destroy(&store->space);
+    pthread_cond_destroy(&store->synced_cond);
+    pthread_mutex_destroy(&store->mutex);
+    free(store->pending.data);
+    free(store->pending.records);
+    free(store->writing.data);
+    free(store->writing.records);
+    free(store->keys.digests);
+    free(store->keys.used);
+    free(store);
+    return ret;
+}
+
+/**
+ * Visit the certificates in a pack store, checking each against its SHA-256 key.
+ * Certificates that are missing or corrupt are reported and skipped.
+ *
+ * @param dir The store directory
+ * @param key_prefix Only visit keys starting with this hex prefix; NULL for all
+ * @param visit Called for each certificate; a non-zero return stops the walk
+ * @param arg Passed to visit
+ * @return The number of certificates visited, or -1 on failure
+ */
+static int walk_store(const char *dir, const char *key_prefix, cert_store_visit_t visit, void *arg) {
+    char path[MAX_PATH_LENGTH];
+    size_t prefix_length = key_prefix ? strlen(key_prefix) : 0;
+    store_record_t *index = NULL;
+    unsigned char *buffer = NULL;
+    size_t buffer_size = 0;
+    size_t count = 0;
+    int segment_fd = -1;
+    uint32_t open_segment_number = 0;
+    int visited = 0;
+    int ret = -1;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, CERT_STORE_INDEX_NAME) >= (int)sizeof(path)) {
+        fprintf(stderr, "Certificate store path too long\n");
+        return -1;
+    }
+    int index_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (index_fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    index = read_index(index_fd, &count);
+    if (!index && errno != 0) {
+        fprintf(stderr, "Failed to read %s: %s\n", path,
+                errno == EINVAL ? "not a certificate pack index" : strerror(errno));
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const store_record_t *record = &index[i];
+        char key[SHA256_DIGEST_LENGTH * 2 + 1];
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+
+        hex_encode(record->digest, SHA256_DIGEST_LENGTH, key);
+        if (prefix_length > 0 && strncasecmp(key, key_prefix, prefix_length) != 0) {
+            continue;
+        }
+
+        if (segment_fd < 0 || record->segment != open_segment_number) {
+            if (segment_fd >= 0) close(segment_fd);
+            if (segment_path(dir, record->segment, path, sizeof(path)) != 0 ||
+                (segment_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+                fprintf(stderr, "Failed to open certificate pack segment %u: %s\n", record->segment, strerror(errno));
+                goto cleanup;
+            }
+            open_segment_number = record->segment;
+        }
+
+        if (record->length > buffer_size) {
+            unsigned char *grown = realloc(buffer, record->length);
+            if (!grown) {
+                fprintf(stderr, "Failed to allocate memory for certificate %s\n", key);
+                goto cleanup;
+            }
+            buffer = grown;
+            buffer_size = record->length;
+        }
+        if (pread(segment_fd, buffer, record->length, (off_t)record->offset) != (ssize_t)record->length ||
+            !fingerprint_bytes(buffer, record->length, digest) ||
+            memcmp(digest, record->digest, SHA256_DIGEST_LENGTH) != 0) {
+            fprintf(stderr, "Certificate %s is missing or corrupt in segment %u\n", key, record->segment);
+            continue;
+        }
+
+        if (visit(key, buffer, record->length, arg) != 0) {
+            goto cleanup;
+        }
+        visited++;
+    }
+    ret = visited;
+
+cleanup:
+    if (segment_fd >= 0) close(segment_fd);
+    close(index_fd);
+    free(buffer);
+    free(index);
+    return ret;
+}
+
+/**
+ * Visit every certificate in a pack store.
+ *
+ * @param dir The store directory
+ * @param visit Called with each key, encoded certificate and length; a non-zero return stops the walk
+ * @param arg Passed to visit
+ * @return The number of certificates visited, or -1 on failure
+ */
+int cert_store_foreach(const char *dir, cert_store_visit_t visit, void *arg) {
+    return walk_store(dir, NULL, visit, arg);
+}
+
+/**
+ * Write one extracted certificate to <key>.pem or <key>.der, or to stdout.
+ *
+ * @param key The certificate's key
+ * @param data The encoded certificate
+ * @param length Number of bytes
+ * @param arg The output directory, or NULL for stdout
+ * @return 0 on success, -1 on failure
+ */
+static int write_extracted(const char *key, const unsigned char *data, size_t length, void *arg) {
+    const char *output_dir = arg;
+    char path[MAX_PATH_LENGTH];
+
+    if (!output_dir) {
+        if (fwrite(data, 1, length, stdout) != length) {
+            fprintf(stderr, "Failed to write certificate data to stdout\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    // DER starts with an ASN.1 SEQUENCE tag, PEM with its "-----BEGIN" line
+    if (snprintf(path, sizeof(path), "%s/%s.%s", output_dir, key, data[0] == 0x30 ? "der" : "pem") >= (int)sizeof(path)) {
+        fprintf(stderr, "File path too long\n");
+        return -1;
+    }
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open file %s for writing: %s\n", path, strerror(errno));
+        return -1;
+    }
+    bool written = fwrite(data, 1, length, file) == length;
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Failed to write certificate data to %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copy certificates out of a pack store, checking each against its SHA-256 key.
+ * Each certificate is written to <key>.pem (or .der) in the output directory, or to stdout.
+ *
+ * @param dir The store directory
+ * @param key_prefix Only extract keys starting with this hex prefix; NULL for all
+ * @param output_dir Directory to write the certificates to, or NULL for stdout
+ * @return The number of certificates extracted, or -1 on failure
+ */
+int cert_store_extract(const char *dir, const char *key_prefix, const char *output_dir) {
+    return walk_store(dir, key_prefix, write_extracted, (void *)output_dir);
+}
@@ -0,0 +1,372 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "certfetch.h"
+#include "conn_loop.h"
+#include "tls_conn.h"
+#include "ssl_profile.h"
+#include "starttls.h"
+#include "utils.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <openssl/err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_TIMEOUT_MS 3000
+#define DEFAULT_INFLIGHT 64
+#define MAX_INFLIGHT 100000
+
+struct certfetch {
+    certfetch_allocator_t allocator;
+    tls_conn_options_t tls;
+    int inflight;
+    conn_loop_t driver;
+    tls_conn_t *conns;
+    size_t *slot_target;
+    int *registered_fd;
+    int *free_slots;
+    const certfetch_target_t *targets;
+    certfetch_callback_t callback;
+    void *callback_context;
+};
+
+static const char *const status_names[] = {
+    [CERTFETCH_OK]                 = "ok",
+    [CERTFETCH_ERR_DNS]            = "dns",
+    [CERTFETCH_ERR_REFUSED]        = "refused",
+    [CERTFETCH_ERR_CONNECT]        = "connect",
+    [CERTFETCH_ERR_TIMEOUT]        = "timeout",
+    [CERTFETCH_ERR_HANDSHAKE]      = "handshake",
+    [CERTFETCH_ERR_STARTTLS]       = "starttls",
+    [CERTFETCH_ERR_NO_CERTIFICATE] = "no-certificate",
+    [CERTFETCH_ERR_INTERNAL]       = "internal"
+};
+
+static void *default_alloc(size_t size, void *context) {
+    (void)context;
+    return malloc(size);
+}
+
+static void default_free(void *ptr, void *context) {
+    (void)context;
+    free(ptr);
+}
+
+/**
+ * Allocate zeroed memory through the scanner's allocator.
+ *
+ * @param scanner The scanner
+ * @param size Bytes to allocate
+ * @return The memory, or NULL on failure
+ */
+static void *scanner_alloc(certfetch_t *scanner, size_t size) {
+    void *ptr = scanner->allocator.alloc(size, scanner->allocator.context);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+static void scanner_free(certfetch_t *scanner, void *ptr) {
+    if (ptr) {
+        scanner->allocator.free(ptr, scanner->allocator.context);
+    }
+}
+
+static void finish_conn(void *context, int slot, tls_conn_t *conn);
+
+/**
+ * Fill in the default scanner settings: a 3 second timeout and 64 connections in flight.
+ *
+ * @param options The settings to initialise
+ */
+void certfetch_options_init(certfetch_options_t *options) {
+    memset(options, 0, sizeof(*options));
+    options->timeout_ms = DEFAULT_TIMEOUT_MS;
+    options->inflight = DEFAULT_INFLIGHT;
+}
+
+/**
+ * Name a status.
+ *
+ * @param status The status
+ * @return The name, as used in the CLI's results
+ */
+const char *certfetch_status_name(certfetch_status_t status) {
+    return (unsigned)status < sizeof(status_names) / sizeof(status_names[0]) ? status_names[status] : "internal";
+}
+
+/**
+ * Create a scanner with its own SSL context and connection slots.
+ *
+ * @param options The settings, or NULL for the defaults
+ * @param error_message Buffer for the reason of a failure
+ * @param max_length Size of the buffer
+ * @return The scanner, or NULL on failure
+ */
+certfetch_t *certfetch_create(const certfetch_options_t *options, char *error_message, size_t max_length) {
+    certfetch_options_t defaults;
+    if (!options) {
+        certfetch_options_init(&defaults);
+        options = &defaults;
+    }
+    if (options->timeout_ms <= 0 || options->connect_timeout_ms < 0 || options->handshake_timeout_ms < 0 ||
+        options->inflight <= 0 || options->inflight > MAX_INFLIGHT ||
+        (options->allocator && (!options->allocator->alloc || !options->allocator->free))) {
+        snprintf(error_message, max_length, "Invalid scanner options");
+        return NULL;
+    }
+
+    certfetch_allocator_t allocator = { default_alloc, default_free, NULL };
+    if (options->allocator) {
+        allocator = *options->allocator;
+    }
+    certfetch_t *scanner = allocator.alloc(sizeof(*scanner), allocator.context);
+    if (!scanner) {
+        snprintf(error_message, max_length, "Failed to allocate the scanner");
+        return NULL;
+    }
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->allocator = allocator;
+    scanner->inflight = options->inflight;
+    scanner->driver.epoll_fd = -1;
+    scanner->tls.timeout_ms = options->timeout_ms;
+    scanner->tls.connect_timeout_ms = options->connect_timeout_ms;
+    scanner->tls.handshake_timeout_ms = options->handshake_timeout_ms;
+    scanner->tls.fast_cert = options->fast_cert;
+
+    scanner->tls.ctx = create_ssl_context(options->ssl_profile, error_message, max_length);
+    if (!scanner->tls.ctx) {
+        certfetch_free(scanner);
+        return NULL;
+    }
+
+    size_t slots = (size_t)scanner->inflight;
+    scanner->conns = scanner_alloc(scanner, slots * sizeof(*scanner->conns));
+    scanner->slot_target = scanner_alloc(scanner, slots * sizeof(*scanner->slot_target));
+    scanner->registered_fd = scanner_alloc(scanner, slots * sizeof(*scanner->registered_fd));
+    scanner->free_slots = scanner_alloc(scanner, slots * sizeof(*scanner->free_slots));
+    if (!scanner->conns || !scanner->slot_target || !scanner->registered_fd || !scanner->free_slots ||
+        conn_loop_init(&scanner->driver, scanner->inflight, scanner->conns, scanner->registered_fd,
+                       scanner->free_slots, finish_conn, scanner) != 0) {
+        snprintf(error_message, max_length, "Failed to allocate the connection slots");
+        certfetch_free(scanner);
+        return NULL;
+    }
+    return scanner;
+}
+
+/**
+ * Free a scanner. It must not be running.
+ *
+ * @param scanner The scanner, or NULL
+ */
+void certfetch_free(certfetch_t *scanner) {
+    if (!scanner) {
+        return;
+    }
+    conn_loop_destroy(&scanner->driver);
+    if (scanner->tls.ctx) SSL_CTX_free(scanner->tls.ctx);
+    scanner_free(scanner, scanner->conns);
+    scanner_free(scanner, scanner->slot_target);
+    scanner_free(scanner, scanner->registered_fd);
+    scanner_free(scanner, scanner->free_slots);
+    scanner->allocator.free(scanner, scanner->allocator.context);
+}
+
+/**
+ * Resolve a hostname with the system resolver.
+ *
+ * @param target The target; receives its addresses and lookup status
+ */
+static void resolve_host(target_t *target) {
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    long long started = monotonic_us();
+    int rc = getaddrinfo(target->hostname, NULL, &hints, &result);
+    target->dns_us = (uint32_t)(monotonic_us() - started);
+    if (rc != 0) {
+        target->dns_status = rc == EAI_NONAME ? RESOLVE_NXDOMAIN : RESOLVE_TEMPFAIL;
+        return;
+    }
+
+    for (struct addrinfo *ai = result; ai && target->addr_count < TARGET_MAX_ADDRS; ai = ai->ai_next) {
+        target_addr_t *addr = &target->addrs[target->addr_count];
+        if (ai->ai_family == AF_INET) {
+            memcpy(addr->addr, &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+        } else if (ai->ai_family == AF_INET6) {
+            memcpy(addr->addr, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 16);
+        } else {
+            continue;
+        }
+        addr->family = ai->ai_family;
+        target->addr_count++;
+    }
+    freeaddrinfo(result);
+    target->dns_status = target->addr_count > 0 ? RESOLVE_OK : RESOLVE_NODATA;
+}
+
+/**
+ * Turn a caller's target into the connection layer's.
+ *
+ * @param in The caller's target
+ * @param target Receives the target, with a lookup status the connection reports
+ */
+static void prepare_target(const certfetch_target_t *in, target_t *target) {
+    const char *host = in->host ? in->host : in->address;
+    int protocol = in->protocol ? starttls_protocol_parse(in->protocol, strlen(in->protocol)) : STARTTLS_AUTO;
+
+    memset(target, 0, sizeof(*target));
+    target->dns_status = RESOLVE_INVALID;
+    if (!host || strlen(host) >= sizeof(target->hostname) || protocol < 0) {
+        return;
+    }
+    strcpy(target->hostname, host);
+    target->starttls = (uint8_t)protocol;
+    target->port_number = in->port ? in->port : starttls_default_port((starttls_protocol_t)protocol);
+    snprintf(target->port, sizeof(target->port), "%u", (unsigned int)target->port_number);
+
+    if (!in->address) {
+        resolve_host(target);
+        return;
+    }
+    if (inet_pton(AF_INET, in->address, target->addrs[0].addr) == 1) {
+        target->addrs[0].family = AF_INET;
+    } else if (inet_pton(AF_INET6, in->address, target->addrs[0].addr) == 1) {
+        target->addrs[0].family = AF_INET6;
+    } else {
+        return;
+    }
+    target->addr_count = 1;
+    target->dns_status = RESOLVE_OK;
+}
+
+/**
+ * Map a finished connection to a status.
+ *
+ * @param conn The connection
+ * @return The status
+ */
+static certfetch_status_t conn_status(const tls_conn_t *conn) {
+    switch (conn->error) {
+        case TLS_CONN_OK:            return CERTFETCH_OK;
+        case TLS_CONN_ERR_DNS:       return CERTFETCH_ERR_DNS;
+        case TLS_CONN_ERR_CONNECT:
+            return conn->connect_errno == ECONNREFUSED ? CERTFETCH_ERR_REFUSED : CERTFETCH_ERR_CONNECT;
+        case TLS_CONN_ERR_TIMEOUT:   return CERTFETCH_ERR_TIMEOUT;
+        case TLS_CONN_ERR_HANDSHAKE: return CERTFETCH_ERR_HANDSHAKE;
+        case TLS_CONN_ERR_STARTTLS:  return CERTFETCH_ERR_STARTTLS;
+        default:                     return CERTFETCH_ERR_INTERNAL;
+    }
+}
+
+/**
+ * Deliver a finished connection to the caller's callback; the driver then frees its slot.
+ *
+ * @param context The scanner
+ * @param slot The connection slot
+ * @param conn The connection
+ */
+static void finish_conn(void *context, int slot, tls_conn_t *conn) {
+    certfetch_t *scanner = (certfetch_t *)context;
+    char error[512] = "";
+    char address[INET6_ADDRSTRLEN] = "";
+    certfetch_result_t result = {
+        .target = &scanner->targets[scanner->slot_target[slot]],
+        .status = conn_status(conn),
+        .resumed = conn->resumed,
+        .connect_us = conn->connected_us > 0 ? conn->connected_us - conn->started_us : -1,
+        .handshake_us = conn->handshaken_us > 0 ? conn->handshaken_us - conn->negotiated_us : -1,
+        .total_us = conn->target.dns_us + (monotonic_us() - conn->started_us)
+    };
+
+    const target_addr_t *addr = tls_conn_get_address(conn);
+    if (addr) {
+        inet_ntop(addr->family, addr->addr, address, sizeof(address));
+    }
+    result.address = address;
+
+    if (result.status == CERTFETCH_OK) {
+        result.leaf = tls_conn_get_peer_certificate(conn);
+        result.chain = tls_conn_get_peer_chain(conn);
+        if (!result.leaf) {
+            result.status = CERTFETCH_ERR_NO_CERTIFICATE;
+        }
+    } else if (result.status == CERTFETCH_ERR_DNS) {
+        result.error = conn->target.dns_status == RESOLVE_NXDOMAIN ? "no such host" :
+                       conn->target.dns_status == RESOLVE_NODATA ? "no addresses" :
+                       conn->target.dns_status == RESOLVE_TEMPFAIL ? "lookup failed" : "invalid target";
+    } else if (result.status == CERTFETCH_ERR_HANDSHAKE) {
+        // Drop the " error: " that get_ssl_error puts before the first entry
+        get_ssl_error(error, sizeof(error));
+        result.error = strncmp(error, " error: ", 8) == 0 ? error + 8 : error;
+    } else if (result.status == CERTFETCH_ERR_STARTTLS) {
+        result.error = conn->starttls->error;
+    } else if ((result.status == CERTFETCH_ERR_CONNECT || result.status == CERTFETCH_ERR_REFUSED) &&
+               conn->connect_errno != 0) {
+        result.error = strerror(conn->connect_errno);
+    }
+
+    scanner->callback(&result, scanner->callback_context);
+
+    if (result.chain) sk_X509_pop_free(result.chain, X509_free);
+    if (result.leaf) X509_free(result.leaf);
+    ERR_clear_error();
+}
+
+/**
+ * Fetch the certificates of a batch of targets, driving up to the configured number of
+ * connections at once from the calling thread. Each target's result is passed to the
+ * callback, in the order the targets finish, before this returns.
+ *
+ * @param scanner The scanner; not to be used by another thread until this returns
+ * @param targets The targets
+ * @param count Number of targets
+ * @param callback Called once per target
+ * @param context Passed to the callback
+ * @return 0 once every target was delivered, -1 on failure of the event loop
+ */
+int certfetch_run(certfetch_t *scanner, const certfetch_target_t *targets, size_t count,
+                  certfetch_callback_t callback, void *context) {
+    size_t next = 0;
+    int ret = 0;
+
+    if (!callback) {
+        return -1;
+    }
+    scanner->targets = targets;
+    scanner->callback = callback;
+    scanner->callback_context = context;
+    conn_loop_reset(&scanner->driver);
+
+    while (next < count || conn_loop_active(&scanner->driver) > 0) {
+        int slot;
+        while (next < count && (slot = conn_loop_acquire(&scanner->driver)) >= 0) {
+            target_t target;
+            prepare_target(&targets[next], &target);
+            scanner->slot_target[slot] = next++;
+            conn_loop_start(&scanner->driver, slot, &scanner->tls, &target);
+        }
+        if (conn_loop_active(&scanner->driver) == 0) {
+            continue;
+        }
+        if (conn_loop_poll(&scanner->driver, -1) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    // After a failure, the targets still in flight are delivered as failed
+    if (ret != 0) {
+        conn_loop_abort(&scanner->driver);
+    }
+    return ret;
+}
@@ -0,0 +1,493 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "concurrency.h"
+#include "utils.h"
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// How often the controller looks at the last interval's outcomes and the control file
+#define CONTROL_INTERVAL_MS 1000
+// Fewer finished attempts than this in an interval say too little to act on
+#define MIN_WINDOW_ATTEMPTS 20
+// Timeouts are a sign of congestion at twice their usual rate, and at least this much above it
+#define TIMEOUT_RATE_MARGIN 0.05
+// The same for the average connect time, at this multiple of its usual value and at least this many microseconds above it
+#define LATENCY_FACTOR 3.0
+#define LATENCY_MARGIN_US 50000
+// How far the usual timeout rate and connect time move towards a worse uncongested interval
+#define BASELINE_SMOOTHING 0.05
+// Intervals to wait after a decrease before the limit may change again
+#define DECREASE_COOLDOWN 3
+// The limit only grows while the connections in flight fill this share of it
+#define BUSY_SHARE 0.9
+#define MAX_CONTROL_LINE 256
+
+struct concurrency {
+    atomic_int limit;
+    int minimum;
+    int maximum;
+    bool autoscale;
+    bool finished;
+    const char *control_path;
+    progress_t *progress;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    // Controller state, only touched by its thread once it runs
+    pthread_t thread;
+    bool running;
+    atomic_bool stopping;
+    progress_sample_t last;
+    double baseline_timeout_rate;
+    double baseline_connect_us;
+    bool has_baseline;
+    int cooldown;
+    struct timespec control_mtime;
+    off_t control_size;
+    bool control_read;
+};
+
+/**
+ * Create the concurrency limit of a scan.
+ *
+ * @param options The initial limit, its bounds and what may change it
+ * @param progress The scan's progress counters, told about every change, or NULL
+ * @return The limit, or NULL on failure
+ */
+concurrency_t *concurrency_create(const concurrency_options_t *options, progress_t *progress) {
+    concurrency_t *concurrency = calloc(1, sizeof(*concurrency));
+    if (!concurrency) {
+        return NULL;
+    }
+    concurrency->maximum = options->maximum;
+    concurrency->minimum = options->minimum < options->maximum ? options->minimum : options->maximum;
+    concurrency->autoscale = options->autoscale;
+    concurrency->control_path = options->control_path;
+    concurrency->progress = progress;
+    atomic_init(&concurrency->limit, options->initial);
+    atomic_init(&concurrency->stopping, false);
+    pthread_mutex_init(&concurrency->mutex, NULL);
+    pthread_cond_init(&concurrency->changed, NULL);
+    progress_set_limit(progress, options->initial);
+    return concurrency;
+}
+
+/**
+ * Free the concurrency limit. Its controller must have been stopped.
+ *
+ * @param concurrency The limit, or NULL
+ */
+void concurrency_free(concurrency_t *concurrency) {
+    if (!concurrency) {
+        return;
+    }
+    pthread_cond_destroy(&concurrency->changed);
+    pthread_mutex_destroy(&concurrency->mutex);
+    free(concurrency);
+}
+
+/**
+ * Get the number of connections currently allowed at once.
+ *
+ * @param concurrency The limit
+ * @return The limit
+ */
+int concurrency_limit(concurrency_t *concurrency) {
+    return atomic_load_explicit(&concurrency->limit, memory_order_relaxed);
+}
+
+/**
+ * Get the most connections the limit may ever allow.
+ *
+ * @param concurrency The limit
+ * @return The maximum
+ */
+int concurrency_maximum(concurrency_t *concurrency) {
+    return concurrency->maximum;
+}
+
+/**
+ * Change the limit, within its bounds, and wake the workers waiting on it.
+ * Called with the mutex held.
+ *
+ * @param concurrency The limit
+ * @param limit The new limit
+ * @return The limit set
+ */
+static int set_limit_locked(concurrency_t *concurrency, int limit) {
+    if (limit < concurrency->minimum) limit = concurrency->minimum;
+    if (limit > concurrency->maximum) limit = concurrency->maximum;
+    atomic_store_explicit(&concurrency->limit, limit, memory_order_relaxed);
+    progress_set_limit(concurrency->progress, limit);
+    pthread_cond_broadcast(&concurrency->changed);
+    return limit;
+}
+
+/**
+ * Lower the maximum, such as to what the open file limit allows. Call before the scan starts.
+ *
+ * @param concurrency The limit
+ * @param maximum The new maximum
+ */
+void concurrency_set_maximum(concurrency_t *concurrency, int maximum) {
+    pthread_mutex_lock(&concurrency->mutex);
+    concurrency->maximum = maximum;
+    if (concurrency->minimum > maximum) {
+        concurrency->minimum = maximum;
+    }
+    set_limit_locked(concurrency, concurrency_limit(concurrency));
+    pthread_mutex_unlock(&concurrency->mutex);
+}
+
+/**
+ * Get one event loop's part of the limit, the limit being split evenly across the loops.
+ *
+ * @param concurrency The limit
+ * @param index The loop, counted from 0
+ * @param count The number of loops
+ * @return The connections that loop may keep open
+ */
+int concurrency_share(concurrency_t *concurrency, int index, int count) {
+    int limit = concurrency_limit(concurrency);
+    return limit / count + (index < limit % count ? 1 : 0);
+}
+
+/**
+ * Wait until a worker thread is within the limit. Worker n may scan while the limit is
+ * at least n, so lowering the limit parks the highest numbered workers after their
+ * current target.
+ *
+ * @param concurrency The limit, or NULL for no limit
+ * @param id The worker, counted from 1
+ * @return true if the worker should take another target, false once the scan is finished
+ */
+bool concurrency_wait_turn(concurrency_t *concurrency, int id) {
+    if (!concurrency || id <= concurrency_limit(concurrency)) {
+        return true;
+    }
+
+    pthread_mutex_lock(&concurrency->mutex);
+    while (id > concurrency_limit(concurrency) && !concurrency->finished) {
+        pthread_cond_wait(&concurrency->changed, &concurrency->mutex);
+    }
+    bool turn = !concurrency->finished;
+    pthread_mutex_unlock(&concurrency->mutex);
+    return turn;
+}
+
+/**
+ * Wait until the limit rises above a number of workers, so more can be started.
+ *
+ * @param concurrency The limit
+ * @param count The workers started so far
+ * @return The new limit, or -1 once the scan is finished
+ */
+int concurrency_wait_above(concurrency_t *concurrency, int count) {
+    pthread_mutex_lock(&concurrency->mutex);
+    while (concurrency_limit(concurrency) <= count && !concurrency->finished) {
+        pthread_cond_wait(&concurrency->changed, &concurrency->mutex);
+    }
+    int limit = concurrency->finished ? -1 : concurrency_limit(concurrency);
+    pthread_mutex_unlock(&concurrency->mutex);
+    return limit;
+}
+
+/**
+ * Mark the scan as finished, when a worker finds no more targets, releasing every waiting worker.
+ *
+ * @param concurrency The limit, or NULL
+ */
+void concurrency_finish(concurrency_t *concurrency) {
+    if (!concurrency) {
+        return;
+    }
+    pthread_mutex_lock(&concurrency->mutex);
+    concurrency->finished = true;
+    pthread_cond_broadcast(&concurrency->changed);
+    pthread_mutex_unlock(&concurrency->mutex);
+}
+
+/**
+ * Apply one "key=value" line of the control file.
+ *
+ * @param concurrency The limit
+ * @param line The line, without its newline
+ */
+static void apply_control_line(concurrency_t *concurrency, char *line) {
+    char *key = line;
+    while (isspace((unsigned char)*key)) key++;
+    if (*key == '\0' || *key == '#') {
+        return;
+    }
+
+    char *value = strchr(key, '=');
+    char *end = value ? value : key + strlen(key);
+    while (end > key && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    if (value) {
+        value++;
+        while (isspace((unsigned char)*value)) value++;
+        end = value + strlen(value);
+        while (end > value && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+    }
+
+    if (value && strcmp(key, "concurrency") == 0) {
+        char *endptr;
+        long limit = strtol(value, &endptr, 10);
+        if (*endptr != '\0' || endptr == value || limit <= 0) {
+            fprintf(stderr, "Control file %s: invalid concurrency %s\n", concurrency->control_path, value);
+            return;
+        }
+        if (limit == concurrency_limit(concurrency)) {
+            return;
+        }
+        pthread_mutex_lock(&concurrency->mutex);
+        int set = set_limit_locked(concurrency, limit > concurrency->maximum ? concurrency->maximum : (int)limit);
+        pthread_mutex_unlock(&concurrency->mutex);
+        concurrency->cooldown = 0;
+        fprintf(stderr, "Control file %s: concurrency set to %d%s\n", concurrency->control_path, set,
+                set != limit ? " (the closest the bounds allow)" : "");
+    } else if (value && strcmp(key, "autoscale") == 0) {
+        bool autoscale;
+        if (strcmp(value, "on") == 0) {
+            autoscale = true;
+        } else if (strcmp(value, "off") == 0) {
+            autoscale = false;
+        } else {
+            fprintf(stderr, "Control file %s: autoscale must be on or off, not %s\n", concurrency->control_path, value);
+            return;
+        }
+        if (autoscale != concurrency->autoscale) {
+            concurrency->autoscale = autoscale;
+            concurrency->has_baseline = false;
+            fprintf(stderr, "Control file %s: autoscale %s\n", concurrency->control_path, value);
+        }
+    } else {
+        fprintf(stderr, "Control file %s: unknown setting %s\n", concurrency->control_path, key);
+    }
+}
+
+/**
+ * Read the control file if it changed since it was last read, or if asked to.
+ *
+ * @param concurrency The limit
+ * @param force Read it even if it looks unchanged, as on SIGHUP
+ */
+static void read_control_file(concurrency_t *concurrency, bool force) {
+    struct stat st;
+    if (stat(concurrency->control_path, &st) != 0) {
+        // The file may not have been written yet
+        return;
+    }
+    if (!force && concurrency->control_read && st.st_size == concurrency->control_size &&
+        st.st_mtim.tv_sec == concurrency->control_mtime.tv_sec &&
+        st.st_mtim.tv_nsec == concurrency->control_mtime.tv_nsec) {
+        return;
+    }
+    concurrency->control_read = true;
+    concurrency->control_size = st.st_size;
+    concurrency->control_mtime = st.st_mtim;
+
+    FILE *file = fopen(concurrency->control_path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to read control file %s: %s\n", concurrency->control_path, strerror(errno));
+        return;
+    }
+    char line[MAX_CONTROL_LINE];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        apply_control_line(concurrency, line);
+    }
+    fclose(file);
+}
+
+/**
+ * Move the usual level of a measure towards its latest value. It follows an improvement
+ * at once and a worsening only slowly, so that a creeping rise still stands out.
+ *
+ * @param baseline The usual level
+ * @param value The latest value
+ * @return The new usual level
+ */
+static double follow_baseline(double baseline, double value) {
+    return value < baseline ? value : baseline + BASELINE_SMOOTHING * (value - baseline);
+}
+
+/**
+ * Adjust the limit to the last interval: cut it by a quarter when timeouts or the
+ * connect time rise well above their usual level, and raise it by an eighth while the
+ * connections in flight fill it and the network keeps up.
+ *
+ * @param concurrency The limit
+ */
+static void autoscale(concurrency_t *concurrency) {
+    progress_sample_t sample;
+    progress_sample(concurrency->progress, &sample);
+    unsigned long long attempts = sample.attempts - concurrency->last.attempts;
+    unsigned long long timeouts = sample.timeouts - concurrency->last.timeouts;
+    unsigned long long connects = sample.connects - concurrency->last.connects;
+    unsigned long long connect_us = sample.connect_us - concurrency->last.connect_us;
+
+    if (concurrency->cooldown > 0) {
+        concurrency->cooldown--;
+        concurrency->last = sample;
+        return;
+    }
+    if (attempts < MIN_WINDOW_ATTEMPTS) {
+        // Let the window grow over more intervals until it says enough
+        return;
+    }
+    concurrency->last = sample;
+
+    double timeout_rate = (double)timeouts / (double)attempts;
+    double average_connect_us = connects ? (double)connect_us / (double)connects : 0;
+    if (!concurrency->has_baseline) {
+        concurrency->baseline_timeout_rate = timeout_rate;
+        concurrency->baseline_connect_us = average_connect_us;
+        concurrency->has_baseline = true;
+        return;
+    }
+
+    double timeout_threshold = concurrency->baseline_timeout_rate * 2;
+    if (timeout_threshold < concurrency->baseline_timeout_rate + TIMEOUT_RATE_MARGIN) {
+        timeout_threshold = concurrency->baseline_timeout_rate + TIMEOUT_RATE_MARGIN;
+    }
+    bool timeouts_rose = timeout_rate > timeout_threshold;
+    bool latency_rose = connects > 0 && concurrency->baseline_connect_us > 0 &&
+                        average_connect_us > LATENCY_FACTOR * concurrency->baseline_connect_us &&
+                        average_connect_us > concurrency->baseline_connect_us + LATENCY_MARGIN_US;
+    int limit = concurrency_limit(concurrency);
+
+    if (timeouts_rose || latency_rose) {
+        pthread_mutex_lock(&concurrency->mutex);
+        int set = set_limit_locked(concurrency, limit - (limit + 3) / 4);
+        pthread_mutex_unlock(&concurrency->mutex);
+        concurrency->cooldown = DECREASE_COOLDOWN;
+        if (set != limit) {
+            if (timeouts_rose) {
+                fprintf(stderr, "Autoscale: %.1f%% of attempts timed out (usually %.1f%%), reducing concurrency from %d to %d\n",
+                        100.0 * timeout_rate, 100.0 * concurrency->baseline_timeout_rate, limit, set);
+            } else {
+                fprintf(stderr, "Autoscale: connects took %.1fms (usually %.1fms), reducing concurrency from %d to %d\n",
+                        average_connect_us / 1000.0, concurrency->baseline_connect_us / 1000.0, limit, set);
+            }
+        }
+        return;
+    }
+
+    concurrency->baseline_timeout_rate = follow_baseline(concurrency->baseline_timeout_rate, timeout_rate);
+    if (connects > 0) {
+        concurrency->baseline_connect_us = concurrency->baseline_connect_us > 0
+            ? follow_baseline(concurrency->baseline_connect_us, average_connect_us)
+            : average_connect_us;
+    }
+    if (limit < concurrency->maximum && (double)(sample.started - sample.attempts) >= BUSY_SHARE * limit) {
+        pthread_mutex_lock(&concurrency->mutex);
+        set_limit_locked(concurrency, limit + (limit >= 8 ? limit / 8 : 1));
+        pthread_mutex_unlock(&concurrency->mutex);
+    }
+}
+
+/**
+ * Controller thread function.
+ * Every interval, rereads the control file if it changed and autoscales the limit;
+ * SIGHUP rereads the control file at once.
+ *
+ * @param arg Pointer to the concurrency limit
+ * @return NULL
+ */
+static void *controller_thread(void *arg) {
+    concurrency_t *concurrency = (concurrency_t *)arg;
+    long long next_ms = monotonic_ms() + CONTROL_INTERVAL_MS;
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    if (concurrency->control_path) {
+        read_control_file(concurrency, true);
+    }
+    if (concurrency->progress) {
+        progress_sample(concurrency->progress, &concurrency->last);
+    }
+
+    while (!atomic_load(&concurrency->stopping)) {
+        long long now = monotonic_ms();
+        long long wait_ms = next_ms > now ? next_ms - now : 0;
+        struct timespec timeout = { .tv_sec = (time_t)(wait_ms / 1000), .tv_nsec = (long)(wait_ms % 1000) * 1000000L };
+
+        int sig = sigtimedwait(&signals, NULL, &timeout);
+        if (atomic_load(&concurrency->stopping)) {
+            break;
+        }
+        if (sig == SIGHUP) {
+            if (concurrency->control_path) {
+                read_control_file(concurrency, true);
+            }
+            continue;
+        }
+        if (errno != EAGAIN) {
+            continue;
+        }
+
+        next_ms += CONTROL_INTERVAL_MS;
+        if (concurrency->control_path) {
+            read_control_file(concurrency, false);
+        }
+        if (concurrency->autoscale) {
+            autoscale(concurrency);
+        } else if (concurrency->progress) {
+            progress_sample(concurrency->progress, &concurrency->last);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the thread that autoscales the limit and follows the control file.
+ * With a control file, SIGHUP must be blocked in every other thread, so that it reaches this one.
+ *
+ * @param concurrency The limit
+ * @return 0 on success, -1 on failure
+ */
+int concurrency_controller_start(concurrency_t *concurrency) {
+    if (!concurrency->progress) {
+        concurrency->autoscale = false;
+    }
+
+    // The thread starts with the signal blocked, so it takes it from sigtimedwait instead of dying of it
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    int rc = pthread_create(&concurrency->thread, NULL, controller_thread, concurrency);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (rc != 0) {
+        return -1;
+    }
+    concurrency->running = true;
+    return 0;
+}
+
+/**
+ * Stop the controller thread, if it was started.
+ *
+ * @param concurrency The limit
+ */
+void concurrency_controller_stop(concurrency_t *concurrency) {
+    if (!concurrency->running) {
+        return;
+    }
+    atomic_store(&concurrency->stopping, true);
+    pthread_kill(concurrency->thread, SIGHUP);
+    pthread_join(concurrency->thread, NULL);
+    concurrency->running = false;
+}
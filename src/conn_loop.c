@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "conn_loop.h"
+#include "utils.h"
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 1024
+// How often in-flight connections are checked against their deadlines
+#define SWEEP_INTERVAL_MS 10
+
+/**
+ * Set up a loop over caller-owned slot arrays and create its epoll set.
+ *
+ * @param loop The loop to initialise
+ * @param capacity Number of connection slots
+ * @param conns The connections, one per slot
+ * @param registered_fd Scratch array of one int per slot
+ * @param free_slots Scratch array of one int per slot
+ * @param finish Called with each finished connection
+ * @param context Passed to finish
+ * @return 0 on success, -1 on failure
+ */
+int conn_loop_init(conn_loop_t *loop, int capacity, tls_conn_t *conns, int *registered_fd, int *free_slots,
+                   conn_loop_finish_t finish, void *context) {
+    loop->capacity = capacity;
+    loop->conns = conns;
+    loop->registered_fd = registered_fd;
+    loop->free_slots = free_slots;
+    loop->finish = finish;
+    loop->context = context;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        return -1;
+    }
+    conn_loop_reset(loop);
+    return 0;
+}
+
+/**
+ * Mark every slot free. No connection may be in flight.
+ *
+ * @param loop The loop
+ */
+void conn_loop_reset(conn_loop_t *loop) {
+    // Hand out low slots first so the deadline sweep touches a compact range
+    for (int slot = 0; slot < loop->capacity; slot++) {
+        loop->registered_fd[slot] = -1;
+        loop->free_slots[slot] = loop->capacity - 1 - slot;
+    }
+    loop->free_count = loop->capacity;
+    loop->next_sweep_ms = monotonic_ms() + SWEEP_INTERVAL_MS;
+}
+
+/**
+ * Report a finished connection and return its slot to the free list.
+ *
+ * @param loop The loop
+ * @param slot The connection slot
+ */
+static void finish_slot(conn_loop_t *loop, int slot) {
+    tls_conn_t *conn = &loop->conns[slot];
+
+    loop->finish(loop->context, slot, conn);
+    tls_conn_cleanup(conn);
+    loop->registered_fd[slot] = -1;
+    loop->free_slots[loop->free_count++] = slot;
+}
+
+/**
+ * Fail a connection the loop can no longer drive.
+ *
+ * @param conn The connection
+ */
+static void fail_internal(tls_conn_t *conn) {
+    conn->state = TLS_CONN_FAILED;
+    conn->error = TLS_CONN_ERR_INTERNAL;
+    conn->want = 0;
+}
+
+/**
+ * Register or update the epoll interest for a connection's current socket.
+ *
+ * @param loop The loop
+ * @param slot The connection slot
+ * @return 0 on success, -1 on failure
+ */
+static int update_interest(conn_loop_t *loop, int slot) {
+    tls_conn_t *conn = &loop->conns[slot];
+    struct epoll_event ev = {
+        .events = (conn->want & TLS_CONN_WANT_READ) ? EPOLLIN : EPOLLOUT,
+        .data.u64 = ((uint64_t)(uint32_t)conn->fd << 32) | (uint32_t)slot
+    };
+
+    // The connect path may have replaced the socket with one for the next address, or with a race set.
+    // A closed socket leaves the epoll set on its own, so a reused fd number needs ADD too, while
+    // the socket that won a race is still registered from before it and needs MOD.
+    if (loop->registered_fd[slot] == conn->fd &&
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0) {
+        return 0;
+    }
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) != 0 &&
+        (errno != EEXIST || epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) != 0)) {
+        return -1;
+    }
+    loop->registered_fd[slot] = conn->fd;
+    return 0;
+}
+
+/**
+ * Hand a connection that wants more I/O to epoll, or finish it. A socket that cannot be
+ * registered fails the connection.
+ *
+ * @param loop The loop
+ * @param slot The connection slot
+ */
+static void settle_slot(conn_loop_t *loop, int slot) {
+    tls_conn_t *conn = &loop->conns[slot];
+
+    if (!tls_conn_finished(conn) && update_interest(loop, slot) != 0) {
+        fail_internal(conn);
+    }
+    if (tls_conn_finished(conn)) {
+        finish_slot(loop, slot);
+    }
+}
+
+/**
+ * Take a free slot for a new connection.
+ *
+ * @param loop The loop
+ * @return The slot, or -1 if every slot is in use
+ */
+int conn_loop_acquire(conn_loop_t *loop) {
+    return loop->free_count > 0 ? loop->free_slots[--loop->free_count] : -1;
+}
+
+/**
+ * Start a connection in a slot taken with conn_loop_acquire. It may finish at once.
+ *
+ * @param loop The loop
+ * @param slot The slot
+ * @param options The connection settings
+ * @param target The target
+ */
+void conn_loop_start(conn_loop_t *loop, int slot, const tls_conn_options_t *options, const target_t *target) {
+    tls_conn_start(&loop->conns[slot], options, target);
+    settle_slot(loop, slot);
+}
+
+/**
+ * Count the connections in flight.
+ *
+ * @param loop The loop
+ * @return The number of slots in use
+ */
+int conn_loop_active(const conn_loop_t *loop) {
+    return loop->capacity - loop->free_count;
+}
+
+/**
+ * Wait for I/O for at most max_wait_ms, drive every connection that is ready, and act on
+ * those whose deadline passed.
+ *
+ * @param loop The loop
+ * @param max_wait_ms The longest to wait, or -1 to wait until the next deadline sweep at most
+ * @return 0 on success, -1 if epoll failed
+ */
+int conn_loop_poll(conn_loop_t *loop, int max_wait_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    long long now = monotonic_ms();
+    int wait_ms = loop->next_sweep_ms > now ? (int)(loop->next_sweep_ms - now) : 0;
+    if (max_wait_ms >= 0 && max_wait_ms < wait_ms) {
+        wait_ms = max_wait_ms;
+    }
+
+    int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, wait_ms);
+    if (n < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        // Skip events for sockets that were closed earlier in this batch
+        int slot = (int)(events[i].data.u64 & 0xffffffffu);
+        int fd = (int)(events[i].data.u64 >> 32);
+        if (loop->registered_fd[slot] != fd || loop->conns[slot].fd != fd) {
+            continue;
+        }
+        tls_conn_continue(&loop->conns[slot]);
+        settle_slot(loop, slot);
+    }
+
+    // Start the next raced address of, or fail, every connection whose deadline passed
+    now = monotonic_ms();
+    if (now >= loop->next_sweep_ms) {
+        for (int slot = 0; slot < loop->capacity; slot++) {
+            tls_conn_t *conn = &loop->conns[slot];
+            if (loop->registered_fd[slot] >= 0 && conn->deadline_ms <= now) {
+                tls_conn_timeout(conn);
+                settle_slot(loop, slot);
+            }
+        }
+        loop->next_sweep_ms = now + SWEEP_INTERVAL_MS;
+    }
+    return 0;
+}
+
+/**
+ * Finish every connection still in flight as failed, e.g. after epoll failed.
+ *
+ * @param loop The loop
+ */
+void conn_loop_abort(conn_loop_t *loop) {
+    for (int slot = 0; slot < loop->capacity; slot++) {
+        if (loop->registered_fd[slot] >= 0) {
+            fail_internal(&loop->conns[slot]);
+            finish_slot(loop, slot);
+        }
+    }
+}
+
+/**
+ * Close the loop's epoll set. The slot arrays stay with the caller.
+ *
+ * @param loop The loop
+ */
+void conn_loop_destroy(conn_loop_t *loop) {
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+}
@@ -12,125 +12,200 @@
 #include <errno.h>
 #include <limits.h>
 #include <time.h>  // For nanosleep
+#include <signal.h>
 #include <stdbool.h>
 #include "read_file.h"
 #include "get_certificate.h"
 #include "save_certificate.h"
 #include "utils.h"
+#include "scan_config.h"
+#include "epoll_engine.h"
+#include "ssl_profile.h"
+#include "resolver.h"
+#include "target_queue.h"
+#include "cert_store.h"
+#include "cert_dedup.h"
+#include "cert_index.h"
+#include "manifest.h"
+#include "journal.h"
+#include "metrics.h"
+#include "target_generator.h"
+#include "thread_cache.h"
+#include "shard.h"
+#include "merge.h"
+#include "progress.h"
+#include "concurrency.h"
 
-#define DEFAULT_PORT "443"
 #define DEFAULT_WORKERS 1
 #define DEFAULT_TIMEOUT 3
-#define MAX_WORKERS 100
-#define MAX_LINE_LENGTH 256
-#define MAX_RESULT_LENGTH 2048
+#define DEFAULT_INFLIGHT 256
+#define MAX_WORKERS 1024
+#define DEFAULT_READERS 1
+#define MAX_READERS 64
+#define MAX_INFLIGHT 100000
+#define DEFAULT_DNS_THREADS 4
+#define MAX_DNS_THREADS 256
+#define DEFAULT_DNS_TTL 300
+#define DEFAULT_DNS_CACHE 16384
+#define MAX_DNS_CACHE 16777216
+#define DEFAULT_PREFIX_LEN 24
+#define DEFAULT_PREFIX6_LEN 48
+#define MAX_STATS_INTERVAL 86400
+// Without -max-concurrency, -autoscale and -control may raise the concurrency to this multiple of its start
+#define CONCURRENCY_HEADROOM 4
+#define DEFAULT_SESSION_MAX_AGE 86400
+#define MAX_DURATION_MS 3600000
+#define MAX_RETRIES 10
+#define DEFAULT_RETRY_BACKOFF_MS 1000
+#define MAX_SESSION_MAX_AGE (30 * 86400)
+// A resumed handshake shows the leaf of the full handshake that made the session, so -changed-only
+// caps the session age: a rotation behind a resumed session goes unseen for at most this long
+#define MAX_CHANGED_ONLY_SESSION_AGE 3600
+#define DEFAULT_INDEX_THREADS 2
+#define MAX_INDEX_THREADS 64
+#define MAX_QUERY_DAYS 36500
+// Threads reading the certificates already in a merge's output directory
+#define MERGE_THREADS 4
+// Targets buffered between the input, resolver and connect stages
+#define PARSED_QUEUE_CAPACITY 4096
+#define RESOLVED_QUEUE_CAPACITY 4096
 
-// Mutex for synchronizing access to the input file
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-// Mutex for synchronizing print operations
-static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
-// Global file pointer for the input file
-static FILE *input_file = NULL;
+// Global input source (mapped file or stream)
+static input_source_t *input_source = NULL;
+// Queue of parsed targets feeding the resolver stage
+static target_queue_t parsed_queue;
+// Queue of resolved targets feeding the workers
+static target_queue_t resolved_queue;
+// Rate-limiting scheduler handing resolved targets to the workers
+static scheduler_t *scheduler = NULL;
+// Local addresses given with -bind
+static tls_conn_sources_t bind_sources;
 
 // Structure to hold worker thread data
 typedef struct {
     int worker_id;
-    const char *output_dir;
-    double delay;
-    int timeout;
-    bool overwrite;
+    const scan_config_t *config;
 } worker_data_t;
 
 /**
  * Worker thread function.
- * Reads hostnames from the input file, downloads certificates, and prints results.
+ * Takes resolved targets from the scheduler, downloads certificates, and prints results.
  * 
  * @param arg Pointer to worker_data_t structure
  * @return NULL
  */
 static void *worker_thread(void *arg) {
     worker_data_t *data = (worker_data_t *)arg;
-    char line[MAX_LINE_LENGTH];
+    const scan_config_t *config = data->config;
+    arena_t arena;
+    worker_context_t worker = {
+        .id = data->worker_id,
+        .metrics = config->metrics ? metrics_shard(config->metrics) : NULL,
+        .results = config->results ? result_stream_buffer(config->results) : NULL,
+        .arena = &arena
+    };
+    target_t target;
     char result_message[MAX_RESULT_LENGTH];
 
-    while (1) {
-        // Lock the file mutex before reading from the input file
-        if (pthread_mutex_lock(&file_mutex) != 0) {
-            fprintf(stderr, "Failed to lock file mutex\n");
-            return NULL;
-        }
-
-        // Read a line from the input file
-        if (fgets(line, sizeof(line), input_file) == NULL) {
-            pthread_mutex_unlock(&file_mutex);
-            break;
-        }
-
-        // Unlock the file mutex after reading
-        if (pthread_mutex_unlock(&file_mutex) != 0) {
-            fprintf(stderr, "Failed to unlock file mutex\n");
-            return NULL;
-        }
-
-        // Parse the hostname and port from the input line
-        char *hostname = strtok(line, ":\n");
-        char *port = strtok(NULL, "\n");
-
-        if (port == NULL) {
-            port = DEFAULT_PORT;
-        }
-
-        // Format the result message
-        int ret = snprintf(result_message, sizeof(result_message), 
-                           "Worker %d: Attempting to connect to %s:%s...", 
-                           data->worker_id, hostname, port);
-        if (ret < 0 || (size_t)ret >= sizeof(result_message)) {
-            fprintf(stderr, "Error formatting result message\n");
-            continue;
-        }
-        
-        // Download the certificate
-        download_certificate(hostname, port, data->output_dir, result_message,
-                     sizeof(result_message), data->timeout, data->overwrite, data->worker_id);
-
-        // Lock the print mutex before printing
-        if (pthread_mutex_lock(&print_mutex) != 0) {
-            fprintf(stderr, "Failed to lock print mutex\n");
-            return NULL;
-        }
-
-        // Print the result
-        printf("%s\n", result_message);
-
-        // Unlock the print mutex after printing
-        if (pthread_mutex_unlock(&print_mutex) != 0) {
-            fprintf(stderr, "Failed to unlock print mutex\n");
-            return NULL;
-        }
+    arena_init(&arena, WORKER_ARENA_SIZE);
+    while (concurrency_wait_turn(config->concurrency, data->worker_id) && scheduler_next(scheduler, &target, -1) > 0) {
+        // Download the certificate; the result goes to this worker's output buffer
+        download_certificate(&target, config, &worker, result_message, sizeof(result_message));
 
         // Delay if specified
-        if (data->delay > 0) {
+        if (config->delay > 0) {
             struct timespec ts;
-            ts.tv_sec = (time_t)data->delay;
-            ts.tv_nsec = (long)((data->delay - ts.tv_sec) * 1e9);
+            ts.tv_sec = (time_t)config->delay;
+            ts.tv_nsec = (long)((config->delay - ts.tv_sec) * 1e9);
             nanosleep(&ts, NULL);
         }
     }
+    concurrency_finish(config->concurrency);
 
     // Print completion message
-    if (pthread_mutex_lock(&print_mutex) != 0) {
-        fprintf(stderr, "Failed to lock print mutex\n");
-        return NULL;
+    snprintf(result_message, sizeof(result_message), "Worker %d: finished.", data->worker_id);
+    result_buffer_text(worker.results, result_message);
+    result_buffer_flush(worker.results);
+    arena_destroy(&arena);
+
+    return NULL;
+}
+
+/**
+ * Parse a connection rate such as "50" or "50/s".
+ *
+ * @param text The argument
+ * @param rate Receives the rate in connections per second
+ * @return 0 on success, -1 if the rate is not a positive number
+ */
+static int parse_rate(const char *text, double *rate) {
+    char *endptr;
+    double value = strtod(text, &endptr);
+    if (endptr == text || (*endptr != '\0' && strcmp(endptr, "/s") != 0) || !(value > 0)) {
+        return -1;
     }
+    *rate = value;
+    return 0;
+}
 
-    printf("Worker %d: finished.\n", data->worker_id);
+/**
+ * Parse a duration such as "3", "1.5s" or "250ms". A bare number is in seconds.
+ *
+ * @param text The argument
+ * @param ms Receives the duration in milliseconds
+ * @return 0 on success, -1 if the duration is not a positive number of at most MAX_DURATION_MS
+ */
+static int parse_duration(const char *text, int *ms) {
+    char *endptr;
+    double value = strtod(text, &endptr);
+    if (endptr == text || !(value > 0)) {
+        return -1;
+    }
+    if (strcmp(endptr, "ms") != 0) {
+        if (*endptr != '\0' && strcmp(endptr, "s") != 0) {
+            return -1;
+        }
+        value *= 1000.0;
+    }
+    if (value < 1.0 || value > MAX_DURATION_MS) {
+        return -1;
+    }
+    *ms = (int)value;
+    return 0;
+}
 
-    if (pthread_mutex_unlock(&print_mutex) != 0) {
-        fprintf(stderr, "Failed to unlock print mutex\n");
-        return NULL;
+/**
+ * Make the manifest lines, stored certificates and result records of every target handed
+ * to the journal so far durable, before the journal records those targets as finished.
+ *
+ * @param arg The scan settings
+ * @return 0 on success, -1 on failure
+ */
+static int sync_outputs(void *arg) {
+    const scan_config_t *config = (const scan_config_t *)arg;
+    int ret = 0;
+
+    if (config->manifest && manifest_sync(config->manifest) != 0) {
+        ret = -1;
+    }
+    if (config->store ? cert_store_sync(config->store) != 0 : sync_directory(config->output_dir) != 0) {
+        ret = -1;
+    }
+    if (config->results && result_stream_sync(config->results) != 0) {
+        ret = -1;
     }
+    return ret;
+}
 
-    return NULL;
+/**
+ * Session lookup for the connections: offer each server the session the previous run saved.
+ *
+ * @param context The session cache
+ * @param target The target
+ * @return A new session, or NULL if none is usable
+ */
+static SSL_SESSION *find_saved_session(void *context, const target_t *target) {
+    return session_cache_get((session_cache_t *)context, target);
 }
 
 /**
@@ -139,22 +214,384 @@ static void *worker_thread(void *arg) {
  * @param program_name The name of the program
  */
 static void print_usage(const char *program_name) {
-    fprintf(stderr, "Usage: %s -if <input_file> -od <output_directory> [-delay <seconds>] [-workers <number>] [-overwrite]\n", program_name);
-    fprintf(stderr, "  -if         input file of hostnames and ports to connect to.\n");
+    fprintf(stderr, "Usage: %s -if <input_file> -od <output_directory> [-delay <seconds>] [-workers <number>] [-overwrite]\n"
+                    "          [-engine threads|epoll] [-inflight <number>] [-ssl-profile <profile>] [-fast-cert]\n"
+                    "          [-dns-threads <number>] [-dns-server <ip[:port]>] [-dns-ttl <seconds>] [-dns-cache <entries>]\n"
+                    "          [-readers <number>] [-store files|pack] [-format pem|der] [-chain]\n"
+                    "          [-manifest <file>] [-manifest-format jsonl|csv]\n"
+                    "          [-journal <file>] [-resume] [-stats-interval <seconds>] [-stats-file <file>]\n"
+                    "          [-ports <list>] [-seed <number>]\n"
+                    "          [-max-rate <n/s>] [-ip-rate <n/s>] [-prefix-rate <n/s>] [-prefix-len <bits>] [-prefix6-len <bits>]\n"
+                    "          [-index <file>] [-index-threads <number>] [-shard <i/N>] [-shard-weights <list>]\n"
+                    "          [-progress <seconds>] [-autoscale] [-max-concurrency <number>] [-control <file>]\n"
+                    "          [-bind <address list>] [-all-ips]\n"
+                    "       %s extract -od <output_directory> [-sha256 <hash prefix>] [-out <directory>]\n"
+                    "       %s query -index <file> [-expires-within <days>] [-weak-key <bits>] [-name <text>]\n"
+                    "       %s merge -od <output_directory> [-store files|pack] [-manifest <file>] <node output>...\n",
+                    program_name, program_name, program_name, program_name);
+    fprintf(stderr, "  -if         input file of hostnames and ports to connect to, or - for stdin.\n");
     fprintf(stderr, "  -od         the directory where you want to save all the downloaded certificates.\n");
     fprintf(stderr, "  -delay      the delay between each worker's request. Default is 0.\n");
     fprintf(stderr, "  -workers    the number of workers making requests to websites. Default is 1.\n");
-    fprintf(stderr, "  -timeout    the time in seconds to wait before assuming the connection is not responding. Default is 3.\n");
+    fprintf(stderr, "              With -engine epoll this is the number of event-loop threads.\n");
+    fprintf(stderr, "  -timeout    the time to wait before assuming the connection is not responding, in seconds\n");
+    fprintf(stderr, "              or with an ms or s suffix (e.g. 500ms). Default is 3.\n");
+    fprintf(stderr, "  -connect-timeout    the time the TCP connect may take, within -timeout.\n");
+    fprintf(stderr, "  -handshake-timeout  the time the TLS handshake may take, within -timeout.\n");
+    fprintf(stderr, "  -adaptive-timeout   limit first attempts to this multiple of the observed p99 connect and\n");
+    fprintf(stderr, "              handshake times, within the configured timeouts.\n");
+    fprintf(stderr, "  -retries    retry timeouts and failed connects this many times, without holding a worker while they wait. Default is 0.\n");
+    fprintf(stderr, "  -retry-backoff  the wait before the first retry, doubled for each further one and jittered. Default is 1s.\n");
     fprintf(stderr, "  -overwrite  allow overwriting of existing certificate files.\n");
+    fprintf(stderr, "  -engine     threads: one blocking connection per worker (default).\n");
+    fprintf(stderr, "              epoll: each worker drives many non-blocking connections at once.\n");
+    fprintf(stderr, "  -inflight   the number of concurrent connections across all epoll workers. Default is %d.\n", DEFAULT_INFLIGHT);
+    fprintf(stderr, "  -ssl-profile  TLS settings shared by every connection: an optional base profile\n");
+    fprintf(stderr, "              (default, modern, tls12, compat) followed by comma separated\n");
+    fprintf(stderr, "              min=, max=, ciphers=, ciphersuites= and groups= settings.\n");
+    fprintf(stderr, "  -fast-cert  close the connection as soon as the server's certificate has been received.\n");
+    fprintf(stderr, "  -readers    the number of threads parsing a memory-mapped input file. Default is %d.\n", DEFAULT_READERS);
+    fprintf(stderr, "  -dns-threads  the number of threads resolving hostnames ahead of the workers. Default is %d.\n", DEFAULT_DNS_THREADS);
+    fprintf(stderr, "  -dns-server   query this IPv4 DNS server directly and honour record TTLs instead of\n");
+    fprintf(stderr, "              using the system resolver.\n");
+    fprintf(stderr, "  -dns-ttl    how long system resolver results are cached, in seconds. 0 disables. Default is %d.\n", DEFAULT_DNS_TTL);
+    fprintf(stderr, "  -dns-cache  the number of hostnames the DNS cache holds. 0 disables. Default is %d.\n", DEFAULT_DNS_CACHE);
+    fprintf(stderr, "  -store      files: one .pem file per certificate (default).\n");
+    fprintf(stderr, "              pack: append certificates to large segment files with a SHA256 index.\n");
+    fprintf(stderr, "  -format     save certificates as pem (default) or der.\n");
+    fprintf(stderr, "  -chain      also save the intermediate certificates the server sends.\n");
+    fprintf(stderr, "  -manifest   append one line per host with its outcome and certificate fingerprints.\n");
+    fprintf(stderr, "  -manifest-format  jsonl (default) or csv.\n");
+    fprintf(stderr, "  -journal    append every finished host:port to this file, so the scan can be resumed.\n");
+    fprintf(stderr, "  -resume     skip the targets the -journal file records as finished.\n");
+    fprintf(stderr, "  -stats-interval  print phase latency percentiles to stderr every this many seconds. Default is 0 (only at the end).\n");
+    fprintf(stderr, "  -stats-file  write the phase latency metrics to this file in the Prometheus text format.\n");
+    fprintf(stderr, "  -output     write one result per target as text (default), jsonl or binary records.\n");
+    fprintf(stderr, "  -quiet      write no per-target results, only the summary.\n");
+    fprintf(stderr, "  -session-cache  keep TLS sessions and leaf fingerprints in this file, to resume\n");
+    fprintf(stderr, "              handshakes on the next run and tell which certificates changed.\n");
+    fprintf(stderr, "  -session-max-age  offer a session for at most this many seconds after its full handshake. Default is %d.\n", DEFAULT_SESSION_MAX_AGE);
+    fprintf(stderr, "  -changed-only  only report certificates that changed since the -session-cache was saved, and failures.\n");
+    fprintf(stderr, "              Sessions are then offered for at most %d seconds, the longest a rotation can go unreported.\n", MAX_CHANGED_ONLY_SESSION_AGE);
+    fprintf(stderr, "  -ports      scan every entry without its own port on each of these ports, e.g. 443,8443,9000-9010.\n");
+    fprintf(stderr, "              Input entries may also be CIDR blocks (10.0.0.0/24) or address ranges (10.0.0.1-10.0.0.99).\n");
+    fprintf(stderr, "  -seed       the seed of the random order address ranges are scanned in. Default is random.\n");
+    fprintf(stderr, "  -max-rate   the most new connections per second across the whole scan. Default is unlimited.\n");
+    fprintf(stderr, "  -ip-rate    the most new connections per second to any one IP address. Default is unlimited.\n");
+    fprintf(stderr, "  -prefix-rate  the most new connections per second to any one network. Default is unlimited.\n");
+    fprintf(stderr, "              Targets held back by a limit wait without delaying targets elsewhere.\n");
+    fprintf(stderr, "  -prefix-len   the IPv4 network size used by -prefix-rate. Default is /%d.\n", DEFAULT_PREFIX_LEN);
+    fprintf(stderr, "  -prefix6-len  the IPv6 network size used by -prefix-rate. Default is /%d.\n", DEFAULT_PREFIX6_LEN);
+    fprintf(stderr, "  -index      parse every newly saved certificate on separate threads into this index file,\n");
+    fprintf(stderr, "              sorted by expiry, for the query subcommand.\n");
+    fprintf(stderr, "  -index-threads  the number of threads parsing certificates for -index. Default is %d.\n", DEFAULT_INDEX_THREADS);
+    fprintf(stderr, "  -shard      scan only shard i of N (counted from 1), chosen by a hash of host:port, so N nodes\n");
+    fprintf(stderr, "              given the same input split it between them without overlap.\n");
+    fprintf(stderr, "  -shard-weights  N comma separated weights giving each shard its share of the targets, e.g. 1,1,2.\n");
+    fprintf(stderr, "  -progress   print targets done, hosts per second, connections in flight and the ETA to stderr\n");
+    fprintf(stderr, "              every this many seconds. Default is 0 (only when the process gets SIGUSR1).\n");
+    fprintf(stderr, "  -autoscale  lower the concurrency (-workers, or -inflight with -engine epoll) when timeouts or\n");
+    fprintf(stderr, "              connect times rise, and raise it again while the network keeps up.\n");
+    fprintf(stderr, "  -max-concurrency  the most the concurrency may be raised to. Default is %d times its start.\n", CONCURRENCY_HEADROOM);
+    fprintf(stderr, "  -control    follow concurrency=<number> and autoscale=on|off lines in this file while the scan\n");
+    fprintf(stderr, "              runs. It is reread when it changes, and at once on SIGHUP.\n");
+    fprintf(stderr, "  -bind       connect from these comma separated local IPv4 and IPv6 addresses, taken in turn,\n");
+    fprintf(stderr, "              so the scan is not limited to one address's ephemeral ports.\n");
+    fprintf(stderr, "  -all-ips    fetch the certificate from every address a hostname resolves to, not just the\n");
+    fprintf(stderr, "              first that answers.\n");
+    fprintf(stderr, "  extract     copy certificates out of a pack store, to -out or to stdout.\n");
+    fprintf(stderr, "  query       list the certificates in an -index file as JSON lines, soonest expiry first,\n");
+    fprintf(stderr, "              optionally only those expiring within -expires-within days, with an RSA or DSA\n");
+    fprintf(stderr, "              key shorter than -weak-key bits, or with -name in their subject or SANs.\n");
+    fprintf(stderr, "  merge       combine the output directories and manifests of several nodes into -od and -manifest,\n");
+    fprintf(stderr, "              keeping each certificate and each manifest entry once.\n");
+}
+
+/**
+ * The extract subcommand: copy certificates out of a pack store.
+ *
+ * @param argc Argument count, starting at the subcommand
+ * @param argv Arguments, starting at the subcommand
+ * @param program_name The program name for the usage message
+ * @return The exit status
+ */
+static int extract_command(int argc, char *argv[], const char *program_name) {
+    const char *store_dir = NULL;
+    const char *key_prefix = NULL;
+    const char *output_dir = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-od") == 0 && i + 1 < argc) {
+            store_dir = argv[++i];
+        } else if (strcmp(argv[i], "-sha256") == 0 && i + 1 < argc) {
+            key_prefix = argv[++i];
+        } else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc) {
+            output_dir = argv[++i];
+        } else {
+            print_usage(program_name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!store_dir) {
+        print_usage(program_name);
+        return EXIT_FAILURE;
+    }
+
+    struct stat st = {0};
+    if (output_dir && stat(output_dir, &st) == -1 && mkdir(output_dir, 0700) != 0) {
+        perror("Failed to create output directory");
+        return EXIT_FAILURE;
+    }
+
+    int extracted = cert_store_extract(store_dir, key_prefix, output_dir);
+    if (extracted < 0) {
+        return EXIT_FAILURE;
+    }
+    if (extracted == 0 && key_prefix) {
+        fprintf(stderr, "No certificate matching %s in %s\n", key_prefix, store_dir);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Extracted %d certificate(s) from %s\n", extracted, store_dir);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * The query subcommand: list the certificates in an index file that match some filters.
+ *
+ * @param argc Argument count, starting at the subcommand
+ * @param argv Arguments, starting at the subcommand
+ * @param program_name The program name for the usage message
+ * @return The exit status
+ */
+static int query_command(int argc, char *argv[], const char *program_name) {
+    const char *index_path = NULL;
+    cert_index_query_t query = {
+        .expires_within_days = -1,
+        .weak_key_bits = 0,
+        .name = NULL
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-index") == 0 && i + 1 < argc) {
+            index_path = argv[++i];
+        } else if (strcmp(argv[i], "-expires-within") == 0 && i + 1 < argc) {
+            char *endptr;
+            long days_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || days_long < 0 || days_long > MAX_QUERY_DAYS) {
+                fprintf(stderr, "Invalid number of days. Must be between 0 and %d.\n", MAX_QUERY_DAYS);
+                return EXIT_FAILURE;
+            }
+            query.expires_within_days = (int)days_long;
+        } else if (strcmp(argv[i], "-weak-key") == 0 && i + 1 < argc) {
+            char *endptr;
+            long bits_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || bits_long <= 0 || bits_long > 65536) {
+                fprintf(stderr, "Invalid key size. Must be between 1 and 65536 bits.\n");
+                return EXIT_FAILURE;
+            }
+            query.weak_key_bits = (int)bits_long;
+        } else if (strcmp(argv[i], "-name") == 0 && i + 1 < argc) {
+            query.name = argv[++i];
+        } else {
+            print_usage(program_name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!index_path) {
+        print_usage(program_name);
+        return EXIT_FAILURE;
+    }
+
+    int matches = cert_index_query(index_path, &query, stdout);
+    if (matches < 0 || fflush(stdout) != 0) {
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "%d certificate(s) matched in %s\n", matches, index_path);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * The merge subcommand: combine the output directories and manifests of several nodes.
+ * Directories are merged as certificate outputs and other files as manifests.
+ *
+ * @param argc Argument count, starting at the subcommand
+ * @param argv Arguments, starting at the subcommand
+ * @param program_name The program name for the usage message
+ * @return The exit status
+ */
+static int merge_command(int argc, char *argv[], const char *program_name) {
+    const char *output_dir = NULL;
+    const char *manifest_path = NULL;
+    bool pack_store = false;
+    int first_input = 0;
+    int directories = 0;
+    int manifests = 0;
+    char error_message[256];
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-od") == 0 && i + 1 < argc) {
+            output_dir = argv[++i];
+        } else if (strcmp(argv[i], "-manifest") == 0 && i + 1 < argc) {
+            manifest_path = argv[++i];
+        } else if (strcmp(argv[i], "-store") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "files") == 0) {
+                pack_store = false;
+            } else if (strcmp(argv[i], "pack") == 0) {
+                pack_store = true;
+            } else {
+                fprintf(stderr, "Invalid store. Must be files or pack.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (argv[i][0] != '-') {
+            first_input = i;
+            break;
+        } else {
+            print_usage(program_name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!output_dir || first_input == 0) {
+        print_usage(program_name);
+        return EXIT_FAILURE;
+    }
+
+    struct stat st = {0};
+    if (stat(output_dir, &st) == -1 && mkdir(output_dir, 0700) != 0) {
+        perror("Failed to create output directory");
+        return EXIT_FAILURE;
+    }
+
+    merge_t *merge = merge_open(output_dir, pack_store, manifest_path, MERGE_THREADS, error_message, sizeof(error_message));
+    if (!merge) {
+        fprintf(stderr, "%s\n", error_message);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int i = first_input; i < argc && status == EXIT_SUCCESS; i++) {
+        if (stat(argv[i], &st) != 0) {
+            fprintf(stderr, "Failed to read %s: %s\n", argv[i], strerror(errno));
+            status = EXIT_FAILURE;
+        } else if (S_ISDIR(st.st_mode)) {
+            directories++;
+            if (merge_add_directory(merge, argv[i]) != 0) status = EXIT_FAILURE;
+        } else {
+            manifests++;
+            if (merge_add_manifest(merge, argv[i]) != 0) status = EXIT_FAILURE;
+        }
+    }
+
+    merge_stats_t stats;
+    if (merge_close(merge, &stats) != 0) {
+        status = EXIT_FAILURE;
+    }
+    if (directories > 0) {
+        fprintf(stderr, "Merged %zu certificates from %d directories: %zu new, %zu already in %s, %zu unreadable\n",
+                stats.certificates, directories, stats.added, stats.certificates - stats.added - stats.unreadable,
+                output_dir, stats.unreadable);
+    }
+    if (manifests > 0) {
+        fprintf(stderr, "Merged %zu manifest entries from %d manifests: %zu new, %zu already in %s\n",
+                stats.entries, manifests, stats.entries_added, stats.entries - stats.entries_added, manifest_path);
+    }
+    return status;
 }
 
 int main(int argc, char *argv[]) {
     const char *input_filename = NULL;
-    const char *output_dir = NULL;
-    double delay = 0;
-    int workers = DEFAULT_WORKERS;
-    int timeout = DEFAULT_TIMEOUT;
-    bool overwrite = false;
+    const char *ssl_profile = NULL;
+    bool pack_store = false;
+    const char *manifest_path = NULL;
+    manifest_format_t manifest_format = MANIFEST_JSONL;
+    const char *journal_path = NULL;
+    bool resume = false;
+    journal_set_t *finished = NULL;
+    int stats_interval = 0;
+    const char *stats_path = NULL;
+    metrics_reporter_t *reporter = NULL;
+    result_format_t result_format = RESULT_OUTPUT_TEXT;
+    bool quiet = false;
+    const char *session_path = NULL;
+    int session_max_age = DEFAULT_SESSION_MAX_AGE;
+    const char *ports_list = NULL;
+    port_list_t ports = { NULL, 0 };
+    unsigned long long seed = (unsigned long long)time(NULL) ^ ((unsigned long long)getpid() << 32);
+    target_generator_t *generator = NULL;
+    const char *index_path = NULL;
+    int index_threads = DEFAULT_INDEX_THREADS;
+    const char *shard_spec = NULL;
+    const char *shard_weights = NULL;
+    shard_t shard;
+    int progress_interval = 0;
+    progress_reporter_t *progress_reporter = NULL;
+    bool autoscale = false;
+    int max_concurrency = 0;
+    const char *control_path = NULL;
+    const char *bind_list = NULL;
+    scan_config_t config = {
+        .output_dir = NULL,
+        .delay = 0,
+        .overwrite = false,
+        .store = NULL,
+        .dedup = NULL,
+        .index = NULL,
+        .format = CERT_FORMAT_PEM,
+        .chain = false,
+        .changed_only = false,
+        .manifest = NULL,
+        .journal = NULL,
+        .sessions = NULL,
+        .metrics = NULL,
+        .scheduler = NULL,
+        .results = NULL,
+        .progress = NULL,
+        .concurrency = NULL,
+        .workers = DEFAULT_WORKERS,
+        .engine = SCAN_ENGINE_THREADS,
+        .inflight = DEFAULT_INFLIGHT,
+        .readers = DEFAULT_READERS,
+        .tls = {
+            .ctx = NULL,
+            .timeout_ms = DEFAULT_TIMEOUT * 1000,
+            .connect_timeout_ms = 0,
+            .handshake_timeout_ms = 0,
+            .adaptive_multiplier = 0,
+            .connect_rtt = NULL,
+            .handshake_rtt = NULL,
+            .fast_cert = false,
+            .find_session = NULL,
+            .session_context = NULL
+        },
+        .dns = {
+            .threads = DEFAULT_DNS_THREADS,
+            .server = NULL,
+            .ttl_seconds = DEFAULT_DNS_TTL,
+            .cache_entries = DEFAULT_DNS_CACHE
+        },
+        .rate = {
+            .global_rate = 0,
+            .ip_rate = 0,
+            .prefix_rate = 0,
+            .prefix_len = DEFAULT_PREFIX_LEN,
+            .prefix6_len = DEFAULT_PREFIX6_LEN,
+            .retries = 0,
+            .retry_backoff_ms = DEFAULT_RETRY_BACKOFF_MS
+        }
+    };
+
+    if (argc > 1 && strcmp(argv[1], "extract") == 0) {
+        return extract_command(argc - 1, argv + 1, argv[0]);
+    }
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        return query_command(argc - 1, argv + 1, argv[0]);
+    }
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        return merge_command(argc - 1, argv + 1, argv[0]);
+    }
 
     // Parse command line arguments
     if (argc < 5) {
@@ -166,11 +603,11 @@ int main(int argc, char *argv[]) {
         if (strcmp(argv[i], "-if") == 0 && i + 1 < argc) {
             input_filename = argv[++i];
         } else if (strcmp(argv[i], "-od") == 0 && i + 1 < argc) {
-            output_dir = argv[++i];
+            config.output_dir = argv[++i];
         } else if (strcmp(argv[i], "-delay") == 0 && i + 1 < argc) {
             char *endptr;
-            delay = strtod(argv[++i], &endptr);
-            if (*endptr != '\0' || delay < 0) {
+            config.delay = strtod(argv[++i], &endptr);
+            if (*endptr != '\0' || config.delay < 0) {
                 fprintf(stderr, "Invalid delay value\n");
                 return EXIT_FAILURE;
             }
@@ -181,17 +618,258 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Invalid number of workers. Must be between 1 and %d.\n", MAX_WORKERS);
                 return EXIT_FAILURE;
             }
-            workers = (int)workers_long;
+            config.workers = (int)workers_long;
         } else if (strcmp(argv[i], "-timeout") == 0 && i + 1 < argc) {
-            char *endptr;
-            long timeout_long = strtol(argv[++i], &endptr, 10);
-            if (*endptr != '\0' || timeout_long <= 0 || timeout_long > INT_MAX) {
+            if (parse_duration(argv[++i], &config.tls.timeout_ms) != 0) {
                 fprintf(stderr, "Invalid timeout value\n");
                 return EXIT_FAILURE;
             }
-            timeout = (int)timeout_long;
+        } else if (strcmp(argv[i], "-connect-timeout") == 0 && i + 1 < argc) {
+            if (parse_duration(argv[++i], &config.tls.connect_timeout_ms) != 0) {
+                fprintf(stderr, "Invalid connect timeout value\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-handshake-timeout") == 0 && i + 1 < argc) {
+            if (parse_duration(argv[++i], &config.tls.handshake_timeout_ms) != 0) {
+                fprintf(stderr, "Invalid handshake timeout value\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-adaptive-timeout") == 0 && i + 1 < argc) {
+            char *endptr;
+            config.tls.adaptive_multiplier = strtod(argv[++i], &endptr);
+            if (*endptr != '\0' || !(config.tls.adaptive_multiplier >= 1.0) || config.tls.adaptive_multiplier > 100.0) {
+                fprintf(stderr, "Invalid adaptive timeout multiplier. Must be between 1 and 100.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-retries") == 0 && i + 1 < argc) {
+            char *endptr;
+            long retries_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || retries_long < 0 || retries_long > MAX_RETRIES) {
+                fprintf(stderr, "Invalid number of retries. Must be between 0 and %d.\n", MAX_RETRIES);
+                return EXIT_FAILURE;
+            }
+            config.rate.retries = (int)retries_long;
+        } else if (strcmp(argv[i], "-retry-backoff") == 0 && i + 1 < argc) {
+            if (parse_duration(argv[++i], &config.rate.retry_backoff_ms) != 0) {
+                fprintf(stderr, "Invalid retry backoff value\n");
+                return EXIT_FAILURE;
+            }
         } else if (strcmp(argv[i], "-overwrite") == 0) {
-            overwrite = true;
+            config.overwrite = true;
+        } else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc) {
+            const char *engine = argv[++i];
+            if (strcmp(engine, "threads") == 0) {
+                config.engine = SCAN_ENGINE_THREADS;
+            } else if (strcmp(engine, "epoll") == 0) {
+                config.engine = SCAN_ENGINE_EPOLL;
+            } else {
+                fprintf(stderr, "Invalid engine. Must be threads or epoll.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-inflight") == 0 && i + 1 < argc) {
+            char *endptr;
+            long inflight_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || inflight_long <= 0 || inflight_long > MAX_INFLIGHT) {
+                fprintf(stderr, "Invalid number of in-flight connections. Must be between 1 and %d.\n", MAX_INFLIGHT);
+                return EXIT_FAILURE;
+            }
+            config.inflight = (int)inflight_long;
+        } else if (strcmp(argv[i], "-ssl-profile") == 0 && i + 1 < argc) {
+            ssl_profile = argv[++i];
+        } else if (strcmp(argv[i], "-fast-cert") == 0) {
+            config.tls.fast_cert = true;
+        } else if (strcmp(argv[i], "-readers") == 0 && i + 1 < argc) {
+            char *endptr;
+            long readers_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || readers_long <= 0 || readers_long > MAX_READERS) {
+                fprintf(stderr, "Invalid number of readers. Must be between 1 and %d.\n", MAX_READERS);
+                return EXIT_FAILURE;
+            }
+            config.readers = (int)readers_long;
+        } else if (strcmp(argv[i], "-dns-threads") == 0 && i + 1 < argc) {
+            char *endptr;
+            long threads_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || threads_long <= 0 || threads_long > MAX_DNS_THREADS) {
+                fprintf(stderr, "Invalid number of DNS threads. Must be between 1 and %d.\n", MAX_DNS_THREADS);
+                return EXIT_FAILURE;
+            }
+            config.dns.threads = (int)threads_long;
+        } else if (strcmp(argv[i], "-dns-server") == 0 && i + 1 < argc) {
+            config.dns.server = argv[++i];
+        } else if (strcmp(argv[i], "-dns-ttl") == 0 && i + 1 < argc) {
+            char *endptr;
+            long ttl_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || ttl_long < 0 || ttl_long > INT_MAX) {
+                fprintf(stderr, "Invalid DNS TTL value\n");
+                return EXIT_FAILURE;
+            }
+            config.dns.ttl_seconds = (int)ttl_long;
+        } else if (strcmp(argv[i], "-dns-cache") == 0 && i + 1 < argc) {
+            char *endptr;
+            long cache_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || cache_long < 0 || cache_long > MAX_DNS_CACHE) {
+                fprintf(stderr, "Invalid DNS cache size. Must be between 0 and %d.\n", MAX_DNS_CACHE);
+                return EXIT_FAILURE;
+            }
+            config.dns.cache_entries = (int)cache_long;
+        } else if (strcmp(argv[i], "-store") == 0 && i + 1 < argc) {
+            const char *store = argv[++i];
+            if (strcmp(store, "files") == 0) {
+                pack_store = false;
+            } else if (strcmp(store, "pack") == 0) {
+                pack_store = true;
+            } else {
+                fprintf(stderr, "Invalid store. Must be files or pack.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-format") == 0 && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (strcmp(format, "pem") == 0) {
+                config.format = CERT_FORMAT_PEM;
+            } else if (strcmp(format, "der") == 0) {
+                config.format = CERT_FORMAT_DER;
+            } else {
+                fprintf(stderr, "Invalid format. Must be pem or der.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-chain") == 0) {
+            config.chain = true;
+        } else if (strcmp(argv[i], "-manifest") == 0 && i + 1 < argc) {
+            manifest_path = argv[++i];
+        } else if (strcmp(argv[i], "-manifest-format") == 0 && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (strcmp(format, "jsonl") == 0) {
+                manifest_format = MANIFEST_JSONL;
+            } else if (strcmp(format, "csv") == 0) {
+                manifest_format = MANIFEST_CSV;
+            } else {
+                fprintf(stderr, "Invalid manifest format. Must be jsonl or csv.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-journal") == 0 && i + 1 < argc) {
+            journal_path = argv[++i];
+        } else if (strcmp(argv[i], "-resume") == 0) {
+            resume = true;
+        } else if (strcmp(argv[i], "-stats-interval") == 0 && i + 1 < argc) {
+            char *endptr;
+            long interval_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || interval_long < 0 || interval_long > MAX_STATS_INTERVAL) {
+                fprintf(stderr, "Invalid stats interval. Must be between 0 and %d seconds.\n", MAX_STATS_INTERVAL);
+                return EXIT_FAILURE;
+            }
+            stats_interval = (int)interval_long;
+        } else if (strcmp(argv[i], "-stats-file") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "-output") == 0 && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (strcmp(format, "text") == 0) {
+                result_format = RESULT_OUTPUT_TEXT;
+            } else if (strcmp(format, "jsonl") == 0) {
+                result_format = RESULT_OUTPUT_JSONL;
+            } else if (strcmp(format, "binary") == 0) {
+                result_format = RESULT_OUTPUT_BINARY;
+            } else {
+                fprintf(stderr, "Invalid output format. Must be text, jsonl or binary.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-quiet") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[i], "-session-cache") == 0 && i + 1 < argc) {
+            session_path = argv[++i];
+        } else if (strcmp(argv[i], "-session-max-age") == 0 && i + 1 < argc) {
+            char *endptr;
+            long age_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || age_long < 0 || age_long > MAX_SESSION_MAX_AGE) {
+                fprintf(stderr, "Invalid session age. Must be between 0 and %d seconds.\n", MAX_SESSION_MAX_AGE);
+                return EXIT_FAILURE;
+            }
+            session_max_age = (int)age_long;
+        } else if (strcmp(argv[i], "-changed-only") == 0) {
+            config.changed_only = true;
+        } else if (strcmp(argv[i], "-max-rate") == 0 && i + 1 < argc) {
+            if (parse_rate(argv[++i], &config.rate.global_rate) != 0) {
+                fprintf(stderr, "Invalid maximum rate. Must be a positive number of connections per second.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-ip-rate") == 0 && i + 1 < argc) {
+            if (parse_rate(argv[++i], &config.rate.ip_rate) != 0) {
+                fprintf(stderr, "Invalid per-IP rate. Must be a positive number of connections per second.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-prefix-rate") == 0 && i + 1 < argc) {
+            if (parse_rate(argv[++i], &config.rate.prefix_rate) != 0) {
+                fprintf(stderr, "Invalid per-network rate. Must be a positive number of connections per second.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-ports") == 0 && i + 1 < argc) {
+            ports_list = argv[++i];
+            if (port_list_parse(ports_list, &ports) != 0) {
+                fprintf(stderr, "Invalid port list. Must be comma separated ports or ranges between 1 and 65535.\n");
+                return EXIT_FAILURE;
+            }
+            port_list_free(&ports);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            char *endptr;
+            const char *value = argv[++i];
+            seed = strtoull(value, &endptr, 10);
+            if (*endptr != '\0' || *value == '\0' || *value == '-') {
+                fprintf(stderr, "Invalid seed. Must be a non-negative integer.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-prefix-len") == 0 && i + 1 < argc) {
+            char *endptr;
+            long bits_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || bits_long < 1 || bits_long > 32) {
+                fprintf(stderr, "Invalid IPv4 prefix length. Must be between 1 and 32.\n");
+                return EXIT_FAILURE;
+            }
+            config.rate.prefix_len = (int)bits_long;
+        } else if (strcmp(argv[i], "-prefix6-len") == 0 && i + 1 < argc) {
+            char *endptr;
+            long bits_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || bits_long < 1 || bits_long > 128) {
+                fprintf(stderr, "Invalid IPv6 prefix length. Must be between 1 and 128.\n");
+                return EXIT_FAILURE;
+            }
+            config.rate.prefix6_len = (int)bits_long;
+        } else if (strcmp(argv[i], "-index") == 0 && i + 1 < argc) {
+            index_path = argv[++i];
+        } else if (strcmp(argv[i], "-index-threads") == 0 && i + 1 < argc) {
+            char *endptr;
+            long threads_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || threads_long <= 0 || threads_long > MAX_INDEX_THREADS) {
+                fprintf(stderr, "Invalid number of index threads. Must be between 1 and %d.\n", MAX_INDEX_THREADS);
+                return EXIT_FAILURE;
+            }
+            index_threads = (int)threads_long;
+        } else if (strcmp(argv[i], "-shard") == 0 && i + 1 < argc) {
+            shard_spec = argv[++i];
+        } else if (strcmp(argv[i], "-shard-weights") == 0 && i + 1 < argc) {
+            shard_weights = argv[++i];
+        } else if (strcmp(argv[i], "-progress") == 0 && i + 1 < argc) {
+            char *endptr;
+            long interval_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || interval_long < 0 || interval_long > MAX_STATS_INTERVAL) {
+                fprintf(stderr, "Invalid progress interval. Must be between 0 and %d seconds.\n", MAX_STATS_INTERVAL);
+                return EXIT_FAILURE;
+            }
+            progress_interval = (int)interval_long;
+        } else if (strcmp(argv[i], "-autoscale") == 0) {
+            autoscale = true;
+        } else if (strcmp(argv[i], "-max-concurrency") == 0 && i + 1 < argc) {
+            char *endptr;
+            long concurrency_long = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || concurrency_long <= 0 || concurrency_long > MAX_INFLIGHT) {
+                fprintf(stderr, "Invalid maximum concurrency. Must be between 1 and %d.\n", MAX_INFLIGHT);
+                return EXIT_FAILURE;
+            }
+            max_concurrency = (int)concurrency_long;
+        } else if (strcmp(argv[i], "-control") == 0 && i + 1 < argc) {
+            control_path = argv[++i];
+        } else if (strcmp(argv[i], "-bind") == 0 && i + 1 < argc) {
+            bind_list = argv[++i];
+        } else if (strcmp(argv[i], "-all-ips") == 0) {
+            config.dns.all_addresses = true;
         } else {
             print_usage(argv[0]);
             return EXIT_FAILURE;
@@ -199,60 +877,450 @@ int main(int argc, char *argv[]) {
     }
 
     // Check if required arguments are provided
-    if (!input_filename || !output_dir) {
+    if (!input_filename || !config.output_dir) {
         print_usage(argv[0]);
         return EXIT_FAILURE;
     }
+    if (resume && !journal_path) {
+        fprintf(stderr, "-resume needs the -journal of the run to resume.\n");
+        return EXIT_FAILURE;
+    }
+    if (config.changed_only && !session_path) {
+        fprintf(stderr, "-changed-only needs a -session-cache to compare against.\n");
+        return EXIT_FAILURE;
+    }
+    if (config.changed_only && session_max_age > MAX_CHANGED_ONLY_SESSION_AGE) {
+        if (session_max_age != DEFAULT_SESSION_MAX_AGE) {
+            fprintf(stderr, "-changed-only limits -session-max-age to %d seconds.\n", MAX_CHANGED_ONLY_SESSION_AGE);
+        }
+        session_max_age = MAX_CHANGED_ONLY_SESSION_AGE;
+    }
+    if (shard_weights && !shard_spec) {
+        fprintf(stderr, "-shard-weights needs the -shard this node scans.\n");
+        return EXIT_FAILURE;
+    }
+    // The concurrency -autoscale and -control change is the number of workers, or of epoll connections
+    int concurrency_start = config.engine == SCAN_ENGINE_EPOLL ? config.inflight : config.workers;
+    int concurrency_cap = config.engine == SCAN_ENGINE_EPOLL ? MAX_INFLIGHT : MAX_WORKERS;
+    if (max_concurrency && !autoscale && !control_path) {
+        fprintf(stderr, "-max-concurrency needs -autoscale or -control.\n");
+        return EXIT_FAILURE;
+    }
+    if (max_concurrency && (max_concurrency < concurrency_start || max_concurrency > concurrency_cap)) {
+        fprintf(stderr, "Invalid maximum concurrency. Must be between %d and %d.\n", concurrency_start, concurrency_cap);
+        return EXIT_FAILURE;
+    }
+    if (!max_concurrency) {
+        max_concurrency = concurrency_start <= concurrency_cap / CONCURRENCY_HEADROOM
+            ? concurrency_start * CONCURRENCY_HEADROOM : concurrency_cap;
+    }
+    char error_message[256];
+    if (bind_list) {
+        if (tls_conn_parse_sources(bind_list, &bind_sources, error_message, sizeof(error_message)) != 0) {
+            fprintf(stderr, "%s\n", error_message);
+            return EXIT_FAILURE;
+        }
+        config.tls.sources = &bind_sources;
+    }
+    if (shard_spec && shard_parse(shard_spec, shard_weights, &shard, error_message, sizeof(error_message)) != 0) {
+        fprintf(stderr, "%s\n", error_message);
+        return EXIT_FAILURE;
+    }
 
     // Create output directory if it doesn't exist
     struct stat st = {0};
-    if (stat(output_dir, &st) == -1) {
-        if (mkdir(output_dir, 0700) != 0) {
+    if (stat(config.output_dir, &st) == -1) {
+        if (mkdir(config.output_dir, 0700) != 0) {
             perror("Failed to create output directory");
             return EXIT_FAILURE;
         }
     }
 
+    // A server that closes mid-handshake must fail that connection, not kill the scan with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 prints the progress and SIGHUP rereads the -control file. Every thread keeps
+    // them blocked, and the thread reporting the progress or following the file waits for them.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (control_path) {
+        sigaddset(&signals, SIGHUP);
+    }
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // Serve OpenSSL's allocations from per-thread caches; this must come before its first allocation
+    if (!thread_cache_install()) {
+        fprintf(stderr, "Failed to install the OpenSSL allocator, using malloc\n");
+    }
+
     // Initialize OpenSSL
     if (OPENSSL_init_ssl(0, NULL) == 0) {
         fprintf(stderr, "Failed to initialize OpenSSL\n");
         return EXIT_FAILURE;
     }
 
+    int status = EXIT_FAILURE;
+    input_reader_t *reader = NULL;
+    resolver_t *resolver = NULL;
+
+    // Build the SSL context shared by every connection
+    config.tls.ctx = create_ssl_context(ssl_profile, error_message, sizeof(error_message));
+    if (!config.tls.ctx) {
+        fprintf(stderr, "%s\n", error_message);
+        goto cleanup;
+    }
+
+    // Load the fingerprints of the certificates already saved, unless they are to be overwritten
+    config.dedup = cert_dedup_create();
+    if (!config.dedup) {
+        fprintf(stderr, "Failed to allocate the certificate fingerprint set\n");
+        goto cleanup;
+    }
+    if (!config.overwrite) {
+        int seeded = cert_dedup_seed(config.dedup, config.output_dir, config.workers);
+        if (seeded < 0) {
+            perror("Failed to read output directory");
+        } else if (seeded > 0) {
+            fprintf(stderr, "Loaded %d existing certificate fingerprints from %s\n", seeded, config.output_dir);
+        }
+    }
+
+    // Start the threads that parse new certificates into the index
+    if (index_path) {
+        config.index = cert_index_open(index_path, index_threads, error_message, sizeof(error_message));
+        if (!config.index) {
+            fprintf(stderr, "%s\n", error_message);
+            goto cleanup;
+        }
+    }
+
+    // Open the pack store and start its writer
+    if (pack_store) {
+        config.store = cert_store_open(config.output_dir, error_message, sizeof(error_message));
+        if (!config.store) {
+            fprintf(stderr, "%s\n", error_message);
+            goto cleanup;
+        }
+    }
+
+    // Open the manifest
+    if (manifest_path) {
+        config.manifest = manifest_open(manifest_path, manifest_format);
+        if (!config.manifest) {
+            perror("Failed to open manifest");
+            goto cleanup;
+        }
+    }
+
+    // Load the targets an earlier run finished, then open the journal to record this run's
+    if (journal_path) {
+        if (resume) {
+            finished = journal_load(journal_path, error_message, sizeof(error_message));
+            if (finished) {
+                fprintf(stderr, "Loaded %zu finished targets from %s\n", journal_set_count(finished), journal_path);
+            }
+        }
+        config.journal = !resume || finished ? journal_open(journal_path, error_message, sizeof(error_message)) : NULL;
+        if (!config.journal) {
+            fprintf(stderr, "%s\n", error_message);
+            goto cleanup;
+        }
+        journal_set_sync(config.journal, sync_outputs, &config);
+    }
+
+    // Load the sessions and leaf fingerprints the previous run saved
+    if (session_path) {
+        config.sessions = session_cache_load(session_path, session_max_age, error_message, sizeof(error_message));
+        if (!config.sessions || !tls_conn_capture_sessions(config.tls.ctx)) {
+            fprintf(stderr, "%s\n", config.sessions ? "Failed to set up session capture" : error_message);
+            goto cleanup;
+        }
+        config.tls.find_session = find_saved_session;
+        config.tls.session_context = config.sessions;
+    }
+
+    // Start the writer that every worker hands its results to
+    config.results = result_stream_open(STDOUT_FILENO, result_format, quiet);
+    if (!config.results) {
+        fprintf(stderr, "Failed to start the result writer\n");
+        goto cleanup;
+    }
+
     // Open input file
-    input_file = open_input_file(input_filename);
-    if (!input_file) {
+    input_source = open_input_source(input_filename);
+    if (!input_source) {
         perror("Failed to open input file");
-        return EXIT_FAILURE;
+        goto cleanup;
     }
 
-    // Create and start worker threads
-    pthread_t threads[MAX_WORKERS];
-    worker_data_t data[MAX_WORKERS];
+    // Start the input and resolver stages feeding the workers
+    if (target_queue_init(&parsed_queue, PARSED_QUEUE_CAPACITY) != 0 ||
+        target_queue_init(&resolved_queue, RESOLVED_QUEUE_CAPACITY) != 0 ||
+        (scheduler = scheduler_create(&config.rate, &resolved_queue)) == NULL) {
+        fprintf(stderr, "Failed to allocate the target queues\n");
+        goto cleanup;
+    }
 
-    for (int i = 0; i < workers; i++) {
-        data[i].worker_id = i + 1;
-        data[i].output_dir = output_dir;
-        data[i].delay = delay;
-        data[i].timeout = timeout;
-        data[i].overwrite = overwrite;
-        if (pthread_create(&threads[i], NULL, worker_thread, &data[i]) != 0) {
-            perror("Failed to create thread");
-            fclose(input_file);
-            return EXIT_FAILURE;
+    // Address ranges and port lists are expanded lazily as the readers reach them
+    if (ports_list && port_list_parse(ports_list, &ports) != 0) {
+        ports_list = NULL;
+    }
+    generator = target_generator_create(ports_list ? &ports : NULL, seed);
+    port_list_free(&ports);
+    reader = generator ? input_reader_start(input_source, config.readers, &parsed_queue, finished, generator,
+                                            shard_spec ? &shard : NULL) : NULL;
+    resolver = reader ? resolver_start(&config.dns, &parsed_queue, &resolved_queue) : NULL;
+    if (!resolver) {
+        goto cleanup;
+    }
+
+    status = EXIT_SUCCESS;
+
+    // Each worker records its own phase latencies; they are merged for the reports
+    config.scheduler = scheduler;
+
+    // The delay before racing another address follows the connect times of this run, and so
+    // do adaptive timeouts, along with the handshake times
+    config.tls.connect_rtt = rtt_estimator_create();
+    if (!config.tls.connect_rtt) {
+        fprintf(stderr, "Failed to allocate the connect time estimator, continuing with fixed delays and timeouts\n");
+    } else if (config.tls.adaptive_multiplier > 0) {
+        config.tls.handshake_rtt = rtt_estimator_create();
+        if (!config.tls.handshake_rtt) {
+            fprintf(stderr, "Failed to allocate the handshake time estimator, continuing with fixed timeouts\n");
+            config.tls.adaptive_multiplier = 0;
+        }
+    }
+
+    config.metrics = metrics_create();
+    if (!config.metrics) {
+        fprintf(stderr, "Failed to allocate the scan metrics, continuing without them\n");
+    } else if (stats_interval > 0) {
+        reporter = metrics_reporter_start(config.metrics, stats_interval, stats_path);
+        if (!reporter) {
+            fprintf(stderr, "Failed to start the stats reporter\n");
+        }
+    }
+
+    // Count the targets done for the progress reports and the concurrency controller
+    config.progress = progress_create(concurrency_start);
+    if (!config.progress) {
+        fprintf(stderr, "Failed to allocate the progress counters, continuing without progress reports\n");
+    } else if ((progress_reporter = progress_reporter_start(config.progress, progress_interval, &resolved_queue)) == NULL) {
+        fprintf(stderr, "Failed to start the progress reporter\n");
+    }
+    if (autoscale || control_path) {
+        concurrency_options_t concurrency_options = {
+            .initial = concurrency_start,
+            // Each event loop keeps at least one connection
+            .minimum = config.engine != SCAN_ENGINE_EPOLL ? 1 : config.workers < config.inflight ? config.workers : config.inflight,
+            .maximum = max_concurrency,
+            .autoscale = autoscale,
+            .control_path = control_path
+        };
+        config.concurrency = concurrency_create(&concurrency_options, config.progress);
+        if (!config.concurrency || concurrency_controller_start(config.concurrency) != 0) {
+            fprintf(stderr, "Failed to start the concurrency controller, continuing at a fixed concurrency\n");
+            concurrency_free(config.concurrency);
+            config.concurrency = NULL;
+        }
+    }
+
+    if (config.engine == SCAN_ENGINE_EPOLL) {
+        if (run_epoll_engine(&config, scheduler) != 0) {
+            status = EXIT_FAILURE;
+        }
+    } else {
+        // Start a worker for each connection the limit allows, and more whenever it rises
+        int maximum = config.concurrency ? concurrency_maximum(config.concurrency) : config.workers;
+        pthread_t *threads = calloc((size_t)maximum, sizeof(*threads));
+        worker_data_t *data = calloc((size_t)maximum, sizeof(*data));
+        int wanted = config.workers;
+        int started = 0;
+
+        if (!threads || !data) {
+            fprintf(stderr, "Failed to allocate the workers\n");
+            status = EXIT_FAILURE;
+            wanted = 0;
+        }
+        while (started < wanted) {
+            for (; started < wanted; started++) {
+                data[started].worker_id = started + 1;
+                data[started].config = &config;
+                if (pthread_create(&threads[started], NULL, worker_thread, &data[started]) != 0) {
+                    perror("Failed to create thread");
+                    status = EXIT_FAILURE;
+                    break;
+                }
+            }
+            if (started < wanted || !config.concurrency) {
+                break;
+            }
+            wanted = concurrency_wait_above(config.concurrency, started);
+        }
+
+        // Wait for all threads to complete
+        for (int i = 0; i < started; i++) {
+            if (pthread_join(threads[i], NULL) != 0) {
+                perror("Failed to join thread");
+            }
         }
+        free(threads);
+        free(data);
     }
 
-    // Wait for all threads to complete
-    for (int i = 0; i < workers; i++) {
-        if (pthread_join(threads[i], NULL) != 0) {
-            perror("Failed to join thread");
+    if (reporter) {
+        metrics_reporter_stop(reporter);
+    }
+    if (progress_reporter) {
+        progress_reporter_stop(progress_reporter);
+    }
+    int final_concurrency = 0;
+    if (config.concurrency) {
+        concurrency_controller_stop(config.concurrency);
+        final_concurrency = concurrency_limit(config.concurrency);
+    }
+    if (result_stream_close(config.results) != 0) {
+        status = EXIT_FAILURE;
+    }
+    config.results = NULL;
+
+    // Stop the input and resolver stages if the workers gave up early
+    target_queue_close(&resolved_queue);
+    target_queue_close(&parsed_queue);
+    resolver_join(resolver);
+    size_t skipped = input_reader_skipped(reader);
+    size_t other_shards = input_reader_other_shards(reader);
+    input_reader_join(reader);
+    reader = NULL;
+    uint64_t generated = target_generator_count(generator);
+    unsigned long long deferrals = scheduler_deferrals(scheduler);
+    unsigned long long retries = scheduler_retries(scheduler);
+
+    // Flush the pack store, or the names of the certificate files, and the manifest, and write
+    // the index once its threads are done. The journal's last records are only written after
+    // them, so it no longer needs to sync them.
+    if (config.journal) {
+        journal_set_sync(config.journal, NULL, NULL);
+    }
+    if (config.journal && !config.store && sync_directory(config.output_dir) != 0) {
+        fprintf(stderr, "Failed to sync %s: %s\n", config.output_dir, strerror(errno));
+        status = EXIT_FAILURE;
+    }
+    if (config.store && cert_store_close(config.store) != 0) {
+        status = EXIT_FAILURE;
+    }
+    config.store = NULL;
+    cert_index_stats_t index_stats;
+    if (config.index && cert_index_close(config.index, &index_stats) != 0) {
+        status = EXIT_FAILURE;
+    }
+    config.index = NULL;
+    if (config.manifest && manifest_close(config.manifest) != 0) {
+        fprintf(stderr, "Failed to write manifest %s\n", manifest_path);
+        status = EXIT_FAILURE;
+    }
+    config.manifest = NULL;
+    if (config.journal && journal_close(config.journal) != 0) {
+        fprintf(stderr, "Failed to write journal %s\n", journal_path);
+        status = EXIT_FAILURE;
+    }
+    config.journal = NULL;
+    session_cache_stats_t session_stats;
+    if (config.sessions) {
+        session_cache_get_stats(config.sessions, &session_stats);
+        if (session_cache_save(config.sessions, session_path, error_message, sizeof(error_message)) != 0) {
+            fprintf(stderr, "%s\n", error_message);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    // Print the run summary; it stays out of the way of machine-readable results
+    FILE *summary_out = result_format == RESULT_OUTPUT_TEXT ? stdout : stderr;
+    cert_dedup_stats_t stats;
+    char summary[MAX_RESULT_LENGTH];
+    cert_dedup_get_stats(config.dedup, &stats);
+    snprintf(summary, sizeof(summary),
+             "Summary: %zu certificates received, %zu new, %zu already saved (%.1f%% dedup hit rate)",
+             stats.checked, stats.checked - stats.hits, stats.hits,
+             stats.checked ? 100.0 * (double)stats.hits / (double)stats.checked : 0.0);
+    fprintf(summary_out, "%s\n", summary);
+    if (generated > 0) {
+        fprintf(summary_out, "Expanded address ranges into %llu targets (seed %llu)\n",
+                (unsigned long long)generated, seed);
+    }
+    if (deferrals > 0) {
+        fprintf(summary_out, "Rate limits held back %llu targets\n", deferrals);
+    }
+    if (retries > 0) {
+        fprintf(summary_out, "Retried %llu failed attempts\n", retries);
+    }
+    if (resume) {
+        fprintf(summary_out, "Skipped %zu targets finished in an earlier run\n", skipped);
+    }
+    if (shard_spec) {
+        fprintf(summary_out, "Shard %u/%u (weight %u of %llu): left %zu targets to the other shards\n",
+                shard.index + 1, shard.count, shard.weight, (unsigned long long)shard.total_weight, other_shards);
+    }
+    if (config.sessions) {
+        fprintf(summary_out, "Sessions: %zu resumed of %zu offered, %zu certificates changed since the last run\n",
+                session_stats.resumed, session_stats.offered, session_stats.changed);
+    }
+    if (tls_conn_fallback_count() > 0) {
+        fprintf(summary_out, "Happy eyeballs: %llu connections reached their host through another address than its first\n",
+                tls_conn_fallback_count());
+    }
+    if (config.concurrency) {
+        fprintf(summary_out, "Concurrency: started at %d, ended at %d, at most %d\n",
+                concurrency_start, final_concurrency, concurrency_maximum(config.concurrency));
+    }
+    if (index_path) {
+        fprintf(summary_out, "Index: %zu certificates analysed, %zu unreadable, %zu in %s\n",
+                index_stats.analysed, index_stats.failed, index_stats.indexed, index_path);
+    }
+    // Allocation counts are for benchmarking, so they come with the other scan metrics
+    thread_cache_stats_t alloc_stats;
+    thread_cache_get_stats(&alloc_stats);
+    if ((stats_interval > 0 || stats_path) && alloc_stats.connections > 0 && alloc_stats.allocations > 0) {
+        fprintf(summary_out, "Allocations: %.1f per connection by OpenSSL, %.1f of them from malloc\n",
+                (double)alloc_stats.allocations / (double)alloc_stats.connections,
+                (double)alloc_stats.heap_allocations / (double)alloc_stats.connections);
+    }
+    if (config.metrics) {
+        metrics_report(config.metrics, summary_out);
+        if (stats_path && metrics_write_prometheus(config.metrics, stats_path) != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", stats_path, strerror(errno));
+            status = EXIT_FAILURE;
         }
     }
 
-    // Clean up
-    fclose(input_file);
+cleanup:
+    // Release in the reverse order of setup; a failed setup step leaves the later handles NULL
+    if (config.metrics) metrics_free(config.metrics);
+    if (config.progress) progress_free(config.progress);
+    concurrency_free(config.concurrency);
+    rtt_estimator_free(config.tls.handshake_rtt);
+    rtt_estimator_free(config.tls.connect_rtt);
+    if (reader) {
+        target_queue_close(&parsed_queue);
+        input_reader_join(reader);
+    }
+    target_generator_free(generator);
+    if (scheduler) scheduler_free(scheduler);
+    target_queue_destroy(&resolved_queue);
+    target_queue_destroy(&parsed_queue);
+    if (input_source) close_input_source(input_source);
+    if (config.results) result_stream_close(config.results);
+    session_cache_free(config.sessions);
+    if (config.journal) journal_close(config.journal);
+    if (finished) journal_set_free(finished);
+    if (config.manifest) manifest_close(config.manifest);
+    if (config.store) cert_store_close(config.store);
+    if (config.index) cert_index_close(config.index, NULL);
+    if (config.dedup) cert_dedup_free(config.dedup);
+    SSL_CTX_free(config.tls.ctx);
     OPENSSL_cleanup();
 
-    return EXIT_SUCCESS;
+    return status;
 }
@@ -0,0 +1,302 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "epoll_engine.h"
+#include "conn_loop.h"
+#include "get_certificate.h"
+#include "tls_conn.h"
+#include "utils.h"
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+// File descriptors kept free for the output directory, stdio and OpenSSL
+#define RESERVED_FDS 32
+// Connections per file descriptor set aside for racing addresses (Happy Eyeballs)
+#define CONNS_PER_RACE_FD 8
+// How long an idle loop waits for the resolver stage before re-checking its state
+#define IDLE_WAIT_MS 100
+
+// State owned by a single event-loop thread
+typedef struct {
+    worker_context_t worker;
+    arena_t arena;
+    const scan_config_t *config;
+    const tls_conn_options_t *tls;
+    scheduler_t *scheduler;
+    int index;
+    int loops;
+    int capacity;
+    bool input_done;
+    conn_loop_t driver;
+    tls_conn_t *conns;
+    int *registered_fd;
+    int *free_slots;
+    long long next_start_ms;
+} epoll_loop_t;
+
+/**
+ * Report the outcome of a finished connection; the driver then frees its slot.
+ *
+ * @param context The event loop
+ * @param slot The connection slot
+ * @param conn The connection
+ */
+static void finish_conn(void *context, int slot, tls_conn_t *conn) {
+    epoll_loop_t *loop = (epoll_loop_t *)context;
+    char result_message[MAX_RESULT_LENGTH];
+
+    (void)slot;
+    complete_certificate_download(conn, loop->config, &loop->worker, result_message, sizeof(result_message));
+}
+
+/**
+ * Check whether the loop may start another connection: it has a free slot and its
+ * part of the concurrency limit, which may have changed since, is not used up.
+ *
+ * @param loop The event loop
+ * @return true if another connection may start
+ */
+static bool has_room(const epoll_loop_t *loop) {
+    int active = conn_loop_active(&loop->driver);
+    if (active == loop->capacity) {
+        return false;
+    }
+    // A loop always runs at least one connection, so it keeps taking targets until the input ends
+    return !loop->config->concurrency || active == 0 ||
+           active < concurrency_share(loop->config->concurrency, loop->index, loop->loops);
+}
+
+/**
+ * Start new connections until the loop is at capacity or the input runs out.
+ *
+ * @param loop The event loop
+ */
+static void fill_slots(epoll_loop_t *loop) {
+    target_t target;
+
+    while (!loop->input_done && has_room(loop)) {
+        // With a delay, connections are started one at a time at that interval
+        long long now = monotonic_ms();
+        if (loop->config->delay > 0) {
+            if (now < loop->next_start_ms) {
+                break;
+            }
+            loop->next_start_ms = now + (long long)(loop->config->delay * 1000);
+        }
+
+        // Only wait for a target the rate limits allow when there is nothing else to drive
+        int rc = scheduler_next(loop->scheduler, &target, conn_loop_active(&loop->driver) == 0 ? IDLE_WAIT_MS : 0);
+        if (rc < 0) {
+            loop->input_done = true;
+            break;
+        }
+        if (rc == 0) {
+            break;
+        }
+
+        progress_start(loop->config->progress);
+        conn_loop_start(&loop->driver, conn_loop_acquire(&loop->driver), loop->tls, &target);
+    }
+}
+
+/**
+ * Event-loop thread function.
+ * Keeps up to capacity connections in flight and drives them all from one epoll set.
+ *
+ * @param arg Pointer to epoll_loop_t structure
+ * @return NULL
+ */
+static void *event_loop_thread(void *arg) {
+    epoll_loop_t *loop = (epoll_loop_t *)arg;
+
+    fill_slots(loop);
+
+    while (conn_loop_active(&loop->driver) > 0 || !loop->input_done) {
+        // With room for more, wake in time for the next start
+        int wait_ms = -1;
+        if (!loop->input_done && has_room(loop)) {
+            long long now = monotonic_ms();
+            wait_ms = loop->next_start_ms > now ? (int)(loop->next_start_ms - now) : 0;
+        }
+
+        if (conn_loop_poll(&loop->driver, wait_ms) != 0) {
+            perror("epoll_wait failed");
+            conn_loop_abort(&loop->driver);
+            break;
+        }
+
+        fill_slots(loop);
+    }
+
+    char message[64];
+    snprintf(message, sizeof(message), "Worker %d: finished.", loop->worker.id);
+    result_buffer_text(loop->worker.results, message);
+    result_buffer_flush(loop->worker.results);
+
+    return NULL;
+}
+
+/**
+ * Raise the open file limit as far as allowed and clamp the in-flight limit to it. A connection
+ * holds one file descriptor, and one more for each address it races against the first, so
+ * some are kept for racing on top of one per connection.
+ *
+ * @param inflight The requested number of concurrent connections
+ * @param race_fds Set to the file descriptors left for racing, or -1 for no limit
+ * @return The number of concurrent connections that fit in the file limit
+ */
+static int fit_inflight_to_fd_limit(int inflight, int *race_fds) {
+    struct rlimit rl;
+    *race_fds = -1;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return inflight;
+    }
+
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY) {
+        return inflight;
+    }
+
+    long long available = rl.rlim_cur > RESERVED_FDS ? (long long)(rl.rlim_cur - RESERVED_FDS) : 0;
+    long long wanted = (long long)inflight + inflight / CONNS_PER_RACE_FD;
+    int fitted = inflight;
+    if (wanted > available) {
+        fitted = (int)(available * CONNS_PER_RACE_FD / (CONNS_PER_RACE_FD + 1));
+        if (fitted < 1) fitted = 1;
+        fprintf(stderr, "Open file limit is %llu, reducing in-flight connections from %d to %d\n",
+                (unsigned long long)rl.rlim_cur, inflight, fitted);
+    }
+    long long left = available - fitted;
+    *race_fds = left > INT_MAX ? INT_MAX : (int)(left > 0 ? left : 0);
+    return fitted;
+}
+
+/**
+ * Release the resources of an event loop.
+ *
+ * @param loop The event loop
+ */
+static void destroy_loop(epoll_loop_t *loop) {
+    conn_loop_destroy(&loop->driver);
+    free(loop->conns);
+    free(loop->registered_fd);
+    free(loop->free_slots);
+    arena_destroy(&loop->arena);
+}
+
+/**
+ * Allocate the connection slots and epoll set of an event loop.
+ *
+ * @param loop The event loop to initialise
+ * @return 0 on success, -1 on failure
+ */
+static int init_loop(epoll_loop_t *loop) {
+    arena_init(&loop->arena, WORKER_ARENA_SIZE);
+    loop->worker.arena = &loop->arena;
+    loop->conns = calloc((size_t)loop->capacity, sizeof(*loop->conns));
+    loop->registered_fd = malloc((size_t)loop->capacity * sizeof(*loop->registered_fd));
+    loop->free_slots = malloc((size_t)loop->capacity * sizeof(*loop->free_slots));
+    if (!loop->conns || !loop->registered_fd || !loop->free_slots) {
+        return -1;
+    }
+    return conn_loop_init(&loop->driver, loop->capacity, loop->conns, loop->registered_fd, loop->free_slots,
+                          finish_conn, loop);
+}
+
+/**
+ * Scan every target from the resolver stage using event-loop threads.
+ * The in-flight limit is split evenly across config->workers loops. With a
+ * concurrency limit that may change, each loop has slots for its part of the
+ * maximum and uses those its part of the current limit allows.
+ *
+ * @param config The scan settings
+ * @param scheduler The rate-limiting scheduler handing out resolved targets
+ * @return 0 on success, -1 on failure
+ */
+int run_epoll_engine(const scan_config_t *config, scheduler_t *scheduler) {
+    int loops = config->workers;
+    int requested = config->concurrency ? concurrency_maximum(config->concurrency) : config->inflight;
+    int race_limit;
+    int inflight = fit_inflight_to_fd_limit(requested, &race_limit);
+    int ret = -1;
+
+    // Every loop's connections race addresses out of the same descriptors
+    atomic_int race_fds;
+    atomic_init(&race_fds, race_limit);
+    tls_conn_options_t tls = config->tls;
+    tls.race_fds = race_limit >= 0 ? &race_fds : NULL;
+
+    if (config->concurrency) {
+        if (inflight < requested) {
+            concurrency_set_maximum(config->concurrency, inflight);
+        }
+    } else {
+        progress_set_limit(config->progress, inflight);
+    }
+
+    if (inflight < loops) {
+        loops = inflight;
+    }
+
+    epoll_loop_t *data = calloc((size_t)loops, sizeof(*data));
+    pthread_t *threads = calloc((size_t)loops, sizeof(*threads));
+    int started = 0;
+    if (!data || !threads) {
+        fprintf(stderr, "Failed to allocate event loops\n");
+        goto cleanup;
+    }
+
+    for (int i = 0; i < loops; i++) {
+        data[i].driver.epoll_fd = -1;
+    }
+    for (int i = 0; i < loops; i++) {
+        data[i].worker.id = i + 1;
+        data[i].worker.metrics = config->metrics ? metrics_shard(config->metrics) : NULL;
+        data[i].worker.results = config->results ? result_stream_buffer(config->results) : NULL;
+        data[i].config = config;
+        data[i].tls = &tls;
+        data[i].scheduler = scheduler;
+        data[i].index = i;
+        data[i].loops = loops;
+        data[i].capacity = inflight / loops + (i < inflight % loops ? 1 : 0);
+        if (init_loop(&data[i]) != 0) {
+            fprintf(stderr, "Failed to initialise event loop %d\n", i + 1);
+            goto cleanup;
+        }
+    }
+
+    for (; started < loops; started++) {
+        if (pthread_create(&threads[started], NULL, event_loop_thread, &data[started]) != 0) {
+            perror("Failed to create thread");
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    // Wait for all threads to complete
+    for (int i = 0; i < started; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            perror("Failed to join thread");
+        }
+    }
+    if (data) {
+        for (int i = 0; i < loops; i++) {
+            destroy_loop(&data[i]);
+        }
+    }
+    free(data);
+    free(threads);
+
+    return ret;
+}
@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "fingerprint.h"
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Most certificates fit; the buffer grows for the rare larger one and stays grown
+#define INITIAL_DER_CAPACITY 4096
+
+// What a thread reuses for every certificate it fingerprints
+typedef struct {
+    EVP_MD_CTX *ctx;
+    unsigned char *der;
+    size_t der_capacity;
+} fingerprint_state_t;
+
+static __thread fingerprint_state_t *local_state;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t state_key;
+// Fetched once, so initialising a digest does not look the algorithm up again
+static EVP_MD *sha256_md;
+
+static void release_state(void *arg) {
+    fingerprint_state_t *state = arg;
+    EVP_MD_CTX_free(state->ctx);
+    free(state->der);
+    free(state);
+    local_state = NULL;
+}
+
+static void init_fingerprint(void) {
+    pthread_key_create(&state_key, release_state);
+    sha256_md = EVP_MD_fetch(NULL, "SHA2-256", NULL);
+}
+
+/**
+ * Get the calling thread's digest context and DER buffer, creating them on first use.
+ *
+ * @return The state, or NULL on failure
+ */
+static fingerprint_state_t *get_state(void) {
+    if (local_state) {
+        return local_state;
+    }
+
+    pthread_once(&init_once, init_fingerprint);
+    if (!sha256_md) {
+        return NULL;
+    }
+    fingerprint_state_t *state = calloc(1, sizeof(*state));
+    if (!state || !(state->ctx = EVP_MD_CTX_new())) {
+        free(state);
+        return NULL;
+    }
+    pthread_setspecific(state_key, state);
+    local_state = state;
+    return state;
+}
+
+/**
+ * Hash bytes with the thread's reusable context.
+ *
+ * @param state The thread's state
+ * @param data The bytes
+ * @param length Number of bytes
+ * @param digest Receives the SHA-256
+ * @return true on success
+ */
+static bool digest_with(fingerprint_state_t *state, const unsigned char *data, size_t length,
+                        unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    unsigned int digest_length = 0;
+    return EVP_DigestInit_ex2(state->ctx, sha256_md, NULL) == 1 &&
+           EVP_DigestUpdate(state->ctx, data, length) == 1 &&
+           EVP_DigestFinal_ex(state->ctx, digest, &digest_length) == 1 &&
+           digest_length == SHA256_DIGEST_LENGTH;
+}
+
+/**
+ * DER-encode a certificate into the thread's buffer and hash it.
+ *
+ * @param state The thread's state
+ * @param cert The certificate
+ * @param digest Receives the fingerprint
+ * @return true on success
+ */
+static bool digest_cert_with(fingerprint_state_t *state, X509 *cert, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    int length = i2d_X509(cert, NULL);
+    if (length <= 0) {
+        return false;
+    }
+    if ((size_t)length > state->der_capacity) {
+        size_t capacity = state->der_capacity ? state->der_capacity : INITIAL_DER_CAPACITY;
+        while (capacity < (size_t)length) {
+            capacity *= 2;
+        }
+        unsigned char *grown = realloc(state->der, capacity);
+        if (!grown) {
+            return false;
+        }
+        state->der = grown;
+        state->der_capacity = capacity;
+    }
+
+    unsigned char *end = state->der;
+    return i2d_X509(cert, &end) == length && digest_with(state, state->der, (size_t)length, digest);
+}
+
+/**
+ * Compute the SHA-256 of some bytes, such as an encoded certificate, without
+ * allocating a digest context per call.
+ *
+ * @param data The bytes
+ * @param length Number of bytes
+ * @param digest Receives the SHA-256
+ * @return true on success
+ */
+bool fingerprint_bytes(const unsigned char *data, size_t length, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    fingerprint_state_t *state = get_state();
+    return state && digest_with(state, data, length, digest);
+}
+
+/**
+ * Compute a certificate's fingerprint: the SHA-256 of its DER encoding, the same value
+ * as X509_digest, encoded into a buffer the thread keeps.
+ *
+ * @param cert The certificate
+ * @param digest Receives the fingerprint
+ * @return true on success
+ */
+bool fingerprint_cert(X509 *cert, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    fingerprint_state_t *state = get_state();
+    return state && digest_cert_with(state, cert, digest);
+}
+
+/**
+ * Fingerprint several certificates at once, such as a server's chain.
+ * A certificate that cannot be encoded gets an all-zero fingerprint.
+ *
+ * @param certs The certificates
+ * @param count Number of certificates
+ * @param digests Receives one fingerprint per certificate
+ * @param valid Receives whether each fingerprint was computed, or NULL
+ * @return The number of certificates fingerprinted
+ */
+size_t fingerprint_batch(X509 *const *certs, size_t count, unsigned char (*digests)[SHA256_DIGEST_LENGTH],
+                         bool *valid) {
+    fingerprint_state_t *state = get_state();
+    size_t done = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        bool ok = state && digest_cert_with(state, certs[i], digests[i]);
+        if (!ok) {
+            memset(digests[i], 0, SHA256_DIGEST_LENGTH);
+        }
+        if (valid) {
+            valid[i] = ok;
+        }
+        done += ok;
+    }
+    return done;
+}
@@ -3,182 +3,391 @@
 #include "get_certificate.h"
 #include "save_certificate.h"
 #include "utils.h"
-#include <openssl/bio.h>
+#include "resolver.h"
+#include "thread_cache.h"
+#include "fingerprint.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
-#include <sys/select.h>
-#include <unistd.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 
+// Most certificates a manifest entry records for one host, leaf included
+#define MAX_CHAIN_CERTS 16
+
 /**
- * Wait for a BIO to become ready for reading or writing.
+ * Wait for a connection's socket to become ready for what its state machine needs.
  *
- * @param bio The BIO to wait for
- * @param timeout The maximum time to wait in seconds
- * @param for_read If non-zero, wait for read, otherwise wait for write
- * @return >0 if the BIO is ready, 0 on timeout, <0 on error
+ * @param conn The connection to wait for
+ * @return >0 if the socket is ready, 0 on timeout, <0 on error
  */
-static int wait_for_bio(BIO *bio, int timeout, int for_read) {
-    int fd = BIO_get_fd(bio, NULL);
-    if (fd < 0) return -1;
-
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
+static int wait_for_conn(const tls_conn_t *conn) {
+    long long remaining = conn->deadline_ms - monotonic_ms();
+    if (remaining <= 0) return 0;
 
-    struct timeval tv = {
-        .tv_sec = timeout,
-        .tv_usec = 0
+    struct pollfd pfd = {
+        .fd = conn->fd,
+        .events = (conn->want & TLS_CONN_WANT_READ) ? POLLIN : POLLOUT
     };
 
-    if (for_read) {
-        return select(fd + 1, &fds, NULL, NULL, &tv);
-    } else {
-        return select(fd + 1, NULL, &fds, NULL, &tv);
+    return poll(&pfd, 1, (int)remaining);
+}
+
+/**
+ * Name a connection outcome for the manifest.
+ *
+ * @param error The connection's error
+ * @return The outcome name
+ */
+static const char *outcome_name(tls_conn_error_t error) {
+    switch (error) {
+        case TLS_CONN_OK:            return "ok";
+        case TLS_CONN_ERR_DNS:       return "dns";
+        case TLS_CONN_ERR_CONNECT:   return "connect";
+        case TLS_CONN_ERR_TIMEOUT:   return "timeout";
+        case TLS_CONN_ERR_HANDSHAKE: return "handshake";
+        case TLS_CONN_ERR_STARTTLS:  return "starttls";
+        default:                     return "internal";
     }
 }
 
 /**
- * Download a certificate from a given hostname and port.
+ * Classify a connection's outcome for the metrics, telling refused connections
+ * apart from other connect failures.
  *
- * @param hostname The hostname to connect to
- * @param port The port to connect to
- * @param output_dir The directory to save the certificate
- * @param result_message Buffer to store the result message
- * @param max_length Maximum length of the result message
- * @param timeout Connection timeout in seconds
- * @return 0 on success, -1 on failure
+ * @param conn The finished connection
+ * @return The outcome class
  */
-int download_certificate(const char *hostname, const char *port, const char *output_dir,
-                         char *result_message, size_t max_length, int timeout, bool overwrite, int worker_id) {
+static metric_outcome_t metric_outcome(const tls_conn_t *conn) {
+    switch (conn->error) {
+        case TLS_CONN_OK:            return METRIC_OUTCOME_OK;
+        case TLS_CONN_ERR_DNS:       return METRIC_OUTCOME_DNS;
+        case TLS_CONN_ERR_CONNECT:
+            return conn->connect_errno == ECONNREFUSED ? METRIC_OUTCOME_REFUSED : METRIC_OUTCOME_CONNECT;
+        case TLS_CONN_ERR_TIMEOUT:   return METRIC_OUTCOME_TIMEOUT;
+        case TLS_CONN_ERR_HANDSHAKE: return METRIC_OUTCOME_HANDSHAKE;
+        case TLS_CONN_ERR_STARTTLS:  return METRIC_OUTCOME_STARTTLS;
+        default:                     return METRIC_OUTCOME_OTHER;
+    }
+}
 
-    SSL_CTX *ctx = NULL;
-    SSL *ssl = NULL;
-    BIO *bio = NULL;
-    X509 *cert = NULL;
-    int ret = -1;
+/**
+ * Decide whether a failed connection is worth another attempt: timeouts and connect
+ * failures other than a refusal may clear up, the rest will not.
+ *
+ * @param conn The finished connection
+ * @return true if the failure may be transient
+ */
+static bool transient_failure(const tls_conn_t *conn) {
+    return conn->error == TLS_CONN_ERR_TIMEOUT ||
+           (conn->error == TLS_CONN_ERR_CONNECT && conn->connect_errno != ECONNREFUSED);
+}
 
-    // Create SSL context
-    ctx = SSL_CTX_new(TLS_client_method());
-    if (!ctx) {
-        snprintf(result_message, max_length, "Failed to create SSL context");
-        goto cleanup;
+/**
+ * Fill in the phase latencies of a finished connection.
+ *
+ * @param result The result to fill in
+ * @param conn The finished connection
+ * @param finished_us When the connection finished, used if the handshake's own end is unknown
+ * @param save_us Time spent saving certificates, or -1 if nothing was saved
+ */
+static void measure_phases(scan_result_t *result, const tls_conn_t *conn, long long finished_us, long long save_us) {
+    if (conn->handshaken_us > 0) {
+        finished_us = conn->handshaken_us;
     }
+    result->dns_us = conn->target.dns_us;
+    result->connect_us = -1;
+    result->handshake_us = -1;
+    if (conn->connected_us > 0) {
+        result->connect_us = conn->connected_us - conn->started_us;
+        if (conn->negotiated_us > 0 && (conn->error == TLS_CONN_OK || conn->error == TLS_CONN_ERR_HANDSHAKE)) {
+            result->handshake_us = finished_us - conn->negotiated_us;
+        }
+    }
+    result->save_us = save_us;
+    result->total_us = conn->target.dns_us + (monotonic_us() - conn->started_us);
+}
 
-    // Disable certificate verification (Note: This is not recommended for production use)
-    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
-
-    // Create BIO and set up SSL connection
-    bio = BIO_new_ssl_connect(ctx);
-    if (!bio) {
-        snprintf(result_message, max_length, "Failed to create BIO");
-        goto cleanup;
+/**
+ * Record the phase latencies and outcome of a result.
+ *
+ * @param metrics The calling thread's metrics, or NULL
+ * @param result The result
+ */
+static void record_metrics(metrics_shard_t *metrics, const scan_result_t *result) {
+    if (!metrics) {
+        return;
     }
 
-    BIO_get_ssl(bio, &ssl);
-    if (!ssl) {
-        snprintf(result_message, max_length, "Failed to get SSL from BIO");
-        goto cleanup;
+    metrics_record(metrics, METRIC_PHASE_DNS, result->dns_us);
+    if (result->connect_us >= 0) {
+        metrics_record(metrics, METRIC_PHASE_CONNECT, result->connect_us);
     }
+    if (result->handshake_us >= 0) {
+        metrics_record(metrics, METRIC_PHASE_HANDSHAKE, result->handshake_us);
+    }
+    if (result->save_us >= 0) {
+        metrics_record(metrics, METRIC_PHASE_SAVE, result->save_us);
+    }
+    metrics_outcome(metrics, result->status, result->total_us);
+}
 
-    SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+/**
+ * Save one certificate unless a certificate with the same fingerprint was saved before,
+ * and queue a newly saved one for the certificate index.
+ *
+ * @param cert The certificate
+ * @param config The scan settings
+ * @param worker The worker saving the certificate
+ * @param fingerprint The certificate's SHA256 fingerprint, all zero if it could not be computed
+ * @param fingerprinted Whether the fingerprint was computed
+ * @return 1 if saved, 0 if already saved, -1 on failure
+ */
+static int save_unless_seen(X509 *cert, const scan_config_t *config, const worker_context_t *worker,
+                            const unsigned char fingerprint[SHA256_DIGEST_LENGTH], bool fingerprinted) {
+    const unsigned char *known = fingerprinted ? fingerprint : NULL;
+    int added = -1;
 
-    // Set up connection details
-    char address[512];
-    if (snprintf(address, sizeof(address), "%s:%s", hostname, port) >= (int)sizeof(address)) {
-        snprintf(result_message, max_length, "Worker %d: Hostname and port too long", worker_id);
-        goto cleanup;
+    if (fingerprinted && config->dedup) {
+        added = cert_dedup_add(config->dedup, fingerprint);
+        if (added == 0) {
+            return 0;
+        }
     }
 
-    if (BIO_set_conn_hostname(bio, address) != 1) {
-        snprintf(result_message, max_length, "Worker %d: Failed to set connection hostname", worker_id);
-        goto cleanup;
+    // Save the certificate to the pack store, or to its own file passing the overwrite flag
+    if ((config->store ? store_certificate(cert, known, config->format, config->store, worker->arena, worker->id)
+                       : save_certificate(cert, known, config->format, config->output_dir, config->overwrite,
+                                          config->journal != NULL, worker->arena, worker->id)) != 0) {
+        if (added == 1) cert_dedup_remove(config->dedup, fingerprint);
+        return -1;
     }
 
-    // Set the hostname for SNI
-    if (SSL_set_tlsext_host_name(ssl, hostname) != 1) {
-        snprintf(result_message, max_length, "Worker %d: Failed to set TLS extension hostname", worker_id);
-        goto cleanup;
+    // Only a reference is queued here; the analysis threads do the parsing
+    if (config->index && fingerprinted) {
+        cert_index_submit(config->index, cert, fingerprint);
     }
+    return 1;
+}
 
-    // Set non-blocking mode
-    BIO_set_nbio(bio, 1);
+/**
+ * Turn a finished connection into saved certificates, manifest and journal entries, metrics and a result.
+ * The result is written to the worker's result buffer and its message left in result_message.
+ * A transient failure with retries left is handed back to the scheduler and not reported.
+ *
+ * @param conn The finished connection
+ * @param config The scan settings (output directory or pack store, format, chain, manifest, journal)
+ * @param worker The worker reporting the result
+ * @param result_message Buffer to store the result message
+ * @param max_length Maximum length of the result message
+ * @return 0 on success, 1 if the target will be retried, -1 on failure
+ */
+int complete_certificate_download(tls_conn_t *conn, const scan_config_t *config, const worker_context_t *worker,
+                                  char *result_message, size_t max_length) {
+    int worker_id = worker->id;
+    const char *hostname = conn->target.hostname;
+    const char *port = conn->target.port;
+    const char *outcome = outcome_name(conn->error);
+    metric_outcome_t metric = metric_outcome(conn);
+    long long finished_us = monotonic_us();
+    long long save_us = -1;
+    X509 *cert = NULL;
+    STACK_OF(X509) *chain = NULL;
+    X509 *certs[MAX_CHAIN_CERTS];
+    unsigned char fingerprints[MAX_CHAIN_CERTS][SHA256_DIGEST_LENGTH];
+    bool fingerprinted[MAX_CHAIN_CERTS];
+    int count = 0;
+    int reported = 0;
+    int leaf_saved = -1;
+    bool changed = true;
+    int ret = -1;
 
-    /*
-    // Try connecting with timeout
-    while ((ret = BIO_do_connect(bio)) <= 0) {
-        if (!BIO_should_retry(bio)) {
-            snprintf(result_message, max_length, "Error connecting to %s:%s", hostname, port);
-            get_ssl_error(result_message, max_length);
-            goto cleanup;
-        }
-        if (wait_for_bio(bio, timeout, 0) <= 0) {
-            snprintf(result_message, max_length, "Connection timeout to %s:%s", hostname, port);
-            goto cleanup;
-        }
-    }
+    arena_reset(worker->arena);
+    thread_cache_count_connection();
 
-    // Try handshake with timeout
-    while ((ret = BIO_do_handshake(bio)) <= 0) {
-        if (!BIO_should_retry(bio)) {
-            snprintf(result_message, max_length, "Failed to perform SSL handshake");
-            get_ssl_error(result_message, max_length);
-            goto cleanup;
-        }
-        if (wait_for_bio(bio, timeout, 0) <= 0) {
-            snprintf(result_message, max_length, "SSL handshake timeout");
-            goto cleanup;
-        }
+    if (config->scheduler && scheduler_finish(config->scheduler, &conn->target, transient_failure(conn))) {
+        progress_record(config->progress, metric, false, conn->connected_us > 0 ? conn->connected_us - conn->started_us : -1);
+        snprintf(result_message, max_length, "Worker %d: %s to %s:%s, will retry", worker_id,
+                 conn->error == TLS_CONN_ERR_TIMEOUT ? "Connection timeout" : "Connection failed", hostname, port);
+        result_buffer_text(worker->results, result_message);
+        return 1;
     }
 
-    */
-    // Try connecting with timeout
-    while ((ret = BIO_do_connect(bio)) <= 0) {
-        if (!BIO_should_retry(bio)) {
-            unsigned long error_code = ERR_get_error();
-            char error_string[256];
-            ERR_error_string_n(error_code, error_string, sizeof(error_string));
-
-            // Check if it's likely a DNS resolution failure
-            // I don't think these errors in error_string are valid
-            snprintf(result_message, max_length, error_string);
-            if (strstr(error_string, "unknown host") ||
-                strstr(error_string, "Name or service not known")) {
-                snprintf(result_message, max_length, "Worker %d: DNS resolution failure for %s:%s", worker_id, hostname, port);
-            } else {
-                snprintf(result_message, max_length, "Worker %d: Connection failed to %s:%s",
-                         worker_id, hostname, port);
-            }
+    switch (conn->error) {
+        case TLS_CONN_OK:
+            break;
+        case TLS_CONN_ERR_DNS:
+            snprintf(result_message, max_length, "Worker %d: DNS resolution failure for %s:%s (%s)", worker_id, hostname, port,
+                     resolve_status_name(conn->target.dns_status));
             goto cleanup;
-        }
-        if (wait_for_bio(bio, timeout, 0) <= 0) {
+        case TLS_CONN_ERR_CONNECT:
+            snprintf(result_message, max_length, "Worker %d: Connection failed to %s:%s", worker_id, hostname, port);
+            goto cleanup;
+        case TLS_CONN_ERR_TIMEOUT:
             snprintf(result_message, max_length, "Worker %d: Connection timeout to %s:%s", worker_id, hostname, port);
             goto cleanup;
+        case TLS_CONN_ERR_HANDSHAKE: {
+            char ssl_error[512];
+            get_ssl_error(ssl_error, sizeof(ssl_error));
+            snprintf(result_message, max_length, "Worker %d: SSL handshake failed with %s:%s%s", worker_id, hostname, port, ssl_error);
+            goto cleanup;
         }
+        case TLS_CONN_ERR_STARTTLS:
+            snprintf(result_message, max_length, "Worker %d: STARTTLS (%s) failed with %s:%s: %s", worker_id,
+                     starttls_protocol_name(conn->starttls->protocol), hostname, port, conn->starttls->error);
+            goto cleanup;
+        default:
+            snprintf(result_message, max_length, "Worker %d: Failed to set up connection to %s:%s", worker_id, hostname, port);
+            goto cleanup;
     }
 
     // Retrieve the server certificate
-    cert = SSL_get_peer_certificate(ssl);
+    cert = tls_conn_get_peer_certificate(conn);
     if (!cert) {
         snprintf(result_message, max_length, "Worker %d: Failed to get server certificate for %s:%s", worker_id, hostname, port);
-        get_ssl_error(result_message, max_length);
+        outcome = "no-certificate";
+        metric = METRIC_OUTCOME_OTHER;
         goto cleanup;
     }
 
-    // Save the certificate, passing the overwrite flag
-    if (save_certificate(cert, output_dir, overwrite, worker_id) != 0) {
-        snprintf(result_message, max_length, "Worker %d: Failed to save certificate for %s:%s", worker_id, hostname, port);
+    // The leaf, then the rest of the chain the server sent, fingerprinted together
+    certs[count++] = cert;
+    chain = config->chain ? tls_conn_get_peer_chain(conn) : NULL;
+    for (int i = 0; chain && i < sk_X509_num(chain) && count < MAX_CHAIN_CERTS; i++) {
+        X509 *issuer = sk_X509_value(chain, i);
+        if (X509_cmp(issuer, cert) != 0) {
+            certs[count++] = issuer;
+        }
+    }
+    fingerprint_batch(certs, (size_t)count, fingerprints, fingerprinted);
+
+    // A certificate seen before is not encoded or written again
+    leaf_saved = save_unless_seen(cert, config, worker, fingerprints[0], fingerprinted[0]);
+    bool failed = leaf_saved < 0;
+    for (int i = 1; i < count; i++) {
+        if (save_unless_seen(certs[i], config, worker, fingerprints[i], fingerprinted[i]) < 0) {
+            failed = true;
+        }
+    }
+
+    save_us = monotonic_us() - finished_us;
+
+    // Only fingerprints that were computed are reported, and none without the leaf's
+    if (fingerprinted[0]) {
+        for (int i = 0; i < count; i++) {
+            if (fingerprinted[i]) {
+                memmove(fingerprints[reported++], fingerprints[i], SHA256_DIGEST_LENGTH);
+            }
+        }
+    }
+
+    // Remember the session to offer and the leaf to compare against next time
+    if (config->sessions) {
+        changed = session_cache_update(config->sessions, &conn->target, conn->session, conn->resumed,
+                                       reported > 0 ? fingerprints[0] : NULL) != 0;
+    }
+
+    if (failed) {
+        snprintf(result_message, max_length, "Worker %d: Failed to save certificate%s for %s:%s", worker_id,
+                 leaf_saved < 0 ? "" : " chain", hostname, port);
+        outcome = "save-failed";
+        metric = METRIC_OUTCOME_SAVE;
         goto cleanup;
     }
 
-    //snprintf(result_message, max_length, "Certificate downloaded and saved successfully");
+    // Name the address that served the certificate, unless the target was given as that address
+    char address[INET6_ADDRSTRLEN];
+    char served_by[INET6_ADDRSTRLEN + 3] = "";
+    const target_addr_t *addr = tls_conn_get_address(conn);
+    if (addr && inet_ntop(addr->family, addr->addr, address, sizeof(address)) && strcmp(address, hostname) != 0) {
+        snprintf(served_by, sizeof(served_by), " (%s)", address);
+    }
+
+    char fingerprint_hex[SHA256_DIGEST_LENGTH * 2 + 1] = "unavailable";
+    if (reported > 0) {
+        hex_encode(fingerprints[0], SHA256_DIGEST_LENGTH, fingerprint_hex);
+    }
+    snprintf(result_message, max_length, "Worker %d: Certificate for %s:%s%s %s, SHA256 fingerprint %s%s",
+             worker_id, hostname, port, served_by, leaf_saved ? "saved" : "already saved", fingerprint_hex,
+             conn->resumed ? " (session resumed)" : "");
+
     ret = 0;
 
 cleanup:
+    if (config->manifest) {
+        manifest_write(config->manifest, &conn->target, tls_conn_get_address(conn), outcome,
+                       (const unsigned char (*)[SHA256_DIGEST_LENGTH])fingerprints, reported);
+    }
+    scan_result_t result = {
+        .target = &conn->target,
+        .addr = tls_conn_get_address(conn),
+        .status = metric,
+        .worker_id = worker_id,
+        .has_fingerprint = reported > 0,
+        .new_certificate = leaf_saved == 1,
+        .resumed = conn->resumed,
+        .changed = reported > 0 && changed,
+        .message = result_message
+    };
+    if (reported > 0) {
+        memcpy(result.fingerprint, fingerprints[0], SHA256_DIGEST_LENGTH);
+    }
+    measure_phases(&result, conn, finished_us, save_us);
+    record_metrics(worker->metrics, &result);
+    progress_record(config->progress, metric, true, result.connect_us);
+    // In changed-only mode a certificate the previous run already saw is not reported
+    if (worker->results && (!config->changed_only || ret != 0 || changed)) {
+        result_buffer_write(worker->results, &result);
+    }
+    // Journaled last, so the outputs it syncs before recording the target include its result
+    if (config->journal) {
+        journal_record(config->journal, &conn->target, outcome);
+    }
+
+    if (chain) sk_X509_pop_free(chain, X509_free);
     if (cert) X509_free(cert);
-    if (bio) BIO_free_all(bio);
-    if (ctx) SSL_CTX_free(ctx);
+    ERR_clear_error();
+
+    return ret;
+}
+
+/**
+ * Download a certificate from a resolved target.
+ *
+ * @param target The target to connect to
+ * @param config The scan settings (shared SSL context, timeout, output directory)
+ * @param worker The worker making the request
+ * @param result_message Buffer to store the result message
+ * @param max_length Maximum length of the result message
+ * @return 0 on success, 1 if the target will be retried, -1 on failure
+ */
+int download_certificate(const target_t *target, const scan_config_t *config, const worker_context_t *worker,
+                         char *result_message, size_t max_length) {
+    tls_conn_t conn;
+    int ret;
+
+    // Drive the connection state machine, blocking on its socket (or its race set while connecting)
+    progress_start(config->progress);
+    if (tls_conn_start(&conn, &config->tls, target) > 0) {
+        while (!tls_conn_finished(&conn)) {
+            int rc = wait_for_conn(&conn);
+            if (rc < 0) {
+                tls_conn_expire(&conn);
+                break;
+            }
+            if (rc == 0) {
+                // Past the deadline: either the next raced address is due or the connection expires
+                tls_conn_timeout(&conn);
+                continue;
+            }
+            tls_conn_continue(&conn);
+        }
+    }
+
+    ret = complete_certificate_download(&conn, config, worker, result_message, max_length);
+    tls_conn_cleanup(&conn);
 
     return ret;
 }
@@ -0,0 +1,449 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "journal.h"
+#include "utils.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define JOURNAL_MAGIC "CRTJNL01"
+#define JOURNAL_MAGIC_LENGTH 8
+// Records are written and fsynced in batches of this many, or once the oldest has waited FLUSH_INTERVAL_MS
+#define BATCH_RECORDS 4096
+#define FLUSH_INTERVAL_MS 1000
+
+// One finished target. Only the key is needed to resume; the rest is for inspection.
+typedef struct {
+    uint64_t key;
+    uint32_t time;
+    uint16_t port;
+    uint8_t outcome;
+    uint8_t reserved;
+} journal_record_t;
+
+_Static_assert(sizeof(journal_record_t) == 16, "journal records are stored as 16 bytes");
+
+// Outcome names as written to the manifest; a record stores the index plus one
+static const char *const outcome_names[] = {
+    "ok", "dns", "connect", "timeout", "handshake", "internal", "no-certificate", "save-failed",
+    "starttls"
+};
+
+struct journal {
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_mutex_t io_mutex;
+    journal_record_t *pending;
+    journal_record_t *writing;
+    size_t count;
+    long long since_ms;
+    journal_sync_t sync;
+    void *sync_context;
+    bool failed;
+};
+
+// Sorted keys of the targets a journal records as finished
+struct journal_set {
+    uint64_t *keys;
+    size_t count;
+};
+
+/**
+ * Write a whole buffer, retrying short writes.
+ *
+ * @param fd The file descriptor
+ * @param data The data
+ * @param length Number of bytes
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+static int write_all(int fd, const void *data, size_t length) {
+    const unsigned char *p = data;
+    while (length > 0) {
+        ssize_t written = write(fd, p, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Check that a journal file starts with the journal magic.
+ *
+ * @param fd The journal file, positioned anywhere
+ * @return 0 if it does, -1 otherwise (errno is set)
+ */
+static int check_magic(int fd) {
+    char magic[JOURNAL_MAGIC_LENGTH];
+    if (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic)) {
+        if (errno == 0) errno = EINVAL;
+        return -1;
+    }
+    if (memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open a journal for appending, creating it if needed. A record left half
+ * written by a crash is cut off.
+ *
+ * @param path The journal file
+ * @param error_message Buffer to store an error message in
+ * @param max_length Maximum length of the error message
+ * @return The journal, or NULL on failure
+ */
+journal_t *journal_open(const char *path, char *error_message, size_t max_length) {
+    journal_t *journal = calloc(1, sizeof(*journal));
+    struct stat st;
+
+    if (!journal) {
+        snprintf(error_message, max_length, "Failed to allocate the journal");
+        return NULL;
+    }
+    journal->fd = -1;
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_mutex_init(&journal->io_mutex, NULL);
+
+    journal->pending = malloc(BATCH_RECORDS * sizeof(*journal->pending));
+    journal->writing = malloc(BATCH_RECORDS * sizeof(*journal->writing));
+    if (!journal->pending || !journal->writing) {
+        snprintf(error_message, max_length, "Failed to allocate the journal");
+        goto error;
+    }
+
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal->fd < 0 || fstat(journal->fd, &st) != 0) {
+        snprintf(error_message, max_length, "Failed to open %s: %s", path, strerror(errno));
+        goto error;
+    }
+
+    if (st.st_size == 0) {
+        if (write_all(journal->fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) != 0) {
+            snprintf(error_message, max_length, "Failed to write %s: %s", path, strerror(errno));
+            goto error;
+        }
+    } else {
+        errno = 0;
+        if (check_magic(journal->fd) != 0) {
+            snprintf(error_message, max_length, "Failed to read %s: %s", path,
+                     errno == EINVAL ? "not a scan journal" : strerror(errno));
+            goto error;
+        }
+        off_t records = (st.st_size - JOURNAL_MAGIC_LENGTH) / (off_t)sizeof(journal_record_t);
+        off_t complete = JOURNAL_MAGIC_LENGTH + records * (off_t)sizeof(journal_record_t);
+        if (st.st_size != complete && ftruncate(journal->fd, complete) != 0) {
+            snprintf(error_message, max_length, "Failed to repair %s: %s", path, strerror(errno));
+            goto error;
+        }
+    }
+    return journal;
+
+error:
+    if (journal->fd >= 0) close(journal->fd);
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_mutex_destroy(&journal->io_mutex);
+    free(journal->pending);
+    free(journal->writing);
+    free(journal);
+    return NULL;
+}
+
+/**
+ * Have the journal make the targets' outputs durable before it records them as finished,
+ * so a resumed scan never skips a target whose manifest line or certificates were lost.
+ *
+ * @param journal The journal
+ * @param sync Called before every batch of records is written, or NULL
+ * @param context Passed to sync
+ */
+void journal_set_sync(journal_t *journal, journal_sync_t sync, void *context) {
+    pthread_mutex_lock(&journal->io_mutex);
+    journal->sync = sync;
+    journal->sync_context = context;
+    pthread_mutex_unlock(&journal->io_mutex);
+}
+
+/**
+ * Write out and fsync the records gathered so far, once the outputs of their targets are
+ * durable. Workers keep adding records to the other buffer while this one is on its way to disk.
+ *
+ * @param journal The journal
+ * @param wait Wait for a flush already in progress instead of leaving the records to it
+ */
+static void flush_records(journal_t *journal, bool wait) {
+    if (wait) {
+        pthread_mutex_lock(&journal->io_mutex);
+    } else if (pthread_mutex_trylock(&journal->io_mutex) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal->mutex);
+    journal_record_t *batch = journal->pending;
+    size_t count = journal->count;
+    journal->pending = journal->writing;
+    journal->writing = batch;
+    journal->count = 0;
+    pthread_mutex_unlock(&journal->mutex);
+
+    // Every record in the batch was added after its target's outputs were handed over
+    if (count > 0 && !journal->failed && journal->sync && journal->sync(journal->sync_context) != 0) {
+        fprintf(stderr, "Failed to save the outputs of finished targets, no longer journaling them\n");
+        journal->failed = true;
+    }
+    if (count > 0 && !journal->failed &&
+        (write_all(journal->fd, batch, count * sizeof(*batch)) != 0 || fdatasync(journal->fd) != 0)) {
+        fprintf(stderr, "Failed to write the scan journal: %s\n", strerror(errno));
+        journal->failed = true;
+    }
+    pthread_mutex_unlock(&journal->io_mutex);
+}
+
+/**
+ * Record that a target is finished, whatever its outcome.
+ *
+ * @param journal The journal
+ * @param target The target
+ * @param outcome Outcome name as written to the manifest
+ */
+void journal_record(journal_t *journal, const target_t *target, const char *outcome) {
+    journal_record_t record = {
+        .key = target_key(target->hostname, target->port),
+        .time = (uint32_t)time(NULL),
+        .port = target->port_number,
+        .outcome = 0,
+        .reserved = 0
+    };
+    for (size_t i = 0; i < sizeof(outcome_names) / sizeof(outcome_names[0]); i++) {
+        if (strcmp(outcome, outcome_names[i]) == 0) {
+            record.outcome = (uint8_t)(i + 1);
+            break;
+        }
+    }
+
+    long long now = monotonic_ms();
+    bool flush;
+
+    pthread_mutex_lock(&journal->mutex);
+    // The other buffer is still being written out; wait for it rather than drop records
+    while (journal->count == BATCH_RECORDS) {
+        pthread_mutex_unlock(&journal->mutex);
+        flush_records(journal, true);
+        pthread_mutex_lock(&journal->mutex);
+    }
+    if (journal->count == 0) {
+        journal->since_ms = now;
+    }
+    journal->pending[journal->count++] = record;
+    flush = journal->count == BATCH_RECORDS || now - journal->since_ms >= FLUSH_INTERVAL_MS;
+    pthread_mutex_unlock(&journal->mutex);
+
+    if (flush) {
+        flush_records(journal, false);
+    }
+}
+
+/**
+ * Flush and close a journal.
+ *
+ * @param journal The journal
+ * @return 0 on success, -1 if any record could not be written
+ */
+int journal_close(journal_t *journal) {
+    flush_records(journal, true);
+    int ret = journal->failed ? -1 : 0;
+    if (close(journal->fd) != 0) {
+        ret = -1;
+    }
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_mutex_destroy(&journal->io_mutex);
+    free(journal->pending);
+    free(journal->writing);
+    free(journal);
+    return ret;
+}
+
+/**
+ * Sort keys with an 8-pass byte-wise radix sort.
+ *
+ * @param keys The keys; sorted in place
+ * @param scratch Scratch space for as many keys
+ * @param count Number of keys
+ */
+static void sort_keys(uint64_t *keys, uint64_t *scratch, size_t count) {
+    uint64_t *from = keys;
+    uint64_t *to = scratch;
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            offsets[(from[i] >> shift) & 0xff]++;
+        }
+        size_t total = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t n = offsets[b];
+            offsets[b] = total;
+            total += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            to[offsets[(from[i] >> shift) & 0xff]++] = from[i];
+        }
+        uint64_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    // An even number of passes leaves the result back in keys
+}
+
+/**
+ * Load the keys of every target a journal records as finished. The journal is
+ * memory-mapped and reduced to a sorted array of 8-byte keys, so a journal of
+ * 50 million targets takes about 400MB and a few seconds to load.
+ *
+ * @param path The journal file; a missing file gives an empty set
+ * @param error_message Buffer to store an error message in
+ * @param max_length Maximum length of the error message
+ * @return The set, or NULL on failure
+ */
+journal_set_t *journal_load(const char *path, char *error_message, size_t max_length) {
+    journal_set_t *set = calloc(1, sizeof(*set));
+    uint64_t *scratch = NULL;
+    void *map = MAP_FAILED;
+    struct stat st;
+    int fd = -1;
+
+    if (!set) {
+        snprintf(error_message, max_length, "Failed to allocate the journal set");
+        return NULL;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return set;
+        }
+        snprintf(error_message, max_length, "Failed to open %s: %s", path, strerror(errno));
+        goto error;
+    }
+    if (fstat(fd, &st) != 0) {
+        snprintf(error_message, max_length, "Failed to read %s: %s", path, strerror(errno));
+        goto error;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return set;
+    }
+    errno = 0;
+    if (check_magic(fd) != 0) {
+        snprintf(error_message, max_length, "Failed to read %s: %s", path,
+                 errno == EINVAL ? "not a scan journal" : strerror(errno));
+        goto error;
+    }
+
+    size_t count = (size_t)(st.st_size - JOURNAL_MAGIC_LENGTH) / sizeof(journal_record_t);
+    if (count == 0) {
+        close(fd);
+        return set;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        snprintf(error_message, max_length, "Failed to map %s: %s", path, strerror(errno));
+        goto error;
+    }
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    set->keys = malloc(count * sizeof(*set->keys));
+    scratch = malloc(count * sizeof(*scratch));
+    if (!set->keys || !scratch) {
+        snprintf(error_message, max_length, "Failed to allocate the journal set");
+        goto error;
+    }
+
+    const unsigned char *records = (const unsigned char *)map + JOURNAL_MAGIC_LENGTH;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(&set->keys[i], records + i * sizeof(journal_record_t), sizeof(uint64_t));
+    }
+    munmap(map, (size_t)st.st_size);
+    map = MAP_FAILED;
+    close(fd);
+    fd = -1;
+
+    sort_keys(set->keys, scratch, count);
+    free(scratch);
+
+    // A target recorded by more than one run is kept once
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || set->keys[unique - 1] != set->keys[i]) {
+            set->keys[unique++] = set->keys[i];
+        }
+    }
+    set->count = unique;
+    return set;
+
+error:
+    if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+    if (fd >= 0) close(fd);
+    free(scratch);
+    journal_set_free(set);
+    return NULL;
+}
+
+/**
+ * Check whether a journal records a target as finished.
+ *
+ * @param set The journal set
+ * @param target The target
+ * @return true if the target was finished in an earlier run
+ */
+bool journal_contains(const journal_set_t *set, const target_t *target) {
+    if (set->count == 0) {
+        return false;
+    }
+
+    uint64_t key = target_key(target->hostname, target->port);
+    size_t low = 0;
+    size_t high = set->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (set->keys[mid] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < set->count && set->keys[low] == key;
+}
+
+/**
+ * Report how many distinct targets a journal set holds.
+ *
+ * @param set The journal set
+ * @return The number of targets
+ */
+size_t journal_set_count(const journal_set_t *set) {
+    return set->count;
+}
+
+/**
+ * Free a journal set.
+ *
+ * @param set The journal set
+ */
+void journal_set_free(journal_set_t *set) {
+    free(set->keys);
+    free(set);
+}
@@ -0,0 +1,347 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "manifest.h"
+#include "utils.h"
+#include "fingerprint.h"
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MANIFEST_LINE_LENGTH 4096
+#define MANIFEST_BUFFER_SIZE (1024 * 1024)
+
+struct manifest {
+    FILE *file;
+    manifest_format_t format;
+    pthread_mutex_t mutex;
+};
+
+// A line being formatted; overflow is remembered and the line dropped
+typedef struct {
+    char data[MANIFEST_LINE_LENGTH];
+    size_t length;
+    bool overflow;
+} line_buffer_t;
+
+/**
+ * Append text to a line.
+ *
+ * @param line The line
+ * @param text The text
+ * @param length Number of bytes
+ */
+static void append(line_buffer_t *line, const char *text, size_t length) {
+    if (line->overflow || line->length + length >= sizeof(line->data)) {
+        line->overflow = true;
+        return;
+    }
+    memcpy(line->data + line->length, text, length);
+    line->length += length;
+}
+
+/**
+ * Append a null-terminated string to a line.
+ *
+ * @param line The line
+ * @param text The string
+ */
+static void append_str(line_buffer_t *line, const char *text) {
+    append(line, text, strlen(text));
+}
+
+/**
+ * Append a string as a quoted JSON string.
+ *
+ * @param line The line
+ * @param text The string
+ */
+static void append_json_string(line_buffer_t *line, const char *text) {
+    append(line, "\"", 1);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            char escaped[2] = { '\\', (char)*p };
+            append(line, escaped, 2);
+        } else if (*p < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *p);
+            append_str(line, escaped);
+        } else {
+            append(line, (const char *)p, 1);
+        }
+    }
+    append(line, "\"", 1);
+}
+
+/**
+ * Append a string as a CSV field, quoting it only when needed.
+ *
+ * @param line The line
+ * @param text The string
+ */
+static void append_csv_field(line_buffer_t *line, const char *text) {
+    if (!strpbrk(text, ",\"\r\n")) {
+        append_str(line, text);
+        return;
+    }
+    append(line, "\"", 1);
+    for (const char *p = text; *p; p++) {
+        append(line, p, 1);
+        if (*p == '"') {
+            append(line, "\"", 1);
+        }
+    }
+    append(line, "\"", 1);
+}
+
+/**
+ * Open a manifest for appending. A new CSV manifest starts with a header line.
+ *
+ * @param path The manifest file
+ * @param format JSON lines or CSV
+ * @return The manifest, or NULL on failure (errno is set)
+ */
+manifest_t *manifest_open(const char *path, manifest_format_t format) {
+    manifest_t *manifest = calloc(1, sizeof(*manifest));
+    if (!manifest) {
+        return NULL;
+    }
+
+    manifest->file = fopen(path, "a");
+    if (!manifest->file) {
+        free(manifest);
+        return NULL;
+    }
+    setvbuf(manifest->file, NULL, _IOFBF, MANIFEST_BUFFER_SIZE);
+    manifest->format = format;
+    pthread_mutex_init(&manifest->mutex, NULL);
+
+    struct stat st;
+    if (format == MANIFEST_CSV && fstat(fileno(manifest->file), &st) == 0 && st.st_size == 0) {
+        fputs(MANIFEST_CSV_HEADER, manifest->file);
+    }
+    return manifest;
+}
+
+/**
+ * Record the outcome for one target. The line is formatted before taking the
+ * lock, so workers only serialise on the buffered write.
+ *
+ * @param manifest The manifest
+ * @param target The target
+ * @param addr The address connected to, or last tried, or NULL if there was none
+ * @param outcome Short outcome name, "ok" on success
+ * @param fingerprints SHA256 fingerprints of the leaf and then the rest of the chain
+ * @param count Number of fingerprints (0 if no certificate was received)
+ */
+void manifest_write(manifest_t *manifest, const target_t *target, const target_addr_t *addr, const char *outcome,
+                    const unsigned char (*fingerprints)[SHA256_DIGEST_LENGTH], int count) {
+    line_buffer_t line = { .length = 0, .overflow = false };
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    char address[INET6_ADDRSTRLEN] = "";
+    char timestamp[40];
+    struct timespec now;
+    struct tm tm;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm);
+    size_t length = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(timestamp + length, sizeof(timestamp) - length, ".%03ldZ", now.tv_nsec / 1000000);
+    if (addr && !inet_ntop(addr->family, addr->addr, address, sizeof(address))) {
+        address[0] = '\0';
+    }
+
+    if (manifest->format == MANIFEST_JSONL) {
+        append_str(&line, "{\"host\":");
+        append_json_string(&line, target->hostname);
+        append_str(&line, ",\"port\":");
+        append_json_string(&line, target->port);
+        append_str(&line, ",\"time\":\"");
+        append_str(&line, timestamp);
+        append_str(&line, "\",\"outcome\":\"");
+        append_str(&line, outcome);
+        append_str(&line, "\",\"leaf\":");
+        if (count > 0) {
+            hex_encode(fingerprints[0], SHA256_DIGEST_LENGTH, hex);
+            append(&line, "\"", 1);
+            append_str(&line, hex);
+            append(&line, "\"", 1);
+        } else {
+            append_str(&line, "null");
+        }
+        append_str(&line, ",\"chain\":[");
+        for (int i = 1; i < count; i++) {
+            hex_encode(fingerprints[i], SHA256_DIGEST_LENGTH, hex);
+            append_str(&line, i > 1 ? ",\"" : "\"");
+            append_str(&line, hex);
+            append(&line, "\"", 1);
+        }
+        append_str(&line, "],\"ip\":");
+        if (address[0]) {
+            append(&line, "\"", 1);
+            append_str(&line, address);
+            append(&line, "\"", 1);
+        } else {
+            append_str(&line, "null");
+        }
+        append_str(&line, "}\n");
+    } else {
+        append_csv_field(&line, target->hostname);
+        append(&line, ",", 1);
+        append_csv_field(&line, target->port);
+        append(&line, ",", 1);
+        append_str(&line, timestamp);
+        append(&line, ",", 1);
+        append_str(&line, outcome);
+        append(&line, ",", 1);
+        if (count > 0) {
+            hex_encode(fingerprints[0], SHA256_DIGEST_LENGTH, hex);
+            append_str(&line, hex);
+        }
+        append(&line, ",", 1);
+        for (int i = 1; i < count; i++) {
+            hex_encode(fingerprints[i], SHA256_DIGEST_LENGTH, hex);
+            if (i > 1) append(&line, ";", 1);
+            append_str(&line, hex);
+        }
+        append(&line, ",", 1);
+        append_str(&line, address);
+        append(&line, "\n", 1);
+    }
+
+    if (line.overflow) {
+        fprintf(stderr, "Manifest entry for %s:%s is too long, skipped\n", target->hostname, target->port);
+        return;
+    }
+
+    pthread_mutex_lock(&manifest->mutex);
+    fwrite(line.data, 1, line.length, manifest->file);
+    pthread_mutex_unlock(&manifest->mutex);
+}
+
+/**
+ * Write out the buffered entries and wait until they are on disk.
+ *
+ * @param manifest The manifest
+ * @return 0 on success, -1 on failure
+ */
+int manifest_sync(manifest_t *manifest) {
+    pthread_mutex_lock(&manifest->mutex);
+    int ret = fflush(manifest->file) == 0 && fdatasync(fileno(manifest->file)) == 0 ? 0 : -1;
+    pthread_mutex_unlock(&manifest->mutex);
+    return ret;
+}
+
+/**
+ * Flush and close a manifest.
+ *
+ * @param manifest The manifest
+ * @return 0 on success, -1 if anything could not be written
+ */
+int manifest_close(manifest_t *manifest) {
+    int ret = ferror(manifest->file) || fflush(manifest->file) != 0 || fdatasync(fileno(manifest->file)) != 0 ? -1 : 0;
+    if (fclose(manifest->file) != 0) {
+        ret = -1;
+    }
+    pthread_mutex_destroy(&manifest->mutex);
+    free(manifest);
+    return ret;
+}
+
+/**
+ * Tell the format of a manifest from its first line.
+ *
+ * @param line The first line
+ * @param length Number of bytes, with or without the newline
+ * @param format Receives the format
+ * @return 0 if the line starts a manifest, -1 otherwise
+ */
+int manifest_detect_format(const char *line, size_t length, manifest_format_t *format) {
+    size_t header_length = sizeof(MANIFEST_CSV_HEADER) - 2;
+    size_t old_header_length = sizeof(MANIFEST_CSV_HEADER_NO_IP) - 2;
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        length--;
+    }
+    if ((length == header_length && memcmp(line, MANIFEST_CSV_HEADER, header_length) == 0) ||
+        (length == old_header_length && memcmp(line, MANIFEST_CSV_HEADER_NO_IP, old_header_length) == 0)) {
+        *format = MANIFEST_CSV;
+        return 0;
+    }
+    if (length > 0 && line[0] == '{') {
+        *format = MANIFEST_JSONL;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Find the end of the CSV field starting at a position, skipping quoted commas.
+ *
+ * @param line The line
+ * @param length Number of bytes
+ * @param start Where the field starts
+ * @return The position of the comma after the field, or length
+ */
+static size_t csv_field_end(const char *line, size_t length, size_t start) {
+    bool quoted = false;
+    for (size_t i = start; i < length; i++) {
+        if (line[i] == '"') {
+            quoted = !quoted;
+        } else if (line[i] == ',' && !quoted) {
+            return i;
+        }
+    }
+    return length;
+}
+
+/**
+ * Hash a manifest entry without its time, so the same host reporting the same
+ * outcome and certificates is recognised whichever node or run wrote it.
+ *
+ * @param line The entry
+ * @param length Number of bytes, with or without the newline
+ * @param format The manifest's format
+ * @param key Receives the SHA-256 of the entry without its time
+ * @return true on success, false if the line is not a manifest entry
+ */
+bool manifest_entry_key(const char *line, size_t length, manifest_format_t format,
+                        unsigned char key[SHA256_DIGEST_LENGTH]) {
+    char scratch[MANIFEST_LINE_LENGTH + 1];
+    size_t time_start;
+    size_t time_end;
+
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        length--;
+    }
+    if (length == 0 || length >= sizeof(scratch)) {
+        return false;
+    }
+    memcpy(scratch, line, length);
+    scratch[length] = '\0';
+
+    if (format == MANIFEST_JSONL) {
+        // Every entry is written with the time after the host and port, as ,"time":"..."
+        const char *found = strstr(scratch, ",\"time\":\"");
+        const char *close = found ? strchr(found + 9, '"') : NULL;
+        if (!close) {
+            return false;
+        }
+        time_start = (size_t)(found - scratch);
+        time_end = (size_t)(close - scratch) + 1;
+    } else {
+        size_t port_end = csv_field_end(scratch, length, csv_field_end(scratch, length, 0) + 1);
+        if (port_end >= length) {
+            return false;
+        }
+        time_start = port_end;
+        time_end = csv_field_end(scratch, length, port_end + 1);
+    }
+
+    memmove(scratch + time_start, scratch + time_end, length - time_end);
+    return fingerprint_bytes((const unsigned char *)scratch, length - (time_end - time_start), key);
+}
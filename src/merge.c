@@ -0,0 +1,415 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "merge.h"
+#include "cert_dedup.h"
+#include "cert_store.h"
+#include "fingerprint.h"
+#include "manifest.h"
+#include "utils.h"
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_PATH_LENGTH 1024
+// Certificates are a few KB; anything far larger in an output directory is not one
+#define MAX_CERTIFICATE_FILE (1024 * 1024)
+
+struct merge {
+    char output_dir[MAX_PATH_LENGTH];
+    cert_dedup_t *certificates;
+    cert_store_t *store;
+    cert_dedup_t *entries;
+    FILE *manifest;
+    const char *manifest_path;
+    manifest_format_t manifest_format;
+    bool manifest_format_known;
+    merge_stats_t stats;
+};
+
+/**
+ * Read the manifest being merged into, so entries it already holds are not appended again.
+ *
+ * @param merge The merge
+ * @param path The manifest file
+ * @return 0 on success (including when the file does not exist yet), -1 on failure
+ */
+static int load_output_manifest(merge_t *merge, const char *path) {
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int ret = 0;
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while ((length = getline(&line, &capacity, file)) > 0) {
+        if (!merge->manifest_format_known) {
+            if (manifest_detect_format(line, (size_t)length, &merge->manifest_format) != 0) {
+                errno = EINVAL;
+                ret = -1;
+                break;
+            }
+            merge->manifest_format_known = true;
+            if (merge->manifest_format == MANIFEST_CSV) continue;
+        }
+        if (manifest_entry_key(line, (size_t)length, merge->manifest_format, key) &&
+            cert_dedup_add(merge->entries, key) < 0) {
+            errno = ENOMEM;
+            ret = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(file);
+    return ret;
+}
+
+/**
+ * Start merging node outputs into one output directory, and optionally one manifest.
+ * The fingerprints of the certificates already in the output are loaded first.
+ *
+ * @param output_dir The directory receiving the certificates; it must exist
+ * @param pack_store Add the certificates to a pack store rather than one file each
+ * @param manifest_path The manifest receiving the node manifests' entries, or NULL
+ * @param threads Number of threads reading the certificates already in the output
+ * @param error_message Buffer to store the error message
+ * @param max_length Maximum length of the error message
+ * @return The merge, or NULL on failure
+ */
+merge_t *merge_open(const char *output_dir, bool pack_store, const char *manifest_path, int threads,
+                    char *error_message, size_t max_length) {
+    merge_t *merge = calloc(1, sizeof(*merge));
+    if (!merge) {
+        snprintf(error_message, max_length, "Failed to allocate the merge");
+        return NULL;
+    }
+    if (snprintf(merge->output_dir, sizeof(merge->output_dir), "%s", output_dir) >= (int)sizeof(merge->output_dir)) {
+        snprintf(error_message, max_length, "Output directory path too long");
+        free(merge);
+        return NULL;
+    }
+
+    merge->certificates = cert_dedup_create();
+    merge->entries = cert_dedup_create();
+    if (!merge->certificates || !merge->entries) {
+        snprintf(error_message, max_length, "Failed to allocate the fingerprint sets");
+        goto fail;
+    }
+    if (cert_dedup_seed(merge->certificates, output_dir, threads) < 0) {
+        snprintf(error_message, max_length, "Failed to read %s: %s", output_dir, strerror(errno));
+        goto fail;
+    }
+
+    if (pack_store) {
+        merge->store = cert_store_open(output_dir, error_message, max_length);
+        if (!merge->store) {
+            goto fail;
+        }
+    }
+
+    if (manifest_path) {
+        merge->manifest_path = manifest_path;
+        if (load_output_manifest(merge, manifest_path) != 0) {
+            snprintf(error_message, max_length, "Failed to read manifest %s: %s", manifest_path,
+                     errno == EINVAL ? "not a manifest" : strerror(errno));
+            goto fail;
+        }
+        merge->manifest = fopen(manifest_path, "a");
+        if (!merge->manifest) {
+            snprintf(error_message, max_length, "Failed to open manifest %s: %s", manifest_path, strerror(errno));
+            goto fail;
+        }
+    }
+    return merge;
+
+fail:
+    if (merge->store) cert_store_close(merge->store);
+    if (merge->certificates) cert_dedup_free(merge->certificates);
+    if (merge->entries) cert_dedup_free(merge->entries);
+    free(merge);
+    return NULL;
+}
+
+/**
+ * Write a certificate to its own file, named the way a scan names it: the SHA256
+ * hash of its encoding, with the extension of that encoding.
+ *
+ * @param merge The merge
+ * @param data The encoded certificate
+ * @param length Number of bytes
+ * @param der Whether the encoding is DER
+ * @return 0 on success, -1 on failure
+ */
+static int write_certificate_file(merge_t *merge, const unsigned char *data, size_t length, bool der) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char name[SHA256_DIGEST_LENGTH * 2 + 1];
+    char path[MAX_PATH_LENGTH];
+
+    if (!fingerprint_bytes(data, length, digest)) {
+        fprintf(stderr, "Failed to calculate SHA256 hash\n");
+        return -1;
+    }
+    hex_encode(digest, SHA256_DIGEST_LENGTH, name);
+    if (snprintf(path, sizeof(path), "%s/%s.%s", merge->output_dir, name, der ? "der" : "pem") >= (int)sizeof(path)) {
+        fprintf(stderr, "File path too long\n");
+        return -1;
+    }
+
+    // A file by that name already holds these exact bytes
+    FILE *file = fopen(path, "wx");
+    if (!file) {
+        if (errno == EEXIST) return 0;
+        fprintf(stderr, "Failed to open file %s for writing: %s\n", path, strerror(errno));
+        return -1;
+    }
+    bool written = fwrite(data, 1, length, file) == length;
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Failed to write certificate data to %s\n", path);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Add one encoded certificate from a node's output unless the output already has
+ * a certificate with the same fingerprint. The encoding is copied as it is.
+ *
+ * @param merge The merge
+ * @param data The PEM or DER encoded certificate
+ * @param length Number of bytes
+ * @return 0 on success or if the certificate is unreadable, -1 if it could not be written
+ */
+static int add_certificate(merge_t *merge, const unsigned char *data, size_t length) {
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+    // DER starts with an ASN.1 SEQUENCE tag, PEM with its "-----BEGIN" line
+    bool der = length > 0 && data[0] == 0x30;
+    const unsigned char *p = data;
+    X509 *cert = NULL;
+
+    merge->stats.certificates++;
+    if (der) {
+        cert = d2i_X509(NULL, &p, (long)length);
+    } else if (length <= INT32_MAX) {
+        BIO *mem = BIO_new_mem_buf(data, (int)length);
+        cert = mem ? PEM_read_bio_X509(mem, NULL, NULL, NULL) : NULL;
+        BIO_free(mem);
+    }
+    bool fingerprinted = cert && fingerprint_cert(cert, fingerprint);
+    X509_free(cert);
+    ERR_clear_error();
+    if (!fingerprinted) {
+        merge->stats.unreadable++;
+        return 0;
+    }
+
+    int added = cert_dedup_add(merge->certificates, fingerprint);
+    if (added <= 0) {
+        return added;
+    }
+    if ((merge->store ? cert_store_put(merge->store, data, length, NULL, NULL, 0)
+                      : write_certificate_file(merge, data, length, der)) < 0) {
+        cert_dedup_remove(merge->certificates, fingerprint);
+        return -1;
+    }
+    merge->stats.added++;
+    return 0;
+}
+
+/**
+ * Add a certificate from a node's pack store.
+ *
+ * @param key The entry's key
+ * @param data The encoded certificate
+ * @param length Number of bytes
+ * @param arg The merge
+ * @return 0 to keep going, -1 to stop
+ */
+static int add_stored_certificate(const char *key, const unsigned char *data, size_t length, void *arg) {
+    (void)key;
+    return add_certificate((merge_t *)arg, data, length);
+}
+
+/**
+ * Add a certificate saved as its own file in a node's output.
+ *
+ * @param merge The merge
+ * @param path The file
+ * @return 0 on success or if the file is unreadable, -1 if the certificate could not be written
+ */
+static int add_certificate_file(merge_t *merge, const char *path) {
+    struct stat st;
+    int ret = 0;
+
+    FILE *file = fopen(path, "rb");
+    if (!file || fstat(fileno(file), &st) != 0 || st.st_size <= 0 || st.st_size > MAX_CERTIFICATE_FILE) {
+        merge->stats.certificates++;
+        merge->stats.unreadable++;
+        if (file) fclose(file);
+        return 0;
+    }
+
+    unsigned char *data = malloc((size_t)st.st_size);
+    if (data && fread(data, 1, (size_t)st.st_size, file) == (size_t)st.st_size) {
+        ret = add_certificate(merge, data, (size_t)st.st_size);
+    } else {
+        merge->stats.certificates++;
+        merge->stats.unreadable++;
+    }
+    free(data);
+    fclose(file);
+    return ret;
+}
+
+/**
+ * Merge the certificates of one node's output directory: its .pem and .der files
+ * and its pack store if it has one.
+ *
+ * @param merge The merge
+ * @param dir The node's output directory
+ * @return 0 on success, -1 on failure
+ */
+int merge_add_directory(merge_t *merge, const char *dir) {
+    char path[MAX_PATH_LENGTH];
+    struct dirent *entry;
+    int ret = 0;
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Failed to read %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, CERT_STORE_INDEX_NAME) < (int)sizeof(path) &&
+        access(path, F_OK) == 0 && cert_store_foreach(dir, add_stored_certificate, merge) < 0) {
+        ret = -1;
+    }
+
+    while (ret == 0 && (entry = readdir(d)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length <= 4 || (strcmp(entry->d_name + length - 4, ".pem") != 0 &&
+                            strcmp(entry->d_name + length - 4, ".der") != 0)) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) {
+            fprintf(stderr, "File path too long\n");
+            ret = -1;
+        } else if (add_certificate_file(merge, path) != 0) {
+            ret = -1;
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+/**
+ * Append the entries of one node's manifest that the merged manifest does not hold yet.
+ * Entries are compared without their time. The merged manifest takes the format of the
+ * first manifest it receives, and every later one must have the same format.
+ *
+ * @param merge The merge
+ * @param path The node's manifest
+ * @return 0 on success, -1 on failure
+ */
+int merge_add_manifest(merge_t *merge, const char *path) {
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    manifest_format_t format;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int ret = -1;
+
+    if (!merge->manifest) {
+        fprintf(stderr, "Merging manifest %s needs a -manifest to merge it into\n", path);
+        return -1;
+    }
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open manifest %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    length = getline(&line, &capacity, file);
+    if (length <= 0) {
+        ret = 0;
+        goto cleanup;
+    }
+    if (manifest_detect_format(line, (size_t)length, &format) != 0) {
+        fprintf(stderr, "%s is not a manifest\n", path);
+        goto cleanup;
+    }
+    if (merge->manifest_format_known && format != merge->manifest_format) {
+        fprintf(stderr, "Manifest %s is %s but %s is %s\n", path, format == MANIFEST_CSV ? "CSV" : "JSON lines",
+                merge->manifest_path, merge->manifest_format == MANIFEST_CSV ? "CSV" : "JSON lines");
+        goto cleanup;
+    }
+    if (!merge->manifest_format_known) {
+        merge->manifest_format = format;
+        merge->manifest_format_known = true;
+        if (format == MANIFEST_CSV) fputs(MANIFEST_CSV_HEADER, merge->manifest);
+    }
+    if (format == MANIFEST_CSV) {
+        length = getline(&line, &capacity, file);
+    }
+
+    for (; length > 0; length = getline(&line, &capacity, file)) {
+        if (!manifest_entry_key(line, (size_t)length, format, key)) {
+            continue;
+        }
+        merge->stats.entries++;
+        int added = cert_dedup_add(merge->entries, key);
+        if (added < 0) {
+            fprintf(stderr, "Failed to allocate memory for manifest %s\n", path);
+            goto cleanup;
+        }
+        if (added == 1) {
+            fwrite(line, 1, (size_t)length, merge->manifest);
+            if (line[length - 1] != '\n') fputc('\n', merge->manifest);
+            merge->stats.entries_added++;
+        }
+    }
+    ret = ferror(file) ? -1 : 0;
+
+cleanup:
+    free(line);
+    fclose(file);
+    return ret;
+}
+
+/**
+ * Finish a merge: flush the pack store and the manifest and free the merge.
+ *
+ * @param merge The merge
+ * @param stats Receives the counters, or NULL
+ * @return 0 on success, -1 if anything could not be written
+ */
+int merge_close(merge_t *merge, merge_stats_t *stats) {
+    int ret = 0;
+
+    if (merge->store && cert_store_close(merge->store) != 0) {
+        ret = -1;
+    }
+    if (merge->manifest) {
+        bool failed = ferror(merge->manifest) != 0;
+        if (fclose(merge->manifest) != 0 || failed) {
+            fprintf(stderr, "Failed to write manifest %s\n", merge->manifest_path);
+            ret = -1;
+        }
+    }
+    if (stats) {
+        *stats = merge->stats;
+    }
+    cert_dedup_free(merge->certificates);
+    cert_dedup_free(merge->entries);
+    free(merge);
+    return ret;
+}
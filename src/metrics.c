@@ -0,0 +1,486 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// Log-linear buckets: each power of two is split into SUB_BUCKETS equal parts,
+// so every recorded value is kept to within about 6% up to 2^MAX_MAGNITUDE microseconds
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_MAGNITUDE 40
+#define HISTOGRAM_BUCKETS ((MAX_MAGNITUDE - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+#define MAX_PATH_LENGTH 1024
+#define METRIC_PREFIX "download_cert"
+
+static const char *const phase_names[METRIC_PHASES] = {
+    "dns", "connect", "handshake", "save", "total"
+};
+
+static const char *const outcome_names[METRIC_OUTCOMES] = {
+    "ok", "dns", "refused", "connect", "timeout", "handshake", "save", "other", "starttls"
+};
+
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+// A latency histogram written by one thread and read by any
+typedef struct {
+    atomic_uint_least64_t counts[HISTOGRAM_BUCKETS];
+    atomic_uint_least64_t total;
+    atomic_uint_least64_t sum_us;
+    atomic_uint_least64_t max_us;
+} histogram_t;
+
+// A merged copy of histograms, taken for reporting
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum_us;
+    uint64_t max_us;
+} histogram_snapshot_t;
+
+typedef struct {
+    histogram_snapshot_t phases[METRIC_PHASES];
+    histogram_snapshot_t outcomes[METRIC_OUTCOMES];
+} metrics_snapshot_t;
+
+// Metrics of one worker thread; only that thread writes them, so no lock is taken
+struct metrics_shard {
+    histogram_t phases[METRIC_PHASES];
+    histogram_t outcomes[METRIC_OUTCOMES];
+    metrics_shard_t *next;
+};
+
+struct metrics {
+    pthread_mutex_t mutex;
+    metrics_shard_t *shards;
+};
+
+struct metrics_reporter {
+    metrics_t *metrics;
+    int interval_seconds;
+    const char *path;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    bool stopping;
+};
+
+/**
+ * Add to a counter only its owning thread writes. A relaxed load and store is
+ * enough for a single writer, and avoids the locked read-modify-write.
+ *
+ * @param counter The counter
+ * @param amount The amount to add
+ */
+static void bump(atomic_uint_least64_t *counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+/**
+ * Find the bucket a value falls in.
+ *
+ * @param value The value in microseconds
+ * @return The bucket index
+ */
+static int bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return (int)value;
+    }
+    if (value >= (1ULL << MAX_MAGNITUDE)) {
+        value = (1ULL << MAX_MAGNITUDE) - 1;
+    }
+    int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    return shift * SUB_BUCKETS + (int)(value >> shift);
+}
+
+/**
+ * Find the value a bucket stands for: the middle of its range.
+ *
+ * @param index The bucket index
+ * @return The value in microseconds
+ */
+static uint64_t bucket_value(int index) {
+    if (index < 2 * SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(index - shift * SUB_BUCKETS) << shift;
+    return lower + (1ULL << shift) / 2;
+}
+
+/**
+ * Add one value to a histogram.
+ *
+ * @param histogram The histogram
+ * @param us The value in microseconds; negative values count as 0
+ */
+static void histogram_add(histogram_t *histogram, long long us) {
+    uint64_t value = us > 0 ? (uint64_t)us : 0;
+    bump(&histogram->counts[bucket_index(value)], 1);
+    bump(&histogram->total, 1);
+    bump(&histogram->sum_us, value);
+    if (value > atomic_load_explicit(&histogram->max_us, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max_us, value, memory_order_relaxed);
+    }
+}
+
+/**
+ * Add a histogram into a snapshot.
+ *
+ * @param snapshot The snapshot
+ * @param histogram The histogram
+ */
+static void histogram_merge(histogram_snapshot_t *snapshot, histogram_t *histogram) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot->counts[i] += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    }
+    snapshot->total += atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    snapshot->sum_us += atomic_load_explicit(&histogram->sum_us, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max_us, memory_order_relaxed);
+    if (max > snapshot->max_us) {
+        snapshot->max_us = max;
+    }
+}
+
+/**
+ * Find a quantile of a snapshot.
+ *
+ * @param snapshot The snapshot
+ * @param quantile The quantile, e.g. 0.99
+ * @return The value in microseconds, 0 if the histogram is empty
+ */
+static uint64_t histogram_quantile(const histogram_snapshot_t *snapshot, double quantile) {
+    uint64_t counted = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counted += snapshot->counts[i];
+    }
+    if (counted == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(quantile * (double)counted + 0.999999);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += snapshot->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < snapshot->max_us ? value : snapshot->max_us;
+        }
+    }
+    return snapshot->max_us;
+}
+
+/**
+ * Merge every thread's metrics.
+ *
+ * @param metrics The metrics
+ * @return The merged snapshot, or NULL on allocation failure
+ */
+static metrics_snapshot_t *take_snapshot(metrics_t *metrics) {
+    metrics_snapshot_t *snapshot = calloc(1, sizeof(*snapshot));
+    if (!snapshot) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&metrics->mutex);
+    for (metrics_shard_t *shard = metrics->shards; shard; shard = shard->next) {
+        for (int p = 0; p < METRIC_PHASES; p++) {
+            histogram_merge(&snapshot->phases[p], &shard->phases[p]);
+        }
+        for (int o = 0; o < METRIC_OUTCOMES; o++) {
+            histogram_merge(&snapshot->outcomes[o], &shard->outcomes[o]);
+        }
+    }
+    pthread_mutex_unlock(&metrics->mutex);
+    return snapshot;
+}
+
+/**
+ * Create an empty set of metrics.
+ *
+ * @return The metrics, or NULL on allocation failure
+ */
+metrics_t *metrics_create(void) {
+    metrics_t *metrics = calloc(1, sizeof(*metrics));
+    if (!metrics) {
+        return NULL;
+    }
+    pthread_mutex_init(&metrics->mutex, NULL);
+    return metrics;
+}
+
+/**
+ * Free a set of metrics and every thread's shard.
+ *
+ * @param metrics The metrics
+ */
+void metrics_free(metrics_t *metrics) {
+    metrics_shard_t *shard = metrics->shards;
+    while (shard) {
+        metrics_shard_t *next = shard->next;
+        free(shard);
+        shard = next;
+    }
+    pthread_mutex_destroy(&metrics->mutex);
+    free(metrics);
+}
+
+/**
+ * Name an outcome class, as used in reports and result records.
+ *
+ * @param outcome The outcome class
+ * @return The name
+ */
+const char *metric_outcome_name(metric_outcome_t outcome) {
+    return (unsigned)outcome < METRIC_OUTCOMES ? outcome_names[outcome] : "other";
+}
+
+/**
+ * Give a worker thread its own metrics to write. The lock is only taken here
+ * and while merging, never while recording.
+ *
+ * @param metrics The metrics
+ * @return The shard, or NULL on allocation failure
+ */
+metrics_shard_t *metrics_shard(metrics_t *metrics) {
+    metrics_shard_t *shard = calloc(1, sizeof(*shard));
+    if (!shard) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&metrics->mutex);
+    shard->next = metrics->shards;
+    metrics->shards = shard;
+    pthread_mutex_unlock(&metrics->mutex);
+    return shard;
+}
+
+/**
+ * Record how long a phase took for one target.
+ *
+ * @param shard The calling thread's shard, or NULL to record nothing
+ * @param phase The phase
+ * @param us The duration in microseconds
+ */
+void metrics_record(metrics_shard_t *shard, metric_phase_t phase, long long us) {
+    if (shard) {
+        histogram_add(&shard->phases[phase], us);
+    }
+}
+
+/**
+ * Record how a target ended and how long it took in all.
+ *
+ * @param shard The calling thread's shard, or NULL to record nothing
+ * @param outcome The outcome
+ * @param total_us The target's total time in microseconds
+ */
+void metrics_outcome(metrics_shard_t *shard, metric_outcome_t outcome, long long total_us) {
+    if (shard) {
+        histogram_add(&shard->phases[METRIC_PHASE_TOTAL], total_us);
+        histogram_add(&shard->outcomes[outcome], total_us);
+    }
+}
+
+/**
+ * Print one table row of counts and latency quantiles in milliseconds.
+ *
+ * @param out The stream
+ * @param name The row name
+ * @param snapshot The histogram
+ */
+static void report_row(FILE *out, const char *name, const histogram_snapshot_t *snapshot) {
+    fprintf(out, "  %-18s %10llu", name, (unsigned long long)snapshot->total);
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        fprintf(out, " %9.1f", (double)histogram_quantile(snapshot, quantiles[q]) / 1000.0);
+    }
+    fprintf(out, " %9.1f\n", (double)snapshot->max_us / 1000.0);
+}
+
+/**
+ * Print the merged latency quantiles of each phase and outcome.
+ *
+ * @param metrics The metrics
+ * @param out The stream
+ */
+void metrics_report(metrics_t *metrics, FILE *out) {
+    metrics_snapshot_t *snapshot = take_snapshot(metrics);
+    if (!snapshot) {
+        return;
+    }
+
+    fprintf(out, "  %-18s %10s %9s %9s %9s %9s\n", "Latency (ms)", "count", "p50", "p99", "p999", "max");
+    for (int p = 0; p < METRIC_PHASES; p++) {
+        report_row(out, phase_names[p], &snapshot->phases[p]);
+    }
+    for (int o = 0; o < METRIC_OUTCOMES; o++) {
+        if (snapshot->outcomes[o].total > 0) {
+            char name[32];
+            snprintf(name, sizeof(name), "outcome %s", outcome_names[o]);
+            report_row(out, name, &snapshot->outcomes[o]);
+        }
+    }
+    fflush(out);
+    free(snapshot);
+}
+
+/**
+ * Write one histogram as a Prometheus summary.
+ *
+ * @param out The stream
+ * @param name The metric name
+ * @param label The label name
+ * @param value The label value
+ * @param snapshot The histogram
+ */
+static void write_summary(FILE *out, const char *name, const char *label, const char *value,
+                          const histogram_snapshot_t *snapshot) {
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        fprintf(out, "%s{%s=\"%s\",quantile=\"%g\"} %.6f\n", name, label, value, quantiles[q],
+                (double)histogram_quantile(snapshot, quantiles[q]) / 1e6);
+    }
+    fprintf(out, "%s_sum{%s=\"%s\"} %.6f\n", name, label, value, (double)snapshot->sum_us / 1e6);
+    fprintf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long)snapshot->total);
+}
+
+/**
+ * Write the merged metrics in the Prometheus text format. The file is replaced
+ * atomically, so a collector never reads a partial file.
+ *
+ * @param metrics The metrics
+ * @param path The file
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+int metrics_write_prometheus(metrics_t *metrics, const char *path) {
+    char temp_path[MAX_PATH_LENGTH];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    metrics_snapshot_t *snapshot = take_snapshot(metrics);
+    if (!snapshot) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    FILE *out = fopen(temp_path, "w");
+    if (!out) {
+        free(snapshot);
+        return -1;
+    }
+
+    fprintf(out, "# HELP " METRIC_PREFIX "_phase_seconds Time spent in each phase of a target's scan.\n");
+    fprintf(out, "# TYPE " METRIC_PREFIX "_phase_seconds summary\n");
+    for (int p = 0; p < METRIC_PHASES; p++) {
+        write_summary(out, METRIC_PREFIX "_phase_seconds", "phase", phase_names[p], &snapshot->phases[p]);
+    }
+    fprintf(out, "# HELP " METRIC_PREFIX "_target_seconds Total time per target by outcome.\n");
+    fprintf(out, "# TYPE " METRIC_PREFIX "_target_seconds summary\n");
+    for (int o = 0; o < METRIC_OUTCOMES; o++) {
+        write_summary(out, METRIC_PREFIX "_target_seconds", "outcome", outcome_names[o], &snapshot->outcomes[o]);
+    }
+    free(snapshot);
+
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed) {
+        remove(temp_path);
+        return -1;
+    }
+    return rename(temp_path, path);
+}
+
+/**
+ * Reporter thread function.
+ * Prints the metrics to stderr and rewrites the Prometheus file every interval.
+ *
+ * @param arg Pointer to the reporter
+ * @return NULL
+ */
+static void *reporter_thread(void *arg) {
+    metrics_reporter_t *reporter = (metrics_reporter_t *)arg;
+    struct timespec next;
+    long elapsed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    pthread_mutex_lock(&reporter->mutex);
+    while (!reporter->stopping) {
+        next.tv_sec += reporter->interval_seconds;
+        while (!reporter->stopping &&
+               pthread_cond_timedwait(&reporter->wake, &reporter->mutex, &next) != ETIMEDOUT) {
+        }
+        if (reporter->stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&reporter->mutex);
+
+        elapsed += reporter->interval_seconds;
+        fprintf(stderr, "Stats after %lds:\n", elapsed);
+        metrics_report(reporter->metrics, stderr);
+        if (reporter->path && metrics_write_prometheus(reporter->metrics, reporter->path) != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", reporter->path, strerror(errno));
+        }
+
+        pthread_mutex_lock(&reporter->mutex);
+    }
+    pthread_mutex_unlock(&reporter->mutex);
+    return NULL;
+}
+
+/**
+ * Start reporting the metrics every interval while the scan runs.
+ *
+ * @param metrics The metrics
+ * @param interval_seconds Seconds between reports
+ * @param path Prometheus file to rewrite at each report, or NULL
+ * @return The reporter, or NULL on failure
+ */
+metrics_reporter_t *metrics_reporter_start(metrics_t *metrics, int interval_seconds, const char *path) {
+    metrics_reporter_t *reporter = calloc(1, sizeof(*reporter));
+    if (!reporter) {
+        return NULL;
+    }
+    reporter->metrics = metrics;
+    reporter->interval_seconds = interval_seconds;
+    reporter->path = path;
+    pthread_mutex_init(&reporter->mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reporter->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&reporter->thread, NULL, reporter_thread, reporter) != 0) {
+        pthread_cond_destroy(&reporter->wake);
+        pthread_mutex_destroy(&reporter->mutex);
+        free(reporter);
+        return NULL;
+    }
+    return reporter;
+}
+
+/**
+ * Stop the periodic reports.
+ *
+ * @param reporter The reporter
+ */
+void metrics_reporter_stop(metrics_reporter_t *reporter) {
+    pthread_mutex_lock(&reporter->mutex);
+    reporter->stopping = true;
+    pthread_cond_signal(&reporter->wake);
+    pthread_mutex_unlock(&reporter->mutex);
+
+    pthread_join(reporter->thread, NULL);
+    pthread_cond_destroy(&reporter->wake);
+    pthread_mutex_destroy(&reporter->mutex);
+    free(reporter);
+}
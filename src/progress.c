@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "progress.h"
+#include "utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// How long the reporter waits for SIGUSR1 when there are no periodic reports
+#define IDLE_WAIT_SECONDS 3600
+// Weight of the latest interval in the rate the ETA is based on
+#define RATE_SMOOTHING 0.3
+
+struct progress {
+    atomic_ullong started;
+    atomic_ullong attempts;
+    atomic_ullong timeouts;
+    atomic_ullong done;
+    atomic_ullong connects;
+    atomic_ullong connect_us;
+    atomic_int limit;
+};
+
+struct progress_reporter {
+    progress_t *progress;
+    int interval_seconds;
+    target_queue_t *input;
+    pthread_t thread;
+    atomic_bool stopping;
+    long long started_ms;
+    long long last_ms;
+    unsigned long long last_done;
+    double rate;
+};
+
+/**
+ * Create the scan's progress counters.
+ *
+ * @param limit The number of connections allowed at once
+ * @return The counters, or NULL on failure
+ */
+progress_t *progress_create(int limit) {
+    progress_t *progress = calloc(1, sizeof(*progress));
+    if (progress) {
+        atomic_init(&progress->limit, limit);
+    }
+    return progress;
+}
+
+/**
+ * Free the progress counters.
+ *
+ * @param progress The counters, or NULL
+ */
+void progress_free(progress_t *progress) {
+    free(progress);
+}
+
+/**
+ * Count a connection attempt as started.
+ *
+ * @param progress The counters, or NULL
+ */
+void progress_start(progress_t *progress) {
+    if (progress) {
+        atomic_fetch_add_explicit(&progress->started, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Count a finished connection attempt.
+ *
+ * @param progress The counters, or NULL
+ * @param outcome How the attempt ended
+ * @param final false if the target will be retried
+ * @param connect_us How long the TCP connect took, or -1 if it did not complete
+ */
+void progress_record(progress_t *progress, metric_outcome_t outcome, bool final, long long connect_us) {
+    if (!progress) {
+        return;
+    }
+    if (outcome == METRIC_OUTCOME_TIMEOUT) {
+        atomic_fetch_add_explicit(&progress->timeouts, 1, memory_order_relaxed);
+    }
+    if (connect_us >= 0) {
+        atomic_fetch_add_explicit(&progress->connects, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&progress->connect_us, (unsigned long long)connect_us, memory_order_relaxed);
+    }
+    if (final) {
+        atomic_fetch_add_explicit(&progress->done, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&progress->attempts, 1, memory_order_release);
+}
+
+/**
+ * Record the number of connections now allowed at once, for the reports.
+ *
+ * @param progress The counters, or NULL
+ * @param limit The limit
+ */
+void progress_set_limit(progress_t *progress, int limit) {
+    if (progress) {
+        atomic_store_explicit(&progress->limit, limit, memory_order_relaxed);
+    }
+}
+
+/**
+ * Read the counters.
+ *
+ * @param progress The counters
+ * @param sample Receives the totals so far
+ */
+void progress_sample(progress_t *progress, progress_sample_t *sample) {
+    // Every finished attempt was started first, so reading attempts first keeps started >= attempts
+    sample->attempts = atomic_load_explicit(&progress->attempts, memory_order_acquire);
+    sample->started = atomic_load_explicit(&progress->started, memory_order_relaxed);
+    sample->timeouts = atomic_load_explicit(&progress->timeouts, memory_order_relaxed);
+    sample->done = atomic_load_explicit(&progress->done, memory_order_relaxed);
+    sample->connects = atomic_load_explicit(&progress->connects, memory_order_relaxed);
+    sample->connect_us = atomic_load_explicit(&progress->connect_us, memory_order_relaxed);
+    sample->limit = atomic_load_explicit(&progress->limit, memory_order_relaxed);
+    if (sample->started < sample->attempts) {
+        sample->started = sample->attempts;
+    }
+}
+
+/**
+ * Format a number of seconds as 45s, 3m05s or 2h03m.
+ *
+ * @param seconds The duration
+ * @param buffer Receives the text
+ * @param size Size of the buffer
+ */
+static void format_duration(double seconds, char *buffer, size_t size) {
+    long long s = (long long)(seconds + 0.5);
+    if (s < 60) {
+        snprintf(buffer, size, "%llds", s);
+    } else if (s < 3600) {
+        snprintf(buffer, size, "%lldm%02llds", s / 60, s % 60);
+    } else {
+        snprintf(buffer, size, "%lldh%02lldm", s / 3600, (s % 3600) / 60);
+    }
+}
+
+/**
+ * Print one progress line to stderr: targets done of those read so far, the recent
+ * rate, the connections in flight against the limit, and the time left at that rate.
+ *
+ * @param reporter The reporter
+ */
+static void report_progress(progress_reporter_t *reporter) {
+    progress_sample_t sample;
+    long long now = monotonic_ms();
+    // Read the close first: once the queue is closed, the count read after it is final
+    bool final = target_queue_closed(reporter->input);
+    size_t total = target_queue_pushed(reporter->input);
+    char elapsed[32];
+    char eta[32] = "unknown";
+
+    progress_sample(reporter->progress, &sample);
+    if (now - reporter->last_ms >= 1000) {
+        double rate = (double)(sample.done - reporter->last_done) * 1000.0 / (double)(now - reporter->last_ms);
+        reporter->rate = reporter->last_done > 0 ? RATE_SMOOTHING * rate + (1.0 - RATE_SMOOTHING) * reporter->rate : rate;
+        reporter->last_ms = now;
+        reporter->last_done = sample.done;
+    }
+    if (reporter->rate > 0) {
+        format_duration((double)(total > sample.done ? total - sample.done : 0) / reporter->rate, eta, sizeof(eta));
+    }
+    format_duration((double)(now - reporter->started_ms) / 1000.0, elapsed, sizeof(elapsed));
+
+    if (final) {
+        fprintf(stderr, "Progress after %s: %llu/%zu targets (%.1f%%), %.1f hosts/s, %llu in flight (limit %d), ETA %s\n",
+                elapsed, sample.done, total, total ? 100.0 * (double)sample.done / (double)total : 100.0,
+                reporter->rate, sample.started - sample.attempts, sample.limit, eta);
+    } else {
+        fprintf(stderr, "Progress after %s: %llu/%zu+ targets, %.1f hosts/s, %llu in flight (limit %d), ETA %s%s\n",
+                elapsed, sample.done, total, reporter->rate, sample.started - sample.attempts, sample.limit,
+                reporter->rate > 0 ? "more than " : "", eta);
+    }
+}
+
+/**
+ * Reporter thread function.
+ * Prints a progress line every interval, and at once whenever the process gets SIGUSR1.
+ *
+ * @param arg Pointer to the reporter
+ * @return NULL
+ */
+static void *reporter_thread(void *arg) {
+    progress_reporter_t *reporter = (progress_reporter_t *)arg;
+    long long next_ms = reporter->started_ms + reporter->interval_seconds * 1000LL;
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while (!atomic_load(&reporter->stopping)) {
+        long long wait_ms = IDLE_WAIT_SECONDS * 1000LL;
+        if (reporter->interval_seconds > 0) {
+            long long now = monotonic_ms();
+            wait_ms = next_ms > now ? next_ms - now : 0;
+        }
+        struct timespec timeout = { .tv_sec = (time_t)(wait_ms / 1000), .tv_nsec = (long)(wait_ms % 1000) * 1000000L };
+
+        int sig = sigtimedwait(&signals, NULL, &timeout);
+        if (atomic_load(&reporter->stopping)) {
+            break;
+        }
+        if (sig == SIGUSR1) {
+            report_progress(reporter);
+        } else if (errno == EAGAIN && reporter->interval_seconds > 0) {
+            report_progress(reporter);
+            next_ms += reporter->interval_seconds * 1000LL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start reporting the scan's progress on stderr, every interval and on SIGUSR1.
+ * SIGUSR1 must be blocked in every other thread, so that it reaches this one.
+ *
+ * @param progress The counters
+ * @param interval_seconds Seconds between reports, or 0 to report only on SIGUSR1
+ * @param input The queue every target to scan passes through, giving the total
+ * @return The reporter, or NULL on failure
+ */
+progress_reporter_t *progress_reporter_start(progress_t *progress, int interval_seconds, target_queue_t *input) {
+    progress_reporter_t *reporter = calloc(1, sizeof(*reporter));
+    if (!reporter) {
+        return NULL;
+    }
+    reporter->progress = progress;
+    reporter->interval_seconds = interval_seconds;
+    reporter->input = input;
+    reporter->started_ms = monotonic_ms();
+    reporter->last_ms = reporter->started_ms;
+    atomic_init(&reporter->stopping, false);
+
+    // The thread starts with the signal blocked, so it takes it from sigtimedwait instead of dying of it
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    int rc = pthread_create(&reporter->thread, NULL, reporter_thread, reporter);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (rc != 0) {
+        free(reporter);
+        return NULL;
+    }
+    return reporter;
+}
+
+/**
+ * Stop the progress reports.
+ *
+ * @param reporter The reporter
+ */
+void progress_reporter_stop(progress_reporter_t *reporter) {
+    atomic_store(&reporter->stopping, true);
+    pthread_kill(reporter->thread, SIGUSR1);
+    pthread_join(reporter->thread, NULL);
+    free(reporter);
+}
@@ -1,6 +1,454 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include "read_file.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Consumed parts of a mapped file are dropped from memory in chunks of this size
+#define RELEASE_CHUNK (64UL * 1024 * 1024)
+
+// Where the lines come from: a memory-mapped regular file, or a stream such as stdin
+struct input_source {
+    const char *map;
+    size_t size;
+    FILE *stream;
+};
+
+// The byte range of a mapped file handled by one reader thread
+typedef struct {
+    input_reader_t *reader;
+    size_t start;
+    size_t end;
+} reader_range_t;
+
+struct input_reader {
+    input_source_t *source;
+    target_queue_t *output;
+    const journal_set_t *finished;
+    target_generator_t *generator;
+    const shard_t *shard;
+    atomic_size_t skipped;
+    atomic_size_t other_shards;
+    pthread_t *threads;
+    reader_range_t *ranges;
+    int count;
+    int started;
+    atomic_int running;
+};
+
+/**
+ * Open the input for reading. Regular files are memory-mapped; "-" reads stdin,
+ * and anything that cannot be mapped (pipes, FIFOs) is streamed instead.
+ *
+ * @param filename The input file name, or "-" for stdin
+ * @return The input source, or NULL on failure (errno is set)
+ */
+input_source_t *open_input_source(const char *filename) {
+    input_source_t *source = calloc(1, sizeof(*source));
+    if (!source) {
+        return NULL;
+    }
+
+    if (strcmp(filename, "-") == 0) {
+        source->stream = stdin;
+        return source;
+    }
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        int saved_errno = errno;
+        if (fd >= 0) close(fd);
+        free(source);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        source->size = (size_t)st.st_size;
+        if (source->size > 0) {
+            void *map = mmap(NULL, source->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, source->size, MADV_SEQUENTIAL);
+                source->map = map;
+                close(fd);
+                return source;
+            }
+        } else {
+            close(fd);
+            return source;
+        }
+    }
+
+    source->size = 0;
+    source->stream = fdopen(fd, "r");
+    if (!source->stream) {
+        int saved_errno = errno;
+        close(fd);
+        free(source);
+        errno = saved_errno;
+        return NULL;
+    }
+    return source;
+}
+
+/**
+ * Close an input source.
+ *
+ * @param source The input source
+ */
+void close_input_source(input_source_t *source) {
+    if (source->map) {
+        munmap((void *)source->map, source->size);
+    }
+    if (source->stream && source->stream != stdin) {
+        fclose(source->stream);
+    }
+    free(source);
+}
+
+/**
+ * Parse one hostname[:port][/protocol] input line into a target. An IPv6 address takes
+ * a port as [address]:port; a bare one, with more than one colon, has none.
+ *
+ * @param line The line, without or with its trailing newline
+ * @param target Receives the hostname, port and STARTTLS protocol. Without a port the
+ *               protocol's usual port is used, or DEFAULT_PORT; without a protocol it
+ *               is left to be inferred from the port.
+ * @param has_port Receives whether the line gave a port
+ * @return true if the line holds an entry, false if it is blank, malformed, does not fit or names an unknown protocol
+ */
+bool parse_target_line(line_slice_t line, target_t *target, bool *has_port) {
+    size_t length = line.length;
+    while (length > 0 && (line.data[length - 1] == '\n' || line.data[length - 1] == '\r')) {
+        length--;
+    }
+    if (length == 0) {
+        return false;
+    }
+
+    target->starttls = STARTTLS_AUTO;
+    const char *slash = memchr(line.data, '/', length);
+    if (slash) {
+        int protocol = starttls_protocol_parse(slash + 1, length - (size_t)(slash - line.data) - 1);
+        if (protocol < 0) {
+            return false;
+        }
+        target->starttls = (uint8_t)protocol;
+        length = (size_t)(slash - line.data);
+    }
+
+    char default_port[TARGET_MAX_PORT];
+    snprintf(default_port, sizeof(default_port), "%u",
+             (unsigned int)starttls_default_port((starttls_protocol_t)target->starttls));
+    const char *host = line.data;
+    const char *colon = memchr(line.data, ':', length);
+    size_t host_length = colon ? (size_t)(colon - line.data) : length;
+    if (line.data[0] == '[') {
+        // [address] or [address]:port
+        const char *bracket = memchr(line.data, ']', length);
+        if (!bracket) {
+            return false;
+        }
+        host = line.data + 1;
+        host_length = (size_t)(bracket - host);
+        size_t rest = length - (size_t)(bracket - line.data) - 1;
+        if (rest > 0 && bracket[1] != ':') {
+            return false;
+        }
+        colon = rest > 0 ? bracket + 1 : NULL;
+    } else if (colon && memchr(colon + 1, ':', length - host_length - 1)) {
+        // A bare IPv6 address
+        colon = NULL;
+        host_length = length;
+    }
+    const char *port = colon ? colon + 1 : slash ? default_port : DEFAULT_PORT;
+    size_t port_length = colon ? length - (size_t)(colon - line.data) - 1 : strlen(port);
+
+    if (host_length == 0 || host_length >= sizeof(target->hostname) || port_length >= sizeof(target->port)) {
+        return false;
+    }
+
+    *has_port = colon != NULL;
+    memcpy(target->hostname, host, host_length);
+    target->hostname[host_length] = '\0';
+    memcpy(target->port, port, port_length);
+    target->port[port_length] = '\0';
+    return true;
+}
+
+/**
+ * Queue a target for the resolver stage, unless another node's shard owns it
+ * or an earlier run finished it.
+ *
+ * @param context The input reader
+ * @param target The target
+ * @return false if the output queue was closed
+ */
+static bool queue_target(void *context, target_t *target) {
+    input_reader_t *reader = context;
+    if (reader->shard && !shard_contains(reader->shard, target)) {
+        atomic_fetch_add_explicit(&reader->other_shards, 1, memory_order_relaxed);
+        return true;
+    }
+    if (reader->finished && journal_contains(reader->finished, target)) {
+        atomic_fetch_add_explicit(&reader->skipped, 1, memory_order_relaxed);
+        return true;
+    }
+    return target_queue_push(reader->output, target);
+}
+
+/**
+ * Parse a line and queue it for the resolver stage. Lines too long to hold a
+ * hostname and port are reported rather than truncated, and targets finished
+ * in an earlier run are dropped before they cost a DNS lookup. Address ranges
+ * go to the generator, and entries without a port expand to every listed port.
+ *
+ * @param reader The input reader
+ * @param line The line
+ * @param offset Byte offset of the line in the input, for the warning
+ * @param target Scratch target
+ * @return false if the output queue was closed
+ */
+static bool queue_line(input_reader_t *reader, line_slice_t line, size_t offset, target_t *target) {
+    const port_list_t *ports = NULL;
+    if (reader->generator) {
+        int range = target_generator_add(reader->generator, line.data, line.length);
+        if (range != 0) {
+            if (range < 0) {
+                fprintf(stderr, "Skipping input line at byte offset %zu: invalid or too large address range\n", offset);
+            }
+            return true;
+        }
+        ports = target_generator_ports(reader->generator);
+    }
+
+    bool has_port;
+    if (!parse_target_line(line, target, &has_port)) {
+        if (line.length > 0 && line.data[0] != '\n' && line.data[0] != '\r') {
+            fprintf(stderr, "Skipping input line at byte offset %zu: malformed or too long entry, or unknown protocol\n", offset);
+        }
+        return true;
+    }
+    if (!ports || has_port) {
+        return queue_target(reader, target);
+    }
+
+    for (size_t i = 0; i < ports->count; i++) {
+        snprintf(target->port, sizeof(target->port), "%u", (unsigned int)ports->ports[i]);
+        if (!queue_target(reader, target)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parse every line in one byte range of a mapped file. Pages already parsed are
+ * released as the reader moves on so resident memory does not grow with the input.
+ *
+ * @param range The byte range
+ */
+static void read_mapped_range(reader_range_t *range) {
+    input_reader_t *reader = range->reader;
+    const char *map = reader->source->map;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t released = range->start;
+    size_t pos = range->start;
+    target_t target;
+
+    memset(&target, 0, sizeof(target));
+    while (pos < range->end) {
+        const char *newline = memchr(map + pos, '\n', range->end - pos);
+        size_t length = newline ? (size_t)(newline - (map + pos)) : range->end - pos;
+        line_slice_t line = { map + pos, length };
+
+        if (!queue_line(reader, line, pos, &target)) {
+            return;
+        }
+        pos += length + (newline ? 1 : 0);
+
+        if (pos - released >= RELEASE_CHUNK) {
+            size_t from = (released + page_size - 1) & ~(page_size - 1);
+            size_t to = pos & ~(page_size - 1);
+            if (to > from) {
+                madvise((void *)(map + from), to - from, MADV_DONTNEED);
+            }
+            released = pos;
+        }
+    }
+}
+
+/**
+ * Parse every line of a streamed input.
+ *
+ * @param reader The input reader
+ */
+static void read_stream(input_reader_t *reader) {
+    char *buffer = NULL;
+    size_t capacity = 0;
+    size_t offset = 0;
+    ssize_t length;
+    target_t target;
+
+    memset(&target, 0, sizeof(target));
+    while ((length = getline(&buffer, &capacity, reader->source->stream)) > 0) {
+        line_slice_t line = { buffer, (size_t)length };
+        if (!queue_line(reader, line, offset, &target)) {
+            break;
+        }
+        offset += (size_t)length;
+    }
+    free(buffer);
+}
+
+/**
+ * Input reader thread function.
+ * Parses its share of the input and queues it for the resolver stage. The last
+ * reader to finish expands the address ranges every reader collected, then
+ * closes the queue. Waiting on a full queue keeps memory bounded.
+ *
+ * @param arg Pointer to the reader's byte range
+ * @return NULL
+ */
+static void *input_reader_thread(void *arg) {
+    reader_range_t *range = (reader_range_t *)arg;
+    input_reader_t *reader = range->reader;
+
+    if (reader->source->stream) {
+        read_stream(reader);
+    } else if (reader->source->map) {
+        read_mapped_range(range);
+    }
+
+    if (atomic_fetch_sub(&reader->running, 1) == 1) {
+        if (reader->generator) {
+            target_t target;
+            memset(&target, 0, sizeof(target));
+            target_generator_run(reader->generator, &target, queue_target, reader);
+        }
+        target_queue_close(reader->output);
+    }
+    return NULL;
+}
+
+/**
+ * Find the start of the line containing a byte offset's successor, so that
+ * every range begins at a line boundary.
+ *
+ * @param source The mapped input
+ * @param offset A byte offset
+ * @return The offset just past the first newline at or after offset - 1
+ */
+static size_t align_to_line(const input_source_t *source, size_t offset) {
+    if (offset == 0 || offset >= source->size) {
+        return offset == 0 ? 0 : source->size;
+    }
+    const char *newline = memchr(source->map + offset - 1, '\n', source->size - offset + 1);
+    return newline ? (size_t)(newline - source->map) + 1 : source->size;
+}
+
+/**
+ * Start the threads that feed parsed input lines into the pipeline.
+ * A mapped file is split into one byte range per reader at line boundaries;
+ * a streamed input is always read by a single thread.
+ *
+ * @param source The input source
+ * @param readers Number of reader threads for a mapped file
+ * @param output The queue parsed targets are pushed to; closed at end of input
+ * @param finished Targets to skip because an earlier run finished them, or NULL
+ * @param generator Collects and expands address ranges and port lists, or NULL to read plain entries only
+ * @param shard The share of the targets this node scans, or NULL to scan them all
+ * @return The running reader, or NULL on failure
+ */
+input_reader_t *input_reader_start(input_source_t *source, int readers, target_queue_t *output,
+                                   const journal_set_t *finished, target_generator_t *generator,
+                                   const shard_t *shard) {
+    input_reader_t *reader = calloc(1, sizeof(*reader));
+    if (!reader) {
+        return NULL;
+    }
+
+    reader->source = source;
+    reader->output = output;
+    reader->finished = finished;
+    reader->generator = generator;
+    reader->shard = shard;
+    atomic_init(&reader->skipped, 0);
+    atomic_init(&reader->other_shards, 0);
+    reader->count = source->stream || readers < 1 ? 1 : readers;
+    reader->threads = calloc((size_t)reader->count, sizeof(*reader->threads));
+    reader->ranges = calloc((size_t)reader->count, sizeof(*reader->ranges));
+    if (!reader->threads || !reader->ranges) {
+        free(reader->threads);
+        free(reader->ranges);
+        free(reader);
+        return NULL;
+    }
+
+    for (int i = 0; i < reader->count; i++) {
+        reader->ranges[i].reader = reader;
+        reader->ranges[i].start = i == 0 ? 0 : reader->ranges[i - 1].end;
+        reader->ranges[i].end = align_to_line(source, source->size * (size_t)(i + 1) / (size_t)reader->count);
+    }
 
-FILE *open_input_file(const char *filename) {
-    return fopen(filename, "r");
+    atomic_init(&reader->running, reader->count);
+    for (; reader->started < reader->count; reader->started++) {
+        if (pthread_create(&reader->threads[reader->started], NULL, input_reader_thread,
+                           &reader->ranges[reader->started]) != 0) {
+            perror("Failed to create input reader thread");
+            break;
+        }
+    }
+
+    // Account for threads that never started so the queue still gets closed
+    int missing = reader->count - reader->started;
+    if (missing > 0 && atomic_fetch_sub(&reader->running, missing) == missing) {
+        target_queue_close(output);
+    }
+    return reader;
+}
+
+/**
+ * Report how many targets were skipped as finished in an earlier run.
+ *
+ * @param reader The input reader
+ * @return The number of targets skipped
+ */
+size_t input_reader_skipped(input_reader_t *reader) {
+    return atomic_load(&reader->skipped);
 }
 
+/**
+ * Report how many targets were left to the nodes scanning the other shards.
+ *
+ * @param reader The input reader
+ * @return The number of targets outside this node's shard
+ */
+size_t input_reader_other_shards(input_reader_t *reader) {
+    return atomic_load(&reader->other_shards);
+}
+
+/**
+ * Wait for the input reader threads to finish and free the reader.
+ *
+ * @param reader The input reader
+ */
+void input_reader_join(input_reader_t *reader) {
+    for (int i = 0; i < reader->started; i++) {
+        if (pthread_join(reader->threads[i], NULL) != 0) {
+            perror("Failed to join input reader thread");
+        }
+    }
+    free(reader->threads);
+    free(reader->ranges);
+    free(reader);
+}
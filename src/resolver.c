@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+
+#include "resolver.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define DNS_ANSWER_SIZE 4096
+#define NEGATIVE_TTL_SECONDS 60
+#define CACHE_SHARDS 64
+
+// One cached lookup result for a hostname
+typedef struct {
+    char hostname[TARGET_MAX_HOSTNAME];
+    long long expires_ms;
+    resolve_status_t status;
+    int addr_count;
+    target_addr_t addrs[TARGET_MAX_ADDRS];
+} cache_entry_t;
+
+// A direct-mapped slice of the cache with its own lock
+typedef struct {
+    pthread_mutex_t mutex;
+    cache_entry_t *entries;
+    size_t size;
+} cache_shard_t;
+
+struct resolver {
+    resolver_options_t options;
+    target_queue_t *input;
+    target_queue_t *output;
+    pthread_t *threads;
+    int started;
+    int running;
+    pthread_mutex_t mutex;
+    bool use_server;
+    struct sockaddr_in server;
+    cache_shard_t shards[CACHE_SHARDS];
+};
+
+/**
+ * Hash a hostname case-insensitively (FNV-1a).
+ *
+ * @param hostname The hostname
+ * @return The 64-bit hash
+ */
+static uint64_t hash_hostname(const char *hostname) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)hostname; *p; p++) {
+        hash ^= (uint64_t)tolower(*p);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Find the cache slot a hostname maps to.
+ *
+ * @param resolver The resolver
+ * @param hostname The hostname
+ * @param entry Receives the slot (only valid while the shard is locked)
+ * @return The shard holding the slot, or NULL if caching is disabled
+ */
+static cache_shard_t *cache_slot(resolver_t *resolver, const char *hostname, cache_entry_t **entry) {
+    uint64_t hash = hash_hostname(hostname);
+    cache_shard_t *shard = &resolver->shards[hash % CACHE_SHARDS];
+    if (shard->size == 0) {
+        return NULL;
+    }
+    *entry = &shard->entries[(hash / CACHE_SHARDS) % shard->size];
+    return shard;
+}
+
+/**
+ * Fill a target from the cache if an unexpired result is present.
+ *
+ * @param resolver The resolver
+ * @param target The target to fill
+ * @return true on a cache hit
+ */
+static bool cache_lookup(resolver_t *resolver, target_t *target) {
+    cache_entry_t *entry;
+    cache_shard_t *shard = cache_slot(resolver, target->hostname, &entry);
+    bool hit = false;
+    if (!shard) {
+        return false;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    if (entry->expires_ms > monotonic_ms() && strcasecmp(entry->hostname, target->hostname) == 0) {
+        target->dns_status = entry->status;
+        target->addr_count = entry->addr_count;
+        memcpy(target->addrs, entry->addrs, sizeof(target->addrs));
+        hit = true;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return hit;
+}
+
+/**
+ * Store a lookup result in the cache, replacing whatever shared its slot.
+ *
+ * @param resolver The resolver
+ * @param target The resolved target
+ * @param ttl_seconds How long the result stays valid
+ */
+static void cache_store(resolver_t *resolver, const target_t *target, long long ttl_seconds) {
+    cache_entry_t *entry;
+    cache_shard_t *shard = cache_slot(resolver, target->hostname, &entry);
+    if (!shard || ttl_seconds <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    memcpy(entry->hostname, target->hostname, sizeof(entry->hostname));
+    entry->expires_ms = monotonic_ms() + ttl_seconds * 1000;
+    entry->status = target->dns_status;
+    entry->addr_count = target->addr_count;
+    memcpy(entry->addrs, target->addrs, sizeof(entry->addrs));
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * Append an address to a target unless it is full or already present.
+ *
+ * @param target The target
+ * @param family AF_INET or AF_INET6
+ * @param addr The raw address (4 or 16 bytes)
+ */
+static void add_address(target_t *target, int family, const void *addr) {
+    size_t len = family == AF_INET ? 4 : 16;
+    for (int i = 0; i < target->addr_count; i++) {
+        if (target->addrs[i].family == family && memcmp(target->addrs[i].addr, addr, len) == 0) {
+            return;
+        }
+    }
+    if (target->addr_count < TARGET_MAX_ADDRS) {
+        target_addr_t *slot = &target->addrs[target->addr_count++];
+        memset(slot, 0, sizeof(*slot));
+        slot->family = family;
+        memcpy(slot->addr, addr, len);
+    }
+}
+
+/**
+ * Resolve a hostname with the system resolver (getaddrinfo).
+ * It reports no TTL, so results are cached for the configured lifetime.
+ *
+ * @param target The target to fill
+ * @return The resolution status
+ */
+static resolve_status_t query_system(target_t *target) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo *result = NULL;
+
+    int rc = getaddrinfo(target->hostname, NULL, &hints, &result);
+    switch (rc) {
+        case 0:
+            break;
+        case EAI_NONAME:
+            return RESOLVE_NXDOMAIN;
+        case EAI_NODATA:
+        case EAI_ADDRFAMILY:
+            return RESOLVE_NODATA;
+        default:
+            return RESOLVE_TEMPFAIL;
+    }
+
+    for (struct addrinfo *ai = result; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET) {
+            add_address(target, AF_INET, &((struct sockaddr_in *)ai->ai_addr)->sin_addr);
+        } else if (ai->ai_family == AF_INET6) {
+            add_address(target, AF_INET6, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr);
+        }
+    }
+    freeaddrinfo(result);
+
+    return target->addr_count > 0 ? RESOLVE_OK : RESOLVE_NODATA;
+}
+
+/**
+ * Query one record type from the configured DNS server and collect the addresses.
+ *
+ * @param state The thread's resolver state
+ * @param target The target to fill
+ * @param type ns_t_a or ns_t_aaaa
+ * @param min_ttl Lowered to the smallest TTL among the returned records
+ * @return The resolution status for this record type
+ */
+static resolve_status_t query_server_type(res_state state, target_t *target, ns_type type, uint32_t *min_ttl) {
+    unsigned char answer[DNS_ANSWER_SIZE];
+    ns_msg msg;
+
+    int len = res_nquery(state, target->hostname, ns_c_in, type, answer, sizeof(answer));
+    if (len < 0) {
+        switch (state->res_h_errno) {
+            case HOST_NOT_FOUND:
+                return RESOLVE_NXDOMAIN;
+            case NO_DATA:
+                return RESOLVE_NODATA;
+            default:
+                return RESOLVE_TEMPFAIL;
+        }
+    }
+
+    if (ns_initparse(answer, len, &msg) < 0) {
+        return RESOLVE_TEMPFAIL;
+    }
+
+    bool found = false;
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0 || ns_rr_type(rr) != type) {
+            continue;
+        }
+        if (type == ns_t_a && ns_rr_rdlen(rr) == 4) {
+            add_address(target, AF_INET, ns_rr_rdata(rr));
+        } else if (type == ns_t_aaaa && ns_rr_rdlen(rr) == 16) {
+            add_address(target, AF_INET6, ns_rr_rdata(rr));
+        } else {
+            continue;
+        }
+        if (ns_rr_ttl(rr) < *min_ttl) {
+            *min_ttl = ns_rr_ttl(rr);
+        }
+        found = true;
+    }
+
+    return found ? RESOLVE_OK : RESOLVE_NODATA;
+}
+
+/**
+ * Resolve a hostname's A and AAAA records against the configured DNS server.
+ *
+ * @param state The thread's resolver state
+ * @param target The target to fill
+ * @param ttl_seconds Receives the smallest record TTL
+ * @return The resolution status
+ */
+static resolve_status_t query_server(res_state state, target_t *target, long long *ttl_seconds) {
+    uint32_t min_ttl = UINT32_MAX;
+
+    resolve_status_t a = query_server_type(state, target, ns_t_a, &min_ttl);
+    if (a == RESOLVE_NXDOMAIN) {
+        return a;
+    }
+    resolve_status_t aaaa = query_server_type(state, target, ns_t_aaaa, &min_ttl);
+
+    if (target->addr_count > 0) {
+        *ttl_seconds = min_ttl;
+        return RESOLVE_OK;
+    }
+    if (a == RESOLVE_TEMPFAIL || aaaa == RESOLVE_TEMPFAIL) {
+        return RESOLVE_TEMPFAIL;
+    }
+    return aaaa == RESOLVE_NXDOMAIN ? RESOLVE_NXDOMAIN : RESOLVE_NODATA;
+}
+
+/**
+ * Resolve a target's hostname and port, going through the cache.
+ *
+ * @param resolver The resolver
+ * @param state The thread's resolver state, or NULL to use the system resolver
+ * @param target The target to fill
+ */
+static void resolve_target(resolver_t *resolver, res_state state, target_t *target) {
+    char *endptr;
+    long port = strtol(target->port, &endptr, 10);
+
+    target->addr_count = 0;
+    if (target->hostname[0] == '\0' || *endptr != '\0' || port <= 0 || port > 65535) {
+        target->dns_status = RESOLVE_INVALID;
+        return;
+    }
+    target->port_number = (uint16_t)port;
+
+    // Literal addresses need no lookup
+    unsigned char literal[16];
+    if (inet_pton(AF_INET, target->hostname, literal) == 1) {
+        add_address(target, AF_INET, literal);
+        target->dns_status = RESOLVE_OK;
+        return;
+    }
+    if (inet_pton(AF_INET6, target->hostname, literal) == 1) {
+        add_address(target, AF_INET6, literal);
+        target->dns_status = RESOLVE_OK;
+        return;
+    }
+
+    if (cache_lookup(resolver, target)) {
+        return;
+    }
+
+    long long ttl_seconds = resolver->options.ttl_seconds;
+    if (state) {
+        target->dns_status = query_server(state, target, &ttl_seconds);
+    } else {
+        target->dns_status = query_system(target);
+    }
+
+    // Temporary failures are not cached so the next occurrence tries again
+    if (target->dns_status == RESOLVE_OK) {
+        cache_store(resolver, target, ttl_seconds);
+    } else if (target->dns_status != RESOLVE_TEMPFAIL) {
+        cache_store(resolver, target, NEGATIVE_TTL_SECONDS);
+    }
+}
+
+/**
+ * Queue a resolved target for the connect stage. When every address is to be scanned, a
+ * target with several becomes one target per address, each connected to on its own.
+ *
+ * @param resolver The resolver
+ * @param target The resolved target
+ * @return true on success, false if the output queue was closed
+ */
+static bool push_resolved(resolver_t *resolver, const target_t *target) {
+    if (!resolver->options.all_addresses || target->dns_status != RESOLVE_OK || target->addr_count <= 1) {
+        return target_queue_push(resolver->output, target);
+    }
+
+    target_t single = *target;
+    single.addr_count = 1;
+    for (int i = 0; i < target->addr_count; i++) {
+        single.addrs[0] = target->addrs[i];
+        if (!target_queue_push(resolver->output, &single)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Resolver thread function.
+ * Takes parsed targets from the input stage, resolves them and queues them for the connect stage.
+ * The last thread to finish closes the output queue.
+ *
+ * @param arg Pointer to the resolver
+ * @return NULL
+ */
+static void *resolver_thread(void *arg) {
+    resolver_t *resolver = (resolver_t *)arg;
+    struct __res_state state;
+    res_state statep = NULL;
+    target_t target;
+
+    if (resolver->use_server) {
+        memset(&state, 0, sizeof(state));
+        if (res_ninit(&state) == 0) {
+            state.nsaddr_list[0] = resolver->server;
+            state.nscount = 1;
+            statep = &state;
+        } else {
+            fprintf(stderr, "Failed to initialise resolver state, using the system resolver\n");
+        }
+    }
+
+    while (target_queue_pop(resolver->input, &target, -1) > 0) {
+        long long started = monotonic_us();
+        resolve_target(resolver, statep, &target);
+        target.dns_us = (uint32_t)(monotonic_us() - started);
+        if (!push_resolved(resolver, &target)) {
+            break;
+        }
+    }
+
+    if (statep) {
+        res_nclose(statep);
+    }
+
+    pthread_mutex_lock(&resolver->mutex);
+    if (--resolver->running == 0) {
+        target_queue_close(resolver->output);
+    }
+    pthread_mutex_unlock(&resolver->mutex);
+
+    return NULL;
+}
+
+/**
+ * Parse an IPv4 DNS server address with an optional port.
+ *
+ * @param server The address, e.g. "127.0.0.1" or "127.0.0.1:5353"
+ * @param addr Receives the socket address
+ * @return true on success, false if the address is invalid
+ */
+static bool parse_server(const char *server, struct sockaddr_in *addr) {
+    char host[INET_ADDRSTRLEN];
+    long port = NS_DEFAULTPORT;
+    const char *colon = strchr(server, ':');
+    size_t host_len = colon ? (size_t)(colon - server) : strlen(server);
+
+    if (host_len >= sizeof(host)) {
+        return false;
+    }
+    memcpy(host, server, host_len);
+    host[host_len] = '\0';
+
+    if (colon) {
+        char *endptr;
+        port = strtol(colon + 1, &endptr, 10);
+        if (*endptr != '\0' || port <= 0 || port > 65535) {
+            return false;
+        }
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)port);
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1;
+}
+
+/**
+ * Free a resolver whose threads have all been joined.
+ *
+ * @param resolver The resolver
+ */
+static void resolver_free(resolver_t *resolver) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&resolver->shards[i].mutex);
+        free(resolver->shards[i].entries);
+    }
+    pthread_mutex_destroy(&resolver->mutex);
+    free(resolver->threads);
+    free(resolver);
+}
+
+/**
+ * Start the resolver stage.
+ *
+ * @param options Thread count, optional DNS server, cache lifetime and size
+ * @param input The queue of parsed targets from the input stage
+ * @param output The queue resolved targets are pushed to; closed when the input is exhausted
+ * @return The running resolver, or NULL on failure
+ */
+resolver_t *resolver_start(const resolver_options_t *options, target_queue_t *input, target_queue_t *output) {
+    resolver_t *resolver = calloc(1, sizeof(*resolver));
+    if (!resolver) {
+        return NULL;
+    }
+
+    resolver->options = *options;
+    resolver->input = input;
+    resolver->output = output;
+    pthread_mutex_init(&resolver->mutex, NULL);
+
+    size_t shard_size = options->cache_entries > 0 ? ((size_t)options->cache_entries + CACHE_SHARDS - 1) / CACHE_SHARDS : 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&resolver->shards[i].mutex, NULL);
+        if (shard_size > 0) {
+            resolver->shards[i].entries = calloc(shard_size, sizeof(cache_entry_t));
+            if (!resolver->shards[i].entries) {
+                fprintf(stderr, "Failed to allocate the DNS cache\n");
+                resolver_free(resolver);
+                return NULL;
+            }
+            resolver->shards[i].size = shard_size;
+        }
+    }
+
+    if (options->server) {
+        if (!parse_server(options->server, &resolver->server)) {
+            fprintf(stderr, "Invalid DNS server address: %s\n", options->server);
+            resolver_free(resolver);
+            return NULL;
+        }
+        resolver->use_server = true;
+    }
+
+    resolver->threads = calloc((size_t)options->threads, sizeof(*resolver->threads));
+    if (!resolver->threads) {
+        resolver_free(resolver);
+        return NULL;
+    }
+
+    resolver->running = options->threads;
+    for (; resolver->started < options->threads; resolver->started++) {
+        if (pthread_create(&resolver->threads[resolver->started], NULL, resolver_thread, resolver) != 0) {
+            perror("Failed to create resolver thread");
+            break;
+        }
+    }
+
+    // Account for threads that never started so the queue still gets closed
+    pthread_mutex_lock(&resolver->mutex);
+    resolver->running -= options->threads - resolver->started;
+    if (resolver->running == 0) {
+        target_queue_close(output);
+    }
+    pthread_mutex_unlock(&resolver->mutex);
+
+    return resolver;
+}
+
+/**
+ * Wait for the resolver threads to finish and free the resolver.
+ *
+ * @param resolver The resolver
+ */
+void resolver_join(resolver_t *resolver) {
+    for (int i = 0; i < resolver->started; i++) {
+        if (pthread_join(resolver->threads[i], NULL) != 0) {
+            perror("Failed to join resolver thread");
+        }
+    }
+    resolver_free(resolver);
+}
+
+/**
+ * Get a short human-readable name for a resolution status.
+ *
+ * @param status The status
+ * @return A static string
+ */
+const char *resolve_status_name(resolve_status_t status) {
+    switch (status) {
+        case RESOLVE_OK:
+            return "ok";
+        case RESOLVE_NXDOMAIN:
+            return "NXDOMAIN";
+        case RESOLVE_NODATA:
+            return "no address records";
+        case RESOLVE_TEMPFAIL:
+            return "temporary failure";
+        case RESOLVE_INVALID:
+            return "invalid hostname or port";
+    }
+    return "unknown";
+}
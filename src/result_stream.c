@@ -0,0 +1,650 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "result_stream.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define RESULT_STREAM_MAGIC "CRTRES01"
+#define RESULT_STREAM_MAGIC_LENGTH 8
+// Workers fill chunks of this size; a chunk is handed to the writer when full or FLUSH_INTERVAL_MS old,
+// and the writer collects chunks that old itself from workers that have gone idle
+#define CHUNK_SIZE (64 * 1024)
+#define FLUSH_INTERVAL_MS 1000
+// Workers wait for the writer once this many chunks are queued
+#define MAX_QUEUED_CHUNKS 256
+#define MAX_RECORD_LENGTH 4096
+// Binary records mark a phase that was not reached with this timing
+#define PHASE_NOT_REACHED 0xffffffffu
+
+typedef struct chunk {
+    struct chunk *next;
+    size_t length;
+    long long since_ms;
+    char data[CHUNK_SIZE];
+} chunk_t;
+
+struct result_stream {
+    int fd;
+    result_format_t format;
+    bool quiet;
+    long long flush_interval_ms;
+    pthread_t writer;
+    bool writer_started;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    chunk_t *head;
+    chunk_t *tail;
+    size_t queued;
+    unsigned long long submitted;
+    unsigned long long written;
+    chunk_t *free_chunks;
+    result_buffer_t *buffers;
+    bool closing;
+    bool failed;
+};
+
+// A worker's own output buffer; only that worker adds to it, but the writer may take its chunk
+struct result_buffer {
+    result_stream_t *stream;
+    pthread_mutex_t mutex;
+    chunk_t *chunk;
+    result_buffer_t *next;
+};
+
+// A record being formatted; overflow is remembered and the record dropped
+typedef struct {
+    char data[MAX_RECORD_LENGTH];
+    size_t length;
+    bool overflow;
+} record_t;
+
+/**
+ * Write a whole buffer, retrying short writes.
+ *
+ * @param fd The file descriptor
+ * @param data The data
+ * @param length Number of bytes
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+static int write_all(int fd, const void *data, size_t length) {
+    const unsigned char *p = data;
+    while (length > 0) {
+        ssize_t written = write(fd, p, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Append bytes to a record.
+ *
+ * @param record The record
+ * @param data The bytes
+ * @param length Number of bytes
+ */
+static void append(record_t *record, const void *data, size_t length) {
+    if (record->overflow || record->length + length > sizeof(record->data)) {
+        record->overflow = true;
+        return;
+    }
+    memcpy(record->data + record->length, data, length);
+    record->length += length;
+}
+
+/**
+ * Append formatted text to a record.
+ *
+ * @param record The record
+ * @param format printf-style format
+ */
+static void appendf(record_t *record, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void appendf(record_t *record, const char *format, ...) {
+    if (record->overflow) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    size_t room = sizeof(record->data) - record->length;
+    int written = vsnprintf(record->data + record->length, room, format, args);
+    va_end(args);
+    if (written < 0 || (size_t)written >= room) {
+        record->overflow = true;
+        return;
+    }
+    record->length += (size_t)written;
+}
+
+/**
+ * Append a string as a quoted JSON string.
+ *
+ * @param record The record
+ * @param text The string
+ */
+static void append_json_string(record_t *record, const char *text) {
+    append(record, "\"", 1);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            char escaped[2] = { '\\', (char)*p };
+            append(record, escaped, 2);
+        } else if (*p < 0x20) {
+            appendf(record, "\\u%04x", *p);
+        } else {
+            append(record, p, 1);
+        }
+    }
+    append(record, "\"", 1);
+}
+
+/**
+ * Append a phase timing as a JSON field, null if the phase was not reached.
+ *
+ * @param record The record
+ * @param name The field name
+ * @param us The timing in microseconds, or -1
+ */
+static void append_json_timing(record_t *record, const char *name, long long us) {
+    if (us < 0) {
+        appendf(record, ",\"%s\":null", name);
+    } else {
+        appendf(record, ",\"%s\":%lld", name, us);
+    }
+}
+
+/**
+ * Append a little-endian integer.
+ *
+ * @param record The record
+ * @param value The value
+ * @param bytes Its width in bytes
+ */
+static void append_le(record_t *record, uint64_t value, int bytes) {
+    unsigned char out[8];
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+    append(record, out, (size_t)bytes);
+}
+
+/**
+ * Append a phase timing to a binary record.
+ *
+ * @param record The record
+ * @param us The timing in microseconds, or -1
+ */
+static void append_binary_timing(record_t *record, long long us) {
+    uint64_t value = us < 0 ? PHASE_NOT_REACHED : (uint64_t)us >= PHASE_NOT_REACHED ? PHASE_NOT_REACHED - 1 : (uint64_t)us;
+    append_le(record, value, 4);
+}
+
+/**
+ * Format a result as one JSON line.
+ *
+ * @param record Receives the line
+ * @param result The result
+ */
+static void format_jsonl(record_t *record, const scan_result_t *result) {
+    char address[INET6_ADDRSTRLEN];
+
+    appendf(record, "{\"host\":");
+    append_json_string(record, result->target->hostname);
+    appendf(record, ",\"port\":%u,\"ip\":", (unsigned)result->target->port_number);
+    if (result->addr && inet_ntop(result->addr->family, result->addr->addr, address, sizeof(address))) {
+        appendf(record, "\"%s\"", address);
+    } else {
+        append(record, "null", 4);
+    }
+    appendf(record, ",\"status\":\"%s\",\"worker\":%d", metric_outcome_name(result->status), result->worker_id);
+    append_json_timing(record, "dns_us", result->dns_us);
+    append_json_timing(record, "connect_us", result->connect_us);
+    append_json_timing(record, "handshake_us", result->handshake_us);
+    append_json_timing(record, "save_us", result->save_us);
+    append_json_timing(record, "total_us", result->total_us);
+    if (result->has_fingerprint) {
+        char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+        hex_encode(result->fingerprint, SHA256_DIGEST_LENGTH, hex);
+        appendf(record, ",\"fingerprint\":\"%s\",\"new\":%s", hex, result->new_certificate ? "true" : "false");
+    } else {
+        appendf(record, ",\"fingerprint\":null,\"new\":false");
+    }
+    appendf(record, ",\"changed\":%s,\"resumed\":%s}\n", result->changed ? "true" : "false",
+            result->resumed ? "true" : "false");
+}
+
+/**
+ * Format a result as one length-prefixed binary record (see README for the layout).
+ *
+ * @param record Receives the record
+ * @param result The result
+ */
+static void format_binary(record_t *record, const scan_result_t *result) {
+    size_t host_length = strlen(result->target->hostname);
+    unsigned char address[16] = {0};
+    int family = 0;
+
+    if (result->addr) {
+        family = result->addr->family == AF_INET6 ? 6 : 4;
+        memcpy(address, result->addr->addr, result->addr->family == AF_INET6 ? 16 : 4);
+    }
+    if (host_length > 255) {
+        host_length = 255;
+    }
+
+    append_le(record, 0, 2);  // length, filled in below
+    append_le(record, (uint64_t)result->status, 1);
+    append_le(record, (result->has_fingerprint ? 1u : 0u) | (result->new_certificate ? 2u : 0u) |
+                      (result->changed ? 4u : 0u) | (result->resumed ? 8u : 0u), 1);
+    append_le(record, result->target->port_number, 2);
+    append_le(record, (uint64_t)family, 1);
+    append(record, address, sizeof(address));
+    append_binary_timing(record, result->dns_us);
+    append_binary_timing(record, result->connect_us);
+    append_binary_timing(record, result->handshake_us);
+    append_binary_timing(record, result->save_us);
+    append_binary_timing(record, result->total_us);
+    if (result->has_fingerprint) {
+        append(record, result->fingerprint, SHA256_DIGEST_LENGTH);
+    } else {
+        unsigned char zero[SHA256_DIGEST_LENGTH] = {0};
+        append(record, zero, sizeof(zero));
+    }
+    append_le(record, host_length, 1);
+    append(record, result->target->hostname, host_length);
+
+    size_t length = record->length - 2;
+    record->data[0] = (char)(length & 0xff);
+    record->data[1] = (char)(length >> 8);
+}
+
+/**
+ * Queue a chunk for the writer. The stream's mutex must be held.
+ *
+ * @param stream The result stream
+ * @param chunk The chunk
+ */
+static void enqueue_chunk(result_stream_t *stream, chunk_t *chunk) {
+    chunk->next = NULL;
+    if (stream->tail) {
+        stream->tail->next = chunk;
+    } else {
+        stream->head = chunk;
+    }
+    stream->tail = chunk;
+    stream->queued++;
+    stream->submitted++;
+    pthread_cond_signal(&stream->ready);
+}
+
+/**
+ * Take the chunks that have waited FLUSH_INTERVAL_MS in the buffers of workers that
+ * are idle or parked, so their results do not sit in memory until the worker's next one.
+ * A buffer its worker is using is skipped; that worker submits its old chunk itself.
+ * The stream's mutex must be held.
+ *
+ * @param stream The result stream
+ * @param now Current monotonic time in milliseconds
+ */
+static void collect_stale_chunks(result_stream_t *stream, long long now) {
+    for (result_buffer_t *buffer = stream->buffers; buffer; buffer = buffer->next) {
+        if (pthread_mutex_trylock(&buffer->mutex) != 0) {
+            continue;
+        }
+        chunk_t *chunk = buffer->chunk;
+        if (chunk && chunk->length > 0 && now - chunk->since_ms >= stream->flush_interval_ms) {
+            buffer->chunk = NULL;
+            enqueue_chunk(stream, chunk);
+        }
+        pthread_mutex_unlock(&buffer->mutex);
+    }
+}
+
+/**
+ * Writer thread function.
+ * Writes queued chunks to the output in order, so workers never block on the output.
+ *
+ * @param arg Pointer to the result stream
+ * @return NULL
+ */
+static void *writer_thread(void *arg) {
+    result_stream_t *stream = (result_stream_t *)arg;
+    long long collect_interval_ms = stream->flush_interval_ms > 0 ? stream->flush_interval_ms : FLUSH_INTERVAL_MS;
+    long long next_collect_ms = monotonic_ms() + collect_interval_ms;
+
+    pthread_mutex_lock(&stream->mutex);
+    for (;;) {
+        long long now = monotonic_ms();
+        if (now >= next_collect_ms) {
+            collect_stale_chunks(stream, now);
+            next_collect_ms = now + collect_interval_ms;
+        }
+        chunk_t *chunk = stream->head;
+        if (!chunk) {
+            if (stream->closing) {
+                break;
+            }
+            struct timespec deadline = {
+                .tv_sec = (time_t)(next_collect_ms / 1000),
+                .tv_nsec = (long)(next_collect_ms % 1000) * 1000000L
+            };
+            pthread_cond_timedwait(&stream->ready, &stream->mutex, &deadline);
+            continue;
+        }
+        stream->head = chunk->next;
+        if (!stream->head) {
+            stream->tail = NULL;
+        }
+        bool failed = stream->failed;
+        pthread_mutex_unlock(&stream->mutex);
+
+        if (!failed && write_all(stream->fd, chunk->data, chunk->length) != 0) {
+            fprintf(stderr, "Failed to write results: %s\n", strerror(errno));
+            failed = true;
+        }
+
+        pthread_mutex_lock(&stream->mutex);
+        stream->failed = stream->failed || failed;
+        chunk->next = stream->free_chunks;
+        stream->free_chunks = chunk;
+        stream->queued--;
+        stream->written++;
+        pthread_cond_broadcast(&stream->space);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+/**
+ * Take an empty chunk, reusing one the writer is done with if possible.
+ *
+ * @param stream The result stream
+ * @return The chunk, or NULL on allocation failure
+ */
+static chunk_t *take_chunk(result_stream_t *stream) {
+    pthread_mutex_lock(&stream->mutex);
+    chunk_t *chunk = stream->free_chunks;
+    if (chunk) {
+        stream->free_chunks = chunk->next;
+    }
+    pthread_mutex_unlock(&stream->mutex);
+
+    if (!chunk) {
+        chunk = malloc(sizeof(*chunk));
+    }
+    if (chunk) {
+        chunk->next = NULL;
+        chunk->length = 0;
+    }
+    return chunk;
+}
+
+/**
+ * Hand a buffer's chunk to the writer; the buffer takes a fresh one when it next needs it.
+ * The buffer's mutex must be held.
+ *
+ * @param buffer The worker's buffer
+ */
+static void submit_chunk(result_buffer_t *buffer) {
+    result_stream_t *stream = buffer->stream;
+    chunk_t *chunk = buffer->chunk;
+
+    if (!chunk || chunk->length == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    while (stream->queued >= MAX_QUEUED_CHUNKS && !stream->failed) {
+        pthread_cond_wait(&stream->space, &stream->mutex);
+    }
+    enqueue_chunk(stream, chunk);
+    pthread_mutex_unlock(&stream->mutex);
+
+    buffer->chunk = NULL;
+}
+
+/**
+ * Add formatted bytes to a worker's buffer.
+ *
+ * @param buffer The worker's buffer
+ * @param data The bytes
+ * @param length Number of bytes, at most CHUNK_SIZE
+ */
+static void buffer_append(result_buffer_t *buffer, const char *data, size_t length) {
+    pthread_mutex_lock(&buffer->mutex);
+    if (buffer->chunk && buffer->chunk->length + length > CHUNK_SIZE) {
+        submit_chunk(buffer);
+    }
+    if (!buffer->chunk) {
+        buffer->chunk = take_chunk(buffer->stream);
+    }
+    chunk_t *chunk = buffer->chunk;
+    if (!chunk) {
+        pthread_mutex_unlock(&buffer->mutex);
+        return;
+    }
+
+    long long now = monotonic_ms();
+    if (chunk->length == 0) {
+        chunk->since_ms = now;
+    }
+    memcpy(chunk->data + chunk->length, data, length);
+    chunk->length += length;
+
+    // Keep a slow scan's output flowing
+    if (now - chunk->since_ms >= buffer->stream->flush_interval_ms) {
+        submit_chunk(buffer);
+    }
+    pthread_mutex_unlock(&buffer->mutex);
+}
+
+/**
+ * Open the result stream and start its writer.
+ *
+ * @param fd Where results are written, normally standard output
+ * @param format text, JSON lines or binary records
+ * @param quiet Write no per-target results at all
+ * @return The stream, or NULL on failure
+ */
+result_stream_t *result_stream_open(int fd, result_format_t format, bool quiet) {
+    result_stream_t *stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        return NULL;
+    }
+    stream->fd = fd;
+    stream->format = format;
+    stream->quiet = quiet;
+    // Someone watching a terminal sees each result as it comes
+    stream->flush_interval_ms = isatty(fd) ? 0 : FLUSH_INTERVAL_MS;
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&stream->ready, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&stream->space, NULL);
+
+    if (format == RESULT_OUTPUT_BINARY && !quiet &&
+        write_all(fd, RESULT_STREAM_MAGIC, RESULT_STREAM_MAGIC_LENGTH) != 0) {
+        goto error;
+    }
+    if (pthread_create(&stream->writer, NULL, writer_thread, stream) != 0) {
+        goto error;
+    }
+    stream->writer_started = true;
+    return stream;
+
+error:
+    pthread_cond_destroy(&stream->ready);
+    pthread_cond_destroy(&stream->space);
+    pthread_mutex_destroy(&stream->mutex);
+    free(stream);
+    return NULL;
+}
+
+/**
+ * Give a worker thread its own output buffer.
+ *
+ * @param stream The result stream
+ * @return The buffer, or NULL on allocation failure
+ */
+result_buffer_t *result_stream_buffer(result_stream_t *stream) {
+    result_buffer_t *buffer = calloc(1, sizeof(*buffer));
+    if (!buffer) {
+        return NULL;
+    }
+    buffer->stream = stream;
+    pthread_mutex_init(&buffer->mutex, NULL);
+
+    pthread_mutex_lock(&stream->mutex);
+    buffer->next = stream->buffers;
+    stream->buffers = buffer;
+    pthread_mutex_unlock(&stream->mutex);
+    return buffer;
+}
+
+/**
+ * Write the result for one target in the stream's format.
+ *
+ * @param buffer The worker's buffer, or NULL to write nothing
+ * @param result The result
+ */
+void result_buffer_write(result_buffer_t *buffer, const scan_result_t *result) {
+    if (!buffer || buffer->stream->quiet) {
+        return;
+    }
+
+    record_t record = { .length = 0, .overflow = false };
+    switch (buffer->stream->format) {
+        case RESULT_OUTPUT_JSONL:
+            format_jsonl(&record, result);
+            break;
+        case RESULT_OUTPUT_BINARY:
+            format_binary(&record, result);
+            break;
+        default:
+            appendf(&record, "%s\n", result->message);
+            break;
+    }
+    if (!record.overflow) {
+        buffer_append(buffer, record.data, record.length);
+    }
+}
+
+/**
+ * Write a progress line such as a worker finishing. Only text output carries these.
+ *
+ * @param buffer The worker's buffer, or NULL to write nothing
+ * @param line The line, without its newline
+ */
+void result_buffer_text(result_buffer_t *buffer, const char *line) {
+    if (!buffer || buffer->stream->quiet || buffer->stream->format != RESULT_OUTPUT_TEXT) {
+        return;
+    }
+
+    record_t record = { .length = 0, .overflow = false };
+    appendf(&record, "%s\n", line);
+    if (!record.overflow) {
+        buffer_append(buffer, record.data, record.length);
+    }
+}
+
+/**
+ * Hand whatever a worker has buffered to the writer, e.g. when the worker finishes.
+ *
+ * @param buffer The worker's buffer, or NULL
+ */
+void result_buffer_flush(result_buffer_t *buffer) {
+    if (buffer) {
+        pthread_mutex_lock(&buffer->mutex);
+        submit_chunk(buffer);
+        pthread_mutex_unlock(&buffer->mutex);
+    }
+}
+
+/**
+ * Write out every result the workers have buffered so far and wait until the writer has
+ * written it, so the journal never records a target whose result line could still be lost.
+ *
+ * @param stream The result stream
+ * @return 0 on success, -1 if any result could not be written
+ */
+int result_stream_sync(result_stream_t *stream) {
+    pthread_mutex_lock(&stream->mutex);
+    result_buffer_t *buffers = stream->buffers;
+    pthread_mutex_unlock(&stream->mutex);
+
+    // Buffers are only ever added at the head, so this walk is safe without the stream's mutex
+    for (result_buffer_t *buffer = buffers; buffer; buffer = buffer->next) {
+        result_buffer_flush(buffer);
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    unsigned long long submitted = stream->submitted;
+    while (stream->written < submitted && !stream->failed) {
+        pthread_cond_wait(&stream->space, &stream->mutex);
+    }
+    int ret = stream->failed ? -1 : 0;
+    pthread_mutex_unlock(&stream->mutex);
+
+    // Pipes and terminals cannot be synced; results going to a file reach the disk
+    if (ret == 0 && fdatasync(stream->fd) != 0 && errno != EINVAL && errno != EROFS) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * Write out every buffered result, stop the writer and free the stream.
+ * Every worker must have finished.
+ *
+ * @param stream The result stream
+ * @return 0 on success, -1 if any result could not be written
+ */
+int result_stream_close(result_stream_t *stream) {
+    for (result_buffer_t *buffer = stream->buffers; buffer; buffer = buffer->next) {
+        result_buffer_flush(buffer);
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->closing = true;
+    pthread_cond_signal(&stream->ready);
+    pthread_mutex_unlock(&stream->mutex);
+    if (stream->writer_started) {
+        pthread_join(stream->writer, NULL);
+    }
+    int ret = stream->failed ? -1 : 0;
+
+    result_buffer_t *buffer = stream->buffers;
+    while (buffer) {
+        result_buffer_t *next = buffer->next;
+        free(buffer->chunk);
+        pthread_mutex_destroy(&buffer->mutex);
+        free(buffer);
+        buffer = next;
+    }
+    chunk_t *chunk = stream->free_chunks;
+    while (chunk) {
+        chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pthread_cond_destroy(&stream->ready);
+    pthread_cond_destroy(&stream->space);
+    pthread_mutex_destroy(&stream->mutex);
+    free(stream);
+    return ret;
+}
@@ -0,0 +1,145 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "rtt_estimator.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Log-linear buckets as in the metrics, coarser: each power of two is split into 8 parts (within about 12%)
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_MAGNITUDE 28
+#define ESTIMATOR_BUCKETS ((MAX_MAGNITUDE - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+// The p99 is recomputed every this many samples, and the counts halved so old samples fade out
+#define UPDATE_INTERVAL 512
+// No estimate is given until this many samples were seen
+#define MIN_SAMPLES 100
+
+// A decaying latency histogram that every worker adds to
+struct rtt_estimator {
+    atomic_uint_least32_t counts[ESTIMATOR_BUCKETS];
+    atomic_uint_least64_t samples;
+    atomic_llong p99_us;
+    pthread_mutex_t update_mutex;
+};
+
+/**
+ * Find the bucket a value falls in.
+ *
+ * @param value The value in microseconds
+ * @return The bucket index
+ */
+static int bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return (int)value;
+    }
+    if (value >= (1ULL << MAX_MAGNITUDE)) {
+        value = (1ULL << MAX_MAGNITUDE) - 1;
+    }
+    int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    return shift * SUB_BUCKETS + (int)(value >> shift);
+}
+
+/**
+ * Find the upper end of a bucket's range, so the estimate errs on the generous side.
+ *
+ * @param index The bucket index
+ * @return The value in microseconds
+ */
+static long long bucket_upper(int index) {
+    if (index < 2 * SUB_BUCKETS) {
+        return index + 1;
+    }
+    int shift = index / SUB_BUCKETS - 1;
+    return ((long long)(index - shift * SUB_BUCKETS + 1) << shift);
+}
+
+/**
+ * Recompute the p99 from the counts and halve them. Only one thread does this at a time.
+ *
+ * @param estimator The estimator
+ */
+static void update(rtt_estimator_t *estimator) {
+    uint64_t counts[ESTIMATOR_BUCKETS];
+    uint64_t total = 0;
+
+    for (int i = 0; i < ESTIMATOR_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&estimator->counts[i], memory_order_relaxed);
+        total += counts[i];
+        if (counts[i] > 1) {
+            atomic_fetch_sub_explicit(&estimator->counts[i], (uint32_t)(counts[i] / 2), memory_order_relaxed);
+        }
+    }
+    if (total == 0) {
+        return;
+    }
+
+    uint64_t rank = total - total / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < ESTIMATOR_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            atomic_store_explicit(&estimator->p99_us, bucket_upper(i), memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+/**
+ * Create an empty estimator.
+ *
+ * @return The estimator, or NULL on allocation failure
+ */
+rtt_estimator_t *rtt_estimator_create(void) {
+    rtt_estimator_t *estimator = calloc(1, sizeof(*estimator));
+    if (!estimator) {
+        return NULL;
+    }
+    atomic_store(&estimator->p99_us, -1);
+    pthread_mutex_init(&estimator->update_mutex, NULL);
+    return estimator;
+}
+
+/**
+ * Free an estimator.
+ *
+ * @param estimator The estimator, or NULL
+ */
+void rtt_estimator_free(rtt_estimator_t *estimator) {
+    if (!estimator) {
+        return;
+    }
+    pthread_mutex_destroy(&estimator->update_mutex);
+    free(estimator);
+}
+
+/**
+ * Add a completed phase's duration.
+ *
+ * @param estimator The estimator
+ * @param us The duration in microseconds
+ */
+void rtt_estimator_add(rtt_estimator_t *estimator, long long us) {
+    if (us < 0) {
+        return;
+    }
+    atomic_fetch_add_explicit(&estimator->counts[bucket_index((uint64_t)us)], 1, memory_order_relaxed);
+    uint64_t samples = atomic_fetch_add_explicit(&estimator->samples, 1, memory_order_relaxed) + 1;
+
+    if ((samples == MIN_SAMPLES || samples % UPDATE_INTERVAL == 0) &&
+        pthread_mutex_trylock(&estimator->update_mutex) == 0) {
+        update(estimator);
+        pthread_mutex_unlock(&estimator->update_mutex);
+    }
+}
+
+/**
+ * Get the current p99 estimate.
+ *
+ * @param estimator The estimator
+ * @return The p99 in microseconds, or -1 until enough samples were seen
+ */
+long long rtt_estimator_p99(rtt_estimator_t *estimator) {
+    return atomic_load_explicit(&estimator->p99_us, memory_order_relaxed);
+}
@@ -2,55 +2,113 @@
 
 #include "save_certificate.h"
 #include "utils.h"
-#include <openssl/bio.h>
-#include <openssl/pem.h>
+#include "fingerprint.h"
+#include <openssl/evp.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 
 #define MAX_PATH_LENGTH 1024
 #define SHA256_HEX_LENGTH (SHA256_DIGEST_LENGTH * 2)
+// PEM wraps the base64 of every 48 bytes of DER into a 64 character line
+#define PEM_LINE_BYTES 48
+#define PEM_LINE_CHARS 64
+#define PEM_HEADER "-----BEGIN CERTIFICATE-----\n"
+#define PEM_FOOTER "-----END CERTIFICATE-----\n"
+
+/**
+ * Encode a certificate in the requested output format, into the worker's arena.
+ * PEM is produced from the DER encoding the same way PEM_write_bio_X509 lays it out,
+ * so file names and pack store keys do not change.
+ *
+ * @param cert The X509 certificate
+ * @param format PEM or DER
+ * @param arena The worker's arena; the encoding lives until it is reset
+ * @param length Receives the length of the encoding
+ * @param worker_id The worker saving the certificate
+ * @return The encoded bytes, or NULL on failure
+ */
+static unsigned char *encode_certificate(X509 *cert, cert_format_t format, arena_t *arena, size_t *length,
+                                         int worker_id) {
+    int der_length = i2d_X509(cert, NULL);
+    unsigned char *der = der_length > 0 ? arena_alloc(arena, (size_t)der_length) : NULL;
+    unsigned char *end = der;
+    if (!der || i2d_X509(cert, &end) != der_length) {
+        fprintf(stderr, "Worker %d: Failed to encode certificate\n", worker_id);
+        return NULL;
+    }
+    if (format == CERT_FORMAT_DER) {
+        *length = (size_t)der_length;
+        return der;
+    }
+
+    size_t lines = ((size_t)der_length + PEM_LINE_BYTES - 1) / PEM_LINE_BYTES;
+    unsigned char *pem = arena_alloc(arena, sizeof(PEM_HEADER) + lines * (PEM_LINE_CHARS + 1) + sizeof(PEM_FOOTER));
+    if (!pem) {
+        fprintf(stderr, "Worker %d: Failed to encode certificate\n", worker_id);
+        return NULL;
+    }
+
+    unsigned char *out = pem;
+    memcpy(out, PEM_HEADER, sizeof(PEM_HEADER) - 1);
+    out += sizeof(PEM_HEADER) - 1;
+    for (size_t offset = 0; offset < (size_t)der_length; offset += PEM_LINE_BYTES) {
+        size_t chunk = (size_t)der_length - offset < PEM_LINE_BYTES ? (size_t)der_length - offset : PEM_LINE_BYTES;
+        out += EVP_EncodeBlock(out, der + offset, (int)chunk);
+        *out++ = '\n';
+    }
+    memcpy(out, PEM_FOOTER, sizeof(PEM_FOOTER) - 1);
+    out += sizeof(PEM_FOOTER) - 1;
+
+    *length = (size_t)(out - pem);
+    return pem;
+}
 
 /**
  * Save an X509 certificate to a file in the specified output directory.
- * The filename is generated from the SHA256 hash of the certificate content.
+ * The filename is generated from the SHA256 hash of the encoded certificate,
+ * which for DER is the certificate's fingerprint and is not computed again.
+ * A durable save is on disk when this returns, but for the file's name, which the
+ * caller makes durable with sync_directory before it relies on it.
  *
  * @param cert The X509 certificate to save
+ * @param fingerprint The certificate's SHA256 fingerprint, or NULL if it is not known
+ * @param format PEM or DER; also the file extension
  * @param output_dir The directory where the certificate should be saved
+ * @param overwrite Replace an existing file with the same name
+ * @param durable Flush the file to disk before returning
+ * @param arena The worker's arena, used for the encoding
+ * @param worker_id The worker saving the certificate
  * @return 0 on success, -1 on failure
  */
-int save_certificate(X509 *cert, const char *output_dir, bool overwrite, int worker_id) {
-    BIO *mem = NULL;
+int save_certificate(X509 *cert, const unsigned char *fingerprint, cert_format_t format, const char *output_dir,
+                     bool overwrite, bool durable, arena_t *arena, int worker_id) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
     FILE *file = NULL;
-    char sha256_output[SHA256_HEX_LENGTH + 5]; // +5 for ".pem" and null terminator
+    char sha256_output[SHA256_HEX_LENGTH + 5]; // +5 for ".pem" or ".der" and null terminator
     char file_path[MAX_PATH_LENGTH];
+    size_t length = 0;
     int result = -1;
 
-    // Create a memory BIO and write the certificate to it
-    mem = BIO_new(BIO_s_mem());
-    if (!mem) {
-        fprintf(stderr, "Worker %d: Failed to create memory BIO\n", worker_id);
+    unsigned char *data = encode_certificate(cert, format, arena, &length, worker_id);
+    if (!data) {
         goto cleanup;
     }
 
-    if (!PEM_write_bio_X509(mem, cert)) {
-        fprintf(stderr, "Worker %d: Failed to write certificate to memory BIO\n", worker_id);
+    // Calculate SHA256 hash of the certificate data, unless it is the DER fingerprint we already have
+    if (format == CERT_FORMAT_DER && fingerprint) {
+        memcpy(digest, fingerprint, SHA256_DIGEST_LENGTH);
+    } else if (!fingerprint_bytes(data, length, digest)) {
+        fprintf(stderr, "Worker %d: Failed to calculate SHA256 hash\n", worker_id);
         goto cleanup;
     }
+    hex_encode(digest, SHA256_DIGEST_LENGTH, sha256_output);
 
-    // Get the certificate data from the memory BIO
-    BUF_MEM *bptr;
-    BIO_get_mem_ptr(mem, &bptr);
-
-    // Calculate SHA256 hash of the certificate data
-    if (!sha256sum((unsigned char *)bptr->data, bptr->length, sha256_output, sizeof(sha256_output))) {
-        fprintf(stderr, "Worker %d: Failed to calculate SHA256 hash\n", worker_id);
-        goto cleanup;
-    } 
-  
-    // Append ".pem" to the hash to create the filename
-    if (snprintf(sha256_output + SHA256_HEX_LENGTH, 5, ".pem") >= 5) {
-        fprintf(stderr, "Worker %d: Buffer overflow when appending .pem\n", worker_id);
+    // Append the extension to the hash to create the filename
+    if (snprintf(sha256_output + SHA256_HEX_LENGTH, 5, "%s", format == CERT_FORMAT_DER ? ".der" : ".pem") >= 5) {
+        fprintf(stderr, "Worker %d: Buffer overflow when appending the extension\n", worker_id);
         goto cleanup;
     }
 
@@ -63,28 +121,70 @@ int save_certificate(X509 *cert, const char *output_dir, bool overwrite, int wor
     // Modify the file opening logic
     const char *mode = overwrite ? "w" : "wx";
     file = fopen(file_path, mode);
-    if (!file) {
-        if (errno == EEXIST && !overwrite) {
+    if (!file && errno == EEXIST) {
+        // The name is the hash of the contents, so a file of another size was cut short,
+        // e.g. by a crash before it reached the disk, and is written again
+        struct stat st;
+        if (stat(file_path, &st) == 0 && st.st_size == (off_t)length) {
             fprintf(stderr, "Worker %d: Certificate file already exists: %s\n", worker_id, file_path);
             result = 0; // Not treating this as an error when not overwriting
-        } else {
-            fprintf(stderr, "Worker %d: Failed to open file %s for writing: %s\n", worker_id, file_path, strerror(errno));
+            goto cleanup;
         }
+        file = fopen(file_path, "w");
+    }
+    if (!file) {
+        fprintf(stderr, "Worker %d: Failed to open file %s for writing: %s\n", worker_id, file_path, strerror(errno));
         goto cleanup;
     }
 
     // Write the certificate data to the file
-    if (fwrite(bptr->data, 1, bptr->length, file) != (size_t)bptr->length) {
-        fprintf(stderr, "Worker %d: Failed to write certificate data to file\n", worker_id);
+    if (fwrite(data, 1, length, file) != length || fflush(file) != 0 || (durable && fdatasync(fileno(file)) != 0)) {
+        fprintf(stderr, "Worker %d: Failed to write certificate data to file %s: %s\n", worker_id, file_path,
+                strerror(errno));
         goto cleanup;
-    } else {
-        fprintf(stderr, "Worker %d: Certificate downloaded and saved successfully: %s\n", worker_id, file_path);
     }
 
     result = 0; // Success
 
 cleanup:
-    if (mem) BIO_free(mem);
-    if (file) fclose(file);
+    if (file && fclose(file) != 0 && result == 0) {
+        fprintf(stderr, "Worker %d: Failed to write certificate data to file %s: %s\n", worker_id, file_path,
+                strerror(errno));
+        result = -1;
+    }
+    // A partial file would pass for the certificate once it exists
+    if (file && result != 0) {
+        unlink(file_path);
+    }
     return result;
 }
+
+/**
+ * Hand an X509 certificate to the pack store instead of writing a file per certificate.
+ * It is keyed by the SHA256 hash of its encoding, the same hash used for file names.
+ *
+ * @param cert The X509 certificate to save
+ * @param fingerprint The certificate's SHA256 fingerprint, or NULL if it is not known
+ * @param format PEM or DER
+ * @param store The pack store
+ * @param arena The worker's arena, used for the encoding
+ * @param worker_id The worker saving the certificate
+ * @return 0 on success, -1 on failure
+ */
+int store_certificate(X509 *cert, const unsigned char *fingerprint, cert_format_t format, cert_store_t *store,
+                      arena_t *arena, int worker_id) {
+    char key[SHA256_HEX_LENGTH + 1];
+    size_t length = 0;
+
+    unsigned char *data = encode_certificate(cert, format, arena, &length, worker_id);
+    if (!data) {
+        return -1;
+    }
+
+    // A DER encoding's hash is the fingerprint, so the store need not compute it again
+    if (cert_store_put(store, data, length, format == CERT_FORMAT_DER ? fingerprint : NULL, key, sizeof(key)) < 0) {
+        fprintf(stderr, "Worker %d: Failed to add certificate to the pack store\n", worker_id);
+        return -1;
+    }
+    return 0;
+}
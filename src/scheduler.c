@@ -0,0 +1,437 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "scheduler.h"
+#include "utils.h"
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Buckets per table; destinations whose slots collide while both are active share a bucket
+#define BUCKET_TABLE_SIZE (1 << 18)
+// Throttled targets held back at once; beyond this no new input is taken. Retries are always taken.
+#define MAX_DEFERRED 16384
+// Longest a waiting caller sleeps before looking again
+#define POLL_INTERVAL_MS 10
+
+// A token bucket for one destination, prefix, or the whole scan
+typedef struct {
+    uint64_t key;
+    double tokens;
+    long long updated_ms;
+} bucket_t;
+
+// A throttled or retried target and when it may start
+typedef struct {
+    long long ready_ms;
+    unsigned long long sequence;
+    target_t target;
+} deferred_t;
+
+struct scheduler {
+    scheduler_options_t options;
+    target_queue_t *input;
+    bool limited;
+    pthread_mutex_t mutex;
+    bucket_t global;
+    bucket_t *ip_buckets;
+    bucket_t *prefix_buckets;
+    deferred_t *heap;
+    size_t heap_count;
+    size_t heap_capacity;
+    size_t outstanding;
+    uint64_t jitter_state;
+    unsigned long long sequence;
+    unsigned long long deferrals;
+    unsigned long long retries;
+};
+
+/**
+ * Hash an address, or its leading bits, into a bucket key (FNV-1a).
+ *
+ * @param addr The address
+ * @param bits Number of leading address bits that count
+ * @return The key
+ */
+static uint64_t address_key(const target_addr_t *addr, int bits) {
+    uint64_t hash = 14695981039346656037ULL;
+    int length = addr->family == AF_INET6 ? 16 : 4;
+
+    hash ^= (uint64_t)addr->family;
+    hash *= 1099511628211ULL;
+    hash ^= (uint64_t)bits;
+    hash *= 1099511628211ULL;
+    for (int i = 0; i < length && bits > 0; i++, bits -= 8) {
+        unsigned char byte = addr->addr[i];
+        if (bits < 8) {
+            byte &= (unsigned char)(0xff << (8 - bits));
+        }
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Bring a bucket up to date and report how long until it holds a whole token.
+ *
+ * @param bucket The bucket
+ * @param rate Tokens per second; the bucket holds at most one second's worth (and at least one)
+ * @param now_ms The current monotonic time
+ * @return 0 if a token is available, otherwise the wait in milliseconds
+ */
+static long long bucket_refill(bucket_t *bucket, double rate, long long now_ms) {
+    double capacity = rate > 1.0 ? rate : 1.0;
+
+    bucket->tokens += (double)(now_ms - bucket->updated_ms) * rate / 1000.0;
+    if (bucket->tokens > capacity) {
+        bucket->tokens = capacity;
+    }
+    bucket->updated_ms = now_ms;
+    if (bucket->tokens >= 1.0) {
+        return 0;
+    }
+    long long wait_ms = (long long)((1.0 - bucket->tokens) * 1000.0 / rate) + 1;
+    return wait_ms;
+}
+
+/**
+ * Find the bucket for a key, taking over the slot if its previous owner has gone idle.
+ *
+ * @param table The bucket table
+ * @param key The key
+ * @param rate Tokens per second
+ * @param now_ms The current monotonic time
+ * @return The bucket
+ */
+static bucket_t *bucket_for(bucket_t *table, uint64_t key, double rate, long long now_ms) {
+    bucket_t *bucket = &table[key & (BUCKET_TABLE_SIZE - 1)];
+    if (bucket->key != key) {
+        bucket_refill(bucket, rate, now_ms);
+        if (bucket->updated_ms == 0 || bucket->tokens >= (rate > 1.0 ? rate : 1.0)) {
+            bucket->key = key;
+            bucket->tokens = rate > 1.0 ? rate : 1.0;
+        }
+    }
+    return bucket;
+}
+
+/**
+ * Take a token from every bucket a target is subject to, or none at all.
+ * The scheduler must be locked.
+ *
+ * @param scheduler The scheduler
+ * @param target The target about to be connected to
+ * @param now_ms The current monotonic time
+ * @return 0 if the target may start now, otherwise the wait in milliseconds
+ */
+static long long acquire(scheduler_t *scheduler, const target_t *target, long long now_ms) {
+    const scheduler_options_t *options = &scheduler->options;
+    bucket_t *buckets[3];
+    double rates[3];
+    int count = 0;
+    long long wait_ms = 0;
+
+    // Targets that failed to resolve never connect, so they are not limited
+    if (target->dns_status != RESOLVE_OK || target->addr_count == 0) {
+        return 0;
+    }
+    const target_addr_t *addr = &target->addrs[0];
+
+    if (options->global_rate > 0) {
+        buckets[count] = &scheduler->global;
+        rates[count++] = options->global_rate;
+    }
+    if (options->ip_rate > 0) {
+        buckets[count] = bucket_for(scheduler->ip_buckets, address_key(addr, 128), options->ip_rate, now_ms);
+        rates[count++] = options->ip_rate;
+    }
+    if (options->prefix_rate > 0) {
+        int bits = addr->family == AF_INET6 ? options->prefix6_len : options->prefix_len;
+        buckets[count] = bucket_for(scheduler->prefix_buckets, address_key(addr, bits), options->prefix_rate, now_ms);
+        rates[count++] = options->prefix_rate;
+    }
+
+    for (int i = 0; i < count; i++) {
+        long long wait = bucket_refill(buckets[i], rates[i], now_ms);
+        if (wait > wait_ms) {
+            wait_ms = wait;
+        }
+    }
+    if (wait_ms == 0) {
+        for (int i = 0; i < count; i++) {
+            buckets[i]->tokens -= 1.0;
+        }
+    }
+    return wait_ms;
+}
+
+/**
+ * Order deferred targets by ready time, then by arrival.
+ *
+ * @param a A deferred target
+ * @param b Another deferred target
+ * @return true if a should start before b
+ */
+static bool deferred_before(const deferred_t *a, const deferred_t *b) {
+    return a->ready_ms < b->ready_ms || (a->ready_ms == b->ready_ms && a->sequence < b->sequence);
+}
+
+/**
+ * Add a throttled or retried target to the deferred min-heap. The scheduler must be locked.
+ *
+ * @param scheduler The scheduler
+ * @param target The target
+ * @param ready_ms When it may start
+ * @return 0 on success, -1 if the heap could not grow
+ */
+static int defer(scheduler_t *scheduler, const target_t *target, long long ready_ms) {
+    if (scheduler->heap_count == scheduler->heap_capacity) {
+        size_t capacity = scheduler->heap_capacity * 2;
+        deferred_t *heap = realloc(scheduler->heap, capacity * sizeof(*heap));
+        if (!heap) {
+            return -1;
+        }
+        scheduler->heap = heap;
+        scheduler->heap_capacity = capacity;
+    }
+
+    size_t i = scheduler->heap_count++;
+    deferred_t item = { .ready_ms = ready_ms, .sequence = scheduler->sequence++, .target = *target };
+
+    while (i > 0 && deferred_before(&item, &scheduler->heap[(i - 1) / 2])) {
+        scheduler->heap[i] = scheduler->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    scheduler->heap[i] = item;
+    return 0;
+}
+
+/**
+ * Remove the earliest deferred target. The scheduler must be locked and the heap non-empty.
+ *
+ * @param scheduler The scheduler
+ * @param target Receives the target
+ */
+static void take_deferred(scheduler_t *scheduler, target_t *target) {
+    deferred_t *heap = scheduler->heap;
+    *target = heap[0].target;
+
+    deferred_t last = heap[--scheduler->heap_count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = i * 2 + 1;
+        if (child >= scheduler->heap_count) break;
+        if (child + 1 < scheduler->heap_count && deferred_before(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!deferred_before(&heap[child], &last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+}
+
+/**
+ * Create the scheduler that hands resolved targets to the workers.
+ * Without any rate limit or retries it simply passes the input queue through.
+ *
+ * @param options The rate limits and retry policy
+ * @param input The queue of resolved targets
+ * @return The scheduler, or NULL on allocation failure
+ */
+scheduler_t *scheduler_create(const scheduler_options_t *options, target_queue_t *input) {
+    scheduler_t *scheduler = calloc(1, sizeof(*scheduler));
+    if (!scheduler) {
+        return NULL;
+    }
+    scheduler->options = *options;
+    scheduler->input = input;
+    scheduler->limited = options->global_rate > 0 || options->ip_rate > 0 || options->prefix_rate > 0 ||
+                         options->retries > 0;
+    pthread_mutex_init(&scheduler->mutex, NULL);
+
+    if (!scheduler->limited) {
+        return scheduler;
+    }
+
+    long long now = monotonic_ms();
+    scheduler->global.tokens = options->global_rate > 1.0 ? options->global_rate : 1.0;
+    scheduler->global.updated_ms = now;
+    scheduler->jitter_state = (uint64_t)monotonic_us() | 1;
+    scheduler->heap_capacity = MAX_DEFERRED;
+    scheduler->heap = malloc(scheduler->heap_capacity * sizeof(*scheduler->heap));
+    if (options->ip_rate > 0) {
+        scheduler->ip_buckets = calloc(BUCKET_TABLE_SIZE, sizeof(*scheduler->ip_buckets));
+    }
+    if (options->prefix_rate > 0) {
+        scheduler->prefix_buckets = calloc(BUCKET_TABLE_SIZE, sizeof(*scheduler->prefix_buckets));
+    }
+    if (!scheduler->heap || (options->ip_rate > 0 && !scheduler->ip_buckets) ||
+        (options->prefix_rate > 0 && !scheduler->prefix_buckets)) {
+        scheduler_free(scheduler);
+        return NULL;
+    }
+    return scheduler;
+}
+
+/**
+ * Free the scheduler.
+ *
+ * @param scheduler The scheduler
+ */
+void scheduler_free(scheduler_t *scheduler) {
+    pthread_mutex_destroy(&scheduler->mutex);
+    free(scheduler->heap);
+    free(scheduler->ip_buckets);
+    free(scheduler->prefix_buckets);
+    free(scheduler);
+}
+
+/**
+ * Take a target from the scheduler once every rate limit it is subject to allows it.
+ * Throttled targets are set aside until their buckets refill, so targets on other
+ * networks are handed out in the meantime. With retries enabled the scheduler is only
+ * drained once every target handed out was finished with scheduler_finish.
+ *
+ * @param scheduler The scheduler
+ * @param target Receives the target
+ * @param timeout_ms How long to wait for a target: 0 to not wait, negative to wait indefinitely
+ * @return 1 if a target was returned, 0 if none was allowed in time, -1 if the input is closed and drained
+ */
+int scheduler_next(scheduler_t *scheduler, target_t *target, int timeout_ms) {
+    if (!scheduler->limited) {
+        return target_queue_pop(scheduler->input, target, timeout_ms);
+    }
+
+    long long deadline = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+
+    for (;;) {
+        long long now = monotonic_ms();
+        long long wait_ms = POLL_INTERVAL_MS;
+        bool input_done = false;
+        long long throttle;
+
+        pthread_mutex_lock(&scheduler->mutex);
+
+        // Deferred targets whose wait is over go first
+        while (scheduler->heap_count > 0 && scheduler->heap[0].ready_ms <= now) {
+            take_deferred(scheduler, target);
+            if ((throttle = acquire(scheduler, target, now)) == 0) {
+                scheduler->outstanding++;
+                pthread_mutex_unlock(&scheduler->mutex);
+                return 1;
+            }
+            defer(scheduler, target, now + throttle);
+        }
+
+        // Then new input, setting aside whatever is throttled
+        while (scheduler->heap_count < MAX_DEFERRED) {
+            int rc = target_queue_pop(scheduler->input, target, 0);
+            if (rc <= 0) {
+                input_done = rc < 0;
+                break;
+            }
+            if ((throttle = acquire(scheduler, target, now)) == 0) {
+                scheduler->outstanding++;
+                pthread_mutex_unlock(&scheduler->mutex);
+                return 1;
+            }
+            defer(scheduler, target, now + throttle);
+            scheduler->deferrals++;
+        }
+
+        if (scheduler->heap_count > 0 && scheduler->heap[0].ready_ms - now < wait_ms) {
+            wait_ms = scheduler->heap[0].ready_ms - now;
+        }
+        bool drained = input_done && scheduler->heap_count == 0 &&
+                       (scheduler->options.retries == 0 || scheduler->outstanding == 0);
+        pthread_mutex_unlock(&scheduler->mutex);
+
+        if (drained) {
+            return -1;
+        }
+        if (timeout_ms == 0 || (timeout_ms > 0 && now >= deadline)) {
+            return 0;
+        }
+        if (timeout_ms > 0 && deadline - now < wait_ms) {
+            wait_ms = deadline - now;
+        }
+
+        struct timespec ts = {
+            .tv_sec = (time_t)(wait_ms / 1000),
+            .tv_nsec = (long)(wait_ms % 1000) * 1000000L
+        };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * Report that a target handed out by scheduler_next is finished with. A target that failed
+ * and has retries left goes back in after an exponential backoff with jitter, so the retry
+ * does not hold a worker while it waits.
+ *
+ * @param scheduler The scheduler
+ * @param target The target
+ * @param failed Whether the attempt failed in a way worth retrying
+ * @return true if the target will be retried, false if this was its last attempt
+ */
+bool scheduler_finish(scheduler_t *scheduler, const target_t *target, bool failed) {
+    if (scheduler->options.retries == 0) {
+        return false;
+    }
+
+    bool retry = false;
+    pthread_mutex_lock(&scheduler->mutex);
+    scheduler->outstanding--;
+    if (failed && target->attempts < scheduler->options.retries) {
+        target_t next = *target;
+        next.attempts++;
+
+        // xorshift64; the jitter spreads retries of targets that failed together
+        uint64_t x = scheduler->jitter_state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        scheduler->jitter_state = x;
+        double jitter = 0.5 + (double)(x >> 11) / (double)(1ULL << 53);
+        long long backoff_ms = (long long)((double)scheduler->options.retry_backoff_ms *
+                                           (double)(1ULL << (next.attempts - 1)) * jitter);
+
+        if (defer(scheduler, &next, monotonic_ms() + backoff_ms) == 0) {
+            scheduler->retries++;
+            retry = true;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->mutex);
+    return retry;
+}
+
+/**
+ * Report how many targets were held back by a rate limit.
+ *
+ * @param scheduler The scheduler
+ * @return The number of targets that had to wait
+ */
+unsigned long long scheduler_deferrals(scheduler_t *scheduler) {
+    pthread_mutex_lock(&scheduler->mutex);
+    unsigned long long deferrals = scheduler->deferrals;
+    pthread_mutex_unlock(&scheduler->mutex);
+    return deferrals;
+}
+
+/**
+ * Report how many failed attempts were retried.
+ *
+ * @param scheduler The scheduler
+ * @return The number of retries
+ */
+unsigned long long scheduler_retries(scheduler_t *scheduler) {
+    pthread_mutex_lock(&scheduler->mutex);
+    unsigned long long retries = scheduler->retries;
+    pthread_mutex_unlock(&scheduler->mutex);
+    return retries;
+}
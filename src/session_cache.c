@@ -0,0 +1,415 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "session_cache.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define SESSION_CACHE_MAGIC "CRTSES01"
+#define SESSION_CACHE_MAGIC_LENGTH 8
+#define SESSION_SHARDS 64
+#define INITIAL_SHARD_CAPACITY 64
+// Serialized sessions larger than this are not kept; they carry the server's whole leaf certificate
+#define MAX_SESSION_LENGTH (64 * 1024)
+#define MAX_PATH_LENGTH 1024
+
+// Flags of a stored record
+#define RECORD_HAS_FINGERPRINT 1
+
+// Fixed part of a stored record; the serialized session follows it
+typedef struct {
+    uint64_t key;
+    uint32_t established;
+    uint32_t session_length;
+    uint8_t flags;
+    uint8_t reserved[7];
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+} session_record_t;
+
+_Static_assert(sizeof(session_record_t) == 56, "session records are stored with a 56-byte header");
+
+// What is known about one host:port. previous is the leaf of the last run, fingerprint the leaf of this one.
+typedef struct {
+    uint64_t key;
+    bool used;
+    bool has_previous;
+    bool has_fingerprint;
+    uint32_t established;
+    uint32_t session_length;
+    unsigned char *session;
+    unsigned char previous[SHA256_DIGEST_LENGTH];
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+} session_entry_t;
+
+// One slice of the cache with its own lock; open addressing with linear probing
+typedef struct {
+    pthread_mutex_t mutex;
+    session_entry_t *entries;
+    size_t capacity;
+    size_t count;
+} session_shard_t;
+
+struct session_cache {
+    session_shard_t shards[SESSION_SHARDS];
+    atomic_size_t loaded;
+    atomic_size_t offered;
+    atomic_size_t resumed;
+    atomic_size_t changed;
+};
+
+/**
+ * Find the slot for a key in a shard. The shard must be locked.
+ *
+ * @param shard The shard
+ * @param key The target's key
+ * @return The slot holding the key, or the empty slot where it belongs
+ */
+static size_t shard_slot(const session_shard_t *shard, uint64_t key) {
+    size_t slot = (size_t)(key / SESSION_SHARDS) & (shard->capacity - 1);
+    while (shard->entries[slot].used && shard->entries[slot].key != key) {
+        slot = (slot + 1) & (shard->capacity - 1);
+    }
+    return slot;
+}
+
+/**
+ * Find the entry for a key, adding an empty one if there is none. The shard must be locked.
+ *
+ * @param shard The shard
+ * @param key The target's key
+ * @return The entry, or NULL on allocation failure
+ */
+static session_entry_t *shard_entry(session_shard_t *shard, uint64_t key) {
+    if ((shard->count + 1) * 4 > shard->capacity * 3) {
+        size_t capacity = shard->capacity ? shard->capacity * 2 : INITIAL_SHARD_CAPACITY;
+        session_entry_t *entries = calloc(capacity, sizeof(*entries));
+        if (!entries) {
+            return NULL;
+        }
+        session_shard_t grown = { .entries = entries, .capacity = capacity };
+        for (size_t i = 0; i < shard->capacity; i++) {
+            if (shard->entries[i].used) {
+                entries[shard_slot(&grown, shard->entries[i].key)] = shard->entries[i];
+            }
+        }
+        free(shard->entries);
+        shard->entries = entries;
+        shard->capacity = capacity;
+    }
+
+    session_entry_t *entry = &shard->entries[shard_slot(shard, key)];
+    if (!entry->used) {
+        entry->used = true;
+        entry->key = key;
+        shard->count++;
+    }
+    return entry;
+}
+
+/**
+ * Look up the entry for a key without adding one. The shard must be locked.
+ *
+ * @param shard The shard
+ * @param key The target's key
+ * @return The entry, or NULL if the key is unknown
+ */
+static session_entry_t *shard_find(session_shard_t *shard, uint64_t key) {
+    if (shard->capacity == 0) {
+        return NULL;
+    }
+    session_entry_t *entry = &shard->entries[shard_slot(shard, key)];
+    return entry->used ? entry : NULL;
+}
+
+/**
+ * Create an empty cache.
+ *
+ * @return The cache, or NULL on allocation failure
+ */
+static session_cache_t *session_cache_create(void) {
+    session_cache_t *cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return NULL;
+    }
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].mutex, NULL);
+    }
+    return cache;
+}
+
+/**
+ * Load the sessions and leaf fingerprints an earlier run saved. A missing file gives an empty cache,
+ * and a torn record at the end of the file is ignored.
+ *
+ * @param path The session cache file
+ * @param max_age_seconds Sessions from full handshakes older than this are dropped
+ * @param error_message Buffer for an error message
+ * @param max_length Size of the error message buffer
+ * @return The cache, or NULL on failure
+ */
+session_cache_t *session_cache_load(const char *path, int max_age_seconds, char *error_message, size_t max_length) {
+    session_cache_t *cache = session_cache_create();
+    if (!cache) {
+        snprintf(error_message, max_length, "Failed to allocate the session cache");
+        return NULL;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        if (errno == ENOENT) {
+            return cache;
+        }
+        snprintf(error_message, max_length, "Failed to open session cache %s: %s", path, strerror(errno));
+        session_cache_free(cache);
+        return NULL;
+    }
+
+    char magic[SESSION_CACHE_MAGIC_LENGTH];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, SESSION_CACHE_MAGIC, SESSION_CACHE_MAGIC_LENGTH) != 0) {
+        snprintf(error_message, max_length, "%s is not a session cache file", path);
+        fclose(file);
+        session_cache_free(cache);
+        return NULL;
+    }
+
+    uint32_t oldest = (uint32_t)time(NULL) - (uint32_t)max_age_seconds;
+    session_record_t record;
+    while (fread(&record, sizeof(record), 1, file) == 1 && record.session_length <= MAX_SESSION_LENGTH) {
+        unsigned char *session = NULL;
+        if (record.session_length > 0) {
+            session = malloc(record.session_length);
+            if (!session || fread(session, 1, record.session_length, file) != record.session_length) {
+                free(session);
+                break;
+            }
+        }
+
+        session_shard_t *shard = &cache->shards[record.key % SESSION_SHARDS];
+        session_entry_t *entry = shard_entry(shard, record.key);
+        if (!entry) {
+            free(session);
+            break;
+        }
+        entry->has_previous = (record.flags & RECORD_HAS_FINGERPRINT) != 0;
+        memcpy(entry->previous, record.fingerprint, SHA256_DIGEST_LENGTH);
+        free(entry->session);
+        entry->session = NULL;
+        entry->session_length = 0;
+        if (session && record.established >= oldest) {
+            entry->session = session;
+            entry->session_length = record.session_length;
+            entry->established = record.established;
+            session = NULL;
+        }
+        free(session);
+        cache->loaded++;
+    }
+
+    fclose(file);
+    return cache;
+}
+
+/**
+ * Get the session saved for a target, to offer it to the server.
+ *
+ * @param cache The cache
+ * @param target The target
+ * @return A new session (free with SSL_SESSION_free), or NULL if none is usable
+ */
+SSL_SESSION *session_cache_get(session_cache_t *cache, const target_t *target) {
+    uint64_t key = target_key(target->hostname, target->port);
+    session_shard_t *shard = &cache->shards[key % SESSION_SHARDS];
+    SSL_SESSION *session = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+    session_entry_t *entry = shard_find(shard, key);
+    if (entry && entry->session) {
+        const unsigned char *data = entry->session;
+        session = d2i_SSL_SESSION(NULL, &data, entry->session_length);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    // The server's own lifetime for the session still applies
+    if (session && SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) <= time(NULL)) {
+        SSL_SESSION_free(session);
+        session = NULL;
+    }
+    if (session) {
+        cache->offered++;
+    }
+    return session;
+}
+
+/**
+ * Record the outcome of a successful handshake: the session to offer next time and the leaf it presented.
+ *
+ * @param cache The cache
+ * @param target The target
+ * @param session The session the server issued, or NULL if it issued none
+ * @param resumed Whether the handshake resumed the session offered to the server
+ * @param fingerprint The leaf certificate's SHA256 fingerprint, or NULL if there is none
+ * @return 1 if the leaf differs from the previous run's or the target is new, 0 if unchanged, -1 on failure
+ */
+int session_cache_update(session_cache_t *cache, const target_t *target, SSL_SESSION *session, bool resumed,
+                         const unsigned char fingerprint[SHA256_DIGEST_LENGTH]) {
+    uint64_t key = target_key(target->hostname, target->port);
+    session_shard_t *shard = &cache->shards[key % SESSION_SHARDS];
+    unsigned char *data = NULL;
+    int length = 0;
+    int changed = 0;
+
+    // Serialize outside the lock
+    if (session && SSL_SESSION_is_resumable(session)) {
+        length = i2d_SSL_SESSION(session, NULL);
+        if (length > 0 && length <= MAX_SESSION_LENGTH && (data = malloc((size_t)length)) != NULL) {
+            unsigned char *p = data;
+            length = i2d_SSL_SESSION(session, &p);
+        }
+        if (!data || length <= 0) {
+            free(data);
+            data = NULL;
+            length = 0;
+        }
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    session_entry_t *entry = shard_entry(shard, key);
+    if (!entry) {
+        pthread_mutex_unlock(&shard->mutex);
+        free(data);
+        return -1;
+    }
+
+    if (fingerprint) {
+        changed = !entry->has_previous || memcmp(entry->previous, fingerprint, SHA256_DIGEST_LENGTH) != 0;
+        memcpy(entry->fingerprint, fingerprint, SHA256_DIGEST_LENGTH);
+        entry->has_fingerprint = true;
+    }
+
+    // A resumed session keeps the age of the full handshake that first proved the certificate;
+    // after a full handshake the old session is of no further use
+    if (data || !resumed) {
+        free(entry->session);
+        entry->session = data;
+        entry->session_length = (uint32_t)length;
+        if (!resumed || entry->established == 0) {
+            entry->established = (uint32_t)time(NULL);
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (resumed) cache->resumed++;
+    if (changed) cache->changed++;
+    return changed;
+}
+
+/**
+ * Write the cache to a file, replacing it atomically. Targets not scanned in this run keep what
+ * the previous run recorded.
+ *
+ * @param cache The cache
+ * @param path The session cache file
+ * @param error_message Buffer for an error message
+ * @param max_length Size of the error message buffer
+ * @return 0 on success, -1 on failure
+ */
+int session_cache_save(session_cache_t *cache, const char *path, char *error_message, size_t max_length) {
+    char temp_path[MAX_PATH_LENGTH];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        snprintf(error_message, max_length, "Session cache path too long");
+        return -1;
+    }
+
+    // Sessions hold their master secrets, so only the owner may read them; a temporary file
+    // a crashed run left behind is replaced rather than reused with its old mode
+    unlink(temp_path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!file) {
+        snprintf(error_message, max_length, "Failed to open %s: %s", temp_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    bool failed = fwrite(SESSION_CACHE_MAGIC, 1, SESSION_CACHE_MAGIC_LENGTH, file) != SESSION_CACHE_MAGIC_LENGTH;
+    for (int i = 0; i < SESSION_SHARDS && !failed; i++) {
+        session_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (size_t slot = 0; slot < shard->capacity && !failed; slot++) {
+            const session_entry_t *entry = &shard->entries[slot];
+            if (!entry->used || (!entry->has_fingerprint && !entry->has_previous && !entry->session)) {
+                continue;
+            }
+
+            session_record_t record;
+            memset(&record, 0, sizeof(record));
+            record.key = entry->key;
+            record.established = entry->established;
+            record.session_length = entry->session_length;
+            if (entry->has_fingerprint || entry->has_previous) {
+                record.flags |= RECORD_HAS_FINGERPRINT;
+                memcpy(record.fingerprint, entry->has_fingerprint ? entry->fingerprint : entry->previous,
+                       SHA256_DIGEST_LENGTH);
+            }
+            failed = fwrite(&record, sizeof(record), 1, file) != 1 ||
+                     (entry->session_length > 0 &&
+                      fwrite(entry->session, 1, entry->session_length, file) != entry->session_length);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        failed = true;
+    }
+    if (fclose(file) != 0) {
+        failed = true;
+    }
+    if (failed || rename(temp_path, path) != 0) {
+        snprintf(error_message, max_length, "Failed to write session cache %s: %s", path, strerror(errno));
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read the cache's counters.
+ *
+ * @param cache The cache
+ * @param stats Receives the counters
+ */
+void session_cache_get_stats(session_cache_t *cache, session_cache_stats_t *stats) {
+    stats->loaded = cache->loaded;
+    stats->offered = cache->offered;
+    stats->resumed = cache->resumed;
+    stats->changed = cache->changed;
+}
+
+/**
+ * Free a cache and every session it holds.
+ *
+ * @param cache The cache
+ */
+void session_cache_free(session_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        session_shard_t *shard = &cache->shards[i];
+        for (size_t slot = 0; slot < shard->capacity; slot++) {
+            free(shard->entries[slot].session);
+        }
+        free(shard->entries);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(cache);
+}
@@ -0,0 +1,136 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "shard.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Read one unsigned number from a list, stopping at the given separator.
+ *
+ * @param text Where the number starts; moved past it
+ * @param separator The character allowed after the number, besides the end of the text
+ * @param max The largest value accepted
+ * @param value Receives the number
+ * @return true if a number in 1..max was read
+ */
+static bool parse_number(const char **text, char separator, unsigned long max, uint32_t *value) {
+    char *endptr;
+    errno = 0;
+    unsigned long number = strtoul(*text, &endptr, 10);
+    if (endptr == *text || errno != 0 || number < 1 || number > max || (*endptr != '\0' && *endptr != separator) ||
+        **text == '-' || **text == '+') {
+        return false;
+    }
+    *text = endptr;
+    *value = (uint32_t)number;
+    return true;
+}
+
+/**
+ * Scale a cumulative weight to its place in the 64-bit hash space: floor(2^64 * cumulative / total).
+ * The total stays below 2^32, so the products cannot overflow and every node gets the same bounds.
+ *
+ * @param cumulative Sum of the weights of the shards before the boundary, below total
+ * @param total Sum of all weights
+ * @return The first hash point past the boundary
+ */
+static uint64_t scale_bound(uint64_t cumulative, uint64_t total) {
+    uint64_t quotient = UINT64_MAX / total;
+    uint64_t remainder = UINT64_MAX % total + 1;
+    if (remainder == total) {
+        quotient++;
+        remainder = 0;
+    }
+    return cumulative * quotient + cumulative * remainder / total;
+}
+
+/**
+ * Parse a -shard argument, "i/N" with i counted from 1, and optional weights, one per
+ * shard, such as "1,1,2" to give the third of three nodes half of the targets.
+ *
+ * @param spec The shard, such as "2/3"
+ * @param weights Comma separated weights, or NULL for equal shards
+ * @param shard Receives the shard
+ * @param error_message Buffer to store the error message
+ * @param max_length Maximum length of the error message
+ * @return 0 on success, -1 if the shard or weights are invalid
+ */
+int shard_parse(const char *spec, const char *weights, shard_t *shard, char *error_message, size_t max_length) {
+    const char *p = spec;
+    uint32_t index;
+    uint32_t count;
+
+    if (!parse_number(&p, '/', SHARD_MAX_COUNT, &index) || *p++ != '/' ||
+        !parse_number(&p, '\0', SHARD_MAX_COUNT, &count) || index > count) {
+        snprintf(error_message, max_length, "Invalid shard %s. Must be i/N with 1 <= i <= N <= %d.", spec, SHARD_MAX_COUNT);
+        return -1;
+    }
+
+    // Shards are laid out in order, each taking its weight's share of the hash space
+    uint64_t before = index - 1;
+    uint64_t weight = 1;
+    uint64_t total = count;
+    if (weights) {
+        uint32_t parsed = 0;
+        before = 0;
+        total = 0;
+        p = weights;
+        while (parsed < count) {
+            uint32_t value;
+            if ((parsed > 0 && *p++ != ',') || !parse_number(&p, ',', SHARD_MAX_WEIGHT, &value)) {
+                break;
+            }
+            parsed++;
+            if (parsed < index) {
+                before += value;
+            } else if (parsed == index) {
+                weight = value;
+            }
+            total += value;
+        }
+        if (parsed != count || *p != '\0') {
+            snprintf(error_message, max_length, "Invalid shard weights %s. Need %u weights between 1 and %d.",
+                     weights, count, SHARD_MAX_WEIGHT);
+            return -1;
+        }
+    }
+
+    shard->index = index - 1;
+    shard->count = count;
+    shard->weight = (uint32_t)weight;
+    shard->total_weight = total;
+    shard->low = before == 0 ? 0 : scale_bound(before, total);
+    shard->high = before + weight == total ? UINT64_MAX : scale_bound(before + weight, total) - 1;
+    return 0;
+}
+
+/**
+ * Place a target in the hash space. The point depends only on the lowercased hostname and
+ * the port, not on where the target is in the input, so every node agrees on it.
+ *
+ * @param hostname The hostname
+ * @param port The port
+ * @return The target's point
+ */
+uint64_t shard_point(const char *hostname, const char *port) {
+    // FNV-1a spreads its low bits well but not its high ones; the splitmix64 finaliser mixes them
+    uint64_t z = target_key(hostname, port);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Check whether a target belongs to this node's shard.
+ *
+ * @param shard The shard
+ * @param target The target
+ * @return true if this node scans the target
+ */
+bool shard_contains(const shard_t *shard, const target_t *target) {
+    uint64_t point = shard_point(target->hostname, target->port);
+    return point >= shard->low && point <= shard->high;
+}
@@ -0,0 +1,171 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ssl_profile.h"
+#include <openssl/err.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAX_PROFILE_LENGTH 1024
+
+// Named starting points for a profile; key=value settings are applied on top
+typedef struct {
+    const char *name;
+    int min_version;
+    int max_version;
+    const char *cipher_list;
+} ssl_profile_base_t;
+
+static const ssl_profile_base_t profile_bases[] = {
+    // OpenSSL defaults
+    { "default", 0, 0, NULL },
+    // TLS 1.3 only
+    { "modern", TLS1_3_VERSION, TLS1_3_VERSION, NULL },
+    // TLS 1.2 only
+    { "tls12", TLS1_2_VERSION, TLS1_2_VERSION, NULL },
+    // Everything the library can still speak, for reaching legacy servers
+    { "compat", TLS1_VERSION, 0, "ALL:@SECLEVEL=0" },
+};
+
+/**
+ * Parse a protocol version name.
+ *
+ * @param value A version such as "1.2", "tls1.2" or "TLSv1.2"
+ * @param version Receives the OpenSSL version constant
+ * @return true on success, false if the version is unknown
+ */
+static bool parse_version(const char *value, int *version) {
+    if (strncasecmp(value, "tlsv", 4) == 0) {
+        value += 4;
+    } else if (strncasecmp(value, "tls", 3) == 0) {
+        value += 3;
+    }
+
+    if (strcmp(value, "1.0") == 0) {
+        *version = TLS1_VERSION;
+    } else if (strcmp(value, "1.1") == 0) {
+        *version = TLS1_1_VERSION;
+    } else if (strcmp(value, "1.2") == 0) {
+        *version = TLS1_2_VERSION;
+    } else if (strcmp(value, "1.3") == 0) {
+        *version = TLS1_3_VERSION;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Apply a single key=value setting from a profile to a context.
+ *
+ * @param ctx The context being configured
+ * @param key The setting name
+ * @param value The setting value
+ * @return true on success, false if the setting is unknown or rejected by OpenSSL
+ */
+static bool apply_setting(SSL_CTX *ctx, const char *key, const char *value) {
+    int version;
+
+    if (strcmp(key, "min") == 0) {
+        return parse_version(value, &version) && SSL_CTX_set_min_proto_version(ctx, version) == 1;
+    } else if (strcmp(key, "max") == 0) {
+        return parse_version(value, &version) && SSL_CTX_set_max_proto_version(ctx, version) == 1;
+    } else if (strcmp(key, "ciphers") == 0) {
+        return SSL_CTX_set_cipher_list(ctx, value) == 1;
+    } else if (strcmp(key, "ciphersuites") == 0) {
+        return SSL_CTX_set_ciphersuites(ctx, value) == 1;
+    } else if (strcmp(key, "groups") == 0) {
+        return SSL_CTX_set1_groups_list(ctx, value) == 1;
+    }
+    return false;
+}
+
+/**
+ * Apply a named base profile to a context.
+ *
+ * @param ctx The context being configured
+ * @param name The base profile name
+ * @return true on success, false if the name is unknown or rejected by OpenSSL
+ */
+static bool apply_base(SSL_CTX *ctx, const char *name) {
+    for (size_t i = 0; i < sizeof(profile_bases) / sizeof(profile_bases[0]); i++) {
+        const ssl_profile_base_t *base = &profile_bases[i];
+        if (strcmp(base->name, name) != 0) {
+            continue;
+        }
+        if (base->min_version && SSL_CTX_set_min_proto_version(ctx, base->min_version) != 1) {
+            return false;
+        }
+        if (base->max_version && SSL_CTX_set_max_proto_version(ctx, base->max_version) != 1) {
+            return false;
+        }
+        if (base->cipher_list && SSL_CTX_set_cipher_list(ctx, base->cipher_list) != 1) {
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Build the client SSL_CTX shared by every connection of a scan.
+ *
+ * A profile is a comma separated list. The first item may name a base profile
+ * (default, modern, tls12, compat); the remaining items are key=value settings:
+ * min, max (protocol versions), ciphers (TLS 1.2 and below), ciphersuites (TLS 1.3)
+ * and groups (key exchange groups). For example "compat,groups=X25519:P-256".
+ *
+ * The returned context is fully configured before it is handed out, so creating
+ * SSL objects from it on several threads at once is safe.
+ *
+ * @param profile The profile string, or NULL for the OpenSSL defaults
+ * @param error_message Buffer to store an error message on failure
+ * @param max_length Maximum length of the error message
+ * @return The new context, or NULL on failure
+ */
+SSL_CTX *create_ssl_context(const char *profile, char *error_message, size_t max_length) {
+    char spec[MAX_PROFILE_LENGTH];
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        snprintf(error_message, max_length, "Failed to create SSL context");
+        return NULL;
+    }
+
+    // Disable certificate verification (Note: This is not recommended for production use)
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+    if (!profile) {
+        return ctx;
+    }
+
+    if (snprintf(spec, sizeof(spec), "%s", profile) >= (int)sizeof(spec)) {
+        snprintf(error_message, max_length, "SSL profile too long");
+        goto error;
+    }
+
+    char *saveptr = NULL;
+    bool first = true;
+    for (char *item = strtok_r(spec, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr), first = false) {
+        char *value = strchr(item, '=');
+        if (!value) {
+            if (!first || !apply_base(ctx, item)) {
+                snprintf(error_message, max_length, "Unknown SSL profile '%s'", item);
+                goto error;
+            }
+            continue;
+        }
+
+        *value++ = '\0';
+        if (!apply_setting(ctx, item, value)) {
+            snprintf(error_message, max_length, "Invalid SSL profile setting %s=%s", item, value);
+            goto error;
+        }
+    }
+
+    return ctx;
+
+error:
+    ERR_clear_error();
+    SSL_CTX_free(ctx);
+    return NULL;
+}
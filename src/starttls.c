@@ -0,0 +1,419 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "starttls.h"
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+// Outcome of looking at the reply bytes received so far
+#define REPLY_INCOMPLETE 0
+#define REPLY_OK         1
+#define REPLY_FAILED     -1
+
+// How to read one reply line: keep reading, accept the reply, or give up
+typedef enum {
+    LINE_MORE,
+    LINE_OK,
+    LINE_FAILED
+} line_result_t;
+
+typedef int (*reply_parser_t)(starttls_t *negotiation);
+
+// One request sent to the server (none for a greeting) and the reply it must get
+typedef struct {
+    const char *request;
+    size_t request_length;
+    reply_parser_t parse;
+} starttls_step_t;
+
+// Protocol names, as given after a '/' in the input, and their usual ports
+static const struct {
+    const char *name;
+    uint16_t port;
+} protocols[] = {
+    [STARTTLS_AUTO]     = { "auto", 443 },
+    [STARTTLS_NONE]     = { "tls", 443 },
+    [STARTTLS_SMTP]     = { "smtp", 25 },
+    [STARTTLS_IMAP]     = { "imap", 143 },
+    [STARTTLS_POP3]     = { "pop3", 110 },
+    [STARTTLS_LDAP]     = { "ldap", 389 },
+    [STARTTLS_POSTGRES] = { "postgres", 5432 }
+};
+
+#define PROTOCOL_COUNT (sizeof(protocols) / sizeof(protocols[0]))
+
+/**
+ * Parse a protocol name.
+ *
+ * @param name The name, not NUL-terminated
+ * @param length Length of the name
+ * @return The protocol, or -1 if the name is unknown
+ */
+int starttls_protocol_parse(const char *name, size_t length) {
+    for (size_t i = STARTTLS_NONE; i < PROTOCOL_COUNT; i++) {
+        if (strlen(protocols[i].name) == length && strncasecmp(protocols[i].name, name, length) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Name a protocol.
+ *
+ * @param protocol The protocol
+ * @return The name
+ */
+const char *starttls_protocol_name(starttls_protocol_t protocol) {
+    return (unsigned)protocol < PROTOCOL_COUNT ? protocols[protocol].name : "unknown";
+}
+
+/**
+ * Get the port a protocol's servers usually listen on.
+ *
+ * @param protocol The protocol
+ * @return The port
+ */
+uint16_t starttls_default_port(starttls_protocol_t protocol) {
+    return (unsigned)protocol < PROTOCOL_COUNT ? protocols[protocol].port : 443;
+}
+
+/**
+ * Pick the protocol a target with no explicit protocol speaks, from its port.
+ * Only the plaintext ports of each protocol are mapped; their implicit TLS ports
+ * (465, 993, 995, 636) speak TLS from the first byte.
+ *
+ * @param port The port
+ * @return The protocol, STARTTLS_NONE for direct TLS
+ */
+starttls_protocol_t starttls_protocol_for_port(uint16_t port) {
+    switch (port) {
+        case 25:
+        case 587:  return STARTTLS_SMTP;
+        case 143:  return STARTTLS_IMAP;
+        case 110:  return STARTTLS_POP3;
+        case 389:  return STARTTLS_LDAP;
+        case 5432: return STARTTLS_POSTGRES;
+        default:   return STARTTLS_NONE;
+    }
+}
+
+/**
+ * Hand every complete reply line to a classifier, dropping the lines it reads past.
+ *
+ * @param negotiation The negotiation
+ * @param classify Decides what a line means
+ * @return REPLY_OK, REPLY_FAILED, or REPLY_INCOMPLETE if more lines are needed
+ */
+static int parse_lines(starttls_t *negotiation, line_result_t (*classify)(const char *line, size_t length)) {
+    for (;;) {
+        char *newline = memchr(negotiation->buffer, '\n', negotiation->length);
+        if (!newline) {
+            if (negotiation->length == sizeof(negotiation->buffer)) {
+                negotiation->error = "reply line too long";
+                return REPLY_FAILED;
+            }
+            return REPLY_INCOMPLETE;
+        }
+
+        size_t consumed = (size_t)(newline - negotiation->buffer) + 1;
+        size_t length = consumed - 1;
+        if (length > 0 && negotiation->buffer[length - 1] == '\r') {
+            length--;
+        }
+        line_result_t result = classify(negotiation->buffer, length);
+
+        memmove(negotiation->buffer, negotiation->buffer + consumed, negotiation->length - consumed);
+        negotiation->length -= consumed;
+        if (result == LINE_OK) {
+            return REPLY_OK;
+        }
+        if (result == LINE_FAILED) {
+            negotiation->error = "server refused";
+            return REPLY_FAILED;
+        }
+    }
+}
+
+/**
+ * Read one line of an SMTP reply. Continuation lines have a '-' after the code.
+ *
+ * @param line The line
+ * @param length Length of the line
+ * @param expected The reply code the final line must have
+ * @return The line's meaning
+ */
+static line_result_t smtp_line(const char *line, size_t length, const char *expected) {
+    if (length < 3 || memcmp(line, expected, 3) != 0) {
+        return LINE_FAILED;
+    }
+    return length > 3 && line[3] == '-' ? LINE_MORE : LINE_OK;
+}
+
+// SMTP readiness (greeting and STARTTLS reply) is 220, EHLO success 250
+static line_result_t smtp_ready_line(const char *line, size_t length) {
+    return smtp_line(line, length, "220");
+}
+
+static line_result_t smtp_ehlo_line(const char *line, size_t length) {
+    return smtp_line(line, length, "250");
+}
+
+static int smtp_ready(starttls_t *negotiation) {
+    return parse_lines(negotiation, smtp_ready_line);
+}
+
+static int smtp_ehlo(starttls_t *negotiation) {
+    return parse_lines(negotiation, smtp_ehlo_line);
+}
+
+// An IMAP greeting must be an untagged OK
+static line_result_t imap_greeting_line(const char *line, size_t length) {
+    return length >= 4 && strncasecmp(line, "* OK", 4) == 0 ? LINE_OK : LINE_FAILED;
+}
+
+// The reply to the tagged STARTTLS command ends with its tagged OK; untagged lines come first
+static line_result_t imap_starttls_line(const char *line, size_t length) {
+    if (length >= 2 && line[0] == '*' && line[1] == ' ') {
+        return LINE_MORE;
+    }
+    return length >= 7 && strncasecmp(line, "a001 OK", 7) == 0 ? LINE_OK : LINE_FAILED;
+}
+
+static int imap_greeting(starttls_t *negotiation) {
+    return parse_lines(negotiation, imap_greeting_line);
+}
+
+static int imap_starttls(starttls_t *negotiation) {
+    return parse_lines(negotiation, imap_starttls_line);
+}
+
+// POP3 status lines must be +OK
+static line_result_t pop3_line(const char *line, size_t length) {
+    return length >= 3 && memcmp(line, "+OK", 3) == 0 ? LINE_OK : LINE_FAILED;
+}
+
+static int pop3_ok(starttls_t *negotiation) {
+    return parse_lines(negotiation, pop3_line);
+}
+
+/**
+ * Read a BER tag and length.
+ *
+ * @param data The encoding
+ * @param size Bytes available
+ * @param pos Position of the tag; moved past the length
+ * @param tag Receives the tag
+ * @param length Receives the content length
+ * @return 1 if read, 0 if more bytes are needed, -1 if the encoding is invalid
+ */
+static int read_ber_header(const unsigned char *data, size_t size, size_t *pos, unsigned char *tag, size_t *length) {
+    if (*pos + 2 > size) {
+        return 0;
+    }
+    *tag = data[*pos];
+    unsigned char first = data[*pos + 1];
+    *pos += 2;
+    if (first < 0x80) {
+        *length = first;
+        return 1;
+    }
+
+    size_t bytes = first & 0x7f;
+    if (bytes == 0 || bytes > 4) {
+        return -1;
+    }
+    if (*pos + bytes > size) {
+        return 0;
+    }
+    *length = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        *length = (*length << 8) | data[(*pos)++];
+    }
+    return 1;
+}
+
+/**
+ * Read the LDAP ExtendedResponse to the StartTLS request: an LDAPMessage holding a
+ * message ID and an [APPLICATION 24] response whose result code must be success (0).
+ */
+static int ldap_extended_response(starttls_t *negotiation) {
+    const unsigned char *data = (const unsigned char *)negotiation->buffer;
+    size_t size = negotiation->length;
+    size_t pos = 0, length, id_length;
+    unsigned char tag;
+
+    int rc = read_ber_header(data, size, &pos, &tag, &length);
+    if (rc == 0) {
+        return REPLY_INCOMPLETE;
+    }
+    if (rc < 0 || tag != 0x30 || pos + length > sizeof(negotiation->buffer)) {
+        negotiation->error = "malformed LDAP response";
+        return REPLY_FAILED;
+    }
+    if (pos + length > size) {
+        return REPLY_INCOMPLETE;
+    }
+
+    size_t end = pos + length;
+    if (read_ber_header(data, end, &pos, &tag, &id_length) != 1 || tag != 0x02 || pos + id_length > end) {
+        negotiation->error = "malformed LDAP response";
+        return REPLY_FAILED;
+    }
+    pos += id_length;
+    if (read_ber_header(data, end, &pos, &tag, &length) != 1 || tag != 0x78 ||
+        read_ber_header(data, end, &pos, &tag, &length) != 1 || tag != 0x0a || length != 1 || pos >= end) {
+        negotiation->error = "malformed LDAP response";
+        return REPLY_FAILED;
+    }
+    if (data[pos] != 0) {
+        negotiation->error = "server refused";
+        return REPLY_FAILED;
+    }
+    negotiation->length = 0;
+    return REPLY_OK;
+}
+
+/**
+ * Read the one-byte answer to a PostgreSQL SSLRequest: 'S' to go ahead, 'N' if SSL is off.
+ */
+static int postgres_answer(starttls_t *negotiation) {
+    if (negotiation->length == 0) {
+        return REPLY_INCOMPLETE;
+    }
+    if (negotiation->buffer[0] != 'S') {
+        negotiation->error = negotiation->buffer[0] == 'N' ? "server does not accept SSL" : "unexpected reply";
+        return REPLY_FAILED;
+    }
+    negotiation->length = 0;
+    return REPLY_OK;
+}
+
+#define REQUEST(text) text, sizeof(text) - 1
+
+static const starttls_step_t smtp_steps[] = {
+    { NULL, 0, smtp_ready },
+    { REQUEST("EHLO download-cert.invalid\r\n"), smtp_ehlo },
+    { REQUEST("STARTTLS\r\n"), smtp_ready }
+};
+
+static const starttls_step_t imap_steps[] = {
+    { NULL, 0, imap_greeting },
+    { REQUEST("a001 STARTTLS\r\n"), imap_starttls }
+};
+
+static const starttls_step_t pop3_steps[] = {
+    { NULL, 0, pop3_ok },
+    { REQUEST("STLS\r\n"), pop3_ok }
+};
+
+// LDAPMessage { messageID 1, ExtendedRequest { requestName "1.3.6.1.4.1.1466.20037" } }
+static const starttls_step_t ldap_steps[] = {
+    { REQUEST("\x30\x1d\x02\x01\x01\x77\x18\x80\x16" "1.3.6.1.4.1.1466.20037"), ldap_extended_response }
+};
+
+// SSLRequest: length 8, code 80877103
+static const starttls_step_t postgres_steps[] = {
+    { REQUEST("\x00\x00\x00\x08\x04\xd2\x16\x2f"), postgres_answer }
+};
+
+/**
+ * Get the steps of a protocol's negotiation.
+ *
+ * @param protocol The protocol
+ * @param count Receives the number of steps
+ * @return The steps
+ */
+static const starttls_step_t *protocol_steps(starttls_protocol_t protocol, int *count) {
+    switch (protocol) {
+        case STARTTLS_SMTP:
+            *count = sizeof(smtp_steps) / sizeof(smtp_steps[0]);
+            return smtp_steps;
+        case STARTTLS_IMAP:
+            *count = sizeof(imap_steps) / sizeof(imap_steps[0]);
+            return imap_steps;
+        case STARTTLS_POP3:
+            *count = sizeof(pop3_steps) / sizeof(pop3_steps[0]);
+            return pop3_steps;
+        case STARTTLS_LDAP:
+            *count = sizeof(ldap_steps) / sizeof(ldap_steps[0]);
+            return ldap_steps;
+        case STARTTLS_POSTGRES:
+            *count = sizeof(postgres_steps) / sizeof(postgres_steps[0]);
+            return postgres_steps;
+        default:
+            *count = 0;
+            return NULL;
+    }
+}
+
+/**
+ * Prepare a negotiation.
+ *
+ * @param negotiation The negotiation
+ * @param protocol The protocol to speak
+ */
+void starttls_init(starttls_t *negotiation, starttls_protocol_t protocol) {
+    negotiation->protocol = protocol;
+    negotiation->step = 0;
+    negotiation->sent = 0;
+    negotiation->length = 0;
+    negotiation->error = NULL;
+}
+
+/**
+ * Advance a negotiation as far as the socket allows without waiting.
+ * The server sends nothing after its final reply until the TLS ClientHello arrives,
+ * so reading whatever is available never takes handshake bytes away from OpenSSL.
+ *
+ * @param negotiation The negotiation
+ * @param fd The connected non-blocking socket
+ * @return STARTTLS_WANT_READ or STARTTLS_WANT_WRITE to wait, 0 once the server is ready for
+ *         the TLS handshake, -1 on failure (the reason is in negotiation->error)
+ */
+int starttls_continue(starttls_t *negotiation, int fd) {
+    int count;
+    const starttls_step_t *steps = protocol_steps(negotiation->protocol, &count);
+
+    while (negotiation->step < count) {
+        const starttls_step_t *step = &steps[negotiation->step];
+
+        if (negotiation->sent < step->request_length) {
+            ssize_t n = send(fd, step->request + negotiation->sent, step->request_length - negotiation->sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    return STARTTLS_WANT_WRITE;
+                }
+                negotiation->error = "send failed";
+                return -1;
+            }
+            negotiation->sent += (size_t)n;
+            continue;
+        }
+
+        int reply = step->parse(negotiation);
+        if (reply == REPLY_FAILED) {
+            return -1;
+        }
+        if (reply == REPLY_OK) {
+            negotiation->step++;
+            negotiation->sent = 0;
+            continue;
+        }
+
+        ssize_t n = recv(fd, negotiation->buffer + negotiation->length, sizeof(negotiation->buffer) - negotiation->length, 0);
+        if (n > 0) {
+            negotiation->length += (size_t)n;
+        } else if (n == 0) {
+            negotiation->error = "connection closed";
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return STARTTLS_WANT_READ;
+        } else {
+            negotiation->error = "receive failed";
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,525 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "target_generator.h"
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest input entry that can be an address range
+#define MAX_RANGE_TEXT 128
+// Most targets all ranges may expand to; keeps the group arithmetic within 64 bits
+#define MAX_TARGETS (1ULL << 62)
+#define INITIAL_RANGES 16
+
+// One CIDR block or address range, expanded to every address times its ports
+typedef struct {
+    int family;
+    unsigned __int128 base;
+    uint64_t addresses;
+    uint64_t first_index;
+    uint16_t port;
+    bool own_port;
+} address_range_t;
+
+struct target_generator {
+    pthread_mutex_t mutex;
+    port_list_t ports;
+    uint64_t seed;
+    address_range_t *ranges;
+    size_t count;
+    size_t capacity;
+    uint64_t total;
+};
+
+/**
+ * Parse a port list such as "443,8443,9000-9010".
+ *
+ * @param text The list
+ * @param list Receives the ports, in the order given (free with port_list_free)
+ * @return 0 on success, -1 if the list is malformed or names a port outside 1-65535
+ */
+int port_list_parse(const char *text, port_list_t *list) {
+    list->ports = NULL;
+    list->count = 0;
+    size_t capacity = 0;
+
+    while (*text) {
+        char *end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text) {
+            goto error;
+        }
+        if (*end == '-') {
+            const char *next = end + 1;
+            last = strtol(next, &end, 10);
+            if (end == next) {
+                goto error;
+            }
+        }
+        if (first < 1 || last > 65535 || last < first || (*end != ',' && *end != '\0')) {
+            goto error;
+        }
+
+        for (long port = first; port <= last; port++) {
+            if (list->count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                uint16_t *ports = realloc(list->ports, capacity * sizeof(*ports));
+                if (!ports) {
+                    goto error;
+                }
+                list->ports = ports;
+            }
+            list->ports[list->count++] = (uint16_t)port;
+        }
+        text = *end == ',' ? end + 1 : end;
+    }
+    if (list->count > 0) {
+        return 0;
+    }
+
+error:
+    port_list_free(list);
+    return -1;
+}
+
+/**
+ * Free a port list.
+ *
+ * @param list The list
+ */
+void port_list_free(port_list_t *list) {
+    free(list->ports);
+    list->ports = NULL;
+    list->count = 0;
+}
+
+/**
+ * Create a generator for address ranges.
+ *
+ * @param ports Ports for ranges that give none, or NULL for the default port only
+ * @param seed Seed of the random permutation; the same seed and input give the same order
+ * @return The generator, or NULL on allocation failure
+ */
+target_generator_t *target_generator_create(const port_list_t *ports, uint64_t seed) {
+    target_generator_t *generator = calloc(1, sizeof(*generator));
+    if (!generator) {
+        return NULL;
+    }
+    if (ports && ports->count > 0) {
+        generator->ports.ports = malloc(ports->count * sizeof(*ports->ports));
+        if (!generator->ports.ports) {
+            free(generator);
+            return NULL;
+        }
+        memcpy(generator->ports.ports, ports->ports, ports->count * sizeof(*ports->ports));
+        generator->ports.count = ports->count;
+    }
+    generator->seed = seed;
+    pthread_mutex_init(&generator->mutex, NULL);
+    return generator;
+}
+
+/**
+ * Free a generator.
+ *
+ * @param generator The generator, or NULL
+ */
+void target_generator_free(target_generator_t *generator) {
+    if (!generator) {
+        return;
+    }
+    port_list_free(&generator->ports);
+    pthread_mutex_destroy(&generator->mutex);
+    free(generator->ranges);
+    free(generator);
+}
+
+/**
+ * Get the ports entries without their own port expand to.
+ *
+ * @param generator The generator
+ * @return The port list, or NULL if only the default port is scanned
+ */
+const port_list_t *target_generator_ports(const target_generator_t *generator) {
+    return generator->ports.count > 0 ? &generator->ports : NULL;
+}
+
+/**
+ * Convert an IPv4 or IPv6 address to a number.
+ *
+ * @param text The address
+ * @param family Receives AF_INET or AF_INET6
+ * @param value Receives the address as a number
+ * @return true if the text is an address
+ */
+static bool parse_address(const char *text, int *family, unsigned __int128 *value) {
+    unsigned char bytes[16];
+    int length;
+
+    if (inet_pton(AF_INET, text, bytes) == 1) {
+        *family = AF_INET;
+        length = 4;
+    } else if (inet_pton(AF_INET6, text, bytes) == 1) {
+        *family = AF_INET6;
+        length = 16;
+    } else {
+        return false;
+    }
+
+    *value = 0;
+    for (int i = 0; i < length; i++) {
+        *value = (*value << 8) | bytes[i];
+    }
+    return true;
+}
+
+/**
+ * Split an optional ":port" off the end of an IPv4 range. IPv6 ranges take their ports from the port list.
+ *
+ * @param text The range text; the port is cut off in place
+ * @param port Receives the port
+ * @return 1 if a port was found, 0 if there is none, -1 if it is invalid
+ */
+static int split_port(char *text, uint16_t *port) {
+    char *colon = strrchr(text, ':');
+    if (!colon || strchr(text, ':') != colon) {
+        return 0;
+    }
+    char *end;
+    long value = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || value < 1 || value > 65535) {
+        return -1;
+    }
+    *colon = '\0';
+    *port = (uint16_t)value;
+    return 1;
+}
+
+/**
+ * Add an input entry if it is a CIDR block ("10.0.0.0/8") or an address range
+ * ("10.0.0.1-10.0.0.200"), optionally followed by ":port" for IPv4.
+ *
+ * @param generator The generator
+ * @param text The entry, possibly with a trailing newline
+ * @param length Length of the entry
+ * @return 1 if the entry was a range and was added, 0 if it is not a range, -1 if it is an invalid or too large range
+ */
+int target_generator_add(target_generator_t *generator, const char *text, size_t length) {
+    char entry[MAX_RANGE_TEXT];
+    address_range_t range;
+    memset(&range, 0, sizeof(range));
+
+    while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) {
+        length--;
+    }
+    const char *slash = memchr(text, '/', length);
+    const char *dash = memchr(text, '-', length);
+    if ((!slash && !dash) || length >= sizeof(entry)) {
+        return 0;
+    }
+    memcpy(entry, text, length);
+    entry[length] = '\0';
+
+    if (slash) {
+        // CIDR block; a protocol name after the slash marks a host entry instead
+        char *prefix = entry + (slash - text);
+        *prefix++ = '\0';
+        if (*prefix < '0' || *prefix > '9') {
+            return 0;
+        }
+        int has_port = split_port(prefix, &range.port);
+        char *end;
+        long bits = strtol(prefix, &end, 10);
+        if (!parse_address(entry, &range.family, &range.base)) {
+            return 0;
+        }
+        int width = range.family == AF_INET ? 32 : 128;
+        if (has_port < 0 || end == prefix || *end != '\0' || bits < 0 || bits > width ||
+            (range.family == AF_INET6 && has_port) || width - bits >= 62) {
+            return -1;
+        }
+        range.own_port = has_port == 1;
+        range.addresses = 1ULL << (width - bits);
+        range.base &= ~(unsigned __int128)(range.addresses - 1);
+    } else {
+        // First-last range; hostnames may contain dashes, so only address pairs count
+        char *last = entry + (dash - text);
+        *last++ = '\0';
+        int family;
+        unsigned __int128 end_value;
+        if (!parse_address(entry, &range.family, &range.base)) {
+            return 0;
+        }
+        int has_port = range.family == AF_INET ? split_port(last, &range.port) : 0;
+        if (has_port < 0 || !parse_address(last, &family, &end_value) || family != range.family ||
+            end_value < range.base || end_value - range.base >= MAX_TARGETS) {
+            return -1;
+        }
+        range.own_port = has_port == 1;
+        range.addresses = (uint64_t)(end_value - range.base) + 1;
+    }
+
+    uint64_t ports = range.own_port || generator->ports.count == 0 ? 1 : generator->ports.count;
+    int ret = -1;
+    pthread_mutex_lock(&generator->mutex);
+    if (range.addresses <= (MAX_TARGETS - generator->total) / ports) {
+        if (generator->count == generator->capacity) {
+            size_t capacity = generator->capacity ? generator->capacity * 2 : INITIAL_RANGES;
+            address_range_t *ranges = realloc(generator->ranges, capacity * sizeof(*ranges));
+            if (ranges) {
+                generator->ranges = ranges;
+                generator->capacity = capacity;
+            }
+        }
+        if (generator->count < generator->capacity) {
+            range.first_index = generator->total;
+            generator->ranges[generator->count++] = range;
+            generator->total += range.addresses * ports;
+            ret = 1;
+        }
+    }
+    pthread_mutex_unlock(&generator->mutex);
+    return ret;
+}
+
+/**
+ * Count the targets the ranges added so far expand to.
+ *
+ * @param generator The generator
+ * @return The number of targets
+ */
+uint64_t target_generator_count(target_generator_t *generator) {
+    pthread_mutex_lock(&generator->mutex);
+    uint64_t total = generator->total;
+    pthread_mutex_unlock(&generator->mutex);
+    return total;
+}
+
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m) {
+    return (uint64_t)((unsigned __int128)a * b % m);
+}
+
+static uint64_t powmod(uint64_t base, uint64_t exponent, uint64_t m) {
+    uint64_t result = 1 % m;
+    base %= m;
+    while (exponent) {
+        if (exponent & 1) result = mulmod(result, base, m);
+        base = mulmod(base, base, m);
+        exponent >>= 1;
+    }
+    return result;
+}
+
+/**
+ * Next value of a splitmix64 generator.
+ *
+ * @param state The generator state
+ * @return A pseudo-random 64-bit value
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Deterministic Miller-Rabin test, exact for every 64-bit number.
+ *
+ * @param n The number
+ * @return true if n is prime
+ */
+static bool is_prime(uint64_t n) {
+    static const uint64_t bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+
+    if (n < 2) return false;
+    for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++) {
+        if (n % bases[i] == 0) return n == bases[i];
+    }
+
+    uint64_t d = n - 1;
+    int shifts = 0;
+    while ((d & 1) == 0) {
+        d >>= 1;
+        shifts++;
+    }
+    for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++) {
+        uint64_t x = powmod(bases[i], d, n);
+        if (x == 1 || x == n - 1) continue;
+        bool composite = true;
+        for (int r = 1; r < shifts && composite; r++) {
+            x = mulmod(x, x, n);
+            composite = x != n - 1;
+        }
+        if (composite) return false;
+    }
+    return true;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/**
+ * Find a non-trivial factor of an odd composite number (Pollard's rho, Brent's variant).
+ *
+ * @param n The number
+ * @param state Random state for the starting points
+ * @return A factor between 2 and n - 1
+ */
+static uint64_t find_factor(uint64_t n, uint64_t *state) {
+    for (;;) {
+        uint64_t c = next_random(state) % (n - 1) + 1;
+        uint64_t y = next_random(state) % n;
+        uint64_t x = y, q = 1, g = 1, ys = y;
+        uint64_t r = 1;
+
+        while (g == 1) {
+            x = y;
+            for (uint64_t i = 0; i < r; i++) y = (mulmod(y, y, n) + c) % n;
+            for (uint64_t k = 0; k < r && g == 1; k += 128) {
+                ys = y;
+                for (uint64_t i = 0; i < 128 && i < r - k; i++) {
+                    y = (mulmod(y, y, n) + c) % n;
+                    q = mulmod(q, x > y ? x - y : y - x, n);
+                }
+                g = gcd(q, n);
+            }
+            r *= 2;
+        }
+        if (g == n) {
+            do {
+                ys = (mulmod(ys, ys, n) + c) % n;
+                g = gcd(x > ys ? x - ys : ys - x, n);
+            } while (g == 1);
+        }
+        if (g != n) return g;
+    }
+}
+
+/**
+ * Collect the distinct prime factors of a number.
+ *
+ * @param n The number
+ * @param factors Receives the factors; a 64-bit number has at most 15 distinct ones
+ * @param state Random state for the factoring
+ * @return The number of factors
+ */
+static int prime_factors(uint64_t n, uint64_t factors[16], uint64_t *state) {
+    uint64_t pending[64];
+    int pending_count = 0;
+    int count = 0;
+
+    for (uint64_t p = 2; p < 1000 && p * p <= n; p++) {
+        if (n % p == 0) {
+            factors[count++] = p;
+            while (n % p == 0) n /= p;
+        }
+    }
+    if (n > 1) pending[pending_count++] = n;
+
+    while (pending_count > 0) {
+        uint64_t m = pending[--pending_count];
+        if (is_prime(m)) {
+            bool seen = false;
+            for (int i = 0; i < count; i++) seen |= factors[i] == m;
+            if (!seen) factors[count++] = m;
+            continue;
+        }
+        uint64_t f = find_factor(m, state);
+        pending[pending_count++] = f;
+        pending[pending_count++] = m / f;
+    }
+    return count;
+}
+
+/**
+ * Turn a position in the permutation into a target.
+ *
+ * @param generator The generator
+ * @param index The position, below the target count
+ * @param target Receives the address and port
+ */
+static void index_target(const target_generator_t *generator, uint64_t index, target_t *target) {
+    size_t low = 0, high = generator->count - 1;
+    while (low < high) {
+        size_t mid = (low + high + 1) / 2;
+        if (generator->ranges[mid].first_index <= index) low = mid;
+        else high = mid - 1;
+    }
+    const address_range_t *range = &generator->ranges[low];
+    uint64_t local = index - range->first_index;
+    uint64_t ports = range->own_port || generator->ports.count == 0 ? 1 : generator->ports.count;
+    unsigned __int128 address = range->base + local / ports;
+    unsigned int port = range->own_port ? range->port
+                      : generator->ports.count ? generator->ports.ports[local % ports] : 443;
+
+    unsigned char bytes[16];
+    int length = range->family == AF_INET ? 4 : 16;
+    for (int i = length - 1; i >= 0; i--) {
+        bytes[i] = (unsigned char)address;
+        address >>= 8;
+    }
+    inet_ntop(range->family, bytes, target->hostname, sizeof(target->hostname));
+    snprintf(target->port, sizeof(target->port), "%u", port);
+}
+
+/**
+ * Expand every range into targets, in a random order that spreads them across networks.
+ * The order walks the cyclic group of integers modulo a prime p just above the target count:
+ * repeated multiplication by a primitive root visits every residue once, and residues past
+ * the count are skipped. Only the current residue is kept, whatever the size of the ranges.
+ *
+ * @param generator The generator; no ranges may be added while it runs
+ * @param scratch A target whose other fields are passed through to every emitted target
+ * @param emit Called for every target
+ * @param context Passed to emit
+ * @return true if every target was emitted, false if emit stopped the generator
+ */
+bool target_generator_run(target_generator_t *generator, target_t *scratch, target_emit_fn emit, void *context) {
+    uint64_t total = generator->total;
+    if (total == 0) {
+        return true;
+    }
+
+    uint64_t state = generator->seed;
+    uint64_t prime = total + 1;
+    while (!is_prime(prime)) prime++;
+
+    // A primitive root: g^((p-1)/q) != 1 for every prime factor q of p - 1
+    uint64_t factors[16];
+    int factor_count = prime_factors(prime - 1, factors, &state);
+    uint64_t root = 1;
+    if (prime > 2) {
+        for (;;) {
+            root = next_random(&state) % (prime - 2) + 2;
+            bool primitive = true;
+            for (int i = 0; i < factor_count && primitive; i++) {
+                primitive = powmod(root, (prime - 1) / factors[i], prime) != 1;
+            }
+            if (primitive) break;
+        }
+    }
+
+    uint64_t start = next_random(&state) % (prime - 1) + 1;
+    uint64_t element = start;
+    do {
+        if (element - 1 < total) {
+            index_target(generator, element - 1, scratch);
+            if (!emit(context, scratch)) {
+                return false;
+            }
+        }
+        element = mulmod(element, root, prime);
+    } while (element != start);
+    return true;
+}
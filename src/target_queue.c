@@ -0,0 +1,212 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "target_queue.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+
+// Busy retries before yielding, and yields before sleeping
+#define SPIN_LIMIT 64
+#define YIELD_LIMIT 128
+// Longest sleep while waiting on a full or empty queue
+#define MAX_SLEEP_NS 1000000L
+
+/**
+ * Wait a little before retrying a full or empty queue, backing off from
+ * spinning to yielding to sleeping the longer the wait goes on.
+ *
+ * @param attempt Number of retries so far; incremented
+ */
+static void backoff(unsigned *attempt) {
+    unsigned n = (*attempt)++;
+    if (n < SPIN_LIMIT) {
+        return;
+    }
+    if (n < YIELD_LIMIT) {
+        sched_yield();
+        return;
+    }
+
+    long sleep_ns = 1000L << ((n - YIELD_LIMIT) < 10 ? (n - YIELD_LIMIT) : 10);
+    struct timespec ts = {
+        .tv_sec = 0,
+        .tv_nsec = sleep_ns < MAX_SLEEP_NS ? sleep_ns : MAX_SLEEP_NS
+    };
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Try to append a target without waiting.
+ *
+ * @param queue The queue
+ * @param target The target to copy into the queue
+ * @return true on success, false if the queue is full
+ */
+static bool try_push(target_queue_t *queue, const target_t *target) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        target_queue_cell_t *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->target = *target;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Try to remove the oldest target without waiting.
+ *
+ * @param queue The queue
+ * @param target Receives the target
+ * @return true on success, false if the queue is empty
+ */
+static bool try_pop(target_queue_t *queue, target_t *target) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        target_queue_cell_t *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *target = cell->target;
+                atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Initialise a bounded target queue.
+ *
+ * @param queue The queue to initialise
+ * @param capacity Maximum number of targets held at once (rounded up to a power of two)
+ * @return 0 on success, -1 on failure
+ */
+int target_queue_init(target_queue_t *queue, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    queue->cells = malloc(size * sizeof(*queue->cells));
+    if (!queue->cells) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->closed, false);
+    return 0;
+}
+
+/**
+ * Release the resources of a target queue.
+ *
+ * @param queue The queue
+ */
+void target_queue_destroy(target_queue_t *queue) {
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+/**
+ * Append a target, waiting while the queue is full.
+ *
+ * @param queue The queue
+ * @param target The target to copy into the queue
+ * @return true on success, false if the queue was closed
+ */
+bool target_queue_push(target_queue_t *queue, const target_t *target) {
+    unsigned attempt = 0;
+
+    while (!atomic_load_explicit(&queue->closed, memory_order_acquire)) {
+        if (try_push(queue, target)) {
+            return true;
+        }
+        backoff(&attempt);
+    }
+    return false;
+}
+
+/**
+ * Remove the oldest target from the queue.
+ *
+ * @param queue The queue
+ * @param target Receives the target
+ * @param timeout_ms How long to wait for a target: 0 to not wait, negative to wait indefinitely
+ * @return 1 if a target was returned, 0 if none arrived in time, -1 if the queue is closed and drained
+ */
+int target_queue_pop(target_queue_t *queue, target_t *target, int timeout_ms) {
+    long long deadline = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+    unsigned attempt = 0;
+
+    for (;;) {
+        if (try_pop(queue, target)) {
+            return 1;
+        }
+
+        // Everything pushed before the close is visible once the close is, so check once more
+        if (atomic_load_explicit(&queue->closed, memory_order_acquire)) {
+            return try_pop(queue, target) ? 1 : -1;
+        }
+
+        if (timeout_ms == 0 || (timeout_ms > 0 && monotonic_ms() >= deadline)) {
+            return 0;
+        }
+        backoff(&attempt);
+    }
+}
+
+/**
+ * Mark the queue as finished. Consumers drain what is left and then see -1,
+ * and producers still waiting for space give up.
+ *
+ * @param queue The queue
+ */
+void target_queue_close(target_queue_t *queue) {
+    atomic_store_explicit(&queue->closed, true, memory_order_release);
+}
+
+/**
+ * Count the targets pushed so far. Once the queue is closed the count is final.
+ *
+ * @param queue The queue
+ * @return The number of targets pushed
+ */
+size_t target_queue_pushed(target_queue_t *queue) {
+    return atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+}
+
+/**
+ * Check whether the queue has been closed.
+ *
+ * @param queue The queue
+ * @return true once no more targets will be pushed
+ */
+bool target_queue_closed(target_queue_t *queue) {
+    return atomic_load_explicit(&queue->closed, memory_order_acquire);
+}
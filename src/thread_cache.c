@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "thread_cache.h"
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Blocks of 16 bytes up to 4 KB are cached, one free list per power of two
+#define MIN_CLASS_SHIFT 4
+#define CLASS_COUNT 9
+#define LARGE_CLASS UINT32_MAX
+// Most bytes a thread keeps on one free list; frees beyond that go back to malloc
+#define MAX_CACHED_BYTES (64 * 1024)
+#define MAX_CACHED_BLOCKS 256
+
+// Placed in front of every block, keeping the caller's memory 16-byte aligned
+typedef struct {
+    _Alignas(16) size_t size;
+    uint32_t size_class;
+} block_header_t;
+
+typedef struct free_block {
+    struct free_block *next;
+} free_block_t;
+
+// A thread's free lists and counters. The counters are only written by their thread.
+typedef struct thread_cache {
+    struct thread_cache *prev;
+    struct thread_cache *next;
+    free_block_t *free_lists[CLASS_COUNT];
+    unsigned int free_counts[CLASS_COUNT];
+    atomic_ullong allocations;
+    atomic_ullong heap_allocations;
+    atomic_ullong connections;
+} thread_cache_t;
+
+static __thread thread_cache_t *local_cache;
+// Set once the thread's cache was released, so frees during thread exit go straight to free()
+static __thread bool local_retired;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_cache_t *registry;
+// Counters of threads that exited
+static thread_cache_stats_t retired;
+
+static size_t class_size(uint32_t size_class) {
+    return (size_t)1 << (size_class + MIN_CLASS_SHIFT);
+}
+
+static unsigned int class_limit(uint32_t size_class) {
+    size_t limit = MAX_CACHED_BYTES / class_size(size_class);
+    return limit < MAX_CACHED_BLOCKS ? (unsigned int)limit : MAX_CACHED_BLOCKS;
+}
+
+/**
+ * Find the free list for a request.
+ *
+ * @param size The requested size
+ * @return The size class, or LARGE_CLASS for sizes that are not cached
+ */
+static uint32_t size_class_of(size_t size) {
+    if (size <= class_size(0)) {
+        return 0;
+    }
+    uint32_t size_class = (uint32_t)(64 - __builtin_clzll((unsigned long long)(size - 1))) - MIN_CLASS_SHIFT;
+    return size_class < CLASS_COUNT ? size_class : LARGE_CLASS;
+}
+
+static block_header_t *header_of(void *ptr) {
+    return (block_header_t *)ptr - 1;
+}
+
+/**
+ * Return a thread's cached blocks to malloc and keep its counters when it exits.
+ *
+ * @param arg The thread's cache
+ */
+static void release_cache(void *arg) {
+    thread_cache_t *cache = arg;
+
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        free_block_t *block = cache->free_lists[i];
+        while (block) {
+            free_block_t *next = block->next;
+            free(header_of(block));
+            block = next;
+        }
+    }
+
+    pthread_mutex_lock(&registry_mutex);
+    retired.allocations += atomic_load_explicit(&cache->allocations, memory_order_relaxed);
+    retired.heap_allocations += atomic_load_explicit(&cache->heap_allocations, memory_order_relaxed);
+    retired.connections += atomic_load_explicit(&cache->connections, memory_order_relaxed);
+    if (cache->prev) cache->prev->next = cache->next;
+    else registry = cache->next;
+    if (cache->next) cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&registry_mutex);
+
+    free(cache);
+    local_cache = NULL;
+    local_retired = true;
+}
+
+static void create_key(void) {
+    pthread_key_create(&cache_key, release_cache);
+}
+
+/**
+ * Get the calling thread's cache, creating it on first use.
+ *
+ * @return The cache, or NULL if the thread is exiting or memory ran out
+ */
+static thread_cache_t *get_cache(void) {
+    if (local_cache || local_retired) {
+        return local_cache;
+    }
+
+    pthread_once(&key_once, create_key);
+    thread_cache_t *cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return NULL;
+    }
+    pthread_mutex_lock(&registry_mutex);
+    cache->next = registry;
+    if (registry) registry->prev = cache;
+    registry = cache;
+    pthread_mutex_unlock(&registry_mutex);
+
+    pthread_setspecific(cache_key, cache);
+    local_cache = cache;
+    return cache;
+}
+
+static void count(atomic_ullong *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static void *cached_malloc(size_t num, const char *file, int line) {
+    (void)file;
+    (void)line;
+    if (num == 0) {
+        return NULL;
+    }
+
+    thread_cache_t *cache = get_cache();
+    uint32_t size_class = size_class_of(num);
+    if (cache) {
+        count(&cache->allocations);
+        if (size_class != LARGE_CLASS && cache->free_lists[size_class]) {
+            free_block_t *block = cache->free_lists[size_class];
+            cache->free_lists[size_class] = block->next;
+            cache->free_counts[size_class]--;
+            return block;
+        }
+        count(&cache->heap_allocations);
+    }
+
+    size_t size = size_class != LARGE_CLASS ? class_size(size_class) : num;
+    if (size > SIZE_MAX - sizeof(block_header_t)) {
+        return NULL;
+    }
+    block_header_t *header = malloc(sizeof(*header) + size);
+    if (!header) {
+        return NULL;
+    }
+    header->size = size;
+    header->size_class = size_class;
+    return header + 1;
+}
+
+static void cached_free(void *ptr, const char *file, int line) {
+    (void)file;
+    (void)line;
+    if (!ptr) {
+        return;
+    }
+
+    // Blocks go to the freeing thread's list, whichever thread allocated them
+    block_header_t *header = header_of(ptr);
+    thread_cache_t *cache = get_cache();
+    uint32_t size_class = header->size_class;
+    if (cache && size_class != LARGE_CLASS && cache->free_counts[size_class] < class_limit(size_class)) {
+        free_block_t *block = ptr;
+        block->next = cache->free_lists[size_class];
+        cache->free_lists[size_class] = block;
+        cache->free_counts[size_class]++;
+        return;
+    }
+    free(header);
+}
+
+static void *cached_realloc(void *ptr, size_t num, const char *file, int line) {
+    if (!ptr) {
+        return cached_malloc(num, file, line);
+    }
+    if (num == 0) {
+        cached_free(ptr, file, line);
+        return NULL;
+    }
+
+    size_t capacity = header_of(ptr)->size;
+    if (num <= capacity) {
+        return ptr;
+    }
+    void *grown = cached_malloc(num, file, line);
+    if (grown) {
+        memcpy(grown, ptr, capacity);
+        cached_free(ptr, file, line);
+    }
+    return grown;
+}
+
+/**
+ * Point OpenSSL's memory functions at per-thread caches of small blocks, so the
+ * allocations of a handshake are served without taking malloc's locks. It must be
+ * called before anything else uses OpenSSL.
+ *
+ * @return true if installed, false if OpenSSL already allocated memory
+ */
+bool thread_cache_install(void) {
+    return CRYPTO_set_mem_functions(cached_malloc, cached_realloc, cached_free) == 1;
+}
+
+/**
+ * Count a finished connection on the calling thread, for allocations per connection.
+ */
+void thread_cache_count_connection(void) {
+    thread_cache_t *cache = get_cache();
+    if (cache) {
+        count(&cache->connections);
+    }
+}
+
+/**
+ * Sum the counters of every thread, running or exited.
+ *
+ * @param stats Receives the counters
+ */
+void thread_cache_get_stats(thread_cache_stats_t *stats) {
+    pthread_mutex_lock(&registry_mutex);
+    *stats = retired;
+    for (thread_cache_t *cache = registry; cache; cache = cache->next) {
+        stats->allocations += atomic_load_explicit(&cache->allocations, memory_order_relaxed);
+        stats->heap_allocations += atomic_load_explicit(&cache->heap_allocations, memory_order_relaxed);
+        stats->connections += atomic_load_explicit(&cache->connections, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
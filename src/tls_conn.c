@@ -0,0 +1,957 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "tls_conn.h"
+#include "utils.h"
+#include <openssl/err.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// How long a finished TLS 1.3 handshake waits for the server's session ticket, at least and at most.
+// The ticket follows the handshake by about one round trip, so the wait is twice the handshake time.
+#define MIN_TICKET_WAIT_MS 20
+#define MAX_TICKET_WAIT_MS 1000
+// Adaptive timeouts never go below this
+#define MIN_ADAPTIVE_TIMEOUT_MS 50
+// How long one address of a target gets before the next is raced against it, before any
+// connect time has been measured, and the bounds of the measured delay (RFC 8305 section 8)
+#define ATTEMPT_DELAY_MS 250
+#define MIN_ATTEMPT_DELAY_MS 100
+#define MAX_ATTEMPT_DELAY_MS 2000
+
+// SSL ex_data slot that links an SSL object back to its connection
+static int conn_ex_index = -1;
+static pthread_once_t conn_ex_once = PTHREAD_ONCE_INIT;
+
+static void init_conn_ex_index(void) {
+    conn_ex_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+// Connections that reached a target through another address than its first
+static atomic_ullong fallbacks;
+
+/**
+ * Mark a connection as failed.
+ *
+ * @param conn The connection
+ * @param error The reason for the failure
+ * @return 0, so callers can return the result directly
+ */
+static int fail(tls_conn_t *conn, tls_conn_error_t error) {
+    conn->state = TLS_CONN_FAILED;
+    conn->error = error;
+    conn->want = 0;
+    return 0;
+}
+
+/**
+ * Fill in a socket address for an IP address and port.
+ *
+ * @param addr The IP address
+ * @param port The port, in host byte order
+ * @param ss Receives the socket address
+ * @return The length of the socket address
+ */
+static socklen_t make_sockaddr(const target_addr_t *addr, uint16_t port, struct sockaddr_storage *ss) {
+    memset(ss, 0, sizeof(*ss));
+    if (addr->family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        memcpy(&sin->sin_addr, addr->addr, 4);
+        return sizeof(*sin);
+    }
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    memcpy(&sin6->sin6_addr, addr->addr, 16);
+    return sizeof(*sin6);
+}
+
+/**
+ * Parse a comma-separated list of local IPv4 and IPv6 addresses to connect from.
+ *
+ * @param list The list, e.g. "192.0.2.10,192.0.2.11,2001:db8::10"
+ * @param sources Receives the addresses
+ * @param error_message Buffer that receives a description of the failure
+ * @param max_length Size of the error buffer
+ * @return 0 on success, -1 on failure
+ */
+int tls_conn_parse_sources(const char *list, tls_conn_sources_t *sources, char *error_message, size_t max_length) {
+    sources->count = 0;
+    atomic_init(&sources->next, 0);
+
+    const char *p = list;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        char text[INET6_ADDRSTRLEN];
+        if (length == 0 || length >= sizeof(text)) {
+            snprintf(error_message, max_length, "Invalid source address '%.*s'", (int)length, p);
+            return -1;
+        }
+        if (sources->count == TLS_CONN_MAX_SOURCES) {
+            snprintf(error_message, max_length, "At most %d source addresses can be given", TLS_CONN_MAX_SOURCES);
+            return -1;
+        }
+        memcpy(text, p, length);
+        text[length] = '\0';
+
+        target_addr_t *addr = &sources->addrs[sources->count];
+        memset(addr, 0, sizeof(*addr));
+        if (inet_pton(AF_INET, text, addr->addr) == 1) {
+            addr->family = AF_INET;
+        } else if (inet_pton(AF_INET6, text, addr->addr) == 1) {
+            addr->family = AF_INET6;
+        } else {
+            snprintf(error_message, max_length, "Invalid source address '%s'", text);
+            return -1;
+        }
+        sources->count++;
+        p += length;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    if (sources->count == 0) {
+        snprintf(error_message, max_length, "No source address given");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Bind a socket to the next source address of its family, leaving the port to connect().
+ * With IP_BIND_ADDRESS_NO_PORT the kernel picks the port per destination, so each source
+ * address can reuse its whole ephemeral range for every server.
+ *
+ * @param sources The source addresses, or NULL to let the kernel choose
+ * @param fd The socket
+ * @param family The socket's address family
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int bind_source(tls_conn_sources_t *sources, int fd, int family) {
+    if (!sources) {
+        return 0;
+    }
+
+    int matching = 0;
+    for (int i = 0; i < sources->count; i++) {
+        matching += sources->addrs[i].family == family;
+    }
+    if (matching == 0) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    int pick = (int)(atomic_fetch_add_explicit(&sources->next, 1, memory_order_relaxed) % (unsigned)matching);
+    const target_addr_t *source = NULL;
+    for (int i = 0; i < sources->count; i++) {
+        if (sources->addrs[i].family == family && pick-- == 0) {
+            source = &sources->addrs[i];
+            break;
+        }
+    }
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    int one = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+    struct sockaddr_storage ss;
+    socklen_t ss_len = make_sockaddr(source, 0, &ss);
+    return bind(fd, (struct sockaddr *)&ss, ss_len);
+}
+
+/**
+ * Order a target's addresses so the families alternate, keeping the first address first
+ * (RFC 8305 section 4). A broken IPv6 or IPv4 path then costs one stagger delay, not one per address.
+ *
+ * @param target The target
+ */
+static void interleave_families(target_t *target) {
+    target_addr_t same[TARGET_MAX_ADDRS], other[TARGET_MAX_ADDRS];
+    int same_count = 0, other_count = 0;
+
+    for (int i = 0; i < target->addr_count; i++) {
+        if (target->addrs[i].family == target->addrs[0].family) {
+            same[same_count++] = target->addrs[i];
+        } else {
+            other[other_count++] = target->addrs[i];
+        }
+    }
+    for (int i = 0, s = 0, o = 0; i < target->addr_count; i++) {
+        bool take_other = (i % 2 == 1 && o < other_count) || s == same_count;
+        target->addrs[i] = take_other ? other[o++] : same[s++];
+    }
+}
+
+/**
+ * Work out how long to give one address before racing the next one against it:
+ * the p99 connect time seen so far, or 250 ms before there is any, within 100 ms to 2 s
+ * (RFC 8305 section 5).
+ *
+ * @param conn The connection
+ * @return The delay in milliseconds
+ */
+static long long attempt_delay_ms(const tls_conn_t *conn) {
+    long long delay_ms = ATTEMPT_DELAY_MS;
+
+    if (conn->options->connect_rtt) {
+        long long p99_us = rtt_estimator_p99(conn->options->connect_rtt);
+        if (p99_us > 0) {
+            delay_ms = p99_us / 1000 + 1;
+        }
+    }
+    if (delay_ms < MIN_ATTEMPT_DELAY_MS) delay_ms = MIN_ATTEMPT_DELAY_MS;
+    if (delay_ms > MAX_ATTEMPT_DELAY_MS) delay_ms = MAX_ATTEMPT_DELAY_MS;
+    return delay_ms;
+}
+
+/**
+ * Read the outcome of a connect attempt whose socket became ready.
+ *
+ * @param fd The socket
+ * @return 0 if it connected, the errno it failed with otherwise
+ */
+static int socket_error(int fd) {
+    int so_error = 0;
+    socklen_t len = sizeof(so_error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len) != 0) {
+        so_error = errno;
+    }
+    return so_error;
+}
+
+/**
+ * Take one file descriptor from the budget for racing, beyond the one a connection always holds.
+ *
+ * @param conn The connection
+ * @return true if the budget had one left
+ */
+static bool take_race_fd(tls_conn_t *conn) {
+    atomic_int *left = conn->options->race_fds;
+    if (left) {
+        int value = atomic_load_explicit(left, memory_order_relaxed);
+        do {
+            if (value <= 0) {
+                return false;
+            }
+        } while (!atomic_compare_exchange_weak_explicit(left, &value, value - 1, memory_order_relaxed,
+                                                        memory_order_relaxed));
+    }
+    conn->race_fds_taken++;
+    return true;
+}
+
+/**
+ * Give back the racing budget a connection no longer uses: all but one of the descriptors
+ * it still holds for its connect attempts and race set are paid for.
+ *
+ * @param conn The connection
+ */
+static void return_race_fds(tls_conn_t *conn) {
+    int held = conn->racing + (conn->race_fd >= 0 ? 1 : 0);
+    int paid = held > 1 ? held - 1 : 0;
+    if (conn->race_fds_taken > paid) {
+        if (conn->options->race_fds) {
+            atomic_fetch_add_explicit(conn->options->race_fds, conn->race_fds_taken - paid, memory_order_relaxed);
+        }
+        conn->race_fds_taken = paid;
+    }
+}
+
+/**
+ * Close one address's connect attempt, and the race set once no attempt is left in it.
+ *
+ * @param conn The connection
+ * @param index The address
+ */
+static void close_attempt(tls_conn_t *conn, int index) {
+    if (conn->attempt_fds[index] == conn->fd) {
+        conn->fd = -1;
+    }
+    close(conn->attempt_fds[index]);
+    conn->attempt_fds[index] = -1;
+    conn->racing--;
+    if (conn->racing == 0 && conn->race_fd >= 0) {
+        if (conn->race_fd == conn->fd) conn->fd = -1;
+        close(conn->race_fd);
+        conn->race_fd = -1;
+    }
+    return_race_fds(conn);
+}
+
+/**
+ * Make a connected attempt the connection's socket, closing the attempts that lost the race.
+ *
+ * @param conn The connection
+ * @param index The address that connected
+ */
+static void win_race(tls_conn_t *conn, int index) {
+    int fd = conn->attempt_fds[index];
+
+    conn->attempt_fds[index] = -1;
+    conn->racing--;
+    for (int i = 0; i < conn->target.addr_count; i++) {
+        if (conn->attempt_fds[i] >= 0) {
+            close_attempt(conn, i);
+        }
+    }
+    if (conn->race_fd >= 0) {
+        close(conn->race_fd);
+        conn->race_fd = -1;
+    }
+    return_race_fds(conn);
+    conn->fd = fd;
+    conn->addr_index = index;
+    if (index > 0) {
+        atomic_fetch_add_explicit(&fallbacks, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Turn a connect to one address into a race, once a second address is due: the attempt in
+ * progress moves into a new race set, which becomes the connection's fd.
+ *
+ * @param conn The connection
+ * @return true on success, false if the race set could not be created
+ */
+static bool open_race(tls_conn_t *conn) {
+    if (!take_race_fd(conn)) {
+        return false;
+    }
+    conn->race_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (conn->race_fd < 0) {
+        return_race_fds(conn);
+        return false;
+    }
+    for (int i = 0; i < conn->target.addr_count; i++) {
+        struct epoll_event event = { .events = EPOLLOUT, .data.u32 = (uint32_t)i };
+        if (conn->attempt_fds[i] >= 0 && epoll_ctl(conn->race_fd, EPOLL_CTL_ADD, conn->attempt_fds[i], &event) != 0) {
+            close(conn->race_fd);
+            conn->race_fd = -1;
+            return_race_fds(conn);
+            return false;
+        }
+    }
+    conn->fd = conn->race_fd;
+    return true;
+}
+
+/**
+ * Get the file descriptors to race another address against the attempts in progress:
+ * the race set if there is none yet, and one for the new attempt's socket.
+ *
+ * @param conn The connection
+ * @return true if the next attempt may start
+ */
+static bool make_room_to_race(tls_conn_t *conn) {
+    if (conn->race_fd < 0 && !open_race(conn)) {
+        return false;
+    }
+    return take_race_fd(conn);
+}
+
+/**
+ * Stop racing for want of file descriptors. Attempts still within their connect timeout
+ * keep going, and the next address is started once they fail; attempts that had their
+ * whole connect timeout give way to the next address.
+ *
+ * @param conn The connection
+ * @return true if the attempts in progress keep going, false if they were closed
+ */
+static bool stop_racing(tls_conn_t *conn) {
+    if (monotonic_ms() < conn->connect_deadline_ms) {
+        conn->deadline_ms = conn->connect_deadline_ms;
+        return true;
+    }
+    conn->connect_errno = ETIMEDOUT;
+    for (int i = 0; i < conn->target.addr_count; i++) {
+        if (conn->attempt_fds[i] >= 0) {
+            close_attempt(conn, i);
+        }
+    }
+    return false;
+}
+
+/**
+ * Start a non-blocking connect to the next untried resolved address, moving on while
+ * addresses fail at once. An attempt started while another is in progress races it.
+ *
+ * @param conn The connection
+ * @return The readiness to wait for while attempts are in progress,
+ *         0 once one has connected, -1 if every address failed
+ */
+static int start_attempt(tls_conn_t *conn) {
+    while (conn->next_addr < conn->target.addr_count) {
+        // Racing costs a descriptor per attempt and one for the race set; without them the
+        // attempts in progress are left to finish, so a scan short of descriptors does not
+        // turn healthy hosts into connect errors
+        if (conn->racing > 0 && !make_room_to_race(conn) && stop_racing(conn)) {
+            return conn->race_fd >= 0 ? TLS_CONN_WANT_READ : TLS_CONN_WANT_WRITE;
+        }
+
+        int index = conn->next_addr;
+        const target_addr_t *addr = &conn->target.addrs[index];
+        struct sockaddr_storage ss;
+        socklen_t ss_len = make_sockaddr(addr, conn->target.port_number, &ss);
+
+        int fd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            conn->connect_errno = errno;
+            return_race_fds(conn);
+            if ((conn->connect_errno == EMFILE || conn->connect_errno == ENFILE) && conn->racing > 0) {
+                if (stop_racing(conn)) {
+                    return conn->race_fd >= 0 ? TLS_CONN_WANT_READ : TLS_CONN_WANT_WRITE;
+                }
+                // The attempts in progress are closed, so this address gets their descriptors
+                continue;
+            }
+            conn->next_addr++;
+            continue;
+        }
+        conn->next_addr++;
+        conn->addr_index = index;
+        conn->attempt_fds[index] = fd;
+        conn->attempt_started_us[index] = monotonic_us();
+        conn->racing++;
+
+        if (bind_source(conn->options->sources, fd, addr->family) != 0) {
+            conn->connect_errno = errno;
+            close_attempt(conn, index);
+            continue;
+        }
+        if (connect(fd, (struct sockaddr *)&ss, ss_len) == 0) {
+            win_race(conn, index);
+            return 0;
+        }
+        if (errno != EINPROGRESS) {
+            conn->connect_errno = errno;
+            close_attempt(conn, index);
+            continue;
+        }
+
+        if (conn->race_fd >= 0) {
+            struct epoll_event event = { .events = EPOLLOUT, .data.u32 = (uint32_t)index };
+            if (epoll_ctl(conn->race_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                conn->connect_errno = errno;
+                close_attempt(conn, index);
+                continue;
+            }
+        } else {
+            conn->fd = fd;
+        }
+
+        // Each address gets the whole connect timeout from its own start
+        long long now = monotonic_ms();
+        long long attempt_deadline = now + conn->connect_window_ms;
+        if (attempt_deadline > conn->expires_ms) attempt_deadline = conn->expires_ms;
+        if (attempt_deadline > conn->connect_deadline_ms) conn->connect_deadline_ms = attempt_deadline;
+        conn->deadline_ms = conn->connect_deadline_ms;
+        long long next_ms = now + attempt_delay_ms(conn);
+        if (conn->next_addr < conn->target.addr_count && next_ms < conn->deadline_ms) {
+            conn->deadline_ms = next_ms;
+        }
+        return conn->race_fd >= 0 ? TLS_CONN_WANT_READ : TLS_CONN_WANT_WRITE;
+    }
+
+    if (conn->racing == 0) {
+        return -1;
+    }
+    conn->deadline_ms = conn->connect_deadline_ms;
+    return conn->race_fd >= 0 ? TLS_CONN_WANT_READ : TLS_CONN_WANT_WRITE;
+}
+
+/**
+ * Advance the connect phase: settle the attempts whose sockets became ready, and start the
+ * next address when one failed or its turn came (RFC 8305 section 5).
+ *
+ * @param conn The connection
+ * @return The readiness to wait for while attempts are in progress,
+ *         0 once one has connected, -1 if every address failed
+ */
+static int continue_connect(tls_conn_t *conn) {
+    bool start_next = conn->racing == 0 || conn->attempt_due;
+    int ready[TARGET_MAX_ADDRS];
+    int ready_count = 0;
+
+    if (conn->race_fd >= 0) {
+        struct epoll_event events[TARGET_MAX_ADDRS];
+        int n = epoll_wait(conn->race_fd, events, TARGET_MAX_ADDRS, 0);
+        for (int i = 0; i < n; i++) {
+            ready[ready_count++] = (int)events[i].data.u32;
+        }
+    } else if (conn->racing > 0 && !conn->attempt_due) {
+        // A lone attempt's socket is the connection's fd, and it became ready
+        ready[ready_count++] = conn->addr_index;
+    }
+    conn->attempt_due = false;
+
+    for (int i = 0; i < ready_count; i++) {
+        if (conn->attempt_fds[ready[i]] < 0) {
+            continue;
+        }
+        int error = socket_error(conn->attempt_fds[ready[i]]);
+        if (error == 0) {
+            win_race(conn, ready[i]);
+            return 0;
+        }
+        conn->connect_errno = error;
+        close_attempt(conn, ready[i]);
+        start_next = true;
+    }
+
+    if (start_next) {
+        return start_attempt(conn);
+    }
+    return conn->race_fd >= 0 ? TLS_CONN_WANT_READ : TLS_CONN_WANT_WRITE;
+}
+
+/**
+ * Verify callback used by fast-cert mode. It runs as soon as the server's
+ * Certificate message has been parsed, keeps the leaf certificate and the
+ * chain the server sent, then fails verification on purpose so the handshake
+ * stops right there.
+ *
+ * @param preverify_ok Result of OpenSSL's own checks (ignored)
+ * @param store The verification context holding the peer certificate
+ * @return 0, to abort the handshake
+ */
+static int capture_certificate(int preverify_ok, X509_STORE_CTX *store) {
+    (void)preverify_ok;
+    SSL *ssl = X509_STORE_CTX_get_ex_data(store, SSL_get_ex_data_X509_STORE_CTX_idx());
+    tls_conn_t *conn = ssl ? SSL_get_ex_data(ssl, conn_ex_index) : NULL;
+    X509 *leaf = X509_STORE_CTX_get0_cert(store);
+
+    if (conn && leaf && !conn->captured_cert && X509_up_ref(leaf)) {
+        conn->captured_cert = leaf;
+        STACK_OF(X509) *chain = X509_STORE_CTX_get0_untrusted(store);
+        conn->captured_chain = chain ? X509_chain_up_ref(chain) : NULL;
+    }
+    return 0;
+}
+
+/**
+ * Work out when the phase a connection is entering must be over.
+ * A first attempt gets adaptive_multiplier times the p99 the estimator has seen, if that is
+ * shorter than the configured timeout; a retry always gets the configured timeout.
+ *
+ * @param conn The connection
+ * @param phase_timeout_ms The configured timeout of the phase, 0 for none
+ * @param estimator The phase's latency estimator, or NULL
+ * @return The phase deadline, never later than the attempt's overall deadline
+ */
+static long long phase_deadline(const tls_conn_t *conn, int phase_timeout_ms, rtt_estimator_t *estimator) {
+    long long limit_ms = phase_timeout_ms > 0 ? phase_timeout_ms : conn->options->timeout_ms;
+
+    if (estimator && conn->options->adaptive_multiplier > 0 && conn->target.attempts == 0) {
+        long long p99_us = rtt_estimator_p99(estimator);
+        if (p99_us > 0) {
+            long long adaptive_ms = (long long)((double)p99_us * conn->options->adaptive_multiplier / 1000.0) + 1;
+            if (adaptive_ms < MIN_ADAPTIVE_TIMEOUT_MS) adaptive_ms = MIN_ADAPTIVE_TIMEOUT_MS;
+            if (adaptive_ms < limit_ms) limit_ms = adaptive_ms;
+        }
+    }
+
+    long long deadline = monotonic_ms() + limit_ms;
+    return deadline < conn->expires_ms ? deadline : conn->expires_ms;
+}
+
+/**
+ * New-session callback: keep the session the server issued on the connection it belongs to.
+ *
+ * @param ssl The SSL object that received the session
+ * @param session The session
+ * @return 1 if the connection took ownership of the session, 0 otherwise
+ */
+static int capture_session(SSL *ssl, SSL_SESSION *session) {
+    tls_conn_t *conn = SSL_get_ex_data(ssl, conn_ex_index);
+    if (!conn || !conn->options->find_session) {
+        return 0;
+    }
+    if (conn->session) {
+        SSL_SESSION_free(conn->session);
+    }
+    conn->session = session;
+    return 1;
+}
+
+/**
+ * Have every connection on an SSL context keep the sessions its server issues, for the session cache.
+ *
+ * @param ctx The shared SSL context
+ * @return true on success, false on failure
+ */
+bool tls_conn_capture_sessions(SSL_CTX *ctx) {
+    pthread_once(&conn_ex_once, init_conn_ex_index);
+    if (conn_ex_index < 0) {
+        return false;
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, capture_session);
+    return true;
+}
+
+/**
+ * Attach an SSL object to the connected socket and switch to the handshake state.
+ *
+ * @param conn The connection
+ * @return true on success, false on failure
+ */
+static bool begin_handshake(tls_conn_t *conn) {
+    conn->negotiated_us = monotonic_us();
+    conn->deadline_ms = phase_deadline(conn, conn->options->handshake_timeout_ms, conn->options->handshake_rtt);
+    conn->ssl = SSL_new(conn->options->ctx);
+    if (!conn->ssl) {
+        return false;
+    }
+
+    if (conn->options->fast_cert || conn->options->find_session) {
+        pthread_once(&conn_ex_once, init_conn_ex_index);
+        if (conn_ex_index < 0 || !SSL_set_ex_data(conn->ssl, conn_ex_index, conn)) {
+            return false;
+        }
+    }
+    if (conn->options->fast_cert) {
+        SSL_set_verify(conn->ssl, SSL_VERIFY_PEER, capture_certificate);
+    }
+
+    // Offer the session an earlier run saved for this host:port
+    if (conn->options->find_session) {
+        SSL_SESSION *session = conn->options->find_session(conn->options->session_context, &conn->target);
+        if (session) {
+            int set = SSL_set_session(conn->ssl, session);
+            SSL_SESSION_free(session);
+            if (set != 1) {
+                return false;
+            }
+        }
+    }
+
+    if (SSL_set_fd(conn->ssl, conn->fd) != 1) {
+        return false;
+    }
+
+    // Set the hostname for SNI
+    if (SSL_set_tlsext_host_name(conn->ssl, conn->target.hostname) != 1) {
+        return false;
+    }
+
+    SSL_set_connect_state(conn->ssl);
+    conn->state = TLS_CONN_HANDSHAKING;
+    return true;
+}
+
+/**
+ * Record the end of the TCP connect, then start the plaintext exchange the target's
+ * protocol needs before TLS, or the handshake straight away. The exchange is limited
+ * like a handshake but not adaptively, since servers such as SMTP may delay their greeting.
+ *
+ * @param conn The connection
+ * @return true on success, false on failure
+ */
+static bool begin_session(tls_conn_t *conn) {
+    conn->connected_us = monotonic_us();
+    // Only the winning address's own connect counts, not the delays before it was raced
+    if (conn->options->connect_rtt) {
+        rtt_estimator_add(conn->options->connect_rtt, conn->connected_us - conn->attempt_started_us[conn->addr_index]);
+    }
+
+    starttls_protocol_t protocol = conn->target.starttls;
+    if (protocol == STARTTLS_AUTO) {
+        protocol = starttls_protocol_for_port(conn->target.port_number);
+    }
+    if (protocol == STARTTLS_NONE) {
+        return begin_handshake(conn);
+    }
+
+    conn->starttls = malloc(sizeof(*conn->starttls));
+    if (!conn->starttls) {
+        return false;
+    }
+    starttls_init(conn->starttls, protocol);
+    conn->deadline_ms = phase_deadline(conn, conn->options->handshake_timeout_ms, NULL);
+    conn->state = TLS_CONN_NEGOTIATING;
+    return true;
+}
+
+/**
+ * Decide whether a finished handshake should wait for a session ticket, and set up the wait.
+ * Only TLS 1.3 servers send their tickets after the handshake; earlier versions issue the
+ * session during it.
+ *
+ * @param conn The connection whose handshake just finished
+ * @return true if the connection now waits for a ticket
+ */
+static bool wait_for_ticket(tls_conn_t *conn) {
+    if (!conn->options->find_session || conn->session || SSL_version(conn->ssl) != TLS1_3_VERSION) {
+        return false;
+    }
+
+    long long wait_ms = 2 * (conn->handshaken_us - conn->negotiated_us) / 1000;
+    if (wait_ms < MIN_TICKET_WAIT_MS) wait_ms = MIN_TICKET_WAIT_MS;
+    if (wait_ms > MAX_TICKET_WAIT_MS) wait_ms = MAX_TICKET_WAIT_MS;
+    long long ticket_deadline = monotonic_ms() + wait_ms;
+    if (ticket_deadline < conn->deadline_ms) {
+        conn->deadline_ms = ticket_deadline;
+    }
+    conn->state = TLS_CONN_AWAITING_TICKET;
+    return true;
+}
+
+/**
+ * Start connecting to a resolved target. A non-blocking socket is opened and
+ * the state machine is advanced as far as it can go without waiting.
+ *
+ * @param conn The connection to initialise
+ * @param options The shared connection settings; must outlive the connection
+ * @param target The target, as produced by the resolver stage
+ * @return The readiness to wait for (TLS_CONN_WANT_*), or 0 if the connection already finished
+ */
+int tls_conn_start(tls_conn_t *conn, const tls_conn_options_t *options, const target_t *target) {
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+    conn->race_fd = -1;
+    for (int i = 0; i < TARGET_MAX_ADDRS; i++) {
+        conn->attempt_fds[i] = -1;
+    }
+    conn->options = options;
+    conn->state = TLS_CONN_CONNECTING;
+    conn->started_us = monotonic_us();
+    conn->target = *target;
+    conn->expires_ms = monotonic_ms() + options->timeout_ms;
+    conn->connect_deadline_ms = phase_deadline(conn, options->connect_timeout_ms, options->connect_rtt);
+    conn->connect_window_ms = conn->connect_deadline_ms - monotonic_ms();
+    conn->deadline_ms = conn->connect_deadline_ms;
+
+    if (target->dns_status != RESOLVE_OK) {
+        return fail(conn, TLS_CONN_ERR_DNS);
+    }
+    if (target->addr_count > 1) {
+        interleave_families(&conn->target);
+    }
+
+    return tls_conn_continue(conn);
+}
+
+/**
+ * Advance the connection state machine after its socket became ready.
+ *
+ * @param conn The connection
+ * @return The readiness to wait for (TLS_CONN_WANT_*), or 0 once the connection finished
+ */
+int tls_conn_continue(tls_conn_t *conn) {
+    if (conn->state == TLS_CONN_CONNECTING) {
+        int rc = continue_connect(conn);
+
+        if (rc < 0) {
+            return fail(conn, TLS_CONN_ERR_CONNECT);
+        }
+        if (rc > 0) {
+            conn->want = rc;
+            return rc;
+        }
+        if (!begin_session(conn)) {
+            return fail(conn, TLS_CONN_ERR_INTERNAL);
+        }
+    }
+
+    if (conn->state == TLS_CONN_NEGOTIATING) {
+        int rc = starttls_continue(conn->starttls, conn->fd);
+        if (rc < 0) {
+            return fail(conn, TLS_CONN_ERR_STARTTLS);
+        }
+        if (rc > 0) {
+            conn->want = rc == STARTTLS_WANT_READ ? TLS_CONN_WANT_READ : TLS_CONN_WANT_WRITE;
+            return conn->want;
+        }
+        if (!begin_handshake(conn)) {
+            return fail(conn, TLS_CONN_ERR_INTERNAL);
+        }
+    }
+
+    if (conn->state == TLS_CONN_HANDSHAKING) {
+        ERR_clear_error();
+        int rc = SSL_connect(conn->ssl);
+        if (rc == 1) {
+            conn->handshaken_us = monotonic_us();
+            conn->resumed = SSL_session_reused(conn->ssl) == 1;
+            if (conn->options->handshake_rtt) {
+                rtt_estimator_add(conn->options->handshake_rtt, conn->handshaken_us - conn->negotiated_us);
+            }
+            if (!wait_for_ticket(conn)) {
+                conn->state = TLS_CONN_DONE;
+                conn->want = 0;
+                return 0;
+            }
+        } else {
+            switch (SSL_get_error(conn->ssl, rc)) {
+                case SSL_ERROR_WANT_READ:
+                    conn->want = TLS_CONN_WANT_READ;
+                    return conn->want;
+                case SSL_ERROR_WANT_WRITE:
+                    conn->want = TLS_CONN_WANT_WRITE;
+                    return conn->want;
+                default:
+                    // In fast-cert mode the handshake is aborted on purpose once the certificate is in
+                    if (conn->captured_cert) {
+                        conn->handshaken_us = monotonic_us();
+                        if (conn->options->handshake_rtt) {
+                            rtt_estimator_add(conn->options->handshake_rtt, conn->handshaken_us - conn->negotiated_us);
+                        }
+                        conn->state = TLS_CONN_DONE;
+                        conn->want = 0;
+                        ERR_clear_error();
+                        return 0;
+                    }
+                    return fail(conn, TLS_CONN_ERR_HANDSHAKE);
+            }
+        }
+    }
+
+    if (conn->state == TLS_CONN_AWAITING_TICKET) {
+        // Reading processes the post-handshake messages; the ticket arrives through capture_session
+        unsigned char byte;
+        ERR_clear_error();
+        int rc = SSL_read(conn->ssl, &byte, 1);
+        if (!conn->session && rc <= 0 && SSL_get_error(conn->ssl, rc) == SSL_ERROR_WANT_READ) {
+            conn->want = TLS_CONN_WANT_READ;
+            return conn->want;
+        }
+        ERR_clear_error();
+        conn->state = TLS_CONN_DONE;
+        conn->want = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Check whether a connection has reached a terminal state.
+ *
+ * @param conn The connection
+ * @return true if the connection is done or failed
+ */
+bool tls_conn_finished(const tls_conn_t *conn) {
+    return conn->state == TLS_CONN_DONE || conn->state == TLS_CONN_FAILED;
+}
+
+/**
+ * Fail a connection whose deadline has passed. A connection only waiting for a session ticket finishes instead.
+ *
+ * @param conn The connection
+ */
+void tls_conn_expire(tls_conn_t *conn) {
+    // The certificate is already in; the server just sent no ticket in time
+    if (conn->state == TLS_CONN_AWAITING_TICKET) {
+        conn->state = TLS_CONN_DONE;
+        conn->want = 0;
+    } else if (!tls_conn_finished(conn)) {
+        fail(conn, TLS_CONN_ERR_TIMEOUT);
+    }
+}
+
+/**
+ * Act on a connection whose deadline has passed. While addresses are raced and some are left,
+ * the deadline means the next one is due, because the others took the attempt delay or their
+ * whole connect timeout, so it is started; otherwise the connection expires.
+ *
+ * @param conn The connection
+ * @return The readiness to wait for (TLS_CONN_WANT_*), or 0 once the connection finished
+ */
+int tls_conn_timeout(tls_conn_t *conn) {
+    if (conn->state == TLS_CONN_CONNECTING && conn->next_addr < conn->target.addr_count &&
+        monotonic_ms() < conn->expires_ms) {
+        conn->attempt_due = true;
+        return tls_conn_continue(conn);
+    }
+    tls_conn_expire(conn);
+    return 0;
+}
+
+/**
+ * Count the connections, over the whole process, that reached their target through
+ * another address than its first.
+ *
+ * @return The count
+ */
+unsigned long long tls_conn_fallback_count(void) {
+    return atomic_load_explicit(&fallbacks, memory_order_relaxed);
+}
+
+/**
+ * Get the server's leaf certificate from a finished connection.
+ *
+ * @param conn The connection
+ * @return A new reference to the certificate (free with X509_free), or NULL if there is none
+ */
+X509 *tls_conn_get_peer_certificate(const tls_conn_t *conn) {
+    if (conn->captured_cert) {
+        return X509_up_ref(conn->captured_cert) ? conn->captured_cert : NULL;
+    }
+    return conn->ssl ? SSL_get_peer_certificate(conn->ssl) : NULL;
+}
+
+/**
+ * Get the certificate chain the server sent, starting with its leaf.
+ *
+ * @param conn The connection
+ * @return A new reference to the chain and its certificates (free with
+ *         sk_X509_pop_free and X509_free), or NULL if there is none
+ */
+STACK_OF(X509) *tls_conn_get_peer_chain(const tls_conn_t *conn) {
+    if (conn->captured_chain) {
+        return X509_chain_up_ref(conn->captured_chain);
+    }
+    STACK_OF(X509) *chain = conn->ssl ? SSL_get_peer_cert_chain(conn->ssl) : NULL;
+    return chain ? X509_chain_up_ref(chain) : NULL;
+}
+
+/**
+ * Get the address a connection reached, or last tried to reach.
+ *
+ * @param conn The connection
+ * @return The address, or NULL if no connect was attempted
+ */
+const target_addr_t *tls_conn_get_address(const tls_conn_t *conn) {
+    return conn->next_addr > 0 ? &conn->target.addrs[conn->addr_index] : NULL;
+}
+
+/**
+ * Release every resource held by a connection.
+ *
+ * @param conn The connection
+ */
+void tls_conn_cleanup(tls_conn_t *conn) {
+    if (conn->captured_cert) X509_free(conn->captured_cert);
+    if (conn->captured_chain) sk_X509_pop_free(conn->captured_chain, X509_free);
+    if (conn->session) SSL_SESSION_free(conn->session);
+    free(conn->starttls);
+    if (conn->ssl) SSL_free(conn->ssl);
+    for (int i = 0; i < conn->target.addr_count; i++) {
+        if (conn->attempt_fds[i] >= 0) close_attempt(conn, i);
+    }
+    if (conn->race_fd >= 0) {
+        if (conn->race_fd == conn->fd) conn->fd = -1;
+        close(conn->race_fd);
+        conn->race_fd = -1;
+    }
+    return_race_fds(conn);
+    if (conn->fd >= 0) close(conn->fd);
+    conn->captured_cert = NULL;
+    conn->captured_chain = NULL;
+    conn->session = NULL;
+    conn->starttls = NULL;
+    conn->ssl = NULL;
+    conn->fd = -1;
+}
@@ -1,8 +1,101 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "utils.h"
 #include <openssl/sha.h>
 #include <openssl/err.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_SIMD 1
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/**
+ * @brief Format bytes as hexadecimal one nibble at a time.
+ */
+static void hex_encode_scalar(const unsigned char *data, size_t len, char *output) {
+    for (size_t i = 0; i < len; i++) {
+        output[i * 2] = hex_digits[data[i] >> 4];
+        output[i * 2 + 1] = hex_digits[data[i] & 0x0f];
+    }
+}
+
+#ifdef HEX_SIMD
+/**
+ * @brief Format 16 bytes at a time: a byte shuffle looks up both nibbles of every
+ * byte in the digit table, and the two halves are interleaved into 32 characters.
+ *
+ * @return The number of bytes formatted, a multiple of 16
+ */
+__attribute__((target("ssse3")))
+static size_t hex_encode_ssse3(const unsigned char *data, size_t len, char *output) {
+    const __m128i digits = _mm_loadu_si128((const __m128i *)hex_digits);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), mask));
+        __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, mask));
+        _mm_storeu_si128((__m128i *)(output + i * 2), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *)(output + i * 2 + 16), _mm_unpackhi_epi8(high, low));
+    }
+    return i;
+}
+
+/**
+ * @brief Format 32 bytes at a time, a whole SHA-256 digest per iteration. The shuffles
+ * work within 128-bit lanes, so the interleaved lanes are put back in order at the end.
+ *
+ * @return The number of bytes formatted, a multiple of 32
+ */
+__attribute__((target("avx2")))
+static size_t hex_encode_avx2(const unsigned char *data, size_t len, char *output) {
+    const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hex_digits));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i high = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), mask));
+        __m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(bytes, mask));
+        __m256i first = _mm256_unpacklo_epi8(high, low);
+        __m256i second = _mm256_unpackhi_epi8(high, low);
+        _mm256_storeu_si256((__m256i *)(output + i * 2), _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *)(output + i * 2 + 32), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    return i;
+}
+#endif
+
+/**
+ * @brief Format bytes as lowercase hexadecimal, with AVX2 or SSSE3 when the CPU has them.
+ *
+ * @param data Pointer to the input bytes.
+ * @param len Number of input bytes.
+ * @param output Buffer receiving 2 * len characters and a null terminator.
+ */
+void hex_encode(const unsigned char *data, size_t len, char *output) {
+    size_t done = 0;
+
+#ifdef HEX_SIMD
+    if (len >= 32 && __builtin_cpu_supports("avx2")) {
+        done = hex_encode_avx2(data, len, output);
+    }
+    if (len - done >= 16 && __builtin_cpu_supports("ssse3")) {
+        done += hex_encode_ssse3(data + done, len - done, output + done * 2);
+    }
+#endif
+    hex_encode_scalar(data + done, len - done, output + done * 2);
+    output[len * 2] = '\0';
+}
 
 /**
  * @brief Compute the SHA256 hash of the input data and format it as a hexadecimal string.
@@ -22,12 +115,7 @@ bool sha256sum(const unsigned char *data, size_t len, char *output, size_t outpu
         return false;
     }
 
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        if (snprintf(output + (i * 2), 3, "%02x", hash[i]) != 2) {
-            return false;
-        }
-    }
-    output[SHA256_DIGEST_LENGTH * 2] = '\0';
+    hex_encode(hash, SHA256_DIGEST_LENGTH, output);
     return true;
 }
 
@@ -66,3 +154,67 @@ bool get_ssl_error(char *error_message, size_t max_length) {
 
     return !buffer_full;
 }
+
+/**
+ * @brief Read the monotonic clock.
+ *
+ * @return The current monotonic time in milliseconds.
+ */
+long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Read the monotonic clock with microsecond resolution, for latency metrics.
+ *
+ * @return The current monotonic time in microseconds.
+ */
+long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Hash a target into the key the journal, the session cache and sharding know it by
+ * (FNV-1a over the lowercased hostname, ':' and port).
+ *
+ * @param hostname The hostname
+ * @param port The port
+ * @return The key
+ */
+uint64_t target_key(const char *hostname, const char *port) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const unsigned char *p = (const unsigned char *)hostname; *p; p++) {
+        hash ^= (uint64_t)tolower(*p);
+        hash *= 1099511628211ULL;
+    }
+    hash ^= ':';
+    hash *= 1099511628211ULL;
+    for (const unsigned char *p = (const unsigned char *)port; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Make the entries of a directory durable, e.g. the names of files created in it.
+ *
+ * @param path The directory
+ * @return 0 on success, -1 on failure
+ */
+int sync_directory(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = fsync(fd) == 0 ? 0 : -1;
+    if (close(fd) != 0) {
+        ret = -1;
+    }
+    return ret;
+}